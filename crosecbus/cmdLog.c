@@ -0,0 +1,57 @@
+#include "driver.h"
+
+VOID CrosEcCmdLogRecord(
+	_Inout_ PCROSEC_CMD_LOG Log,
+	_In_ CROSEC_LOCK_CLASS Class,
+	_In_ UINT16 Command,
+	_In_ UINT8 Version,
+	_In_ ULONG OutSize,
+	_In_ ULONG InSize,
+	_In_ int Result,
+	_In_ ULONGLONG StartTime)
+{
+	ULONGLONG now = KeQueryInterruptTime();
+	LONG64 position = InterlockedIncrement64(&Log->Head) - 1;
+	PCROSEC_CMD_RECORD record = &Log->Records[position & (CROSEC_CMD_LOG_ENTRIES - 1)];
+
+	//Mark the slot busy first so a reader can't take a half-written record for the old one
+	InterlockedExchange((volatile LONG*)&record->Sequence, CROSEC_CMD_LOG_BUSY);
+	record->StartTime = StartTime;
+	record->Command = Command;
+	record->Version = Version;
+	record->Class = (UINT8)Class;
+	record->OutSize = (UINT16)OutSize;
+	record->InSize = (UINT16)InSize;
+	record->Result = Result;
+	record->DurationUs = (UINT32)min((now - StartTime) / 10, MAXULONG);
+	WriteRelease((volatile LONG*)&record->Sequence, (LONG)position);
+}
+
+ULONG CrosEcCmdLogRead(
+	_In_ PCROSEC_CMD_LOG Log,
+	_Out_writes_(MaxRecords) PCROSEC_CMD_RECORD Records,
+	_In_ ULONG MaxRecords,
+	_Out_ PULONG64 Head)
+{
+	LONG64 head = ReadAcquire64(&Log->Head);
+	LONG64 first = max(head - min(MaxRecords, CROSEC_CMD_LOG_ENTRIES), 0);
+	ULONG count = 0;
+
+	for (LONG64 position = first; position < head; position++) {
+		PCROSEC_CMD_RECORD record = &Log->Records[position & (CROSEC_CMD_LOG_ENTRIES - 1)];
+
+		//Skip slots a writer was still filling in, or has since moved past
+		if ((UINT32)position == CROSEC_CMD_LOG_BUSY ||
+			ReadAcquire((volatile LONG*)&record->Sequence) != (LONG)position) {
+			continue;
+		}
+		Records[count] = *record;
+		MemoryBarrier();
+		if (ReadNoFence((volatile LONG*)&record->Sequence) == (LONG)position) {
+			count++;
+		}
+	}
+
+	*Head = head;
+	return count;
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+//
+// Always-on log of the last CROSEC_CMD_LOG_ENTRIES host commands, so the
+// commands leading up to a hang can be read back afterwards. Writers claim
+// a slot with one interlocked increment and fill it in; the sequence number
+// is cleared first and written last so readers can skip a slot that was
+// being rewritten.
+//
+
+#define CROSEC_CMD_LOG_ENTRIES 4096 // Power of 2
+#define CROSEC_CMD_LOG_BUSY    0xFFFFFFFF
+
+typedef struct _CROSEC_CMD_RECORD {
+	UINT64 StartTime;  // Interrupt time (100ns) the command went to the EC
+	UINT32 Sequence;   // Low 32 bits of the record's position, written last
+	UINT16 Command;
+	UINT8 Version;
+	UINT8 Class;       // CROSEC_LOCK_CLASS of the caller
+	UINT16 OutSize;
+	UINT16 InSize;
+	INT32 Result;      // ec_command_proto style
+	UINT32 DurationUs;
+} CROSEC_CMD_RECORD, *PCROSEC_CMD_RECORD;
+
+typedef struct _CROSEC_CMD_LOG {
+	volatile LONG64 Head; // Records ever written
+	CROSEC_CMD_RECORD Records[CROSEC_CMD_LOG_ENTRIES];
+} CROSEC_CMD_LOG, *PCROSEC_CMD_LOG;
+
+VOID CrosEcCmdLogRecord(
+	_Inout_ PCROSEC_CMD_LOG Log,
+	_In_ CROSEC_LOCK_CLASS Class,
+	_In_ UINT16 Command,
+	_In_ UINT8 Version,
+	_In_ ULONG OutSize,
+	_In_ ULONG InSize,
+	_In_ int Result,
+	_In_ ULONGLONG StartTime);
+
+// Copies out up to MaxRecords of the newest records, oldest first; returns how many
+ULONG CrosEcCmdLogRead(
+	_In_ PCROSEC_CMD_LOG Log,
+	_Out_writes_(MaxRecords) PCROSEC_CMD_RECORD Records,
+	_In_ ULONG MaxRecords,
+	_Out_ PULONG64 Head);
@@ -0,0 +1,88 @@
+#include "driver.h"
+
+//Slot layout: generation (16 bits, never 0), command, version mask
+#define CROSEC_SLOT(gen, cmd, mask) \
+	((LONG64)(((ULONG64)(UINT16)(gen) << 48) | ((ULONG64)(cmd) << 32) | (mask)))
+#define CROSEC_SLOT_GEN(slot)  ((UINT16)((ULONG64)(slot) >> 48))
+#define CROSEC_SLOT_CMD(slot)  ((UINT16)((ULONG64)(slot) >> 32))
+#define CROSEC_SLOT_MASK(slot) ((UINT32)(slot))
+
+static UINT16 CrosEcCmdVersionsTag(_In_ LONG Generation) {
+	//Skip 0 on wrap so an empty slot never matches
+	UINT16 tag = (UINT16)Generation;
+	return tag ? tag : 1;
+}
+
+static ULONG CrosEcCmdVersionsHash(_In_ UINT16 Command) {
+	return (Command * 0x9E37u) >> 3;
+}
+
+VOID CrosEcCmdVersionsInit(_Out_ PCROSEC_CMD_VERSIONS Table) {
+	RtlZeroMemory(Table, sizeof(*Table));
+	Table->Generation = 1;
+}
+
+VOID CrosEcCmdVersionsInvalidate(_Inout_ PCROSEC_CMD_VERSIONS Table) {
+	InterlockedIncrement(&Table->Generation);
+}
+
+LONG CrosEcCmdVersionsGeneration(_In_ PCROSEC_CMD_VERSIONS Table) {
+	return Table->Generation;
+}
+
+BOOLEAN CrosEcCmdVersionsLookup(
+	_In_ PCROSEC_CMD_VERSIONS Table,
+	_In_ UINT16 Command,
+	_Out_ PUINT32 VersionMask)
+{
+	UINT16 tag = CrosEcCmdVersionsTag(Table->Generation);
+	ULONG hash = CrosEcCmdVersionsHash(Command);
+
+	//Entries of the current generation sit in a run from their hash slot
+	for (ULONG i = 0; i < CROSEC_CMD_VERSIONS_SLOTS; i++) {
+		LONG64 slot = ReadNoFence64(&Table->Slots[(hash + i) & (CROSEC_CMD_VERSIONS_SLOTS - 1)]);
+
+		if (CROSEC_SLOT_GEN(slot) != tag) {
+			break;
+		}
+		if (CROSEC_SLOT_CMD(slot) == Command) {
+			*VersionMask = CROSEC_SLOT_MASK(slot);
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+VOID CrosEcCmdVersionsInsert(
+	_Inout_ PCROSEC_CMD_VERSIONS Table,
+	_In_ LONG Generation,
+	_In_ UINT16 Command,
+	_In_ UINT32 VersionMask)
+{
+	UINT16 tag = CrosEcCmdVersionsTag(Generation);
+	ULONG hash = CrosEcCmdVersionsHash(Command);
+	LONG64 entry = CROSEC_SLOT(tag, Command, VersionMask);
+
+	for (ULONG i = 0; i < CROSEC_CMD_VERSIONS_SLOTS; ) {
+		volatile LONG64* target = &Table->Slots[(hash + i) & (CROSEC_CMD_VERSIONS_SLOTS - 1)];
+		LONG64 slot = ReadNoFence64(target);
+
+		if (Table->Generation != Generation) {
+			return; //The EC has moved on; this answer may be stale
+		}
+
+		if (CROSEC_SLOT_GEN(slot) == tag) {
+			if (CROSEC_SLOT_CMD(slot) == Command) {
+				return; //Someone else got there first
+			}
+			i++;
+			continue;
+		}
+
+		//Free or left over from an older generation; retry this slot if we lost a race for it
+		if (InterlockedCompareExchange64(target, entry, slot) == slot) {
+			return;
+		}
+	}
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+//
+// Which versions of each host command the EC supports, so EC_CMD_GET_CMD_VERSIONS
+// goes out at most once per command per EC boot. Entries are filled in as
+// commands are asked about.
+//
+// Each slot is a single 64-bit word (generation, command, version mask), so
+// readers never lock and never see a torn entry. Invalidating bumps the
+// generation, which turns every slot into free space for the next fill.
+//
+
+#define CROSEC_CMD_VERSIONS_SLOTS 128 // Power of 2
+
+typedef struct _CROSEC_CMD_VERSIONS {
+	volatile LONG Generation;
+	volatile LONG64 Slots[CROSEC_CMD_VERSIONS_SLOTS];
+} CROSEC_CMD_VERSIONS, *PCROSEC_CMD_VERSIONS;
+
+VOID CrosEcCmdVersionsInit(_Out_ PCROSEC_CMD_VERSIONS Table);
+
+// Forget everything (EC reset or jump to another image)
+VOID CrosEcCmdVersionsInvalidate(_Inout_ PCROSEC_CMD_VERSIONS Table);
+
+// Sample before asking the EC and pass to CrosEcCmdVersionsInsert
+LONG CrosEcCmdVersionsGeneration(_In_ PCROSEC_CMD_VERSIONS Table);
+
+BOOLEAN CrosEcCmdVersionsLookup(
+	_In_ PCROSEC_CMD_VERSIONS Table,
+	_In_ UINT16 Command,
+	_Out_ PUINT32 VersionMask);
+
+// Dropped if the table was invalidated since Generation was sampled, or is full
+VOID CrosEcCmdVersionsInsert(
+	_Inout_ PCROSEC_CMD_VERSIONS Table,
+	_In_ LONG Generation,
+	_In_ UINT16 Command,
+	_In_ UINT32 VersionMask);
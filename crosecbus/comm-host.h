@@ -1,17 +1,101 @@
 #ifndef __COMM_HOST_H__
 #define __COMM_HOST_H__
 
+/*
+ * The transport code (comm-lpc.c, comm-mec_lpc.c) only talks to the EC
+ * through ec_port, so it builds both into the driver and, with CROSEC_HOST
+ * defined, into user-mode programs that plug in a simulated EC instead.
+ */
+#ifdef CROSEC_HOST
+#include "crosec-compat.h"
+#else
+#include "driver.h"
+#endif
+
 #include "ec_commands.h"
 
 /* ec_command return value for non-success result from EC */
 #define EECRESULT 1000
 
+typedef struct ec_port_ops {
+	UINT8(*inb)(unsigned int port);
+	UINT16(*inw)(unsigned int port);
+	UINT32(*inl)(unsigned int port);
+	void(*outb)(UINT8 val, unsigned int port);
+	void(*outw)(UINT16 val, unsigned int port);
+	void(*outl)(UINT32 val, unsigned int port);
+
+	/* Give up the CPU for at least usec microseconds */
+	void(*udelay)(unsigned int usec);
+	/* Busy-wait for usec microseconds without yielding */
+	void(*stall)(unsigned int usec);
+	/* Monotonic time in microseconds */
+	UINT64(*time_us)(void);
+
+	/* Serialize access to the MEC EMI index/data registers */
+	void(*lock)(void);
+	void(*unlock)(void);
+
+	/*
+	 * Optional completion interrupt; leave both NULL to poll. irq_arm
+	 * forgets any earlier interrupt and is called before each status
+	 * read; irq_wait then sleeps until the interrupt fires or usec pass,
+	 * and returns non-zero if it fired.
+	 */
+	void(*irq_arm)(void);
+	int(*irq_wait)(unsigned int usec);
+} ec_port_ops;
+
+extern ec_port_ops ec_port;
+
+static __inline void outb(unsigned char __val, unsigned int __port) {
+	ec_port.outb(__val, __port);
+}
+
+static __inline void outw(unsigned short __val, unsigned int __port) {
+	ec_port.outw(__val, __port);
+}
+
+static __inline void outl(unsigned int __val, unsigned int __port) {
+	ec_port.outl(__val, __port);
+}
+
+static __inline unsigned char inb(unsigned int __port) {
+	return ec_port.inb(__port);
+}
+
+static __inline unsigned short inw(unsigned int __port) {
+	return ec_port.inw(__port);
+}
+
+static __inline unsigned int inl(unsigned int __port) {
+	return ec_port.inl(__port);
+}
+
+/*
+ * read/write move length bytes between a buffer and the EC I/O window at
+ * offset. Both return the sum of the bytes moved, so packet checksums are
+ * built during the transfer rather than in a second pass over the data.
+ */
 typedef struct lpc_driver_ops {
 	int(*read)(unsigned int offset, unsigned int length, UINT8* dest);
 	int(*write)(unsigned int offset, unsigned int length, const UINT8* dest);
+
+	/*
+	 * Optional. Held around a run of read/write calls so a transfer can
+	 * carry on from where the previous one left the window.
+	 */
+	void(*lock)(void);
+	void(*unlock)(void);
 } lpc_driver_ops;
 
+/*
+ * Largest payload each way, after the packet header. For protocol 3 these
+ * come from EC_CMD_GET_PROTOCOL_INFO, which is also kept in ec_protocol_info
+ * (all zero if the EC didn't answer).
+ */
 extern UINT32 ec_max_outsize, ec_max_insize;
+extern struct ec_response_get_protocol_info ec_protocol_info;
 
 extern lpc_driver_ops ec_lpc_ops;
 
@@ -19,6 +103,30 @@ extern int (*ec_command_proto)(UINT16 command, UINT8 version,
 	const void* outdata, int outsize, /* to EC */
 	void* indata, int insize);        /* from EC */
 
+/*
+ * Split-phase form of ec_command_proto for callers that don't want to
+ * block in wait_for_ec. ec_command_submit starts a command; once
+ * ec_command_busy() returns 0, ec_command_complete reads the response and
+ * returns what ec_command_proto would have. Only one command can be in
+ * flight, and the caller keeps the EC to itself from submit to complete.
+ */
+extern int (*ec_command_submit)(UINT16 command, UINT8 version,
+	const void* outdata, int outsize);
+extern int (*ec_command_complete)(void* indata, int insize);
+int ec_command_busy(void);
+
+/*
+ * A command that returns EC_RES_IN_PROGRESS carries on in the background
+ * (if GET_PROTOCOL_INFO reports EC_PROTOCOL_INFO_IN_PROGRESS_SUPPORTED).
+ * ec_command_in_progress asks the EC about it, and returns 1 while it is
+ * still running, 0 once it is done, or a negative error. Only the result
+ * is reported; the command's response data is not available. Callers may
+ * send other commands in between polls.
+ */
+#define EC_IN_PROGRESS_POLL_USEC    10000
+#define EC_IN_PROGRESS_TIMEOUT_USEC 2000000
+int ec_command_in_progress(void);
+
 /**
  * Return the content of the EC information area mapped as "memory".
  * The offsets are defined by the EC_MEMMAP_ constants. Returns the number
@@ -27,4 +135,46 @@ extern int (*ec_command_proto)(UINT16 command, UINT8 version,
  */
 extern int (*ec_readmem)(int offset, int bytes, void* dest);
 
-#endif
\ No newline at end of file
+/* Sum of length bytes at data; only the low 8 bits matter for EC checksums */
+int ec_checksum_bytes(const UINT8* data, unsigned int length);
+
+/* Sum of the bytes of a little-endian word/dword */
+static __inline int ec_word_sum(UINT16 v) {
+	return (v & 0xff) + (v >> 8);
+}
+
+static __inline int ec_dword_sum(UINT32 v) {
+	return ec_word_sum((UINT16)v) + ec_word_sum((UINT16)(v >> 16));
+}
+
+/*
+ * How long to wait for a command's response. Commands passed through to a
+ * sub-processor (EC_CMD_PASSTHRU_OFFSET(n), e.g. the PD MCU) include the
+ * EC's round trip to it, so they get longer.
+ */
+#define EC_COMMAND_TIMEOUT_USEC  1000000
+#define EC_PASSTHRU_TIMEOUT_USEC 3000000
+
+static __inline int ec_command_timeout(UINT16 command) {
+	return command >= EC_CMD_PASSTHRU_OFFSET(1) ?
+		EC_PASSTHRU_TIMEOUT_USEC : EC_COMMAND_TIMEOUT_USEC;
+}
+
+/*
+ * Wait for the busy bit at status_addr to clear. Returns 0 when the EC is
+ * idle, non-zero on timeout. command is only used to tune the polling.
+ */
+int wait_for_ec(int status_addr, int timeout_usec, UINT16 command);
+
+/*
+ * Forget the per-command latency estimates wait_for_ec keeps.
+ * comm_init_lpc does this on every probe.
+ */
+void ec_latency_reset(void);
+
+/*
+ * Probe for the EC and pick a protocol. ec_port must be set up first.
+ */
+NTSTATUS comm_init_lpc(void);
+
+#endif
@@ -1,23 +1,5 @@
-#include "driver.h"
 #include "comm-host.h"
 
-static __inline void outb(unsigned char __val, unsigned int __port) {
-	WRITE_PORT_UCHAR((PUCHAR)__port, __val);
-}
-
-static __inline void outw(unsigned short __val, unsigned int __port) {
-	WRITE_PORT_USHORT((PUSHORT)__port, __val);
-}
-
-static __inline unsigned char inb(unsigned int __port) {
-	return READ_PORT_UCHAR((PUCHAR)__port);
-}
-
-static __inline unsigned short inw(unsigned int __port) {
-	return READ_PORT_USHORT((PUSHORT)__port);
-}
-
-
 #define INITIAL_UDELAY 5     /* 5 us */
 #define MAXIMUM_UDELAY 10000 /* 10 ms */
 
@@ -25,6 +7,9 @@ static ULONG CrosEcBusDebugLevel = 100;
 static ULONG CrosEcBusDebugCatagories = DBG_INIT || DBG_PNP || DBG_IOCTL;
 
 UINT32 ec_max_outsize, ec_max_insize;
+struct ec_response_get_protocol_info ec_protocol_info;
+
+ec_port_ops ec_port = {0};
 
 lpc_driver_ops ec_lpc_ops = {0};
 
@@ -33,50 +18,159 @@ int (*ec_command_proto)(UINT16 command, UINT8 version,
 	void* indata, int insize);
 int (*ec_readmem)(int offset, int bytes, void* dest);
 
+int (*ec_command_submit)(UINT16 command, UINT8 version,
+	const void* outdata, int outsize);
+int (*ec_command_complete)(void* indata, int insize);
+
+/* Command in flight between submit and complete */
+static UINT16 ec_inflight_command;
+
+/*
+ * Don't spin longer than this before falling back to sleeping. Most host
+ * commands complete in a few microseconds, well inside this window.
+ */
+#define MAXIMUM_SPIN_UDELAY 50
+
+/*
+ * Running estimate of how long each command keeps the EC busy, in
+ * microseconds. Commands are hashed into a small table and each slot
+ * remembers the command it belongs to, so a command that finds another
+ * one in its slot starts over from no estimate instead of borrowing it.
+ * One sample raises the estimate by at most half again plus
+ * INITIAL_UDELAY, so a single slow outlier can't make a fast command
+ * sleep.
+ */
+#define LATENCY_SLOTS 64
+
+static struct {
+	UINT32 key; /* command + 1; 0 for a free slot */
+	UINT32 estimate;
+} ec_latency[LATENCY_SLOTS];
+
+static UINT32 ec_latency_get(UINT16 command) {
+	UINT32 slot = (command ^ (command >> 6)) % LATENCY_SLOTS;
+
+	return ec_latency[slot].key == (UINT32)command + 1 ? ec_latency[slot].estimate : 0;
+}
+
+static void ec_latency_update(UINT16 command, UINT32 elapsed) {
+	UINT32 slot = (command ^ (command >> 6)) % LATENCY_SLOTS;
+	UINT32 estimate = ec_latency_get(command);
+	UINT32 step;
+
+	/* Fold this round trip into the estimate with a weight of 1/8 */
+	if (elapsed > estimate) {
+		step = (elapsed - estimate + 7) / 8;
+		if (step > estimate / 2 + INITIAL_UDELAY)
+			step = estimate / 2 + INITIAL_UDELAY;
+		estimate += step;
+	}
+	else {
+		estimate -= (estimate - elapsed) / 8;
+	}
+
+	ec_latency[slot].key = (UINT32)command + 1;
+	ec_latency[slot].estimate = estimate;
+}
+
+void ec_latency_reset(void) {
+	memset(ec_latency, 0, sizeof(ec_latency));
+}
+
+/*
+ * Sleep for usec, or until the EC raises its completion interrupt if the
+ * port has one. The timeout keeps polling going if the interrupt never
+ * comes.
+ */
+static void ec_sleep(unsigned int usec) {
+	if (ec_port.irq_wait)
+		ec_port.irq_wait(usec);
+	else
+		ec_port.udelay(usec);
+}
+
 /*
  * Wait for the EC to be unbusy.  Returns 0 if unbusy, non-zero if
  * timeout.
+ *
+ * The busy flag is set by hardware as soon as the command byte is
+ * written, so it's safe to poll right away. Spin for roughly as long as
+ * this command took last time, then back off exponentially from
+ * INITIAL_UDELAY to MAXIMUM_UDELAY. Commands known to be slow sleep
+ * through most of their estimate first (never more than MAXIMUM_UDELAY).
+ * Without an interrupt to wake them they then poll every sixteenth of it
+ * until they run to twice the estimate, so they don't overshoot the end
+ * by a whole backoff step.
  */
-int wait_for_ec(int status_addr, int timeout_usec)
+int wait_for_ec(int status_addr, int timeout_usec, UINT16 command)
 {
-	LARGE_INTEGER StartTime;
-	KeQuerySystemTimePrecise(&StartTime);
-
-	/*
-	* Delay first, in case we just sent out a command but the EC
-	* hasn't raised the busy flag.  However, I think this doesn't
-	* happen since the LPC commands are executed in order and the
-	* busy flag is set by hardware.  Minor issue in any case,
-	* since the initial delay is very short.
-	*/
-
-	LARGE_INTEGER WaitInterval;
-	WaitInterval.QuadPart = -10 * 200;
-	KeDelayExecutionThread(KernelMode, false, &WaitInterval);
+	UINT64 start_time = ec_port.time_us();
+	UINT32 estimate = ec_latency_get(command);
+	UINT32 spin_usec;
+	UINT32 presleep_usec = 0;
+	unsigned int delay = INITIAL_UDELAY;
+	UINT32 step_usec = 0;
+
+	spin_usec = 2 * estimate + INITIAL_UDELAY;
+	if (estimate > MAXIMUM_SPIN_UDELAY) {
+		/* Known slow command; sleep through most of it */
+		presleep_usec = estimate - estimate / 4;
+		if (presleep_usec > MAXIMUM_UDELAY)
+			presleep_usec = MAXIMUM_UDELAY;
+		if (!ec_port.irq_wait) {
+			step_usec = estimate / 16;
+			delay = step_usec;
+		}
+		spin_usec = 0;
+	}
+	else if (spin_usec > MAXIMUM_SPIN_UDELAY) {
+		spin_usec = MAXIMUM_SPIN_UDELAY;
+	}
 
 	while (true) {
-		LARGE_INTEGER CurrentTime;
-		KeQuerySystemTimePrecise(&CurrentTime);
+		UINT64 now = ec_port.time_us();
 
-		if (CurrentTime.QuadPart > StartTime.QuadPart + 10 * (LONGLONG)timeout_usec)
-			break;
+		/* Arm before reading status so a completion in between isn't lost */
+		if (ec_port.irq_arm)
+			ec_port.irq_arm();
 
 		if (!(inb(status_addr) & EC_LPC_STATUS_BUSY_MASK))
-			return 0;
+			break;
+
+		if (now > start_time + timeout_usec)
+			return -1;  /* Timeout */
 
-		WaitInterval.QuadPart = -10 * 100;
-		KeDelayExecutionThread(KernelMode, false, &WaitInterval);
+		if (now < start_time + spin_usec) {
+			ec_port.stall(1);
+		}
+		else if (presleep_usec) {
+			ec_sleep(presleep_usec);
+			presleep_usec = 0;
+		}
+		else {
+			ec_sleep(delay);
+			if (!step_usec || now > start_time + 2 * estimate) {
+				delay *= 2;
+				if (delay > MAXIMUM_UDELAY)
+					delay = MAXIMUM_UDELAY;
+			}
+		}
 	}
-	return -1;  /* Timeout */
+
+	ec_latency_update(command, (UINT32)(ec_port.time_us() - start_time));
+	return 0;
 }
 
-static int ec_command_lpc(UINT16 command, UINT8 version,
-	const void* outdata, int outsize,
-	void* indata, int insize)
+int ec_command_busy(void)
+{
+	return inb(EC_LPC_ADDR_HOST_CMD) & EC_LPC_STATUS_BUSY_MASK;
+}
+
+static int ec_submit_lpc(UINT16 command, UINT8 version,
+	const void* outdata, int outsize)
 {
 	struct ec_lpc_host_args args;
 	const UINT8* d;
-	UINT8* dout;
 	int csum;
 	int i;
 
@@ -99,13 +193,19 @@ static int ec_command_lpc(UINT16 command, UINT8 version,
 	for (i = 0, d = (const UINT8*)&args; i < sizeof(args); i++, d++)
 		outb(*d, EC_LPC_ADDR_HOST_ARGS + i);
 
+	ec_inflight_command = command;
 	outb((UINT8)command, EC_LPC_ADDR_HOST_CMD);
 
-	if (wait_for_ec(EC_LPC_ADDR_HOST_CMD, 1000000)) {
-		CrosEcBusPrint(DEBUG_LEVEL_INFO, DBG_IOCTL,
-			"Timeout waiting for EC response\n");
-		return -EC_RES_ERROR;
-	}
+	return 0;
+}
+
+static int ec_complete_lpc(void* indata, int insize)
+{
+	struct ec_lpc_host_args args;
+	UINT16 command = ec_inflight_command;
+	UINT8* dout;
+	int csum;
+	int i;
 
 	/* Check result */
 	i = inb(EC_LPC_ADDR_HOST_DATA);
@@ -157,10 +257,86 @@ static int ec_command_lpc(UINT16 command, UINT8 version,
 	return args.data_size;
 }
 
+static int ec_command_lpc(UINT16 command, UINT8 version,
+	const void* outdata, int outsize,
+	void* indata, int insize)
+{
+	int rv = ec_submit_lpc(command, version, outdata, outsize);
+	if (rv < 0)
+		return rv;
+
+	if (wait_for_ec(EC_LPC_ADDR_HOST_CMD, ec_command_timeout(command), command)) {
+		CrosEcBusPrint(DEBUG_LEVEL_INFO, DBG_IOCTL,
+			"Timeout waiting for EC response\n");
+		return -EC_RES_ERROR;
+	}
+
+	return ec_complete_lpc(indata, insize);
+}
+
+/*
+ * Sum of all bytes in a buffer. Works a qword at a time, splitting each
+ * into four 16-bit lanes of byte pairs, which compilers turn into vector
+ * adds for larger buffers.
+ */
+int ec_checksum_bytes(const UINT8* data, unsigned int length)
+{
+	const UINT64 lane_mask = 0x00FF00FF00FF00FFULL;
+	unsigned int i = 0;
+	int sum = 0;
+
+	while (length - i >= 8) {
+		/* Each qword adds at most 510 per lane; fold before 65535 */
+		unsigned int n = (length - i) / 8;
+		UINT64 lanes = 0;
+
+		if (n > 128)
+			n = 128;
+
+		for (; n > 0; n--, i += 8) {
+			UINT64 v;
+			memcpy(&v, &data[i], sizeof(v));
+			lanes += (v & lane_mask) + ((v >> 8) & lane_mask);
+		}
+
+		lanes = (lanes & 0x0000FFFF0000FFFFULL) + ((lanes >> 16) & 0x0000FFFF0000FFFFULL);
+		sum += (int)((lanes & 0xFFFFFFFF) + (lanes >> 32));
+	}
+
+	for (; i < length; i++)
+		sum += data[i];
+
+	return sum;
+}
+
+/*
+ * The host packet and memmap windows are plain I/O ranges, so move the
+ * aligned bulk of a buffer with 32-bit accesses and only fall back to
+ * 16/8-bit accesses for the unaligned head and tail.
+ */
 int ec_lpc_read_bytes(unsigned int offset, unsigned int length, UINT8* dest) {
 	int sum = 0;
-	unsigned int i;
-	for (i = 0; i < length; ++i) {
+	unsigned int i = 0;
+
+	for (; i < length && ((offset + i) & 3); ++i) {
+		dest[i] = inb(offset + i);
+		sum += dest[i];
+	}
+
+	for (; i + 4 <= length; i += 4) {
+		UINT32 v = inl(offset + i);
+		memcpy(&dest[i], &v, sizeof(v));
+		sum += ec_dword_sum(v);
+	}
+
+	if (i + 2 <= length) {
+		UINT16 v = inw(offset + i);
+		memcpy(&dest[i], &v, sizeof(v));
+		sum += ec_word_sum(v);
+		i += 2;
+	}
+
+	if (i < length) {
 		dest[i] = inb(offset + i);
 		sum += dest[i];
 	}
@@ -171,8 +347,29 @@ int ec_lpc_read_bytes(unsigned int offset, unsigned int length, UINT8* dest) {
 
 int ec_lpc_write_bytes(unsigned int offset, unsigned int length, const UINT8* msg) {
 	int sum = 0;
-	unsigned int i;
-	for (i = 0; i < length; ++i) {
+	unsigned int i = 0;
+
+	for (; i < length && ((offset + i) & 3); ++i) {
+		outb(msg[i], offset + i);
+		sum += msg[i];
+	}
+
+	for (; i + 4 <= length; i += 4) {
+		UINT32 v;
+		memcpy(&v, &msg[i], sizeof(v));
+		outl(v, offset + i);
+		sum += ec_dword_sum(v);
+	}
+
+	if (i + 2 <= length) {
+		UINT16 v;
+		memcpy(&v, &msg[i], sizeof(v));
+		outw(v, offset + i);
+		sum += ec_word_sum(v);
+		i += 2;
+	}
+
+	if (i < length) {
 		outb(msg[i], offset + i);
 		sum += msg[i];
 	}
@@ -181,19 +378,24 @@ int ec_lpc_write_bytes(unsigned int offset, unsigned int length, const UINT8* ms
 	return sum;
 }
 
-static int ec_command_lpc_3(UINT16 command, UINT8 version,
-	const void* outdata, int outsize,
-	void* indata, int insize)
+static __inline void ec_lpc_lock(void) {
+	if (ec_lpc_ops.lock)
+		ec_lpc_ops.lock();
+}
+
+static __inline void ec_lpc_unlock(void) {
+	if (ec_lpc_ops.unlock)
+		ec_lpc_ops.unlock();
+}
+
+static int ec_submit_lpc_3(UINT16 command, UINT8 version,
+	const void* outdata, int outsize)
 {
 	struct ec_host_request rq;
-	struct ec_host_response rs;
-	const UINT8* d;
-	UINT8* dout;
-	int csum = 0;
-	int i;
+	int csum;
 
 	/* Fail if output size is too big */
-	if (outsize + sizeof(rq) > EC_LPC_HOST_PACKET_SIZE)
+	if ((UINT32)outsize > ec_max_outsize)
 		return -EC_RES_REQUEST_TRUNCATED;
 
 	/* Fill in request packet */
@@ -205,15 +407,13 @@ static int ec_command_lpc_3(UINT16 command, UINT8 version,
 	rq.reserved = 0;
 	rq.data_len = (UINT16)outsize;
 
+	ec_lpc_lock();
+
 	/* Copy data and update checksum */
-	ec_lpc_ops.write(EC_LPC_ADDR_HOST_PACKET + sizeof(rq), outsize, outdata);
-	for (i = 0, d = (const UINT8*)outdata; i < outsize; i++, d++) {
-		csum += *d;
-	}
+	csum = ec_lpc_ops.write(EC_LPC_ADDR_HOST_PACKET + sizeof(rq), outsize, outdata);
 
 	/* Finish checksum */
-	for (i = 0, d = (const UINT8*)&rq; i < sizeof(rq); i++, d++)
-		csum += *d;
+	csum += ec_checksum_bytes((const UINT8*)&rq, sizeof(rq));
 
 	/* Write checksum field so the entire packet sums to 0 */
 	rq.checksum = (UINT8)(-csum);
@@ -221,14 +421,20 @@ static int ec_command_lpc_3(UINT16 command, UINT8 version,
 	/* Copy header */
 	ec_lpc_ops.write(EC_LPC_ADDR_HOST_PACKET, sizeof(rq), (const UINT8 *)&rq);
 
+	ec_lpc_unlock();
+
 	/* Start the command */
+	ec_inflight_command = command;
 	outb(EC_COMMAND_PROTOCOL_3, EC_LPC_ADDR_HOST_CMD);
 
-	if (wait_for_ec(EC_LPC_ADDR_HOST_CMD, 1000000)) {
-		CrosEcBusPrint(DEBUG_LEVEL_INFO, DBG_IOCTL,
-			"Timeout waiting for EC response\n");
-		return -EC_RES_ERROR;
-	}
+	return 0;
+}
+
+static int ec_complete_lpc_3(void* indata, int insize)
+{
+	struct ec_host_response rs;
+	int csum;
+	int i;
 
 	/* Check result */
 	i = inb(EC_LPC_ADDR_HOST_DATA);
@@ -238,36 +444,37 @@ static int ec_command_lpc_3(UINT16 command, UINT8 version,
 		return -EECRESULT - i;
 	}
 
+	/* Header and data are contiguous; read them under one hold of the window */
+	ec_lpc_lock();
+
 	/* Read back response header and start checksum */
-	ec_lpc_ops.read(EC_LPC_ADDR_HOST_PACKET, sizeof(rs), (UINT8*)&rs);
-	csum = 0;
-	for (i = 0, dout = (UINT8*)&rs; i < sizeof(rs); i++, dout++) {
-		csum += *dout;
-	}
+	csum = ec_lpc_ops.read(EC_LPC_ADDR_HOST_PACKET, sizeof(rs), (UINT8*)&rs);
 
 	if (rs.struct_version != EC_HOST_RESPONSE_VERSION) {
+		ec_lpc_unlock();
 		CrosEcBusPrint(DEBUG_LEVEL_INFO, DBG_IOCTL,
 			"EC response version mismatch\n");
 		return -EC_RES_INVALID_RESPONSE;
 	}
 
 	if (rs.reserved) {
+		ec_lpc_unlock();
 		CrosEcBusPrint(DEBUG_LEVEL_INFO, DBG_IOCTL,
 			"EC response reserved != 0\n");
 		return -EC_RES_INVALID_RESPONSE;
 	}
 
-	if (rs.data_len > insize) {
+	if (rs.data_len > insize || rs.data_len > ec_max_insize) {
+		ec_lpc_unlock();
 		CrosEcBusPrint(DEBUG_LEVEL_INFO, DBG_IOCTL,
 			"EC returned too much data\n");
 		return -EC_RES_RESPONSE_TOO_BIG;
 	}
 
 	/* Read back data and update checksum */
-	ec_lpc_ops.read(EC_LPC_ADDR_HOST_PACKET + sizeof(rs), rs.data_len, indata);
-	for (i = 0, dout = (UINT8*)indata; i < rs.data_len; i++, dout++) {
-		csum += *dout;
-	}
+	csum += ec_lpc_ops.read(EC_LPC_ADDR_HOST_PACKET + sizeof(rs), rs.data_len, indata);
+
+	ec_lpc_unlock();
 
 	/* Verify checksum */
 	if ((UINT8)csum) {
@@ -280,33 +487,123 @@ static int ec_command_lpc_3(UINT16 command, UINT8 version,
 	return rs.data_len;
 }
 
+static int ec_command_lpc_3(UINT16 command, UINT8 version,
+	const void* outdata, int outsize,
+	void* indata, int insize)
+{
+	int rv = ec_submit_lpc_3(command, version, outdata, outsize);
+	if (rv < 0)
+		return rv;
+
+	if (wait_for_ec(EC_LPC_ADDR_HOST_CMD, ec_command_timeout(command), command)) {
+		CrosEcBusPrint(DEBUG_LEVEL_INFO, DBG_IOCTL,
+			"Timeout waiting for EC response\n");
+		return -EC_RES_ERROR;
+	}
+
+	return ec_complete_lpc_3(indata, insize);
+}
+
 static int ec_readmem_lpc(int offset, int bytes, void* dest)
 {
 	int i = offset;
 	UINT8* s = (UINT8*)(dest);
 	int cnt = 0;
 
-	if (offset >= EC_MEMMAP_SIZE - bytes)
+	if (offset < 0 || bytes < 0 || offset + bytes > EC_MEMMAP_SIZE ||
+		offset >= EC_MEMMAP_SIZE)
 		return -1;
 
+	ec_lpc_lock();
+
 	if (bytes) {				/* fixed length */
 		ec_lpc_ops.read(EC_LPC_ADDR_MEMMAP + i, bytes, dest);
 		cnt = bytes;
 	}
 	else {				/* string */
-		for (; i < EC_MEMMAP_SIZE; i++, s++) {
-			ec_lpc_ops.read(EC_LPC_ADDR_MEMMAP + i, 1, s);
-			cnt++;
-			if (!*s)
+		/*
+		 * Strings are at most EC_MEMMAP_TEXT_MAX bytes, so fetch a whole
+		 * field per transfer and look for the terminator afterwards.
+		 * Bytes past the '\0' are not copied to the caller.
+		 */
+		UINT8 chunk[EC_MEMMAP_TEXT_MAX];
+		while (i < EC_MEMMAP_SIZE) {
+			int len = EC_MEMMAP_SIZE - i;
+			int j;
+
+			if (len > EC_MEMMAP_TEXT_MAX)
+				len = EC_MEMMAP_TEXT_MAX;
+
+			ec_lpc_ops.read(EC_LPC_ADDR_MEMMAP + i, len, chunk);
+			for (j = 0; j < len; j++) {
+				s[cnt++] = chunk[j];
+				if (!chunk[j])
+					break;
+			}
+			if (j < len)
 				break;
+			i += len;
 		}
 	}
 
+	ec_lpc_unlock();
+
 	return cnt;
 }
 
 int comm_init_lpc_mec(void);
 
+int ec_command_in_progress(void)
+{
+	struct ec_response_get_comms_status status;
+	int rv;
+
+	rv = ec_command_proto(EC_CMD_GET_COMMS_STATUS, 0, NULL, 0,
+		&status, sizeof(status));
+	if (rv < 0)
+		return rv;
+	if (rv < (int)sizeof(status))
+		return -EC_RES_INVALID_RESPONSE;
+
+	return (status.flags & EC_COMMS_STATUS_PROCESSING) ? 1 : 0;
+}
+
+/*
+ * Ask a protocol 3 EC how big a packet it takes. Whatever it says, the LPC
+ * window caps both directions at EC_LPC_HOST_PACKET_SIZE.
+ */
+static void ec_negotiate_packet_size(void)
+{
+	UINT32 request = EC_LPC_HOST_PACKET_SIZE;
+	UINT32 response = EC_LPC_HOST_PACKET_SIZE;
+	int rv;
+
+	/* The query itself goes out under the window size */
+	ec_max_outsize = request - sizeof(struct ec_host_request);
+	ec_max_insize = response - sizeof(struct ec_host_response);
+
+	rv = ec_command_proto(EC_CMD_GET_PROTOCOL_INFO, 0, NULL, 0,
+		&ec_protocol_info, sizeof(ec_protocol_info));
+	if (rv < (int)sizeof(ec_protocol_info)) {
+		CrosEcBusPrint(DEBUG_LEVEL_INFO, DBG_INIT,
+			"EC didn't report protocol info; keeping window size\n");
+		memset(&ec_protocol_info, 0, sizeof(ec_protocol_info));
+		return;
+	}
+
+	if (ec_protocol_info.max_request_packet_size > sizeof(struct ec_host_request) &&
+		ec_protocol_info.max_request_packet_size < request)
+		request = ec_protocol_info.max_request_packet_size;
+	if (ec_protocol_info.max_response_packet_size > sizeof(struct ec_host_response) &&
+		ec_protocol_info.max_response_packet_size < response)
+		response = ec_protocol_info.max_response_packet_size;
+
+	ec_max_outsize = request - sizeof(struct ec_host_request);
+	ec_max_insize = response - sizeof(struct ec_host_response);
+
+	DbgPrint("EC packet sizes: request %u, response %u\n", request, response);
+}
+
 NTSTATUS comm_init_lpc(void)
 {
 	int i;
@@ -318,6 +615,12 @@ NTSTATUS comm_init_lpc(void)
 	 * be 0, so if the command and data bytes are both 0xff, very likely
 	 * that Chromium EC is not present.  See crosbug.com/p/10963.
 	 */
+	if (!ec_port.inb)
+		return STATUS_DEVICE_NOT_READY;
+
+	/* Estimates from another transport (or EC) don't carry over */
+	ec_latency_reset();
+
 	byte &= inb(EC_LPC_ADDR_HOST_CMD);
 	byte &= inb(EC_LPC_ADDR_HOST_DATA);
 	if (byte == 0xff) {
@@ -336,15 +639,15 @@ NTSTATUS comm_init_lpc(void)
 
 	/* Check for a MEC first. */
 	if (comm_init_lpc_mec && NT_SUCCESS(comm_init_lpc_mec())) {
+		ec_lpc_lock();
 		ec_lpc_ops.read(EC_LPC_ADDR_MEMMAP + EC_MEMMAP_ID, 2, signature);
+		ec_lpc_unlock();
 		if (signature[0] == 'E' && signature[1] == 'C') {
-			ec_max_outsize = EC_LPC_HOST_PACKET_SIZE -
-				sizeof(struct ec_host_request);
-			ec_max_insize = EC_LPC_HOST_PACKET_SIZE -
-				sizeof(struct ec_host_response);
-
 			//All MEC EC's are Protocol V3
 			ec_command_proto = ec_command_lpc_3;
+			ec_command_submit = ec_submit_lpc_3;
+			ec_command_complete = ec_complete_lpc_3;
+			ec_negotiate_packet_size();
 
 			DbgPrint("MEC EC\n");
 			return STATUS_SUCCESS;
@@ -362,6 +665,8 @@ NTSTATUS comm_init_lpc(void)
 
 	ec_lpc_ops.read = ec_lpc_read_bytes;
 	ec_lpc_ops.write = ec_lpc_write_bytes;
+	ec_lpc_ops.lock = NULL;
+	ec_lpc_ops.unlock = NULL;
 	ec_lpc_ops.read(EC_LPC_ADDR_MEMMAP + EC_MEMMAP_ID, 2, signature);
 	if (signature[0] != 'E' || signature[1] != 'C') {
 		CrosEcBusPrint(DEBUG_LEVEL_INFO, DBG_INIT,
@@ -375,10 +680,9 @@ NTSTATUS comm_init_lpc(void)
 	if (i & EC_HOST_CMD_FLAG_VERSION_3) {
 		/* Protocol version 3 */
 		ec_command_proto = ec_command_lpc_3;
-		ec_max_outsize = EC_LPC_HOST_PACKET_SIZE -
-			sizeof(struct ec_host_request);
-		ec_max_insize = EC_LPC_HOST_PACKET_SIZE -
-			sizeof(struct ec_host_response);
+		ec_command_submit = ec_submit_lpc_3;
+		ec_command_complete = ec_complete_lpc_3;
+		ec_negotiate_packet_size();
 
 		DbgPrint("Ver 3\n");
 
@@ -386,7 +690,10 @@ NTSTATUS comm_init_lpc(void)
 	else if (i & EC_HOST_CMD_FLAG_LPC_ARGS_SUPPORTED) {
 		/* Protocol version 2 */
 		ec_command_proto = ec_command_lpc;
+		ec_command_submit = ec_submit_lpc;
+		ec_command_complete = ec_complete_lpc;
 		ec_max_outsize = ec_max_insize = EC_PROTO2_MAX_PARAM_SIZE;
+		memset(&ec_protocol_info, 0, sizeof(ec_protocol_info));
 
 		DbgPrint("Ver 2\n");
 	}
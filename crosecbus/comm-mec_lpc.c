@@ -1,30 +1,8 @@
-#include "driver.h"
-#include "comm-host.h" 
-
-static __inline void outb(unsigned char __val, unsigned int __port) {
-	WRITE_PORT_UCHAR((PUCHAR)__port, __val);
-}
-
-static __inline void outw(unsigned short __val, unsigned int __port) {
-	WRITE_PORT_USHORT((PUSHORT)__port, __val);
-}
-
-static __inline unsigned char inb(unsigned int __port) {
-	return READ_PORT_UCHAR((PUCHAR)__port);
-}
-
-static __inline unsigned short inw(unsigned int __port) {
-	return READ_PORT_USHORT((PUSHORT)__port);
-}
-
+#include "comm-host.h"
 
 static ULONG CrosEcBusDebugLevel = 100;
 static ULONG CrosEcBusDebugCatagories = DBG_INIT || DBG_PNP || DBG_IOCTL;
 
-FAST_MUTEX MecAccessMutex;
-
-int wait_for_ec(int status_addr, int timeout_usec);
-
 // Thanks @DHowett!
 
 typedef enum _ec_xfer_direction { EC_MEC_WRITE, EC_MEC_READ } ec_xfer_direction;
@@ -55,70 +33,107 @@ enum cros_ec_lpc_mec_emi_access_mode {
 
 UINT16 mec_emi_base = 0, mec_emi_end = 0;
 
+/*
+ * Last value written to the EMI address register (address | access mode),
+ * or -1 if unknown. Lets back-to-back transfers skip the re-seek, e.g. a
+ * response header followed by its payload. Only valid while locked.
+ */
+static int mec_emi_address = -1;
+
 static void ec_mec_emi_write_access(UINT16 address, enum cros_ec_lpc_mec_emi_access_mode access_type) {
-	outw((address & 0xFFFC) | (UINT16)access_type, MEC_EMI_EC_ADDRESS_B0(mec_emi_base));
+	int reg = (address & 0xFFFC) | (UINT16)access_type;
+
+	if (reg == mec_emi_address)
+		return;
+
+	outw((UINT16)reg, MEC_EMI_EC_ADDRESS_B0(mec_emi_base));
+	mec_emi_address = reg;
+}
+
+static void ec_mec_lock(void) {
+	ec_port.lock();
+
+	/* Firmware or a sleep transition may have moved the window since we last held it */
+	mec_emi_address = -1;
+}
+
+static void ec_mec_unlock(void) {
+	ec_port.unlock();
 }
 
+/*
+ * Move size bytes between data and EC RAM at address using 32-bit accesses
+ * only. A partial dword at either end is read whole; on writes the bytes
+ * outside the transfer are written back as they were.
+ *
+ * Callers hold ec_mec_lock.
+ */
 static int ec_mec_xfer(ec_xfer_direction direction, UINT16 address,
 	UINT8* data, UINT16 size)
 {
 	if (mec_emi_base == 0 || mec_emi_end == 0)
 		return 0;
 
-	ExAcquireFastMutex(&MecAccessMutex);
-
-	/*
-	 * There's a cleverer way to do this, but it's somewhat less clear what's happening.
-	 * I prefer clarity over cleverness. :)
-	 */
 	int pos = 0;
-	UINT16 temp[2];
-	if (address % 4 > 0) {
-		ec_mec_emi_write_access(address, MEC_EC_BYTE_ACCESS);
-		/* Unaligned start address */
-		for (int i = address % 4; i < 4; ++i) {
-			UINT8* storage = &data[pos++];
-			if (direction == EC_MEC_WRITE)
-				outb(*storage, MEC_EMI_EC_DATA_B0(mec_emi_base) + i);
-			else if (direction == EC_MEC_READ)
-				*storage = inb(MEC_EMI_EC_DATA_B0(mec_emi_base) + i);
-		}
-		address = (address + 4) & 0xFFFC;
-	}
-
-	if (size - pos >= 4) {
-		ec_mec_emi_write_access(address, MEC_EC_LONG_ACCESS_AUTOINCREMENT);
-		while (size - pos >= 4) {
-			if (direction == EC_MEC_WRITE) {
-				memcpy(temp, &data[pos], sizeof(temp));
-				outw(temp[0], MEC_EMI_EC_DATA_B0(mec_emi_base));
-				outw(temp[1], MEC_EMI_EC_DATA_B2(mec_emi_base));
-			}
-			else if (direction == EC_MEC_READ) {
-				temp[0] = inw(MEC_EMI_EC_DATA_B0(mec_emi_base));
-				temp[1] = inw(MEC_EMI_EC_DATA_B2(mec_emi_base));
-				memcpy(&data[pos], temp, sizeof(temp));
+	int sum = 0;
+	UINT32 dword;
+	UINT8* bytes = (UINT8*)&dword;
+
+	while (pos < size) {
+		int skip = address % 4;
+		int count = 4 - skip;
+
+		if (count > size - pos)
+			count = size - pos;
+
+		if (count == 4) {
+			/* Aligned run */
+			ec_mec_emi_write_access(address, MEC_EC_LONG_ACCESS_AUTOINCREMENT);
+			while (size - pos >= 4) {
+				if (direction == EC_MEC_WRITE) {
+					memcpy(&dword, &data[pos], sizeof(dword));
+					outl(dword, MEC_EMI_EC_DATA_B0(mec_emi_base));
+				}
+				else if (direction == EC_MEC_READ) {
+					dword = inl(MEC_EMI_EC_DATA_B0(mec_emi_base));
+					memcpy(&data[pos], &dword, sizeof(dword));
+				}
+				sum += ec_dword_sum(dword);
+
+				pos += 4;
+				address += 4;
 			}
 
-			pos += 4;
-			address += 4;
+			/* Accessing DATA_B3 advanced the EC address with us */
+			mec_emi_address = address | MEC_EC_LONG_ACCESS_AUTOINCREMENT;
+			continue;
 		}
-	}
 
-	if (size - pos > 0) {
-		ec_mec_emi_write_access(address, MEC_EC_BYTE_ACCESS);
-		for (int i = 0; i < (size - pos); ++i) {
-			UINT8* storage = &data[pos + i];
-			if (direction == EC_MEC_WRITE)
-				outb(*storage, MEC_EMI_EC_DATA_B0(mec_emi_base) + i);
-			else if (direction == EC_MEC_READ)
-				*storage = inb(MEC_EMI_EC_DATA_B0(mec_emi_base) + i);
+		/* Unaligned head or short tail */
+		if (direction == EC_MEC_WRITE) {
+			/* Read-modify-write, so the EC address must not advance */
+			ec_mec_emi_write_access(address, MEC_EC_LONG_ACCESS);
+			dword = inl(MEC_EMI_EC_DATA_B0(mec_emi_base));
+			memcpy(&bytes[skip], &data[pos], count);
+			outl(dword, MEC_EMI_EC_DATA_B0(mec_emi_base));
+		}
+		else if (direction == EC_MEC_READ) {
+			/* Auto-increment so an aligned run can follow without a re-seek */
+			ec_mec_emi_write_access(address, MEC_EC_LONG_ACCESS_AUTOINCREMENT);
+			dword = inl(MEC_EMI_EC_DATA_B0(mec_emi_base));
+			mec_emi_address = ((address & 0xFFFC) + 4) | MEC_EC_LONG_ACCESS_AUTOINCREMENT;
+			memcpy(&data[pos], &bytes[skip], count);
 		}
-	}
 
-	ExReleaseFastMutex(&MecAccessMutex);
+		for (int i = 0; i < count; i++)
+			sum += data[pos + i];
 
-	return 0;
+		pos += count;
+		address += (UINT16)count;
+	}
+
+	/* Return checksum of all bytes transferred */
+	return sum;
 }
 
 static int cros_ec_lpc_mec_in_range(unsigned int offset, unsigned int length) {
@@ -149,15 +164,8 @@ static int ec_mec_lpc_read_bytes(unsigned int offset, unsigned int length, UINT8
 		return ec_lpc_read_bytes(offset, length, dest);
 	}
 
-	int sum = 0;
-	unsigned int i;
-	ec_mec_xfer(EC_MEC_READ, (UINT16)offset - EC_HOST_CMD_REGION0, dest, (UINT16)length);
-	for (i = 0; i < length; ++i) {
-		sum += dest[i];
-	}
-
 	/* Return checksum of all bytes read */
-	return sum;
+	return ec_mec_xfer(EC_MEC_READ, (UINT16)offset - EC_HOST_CMD_REGION0, dest, (UINT16)length);
 }
 
 static int ec_mec_lpc_write_bytes(unsigned int offset, unsigned int length, const UINT8* msg) {
@@ -166,28 +174,21 @@ static int ec_mec_lpc_write_bytes(unsigned int offset, unsigned int length, cons
 		return ec_lpc_write_bytes(offset, length, msg);
 	}
 
-	int sum = 0;
-	unsigned int i;
-	ec_mec_xfer(EC_MEC_WRITE, (UINT16)offset - EC_HOST_CMD_REGION0, (UINT8 *)msg, (UINT16)length);
-	for (i = 0; i < length; ++i) {
-		sum += msg[i];
-	}
-
 	/* Return checksum of all bytes written */
-	return sum;
+	return ec_mec_xfer(EC_MEC_WRITE, (UINT16)offset - EC_HOST_CMD_REGION0, (UINT8 *)msg, (UINT16)length);
 }
 
 NTSTATUS comm_init_lpc_mec(void)
 {
 	/* This function assumes some setup was done by comm_init_lpc. */
-	
-	ExInitializeFastMutex(&MecAccessMutex);
 
 	mec_emi_base = EC_HOST_CMD_REGION0;
 	mec_emi_end = EC_LPC_ADDR_MEMMAP + EC_MEMMAP_SIZE;
 
 	ec_lpc_ops.read = ec_mec_lpc_read_bytes;
 	ec_lpc_ops.write = ec_mec_lpc_write_bytes;
+	ec_lpc_ops.lock = ec_mec_lock;
+	ec_lpc_ops.unlock = ec_mec_unlock;
 
 	return STATUS_SUCCESS;
 }
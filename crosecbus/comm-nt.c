@@ -0,0 +1,102 @@
+#include "driver.h"
+#include "comm-host.h"
+
+/*
+ * Port backend for real hardware. Everything Windows-specific that the
+ * transport needs lives here so comm-lpc.c and comm-mec_lpc.c stay portable.
+ */
+
+static FAST_MUTEX MecAccessMutex;
+
+/* Set from OnInterruptIsr; wakes wait_for_ec when the EC raises its interrupt */
+static KEVENT EcCompletionEvent;
+
+static UINT8 nt_inb(unsigned int port) {
+	return READ_PORT_UCHAR((PUCHAR)(ULONG_PTR)port);
+}
+
+static UINT16 nt_inw(unsigned int port) {
+	return READ_PORT_USHORT((PUSHORT)(ULONG_PTR)port);
+}
+
+static UINT32 nt_inl(unsigned int port) {
+	return READ_PORT_ULONG((PULONG)(ULONG_PTR)port);
+}
+
+static void nt_outb(UINT8 val, unsigned int port) {
+	WRITE_PORT_UCHAR((PUCHAR)(ULONG_PTR)port, val);
+}
+
+static void nt_outw(UINT16 val, unsigned int port) {
+	WRITE_PORT_USHORT((PUSHORT)(ULONG_PTR)port, val);
+}
+
+static void nt_outl(UINT32 val, unsigned int port) {
+	WRITE_PORT_ULONG((PULONG)(ULONG_PTR)port, val);
+}
+
+static void nt_udelay(unsigned int usec) {
+	LARGE_INTEGER WaitInterval;
+	WaitInterval.QuadPart = -10 * (LONGLONG)usec;
+	KeDelayExecutionThread(KernelMode, false, &WaitInterval);
+}
+
+static void nt_stall(unsigned int usec) {
+	KeStallExecutionProcessor(usec);
+}
+
+static UINT64 nt_time_us(void) {
+	LARGE_INTEGER CurrentTime;
+	KeQuerySystemTimePrecise(&CurrentTime);
+	return CurrentTime.QuadPart / 10;
+}
+
+static void nt_lock(void) {
+	ExAcquireFastMutex(&MecAccessMutex);
+}
+
+static void nt_unlock(void) {
+	ExReleaseFastMutex(&MecAccessMutex);
+}
+
+static void nt_irq_arm(void) {
+	KeClearEvent(&EcCompletionEvent);
+}
+
+static int nt_irq_wait(unsigned int usec) {
+	LARGE_INTEGER Timeout;
+	Timeout.QuadPart = -10 * (LONGLONG)usec;
+	return KeWaitForSingleObject(&EcCompletionEvent, Executive, KernelMode, FALSE, &Timeout) == STATUS_SUCCESS;
+}
+
+/*
+ * Called at the top of the (passive level) ISR, before it takes EcLock to
+ * query host events, so a command waiting for completion is woken first.
+ * Commands sent by the ISR itself can't be woken this way and fall back to
+ * the polling timeout.
+ */
+void comm_nt_completion_irq(void)
+{
+	KeSetEvent(&EcCompletionEvent, IO_NO_INCREMENT, FALSE);
+}
+
+void comm_init_port_nt(BOOLEAN completion_irq)
+{
+	ExInitializeFastMutex(&MecAccessMutex);
+	KeInitializeEvent(&EcCompletionEvent, NotificationEvent, FALSE);
+
+	ec_port.inb = nt_inb;
+	ec_port.inw = nt_inw;
+	ec_port.inl = nt_inl;
+	ec_port.outb = nt_outb;
+	ec_port.outw = nt_outw;
+	ec_port.outl = nt_outl;
+	ec_port.udelay = nt_udelay;
+	ec_port.stall = nt_stall;
+	ec_port.time_us = nt_time_us;
+	ec_port.lock = nt_lock;
+	ec_port.unlock = nt_unlock;
+
+	ec_port.irq_arm = completion_irq ? nt_irq_arm : NULL;
+	ec_port.irq_wait = completion_irq ? nt_irq_wait : NULL;
+}
@@ -5,6 +5,7 @@
 #include <stdint.h>
 #include "comm-host.h"
 #include "userspaceQueue.h"
+#include "ecEngine.h"
 
 #define bool int
 #define MS_IN_US 1000
@@ -18,10 +19,31 @@ CrosEcBusS0ixNotifyCallback(
 	PCROSECBUS_CONTEXT pDevice,
 	ULONG NotifyCode);
 
+static NTSTATUS send_ec_command(
+	_In_ PCROSECBUS_CONTEXT pDevice,
+	CROSEC_LOCK_CLASS lockClass,
+	UINT32 cmd,
+	UINT32 version,
+	UINT8* out,
+	size_t outSize,
+	UINT8* in,
+	size_t inSize,
+	int* result);
+
+//Everything learned from the EC is stale once it resets or jumps images
+static VOID CrosEcBusEcRestarted(
+	_In_ PCROSECBUS_CONTEXT pDevice)
+{
+	CrosEcMemmapCacheInvalidate(&pDevice->MemmapCache);
+	CrosEcCmdVersionsInvalidate(&pDevice->CmdVersions);
+	CrosEcResponseCacheInvalidate(&pDevice->ResponseCache);
+}
+
 static ULONG CrosEcBusDebugLevel = 100;
 static ULONG CrosEcBusDebugCatagories = DBG_INIT || DBG_PNP || DBG_IOCTL;
 
-NTSTATUS comm_init_lpc(void);
+void comm_init_port_nt(BOOLEAN completion_irq);
+void comm_nt_completion_irq(void);
 
 NTSTATUS
 DriverEntry(
@@ -60,45 +82,238 @@ __in PUNICODE_STRING RegistryPath
 	return status;
 }
 
-static NTSTATUS CrosEcCmdXferStatus(
+//Called with the EC held. The EC finishes the command on its own, so let
+//other callers at it between status polls, unless HoldLock (batches, which
+//promise nothing runs between their commands). Kernel and userspace classes only.
+static int CrosEcWaitInProgress(
 	IN      PCROSECBUS_CONTEXT pDevice,
-	OUT     PCROSEC_COMMAND Msg
+	IN      CROSEC_LOCK_CLASS Class,
+	IN      BOOLEAN HoldLock
+)
+{
+	LARGE_INTEGER delay;
+	delay.QuadPart = -10LL * EC_IN_PROGRESS_POLL_USEC;
+
+	for (ULONG waited = 0; waited < EC_IN_PROGRESS_TIMEOUT_USEC; waited += EC_IN_PROGRESS_POLL_USEC) {
+		if (!HoldLock) {
+			CrosEcLockRelease(&pDevice->EcLock);
+		}
+		KeDelayExecutionThread(KernelMode, FALSE, &delay);
+		if (!HoldLock) {
+			CrosEcLockAcquire(&pDevice->EcLock, Class);
+		}
+
+		int rv = ec_command_in_progress();
+		if (rv != 1) {
+			return rv;
+		}
+	}
+
+	CrosEcBusPrint(DEBUG_LEVEL_ERROR, DBG_IOCTL, "Timeout waiting for EC command in progress\n");
+	return -EC_RES_ERROR;
+}
+
+//Answers Msg from the response cache if it can
+static BOOLEAN CrosEcCmdXferCached(
+	IN      PCROSECBUS_CONTEXT pDevice,
+	IN OUT  PCROSEC_COMMAND Msg,
+	OUT     PULONG ResponseSize
+)
+{
+	return CrosEcResponseCacheLookup(&pDevice->ResponseCache, (UINT16)Msg->Command, (UINT8)Msg->Version,
+		Msg->Data, Msg->OutSize, Msg->Data, Msg->InSize, ResponseSize);
+}
+
+//HoldLock keeps the EC through an EC_RES_IN_PROGRESS wait instead of letting
+//other callers in between polls
+static NTSTATUS CrosEcCmdXferLocked(
+	IN      PCROSECBUS_CONTEXT pDevice,
+	OUT     PCROSEC_COMMAND Msg,
+	IN      CROSEC_LOCK_CLASS Class,
+	IN      BOOLEAN HoldLock,
+	OUT     int* Result OPTIONAL
 )
 {
 	if (!Msg) {
 		return STATUS_INVALID_PARAMETER;
 	}
 
-	if (ec_command_proto) {
-		if (Msg->InSize > ec_max_insize) {
-			CrosEcBusPrint(DEBUG_LEVEL_ERROR, DBG_IOCTL, "Clamping message receive buffer\n");
-			Msg->InSize = ec_max_insize;
-		}
+	if (Msg->InSize > ec_max_insize) {
+		CrosEcBusPrint(DEBUG_LEVEL_ERROR, DBG_IOCTL, "Clamping message receive buffer\n");
+		Msg->InSize = ec_max_insize;
+	}
 
-		if (Msg->OutSize > ec_max_outsize) {
-			CrosEcBusPrint(DEBUG_LEVEL_ERROR, DBG_IOCTL, "request of size %u is too big (max: %u)\n", Msg->OutSize, ec_max_outsize);
-			return STATUS_INVALID_PARAMETER_3;
-		}
+	if (Msg->OutSize > ec_max_outsize) {
+		CrosEcBusPrint(DEBUG_LEVEL_ERROR, DBG_IOCTL, "request of size %u is too big (max: %u)\n", Msg->OutSize, ec_max_outsize);
+		return STATUS_INVALID_PARAMETER_3;
+	}
 
-		InterlockedIncrement64(&pDevice->KernelAccessesWaiting);
-		WdfWaitLockAcquire(pDevice->EcLock, NULL);
+	//The response overwrites the params, so keep them for the cache
+	UINT8 params[CROSEC_RESPONSE_CACHE_MAX_PARAMS];
+	ULONG paramsSize = min(Msg->OutSize, sizeof(params));
+	LONG generation = CrosEcResponseCacheGeneration(&pDevice->ResponseCache);
+	RtlCopyMemory(params, Msg->Data, paramsSize);
+
+	ULONGLONG start = KeQueryInterruptTime();
+	CrosEcTrace(CrosEcTraceCmdSubmit, Msg->Command, Msg->Version, Msg->OutSize);
+	CrosEcCaptureBegin(&pDevice->Capture, Class, (UINT16)Msg->Command, (UINT8)Msg->Version,
+		Msg->Data, Msg->OutSize, Msg->InSize, start);
+	int cmdstatus = ec_command_proto((UINT16)Msg->Command, (UINT8)Msg->Version, Msg->Data, Msg->OutSize, Msg->Data, Msg->InSize);
+	CrosEcCaptureEnd(&pDevice->Capture, cmdstatus, Msg->Data);
+
+	//Interrupt handling can't wait out a slow command; it sees EC_RES_IN_PROGRESS instead
+	if (cmdstatus == -EECRESULT - EC_RES_IN_PROGRESS && Class != CrosEcLockClassIsr &&
+		(pDevice->EcProtocolFlags & EC_PROTOCOL_INFO_IN_PROGRESS_SUPPORTED)) {
+		cmdstatus = CrosEcWaitInProgress(pDevice, Class, HoldLock);
+	}
 
-		int cmdstatus = ec_command_proto((UINT16)Msg->Command, (UINT8)Msg->Version, Msg->Data, Msg->OutSize, Msg->Data, Msg->InSize);
+	ULONG64 busUs = (KeQueryInterruptTime() - start) / 10;
+	CrosEcTrace(CrosEcTraceCmdComplete, Msg->Command, cmdstatus, busUs);
+	CrosEcCmdLogRecord(&pDevice->CmdLog, Class, (UINT16)Msg->Command, (UINT8)Msg->Version,
+		Msg->OutSize, Msg->InSize, cmdstatus, start);
+	CrosEcTargetRecord(pDevice->TargetStats, (UINT16)Msg->Command, busUs, cmdstatus);
 
-		InterlockedDecrement64(&pDevice->KernelAccessesWaiting);
-		WdfWaitLockRelease(pDevice->EcLock);
+	if (Result) {
+		*Result = cmdstatus;
+	}
 
-		if (cmdstatus >= 0) {
-			return STATUS_SUCCESS;
-		}
-		else {
-			CrosEcBusPrint(DEBUG_LEVEL_ERROR, DBG_IOCTL, "EC Returned Error: %d\n", cmdstatus);
-			return STATUS_INTERNAL_ERROR;
+	if (cmdstatus >= 0) {
+		if (Msg->OutSize <= sizeof(params)) {
+			CrosEcResponseCacheInsert(&pDevice->ResponseCache, generation, (UINT16)Msg->Command, (UINT8)Msg->Version,
+				params, paramsSize, Msg->Data, cmdstatus);
 		}
+		return STATUS_SUCCESS;
 	}
 	else {
+		CrosEcBusPrint(DEBUG_LEVEL_ERROR, DBG_IOCTL, "EC Returned Error: %d\n", cmdstatus);
+		return STATUS_INTERNAL_ERROR;
+	}
+}
+
+static NTSTATUS CrosEcCmdXferClass(
+	IN      PCROSECBUS_CONTEXT pDevice,
+	OUT     PCROSEC_COMMAND Msg,
+	IN      CROSEC_LOCK_CLASS Class,
+	OUT     int* Result OPTIONAL
+)
+{
+	if (!Msg) {
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	if (!ec_command_proto) {
 		return STATUS_NOINTERFACE;
 	}
+
+	ULONGLONG start = KeQueryInterruptTime();
+	ULONGLONG lockWait = 0;
+	ULONG outSize = Msg->OutSize;
+	ULONG responseSize;
+	int cmdstatus = -EC_RES_ERROR;
+	NTSTATUS status;
+
+	if (CrosEcCmdXferCached(pDevice, Msg, &responseSize)) {
+		cmdstatus = responseSize;
+		status = STATUS_SUCCESS;
+		goto out;
+	}
+
+	//Share the answer if someone is already asking the EC the same thing
+	CROSEC_FLIGHT_KEY key;
+	PCROSEC_FLIGHT flight = NULL;
+	BOOLEAN leader = TRUE;
+	if (CrosEcFlightKeyInit(&key, (UINT16)Msg->Command, (UINT8)Msg->Version, Msg->Data, Msg->OutSize, Msg->InSize)) {
+		flight = CrosEcFlightJoin(&pDevice->Flights, &key, &leader);
+	}
+
+	if (!leader) {
+		cmdstatus = CrosEcFlightWait(&pDevice->Flights, flight, Msg->Data);
+		status = cmdstatus >= 0 ? STATUS_SUCCESS : STATUS_INTERNAL_ERROR;
+		goto out;
+	}
+
+	CrosEcLockAcquire(&pDevice->EcLock, Class);
+	lockWait = KeQueryInterruptTime() - start;
+
+	status = CrosEcCmdXferLocked(pDevice, Msg, Class, FALSE, &cmdstatus);
+
+	CrosEcLockRelease(&pDevice->EcLock);
+
+	if (flight) {
+		CrosEcFlightLand(&pDevice->Flights, flight, cmdstatus, Msg->Data);
+	}
+
+out:
+	CrosEcStatsRecord(&pDevice->Stats, (UINT16)Msg->Command, outSize, cmdstatus,
+		lockWait / 10, (KeQueryInterruptTime() - start) / 10);
+	if (Result) {
+		*Result = cmdstatus;
+	}
+	return status;
+}
+
+static NTSTATUS CrosEcCmdXferStatus(
+	IN      PCROSECBUS_CONTEXT pDevice,
+	OUT     PCROSEC_COMMAND Msg
+)
+{
+	return CrosEcCmdXferClass(pDevice, Msg, CrosEcLockClassKernel, NULL);
+}
+
+static NTSTATUS CrosEcCmdXferBatch(
+	IN      PCROSECBUS_CONTEXT pDevice,
+	IN      ULONG Count,
+	IN OUT  PCROSEC_COMMAND* Msgs,
+	OUT     NTSTATUS* Results
+)
+{
+	NTSTATUS status = STATUS_SUCCESS;
+
+	if (!Msgs || !Results || Count == 0) {
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	if (!ec_command_proto) {
+		return STATUS_NOINTERFACE;
+	}
+
+	ULONGLONG start = KeQueryInterruptTime();
+	CrosEcLockAcquire(&pDevice->EcLock, CrosEcLockClassKernel);
+	ULONGLONG lockWait = KeQueryInterruptTime() - start;
+
+	for (ULONG i = 0; i < Count; i++) {
+		ULONGLONG msgStart = KeQueryInterruptTime();
+		ULONG responseSize;
+		int cmdstatus = -EC_RES_ERROR;
+
+		if (!Msgs[i]) {
+			Results[i] = STATUS_INVALID_PARAMETER;
+			if (NT_SUCCESS(status)) {
+				status = Results[i];
+			}
+			continue;
+		}
+
+		ULONG outSize = Msgs[i]->OutSize;
+		if (CrosEcCmdXferCached(pDevice, Msgs[i], &responseSize)) {
+			cmdstatus = responseSize;
+			Results[i] = STATUS_SUCCESS;
+		}
+		else {
+			Results[i] = CrosEcCmdXferLocked(pDevice, Msgs[i], CrosEcLockClassKernel, TRUE, &cmdstatus);
+			if (!NT_SUCCESS(Results[i]) && NT_SUCCESS(status)) {
+				status = Results[i];
+			}
+		}
+
+		//The batch waited for the EC once; charge it to the first command
+		CrosEcStatsRecord(&pDevice->Stats, (UINT16)Msgs[i]->Command, outSize, cmdstatus,
+			i == 0 ? lockWait / 10 : 0, (KeQueryInterruptTime() - msgStart + (i == 0 ? lockWait : 0)) / 10);
+	}
+
+	CrosEcLockRelease(&pDevice->EcLock);
+
+	return status;
 }
 
 static BOOLEAN CrosEcCheckFeatures(
@@ -111,6 +326,69 @@ static BOOLEAN CrosEcCheckFeatures(
 	return !!(pDevice->EcFeatures[Feature / 32] & EC_FEATURE_MASK_0(Feature));
 }
 
+static NTSTATUS CrosEcGetMaxSizes(
+	IN PCROSECBUS_CONTEXT pDevice,
+	OUT PULONG MaxOutSize,
+	OUT PULONG MaxInSize
+)
+{
+	UNREFERENCED_PARAMETER(pDevice);
+
+	if (!MaxOutSize || !MaxInSize) {
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	if (!ec_command_proto) {
+		return STATUS_DEVICE_NOT_READY;
+	}
+
+	*MaxOutSize = ec_max_outsize;
+	*MaxInSize = ec_max_insize;
+	return STATUS_SUCCESS;
+}
+
+static NTSTATUS CrosEcGetCmdVersions(
+	IN PCROSECBUS_CONTEXT pDevice,
+	IN UINT16 Command,
+	OUT PUINT32 VersionMask
+)
+{
+	if (!VersionMask) {
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	if (CrosEcCmdVersionsLookup(&pDevice->CmdVersions, Command, VersionMask)) {
+		return STATUS_SUCCESS;
+	}
+
+	if (!ec_command_proto) {
+		return STATUS_DEVICE_NOT_READY;
+	}
+
+	struct ec_params_get_cmd_versions_v1 req_v1 = { 0 };
+	struct ec_response_get_cmd_versions resp = { 0 };
+	req_v1.cmd = Command;
+
+	LONG generation = CrosEcCmdVersionsGeneration(&pDevice->CmdVersions);
+
+	//Like any other kernel command, so the probe shows up in stats, the log and captures
+	int rv = -EC_RES_ERROR;
+	send_ec_command(pDevice, CrosEcLockClassKernel, EC_CMD_GET_CMD_VERSIONS, 1,
+		(UINT8*)&req_v1, sizeof(req_v1), (UINT8*)&resp, sizeof(resp), &rv);
+
+	if (rv == -EECRESULT - EC_RES_INVALID_PARAM) {
+		resp.version_mask = 0; //The EC doesn't know this command
+	}
+	else if (rv < (int)sizeof(resp)) {
+		return STATUS_INTERNAL_ERROR;
+	}
+
+	CrosEcCmdVersionsInsert(&pDevice->CmdVersions, generation, Command, resp.version_mask);
+
+	*VersionMask = resp.version_mask;
+	return STATUS_SUCCESS;
+}
+
 static INT CrosEcReadMem(
 	IN PCROSECBUS_CONTEXT pDevice,
 	IN INT offset,
@@ -118,8 +396,7 @@ static INT CrosEcReadMem(
 	OUT PVOID dest
 )
 {
-	UNREFERENCED_PARAMETER(pDevice);
-	return ec_readmem(offset, bytes, dest);
+	return CrosEcMemmapCacheRead(&pDevice->MemmapCache, offset, bytes, dest);
 }
 
 NTSTATUS
@@ -209,20 +486,18 @@ Status
 		}
 	}
 
-	status = WdfWaitLockCreate(
-		WDF_NO_OBJECT_ATTRIBUTES,
-		&pDevice->EcLock);
-	if (!NT_SUCCESS(status))
-	{
-		CrosEcBusPrint(
-			DEBUG_LEVEL_ERROR,
-			DBG_IOCTL,
-			"Error creating Waitlock - %x\n",
-			status);
+	//Without an interrupt resource wait_for_ec just polls
+	comm_init_port_nt(pDevice->Interrupt != NULL);
+
+	status = comm_init_lpc();
+	if (!NT_SUCCESS(status)) {
 		return status;
 	}
 
-	status = comm_init_lpc();
+	CrosEcMemmapCacheInit(&pDevice->MemmapCache);
+	CrosEcBusEcRestarted(pDevice);
+
+	status = CrosEcMsgPoolInit(&pDevice->MsgPool, max(ec_max_insize, ec_max_outsize));
 	if (!NT_SUCCESS(status)) {
 		return status;
 	}
@@ -257,6 +532,9 @@ Status
 		pDevice->EcFeatures[1] = (UINT32)-1;
 	}
 
+	//Queried by comm_init_lpc along with the packet sizes
+	pDevice->EcProtocolFlags = ec_protocol_info.flags;
+
 	pDevice->hostSleepV1 = FALSE;
 
 	NTSTATUS acpiNotifyStatus = WdfFdoQueryForInterface(FxDevice,
@@ -267,12 +545,9 @@ Status
 		NULL);
 
 	if (NT_SUCCESS(acpiNotifyStatus)) {
-		struct ec_params_get_cmd_versions_v1 req_v1 = { 0 };
-		struct ec_response_get_cmd_versions resp = { 0 };
-		req_v1.cmd = EC_CMD_HOST_SLEEP_EVENT;
-		rv = ec_command_proto(EC_CMD_GET_CMD_VERSIONS, 1, &req_v1, sizeof(req_v1), &resp, sizeof(resp));
-		if (rv >= 0) {
-			pDevice->hostSleepV1 = (resp.version_mask & EC_VER_MASK(1)) != 0;
+		UINT32 versionMask;
+		if (NT_SUCCESS(CrosEcGetCmdVersions(pDevice, EC_CMD_HOST_SLEEP_EVENT, &versionMask))) {
+			pDevice->hostSleepV1 = (versionMask & EC_VER_MASK(1)) != 0;
 		}
 
 		acpiNotifyStatus = pDevice->S0ixNotifyAcpiInterface.RegisterForDeviceNotifications(
@@ -352,10 +627,10 @@ Status
 		pDevice->S0ixNotifyAcpiInterface.UnregisterForDeviceNotifications(pDevice->S0ixNotifyAcpiInterface.Context);
 	}
 
-	if (pDevice->EcLock != NULL)
-	{
-		WdfObjectDelete(pDevice->EcLock);
-	}
+	//Already drained if the device left D0 first
+	CrosEcEngineDrain(pDevice);
+
+	CrosEcMsgPoolFree(&pDevice->MsgPool);
 
 	if (pDevice->CSButtonsCallback) {
 		ObfDereferenceObject(pDevice->CSButtonsCallback);
@@ -365,18 +640,33 @@ Status
 	return status;
 }
 
+//result, if given, receives the EC result: the response size or a negative error
 static NTSTATUS send_ec_command(
 	_In_ PCROSECBUS_CONTEXT pDevice,
+	CROSEC_LOCK_CLASS lockClass,
 	UINT32 cmd,
 	UINT32 version,
 	UINT8* out,
 	size_t outSize,
 	UINT8* in,
-	size_t inSize)
+	size_t inSize,
+	int* result)
 {
-	PCROSEC_COMMAND msg = (PCROSEC_COMMAND)ExAllocatePoolWithTag(NonPagedPool, sizeof(CROSEC_COMMAND) + max(outSize, inSize), CROSECBUS_POOL_TAG);
-	if (!msg) {
-		return STATUS_NO_MEMORY;
+	DECLSPEC_ALIGN(MEMORY_ALLOCATION_ALIGNMENT) UINT8 stackMsg[sizeof(CROSEC_COMMAND) + CROSEC_MSG_STACK_SIZE];
+	size_t dataSize = max(outSize, inSize);
+
+	PCROSEC_COMMAND msg;
+	if (dataSize <= CROSEC_MSG_STACK_SIZE) {
+		msg = (PCROSEC_COMMAND)stackMsg;
+	}
+	else {
+		msg = CrosEcMsgAlloc(&pDevice->MsgPool, dataSize);
+		if (!msg) {
+			if (result) {
+				*result = -EC_RES_ERROR;
+			}
+			return STATUS_NO_MEMORY;
+		}
 	}
 	msg->Version = version;
 	msg->Command = cmd;
@@ -386,7 +676,7 @@ static NTSTATUS send_ec_command(
 	if (outSize)
 		memcpy(msg->Data, out, outSize);
 
-	NTSTATUS status = CrosEcCmdXferStatus(pDevice, msg);
+	NTSTATUS status = CrosEcCmdXferClass(pDevice, msg, lockClass, result);
 	if (!NT_SUCCESS(status)) {
 		goto exit;
 	}
@@ -396,7 +686,9 @@ static NTSTATUS send_ec_command(
 	}
 
 exit:
-	ExFreePoolWithTag(msg, CROSECBUS_POOL_TAG);
+	if (msg != (PCROSEC_COMMAND)stackMsg) {
+		CrosEcMsgFree(&pDevice->MsgPool, msg);
+	}
 	return status;
 }
 
@@ -427,13 +719,18 @@ Status
 
 	PCROSECBUS_CONTEXT pDevice = GetDeviceContext(FxDevice);
 
+	//Static lines survive a sleep; the EC raises INTERFACE_READY if it restarted
+	CrosEcMemmapCacheInvalidateVolatile(&pDevice->MemmapCache);
+
 	struct ec_params_motion_sense params = { 0 };
 	struct ec_response_motion_sense resp;
 
 	params.cmd = MOTIONSENSE_CMD_FIFO_INT_ENABLE;
 	params.fifo_int_enable.enable = 0;
 
-	send_ec_command(pDevice, EC_CMD_MOTION_SENSE_CMD, 1, (UINT8*)&params, sizeof(params), (UINT8*)&resp, sizeof(resp)); //Ignore response as device may not have sensors
+	send_ec_command(pDevice, CrosEcLockClassKernel, EC_CMD_MOTION_SENSE_CMD, 1, (UINT8*)&params, sizeof(params), (UINT8*)&resp, sizeof(resp), NULL); //Ignore response as device may not have sensors
+
+	CrosEcEngineResume(pDevice);
 
 	return status;
 }
@@ -465,6 +762,9 @@ Status
 	NTSTATUS status = STATUS_SUCCESS;
 	PCROSECBUS_CONTEXT pDevice = GetDeviceContext(FxDevice);
 
+	//Finish with the EC while it's still up; XCMD requests that come in meanwhile wait for D0Entry
+	CrosEcEngineDrain(pDevice);
+
 	return status;
 }
 
@@ -476,34 +776,69 @@ BOOLEAN OnInterruptIsr(
 	WDFDEVICE Device = WdfInterruptGetDevice(Interrupt);
 	PCROSECBUS_CONTEXT pDevice = GetDeviceContext(Device);
 
+	CrosEcTrace(CrosEcTraceInterrupt, 0, 0, 0);
+
+	//Wake any command waiting on the EC before contending for EcLock below
+	comm_nt_completion_irq();
+	if (pDevice->EngineCurrent) {
+		CrosEcEngineKick(pDevice);
+	}
+
 	const uint32_t mkbp_mask =
 		EC_HOST_EVENT_MASK(EC_HOST_EVENT_MKBP);
 	struct ec_response_host_event_mask r;
 
-	NTSTATUS status = send_ec_command(pDevice, EC_CMD_HOST_EVENT_GET_B, 0, NULL, 0, (UINT8*)&r, sizeof(r));
+	NTSTATUS status = send_ec_command(pDevice, CrosEcLockClassIsr, EC_CMD_HOST_EVENT_GET_B, 0, NULL, 0, (UINT8*)&r, sizeof(r), NULL);
 	if (!NT_SUCCESS(status)) {
 		goto out;
 	}
 
+	CrosEcTrace(CrosEcTraceHostEvents, 0, r.mask, 0);
+
 	if (r.mask & EC_HOST_EVENT_MASK(EC_HOST_EVENT_INVALID)) {
 		goto out;
 	}
 
+	if (r.mask & ~mkbp_mask) {
+		//Battery, AC, lid, thermal etc. all land in the memory map; keyboard events don't.
+		//Clear what we act on so the next change latches again and the events of a key
+		//press don't keep throwing the map away.
+		struct ec_params_host_event_mask p;
+		p.mask = r.mask & ~mkbp_mask;
+
+		send_ec_command(pDevice, CrosEcLockClassIsr, EC_CMD_HOST_EVENT_CLEAR_B, 0, (UINT8*)&p, sizeof(p), NULL, 0, NULL);
+		CrosEcMemmapCacheInvalidateVolatile(&pDevice->MemmapCache);
+	}
+
+	if (r.mask & (EC_HOST_EVENT_MASK(EC_HOST_EVENT_BATTERY) | EC_HOST_EVENT_MASK(EC_HOST_EVENT_BATTERY_STATUS))) {
+		//A battery may have been inserted or swapped
+		CrosEcMemmapCacheInvalidateBattery(&pDevice->MemmapCache);
+	}
+
+	if (r.mask & EC_HOST_EVENT_MASK(EC_HOST_EVENT_INTERFACE_READY)) {
+		//Raised each time the EC comes up, including a jump between RO and RW
+		CrosEcBusEcRestarted(pDevice);
+	}
+
 	if (r.mask & mkbp_mask) {
 		struct ec_params_host_event_mask p;
 		p.mask = mkbp_mask;
 
-		status = send_ec_command(pDevice, EC_CMD_HOST_EVENT_CLEAR_B, 0, (UINT8*)&p, sizeof(p), NULL, 0);
+		status = send_ec_command(pDevice, CrosEcLockClassIsr, EC_CMD_HOST_EVENT_CLEAR_B, 0, (UINT8*)&p, sizeof(p), NULL, 0, NULL);
 		if (!NT_SUCCESS(status)) {
 			goto out;
 		}
 
 		struct ec_response_get_next_event event = { 0 };
-		status = send_ec_command(pDevice, EC_CMD_GET_NEXT_EVENT, 0, NULL, 0, (UINT8*)&event, sizeof(event));
+		status = send_ec_command(pDevice, CrosEcLockClassIsr, EC_CMD_GET_NEXT_EVENT, 0, NULL, 0, (UINT8*)&event, sizeof(event), NULL);
 		if (!NT_SUCCESS(status)) {
 			goto out;
 		}
 
+		UINT32 eventData;
+		RtlCopyMemory(&eventData, &event.data, sizeof(eventData));
+		CrosEcTrace(CrosEcTraceMkbpEvent, event.event_type, eventData, 0);
+
 		if (event.event_type == EC_MKBP_EVENT_BUTTON) {
 			if (pDevice->CSButtonsCallback) {
 				CSVivaldiSettingsArg newArg;
@@ -536,7 +871,7 @@ NTSTATUS CrosEcBusSleepEvent(
 	req1.sleep_event = sleepEvent;
 	req1.suspend_params.sleep_timeout_ms = EC_HOST_SLEEP_TIMEOUT_DEFAULT;
 
-	return send_ec_command(pDevice, EC_CMD_HOST_SLEEP_EVENT, 1, (UINT8 *)&req1, sizeof(req1), (UINT8 *)&resp1, sizeof(resp1));
+	return send_ec_command(pDevice, CrosEcLockClassKernel, EC_CMD_HOST_SLEEP_EVENT, 1, (UINT8 *)&req1, sizeof(req1), (UINT8 *)&resp1, sizeof(resp1), NULL);
 }
 
 VOID
@@ -544,17 +879,72 @@ CrosEcBusS0ixNotifyCallback(
 	PCROSECBUS_CONTEXT pDevice,
 	ULONG NotifyCode) {
 	if (NotifyCode == 2 && pDevice->isInS0ix) {
-		if (NT_SUCCESS(CrosEcBusSleepEvent(pDevice, HOST_SLEEP_EVENT_S0IX_RESUME))) {
+		NTSTATUS status = CrosEcBusSleepEvent(pDevice, HOST_SLEEP_EVENT_S0IX_RESUME);
+		CrosEcTrace(CrosEcTraceS0ixExit, 0, status, 0);
+		if (NT_SUCCESS(status)) {
 			pDevice->isInS0ix = FALSE;
 		}
+		CrosEcMemmapCacheInvalidateVolatile(&pDevice->MemmapCache);
 	}
 	else if (NotifyCode == 1 && !pDevice->isInS0ix) {
-		if (NT_SUCCESS(CrosEcBusSleepEvent(pDevice, HOST_SLEEP_EVENT_S0IX_SUSPEND))) {
+		NTSTATUS status = CrosEcBusSleepEvent(pDevice, HOST_SLEEP_EVENT_S0IX_SUSPEND);
+		CrosEcTrace(CrosEcTraceS0ixEnter, 0, status, 0);
+		if (NT_SUCCESS(status)) {
 			pDevice->isInS0ix = TRUE;
 		}
 	}
 }
 
+NTSTATUS
+CrosEcBusReadSetting(
+	IN WDFDEVICE Device,
+	IN PCUNICODE_STRING Name,
+	OUT PULONG Value
+)
+{
+	WDFKEY hKey = NULL;
+	WDFKEY hSettings = NULL;
+	DECLARE_CONST_UNICODE_STRING(settingsName, L"Settings");
+
+	NTSTATUS status = WdfDeviceOpenRegistryKey(Device, PLUGPLAY_REGKEY_DEVICE, KEY_READ, WDF_NO_OBJECT_ATTRIBUTES, &hKey);
+	if (!NT_SUCCESS(status)) {
+		return status;
+	}
+
+	status = WdfRegistryOpenKey(hKey, &settingsName, KEY_READ, WDF_NO_OBJECT_ATTRIBUTES, &hSettings);
+	if (NT_SUCCESS(status)) {
+		status = WdfRegistryQueryULong(hSettings, Name, Value);
+		WdfRegistryClose(hSettings);
+	}
+	WdfRegistryClose(hKey);
+
+	return status;
+}
+
+VOID
+CrosEcBusEvtFileCreate(
+	IN WDFDEVICE Device,
+	IN WDFREQUEST Request,
+	IN WDFFILEOBJECT FileObject
+)
+{
+	PCROSECBUS_CONTEXT pDevice = GetDeviceContext(Device);
+
+	CrosEcQuotaInitBucket(&pDevice->QuotaConfig, &GetFileContext(FileObject)->Quota);
+
+	WdfRequestComplete(Request, STATUS_SUCCESS);
+}
+
+VOID
+CrosEcBusEvtDeviceCleanup(
+	IN WDFOBJECT Object
+)
+{
+	CrosEcStatsFree(&GetDeviceContext(Object)->Stats);
+	CrosEcCaptureFree(&GetDeviceContext(Object)->Capture);
+	CrosEcTraceStop();
+}
+
 NTSTATUS
 CrosEcBusEvtDeviceAdd(
 IN WDFDRIVER       Driver,
@@ -604,10 +994,29 @@ IN PWDFDEVICE_INIT DeviceInit
 	//
 
 	WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&attributes, CROSECBUS_CONTEXT);
+	attributes.EvtCleanupCallback = CrosEcBusEvtDeviceCleanup;
 
 	// Set DeviceType
 	WdfDeviceInitSetDeviceType(DeviceInit, FILE_DEVICE_CONTROLLER);
 
+	{
+		WDF_FILEOBJECT_CONFIG fileConfig;
+		WDF_OBJECT_ATTRIBUTES fileAttributes;
+
+		//Each handle gets its own XCMD quota
+		WDF_FILEOBJECT_CONFIG_INIT(&fileConfig, CrosEcBusEvtFileCreate, WDF_NO_EVENT_CALLBACK, WDF_NO_EVENT_CALLBACK);
+		WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&fileAttributes, CROSEC_FILE_CONTEXT);
+		WdfDeviceInitSetFileObjectConfig(DeviceInit, &fileConfig, &fileAttributes);
+	}
+
+	{
+		WDF_OBJECT_ATTRIBUTES requestAttributes;
+
+		//XCMD requests carry their timestamps for the stats
+		WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&requestAttributes, CROSEC_REQUEST_CONTEXT);
+		WdfDeviceInitSetRequestAttributes(DeviceInit, &requestAttributes);
+	}
+
 	//
 	// Create a framework device object.This call will in turn create
 	// a WDM device object, attach to the lower stack, and set the
@@ -643,6 +1052,8 @@ IN PWDFDEVICE_INIT DeviceInit
 		WdfDeviceSetDeviceState(device, &deviceState);
 	}
 
+	devContext = GetDeviceContext(device);
+
 	status = CrosECQueueInitialize(device);
 	if (!NT_SUCCESS(status)) {
 		CrosEcBusPrint(DEBUG_LEVEL_ERROR, DBG_PNP,
@@ -650,7 +1061,54 @@ IN PWDFDEVICE_INIT DeviceInit
 		return status;
 	}
 
-	devContext = GetDeviceContext(device);
+	CrosEcLockInit(&devContext->EcLock);
+	CrosEcCmdVersionsInit(&devContext->CmdVersions);
+	CrosEcFlightsInit(&devContext->Flights);
+
+	status = CrosEcStatsInit(&devContext->Stats);
+	if (!NT_SUCCESS(status)) {
+		CrosEcBusPrint(DEBUG_LEVEL_ERROR, DBG_PNP,
+			"CrosEcStatsInit failed 0x%x\n", status);
+		return status;
+	}
+
+	{
+		DECLARE_CONST_UNICODE_STRING(responseCacheName, L"ResponseCache");
+		ULONG responseCache = 0;
+
+		CrosEcBusReadSetting(device, &responseCacheName, &responseCache);
+		CrosEcResponseCacheInit(&devContext->ResponseCache, responseCache != 0);
+	}
+
+	{
+		DECLARE_CONST_UNICODE_STRING(traceName, L"Trace");
+		ULONG trace = 0;
+
+		//Not fatal; we just run without a trace
+		CrosEcBusReadSetting(device, &traceName, &trace);
+		if (trace && !NT_SUCCESS(CrosEcTraceStart())) {
+			CrosEcBusPrint(DEBUG_LEVEL_ERROR, DBG_PNP, "Couldn't allocate trace buffers\n");
+		}
+	}
+
+	{
+		DECLARE_CONST_UNICODE_STRING(captureName, L"CaptureBytes");
+		ULONG captureBytes = 0;
+
+		CrosEcBusReadSetting(device, &captureName, &captureBytes);
+		if (captureBytes && !NT_SUCCESS(CrosEcCaptureControl(&devContext->EcLock, &devContext->Capture, captureBytes))) {
+			CrosEcBusPrint(DEBUG_LEVEL_ERROR, DBG_PNP, "Couldn't start command capture\n");
+		}
+	}
+	CrosEcQuotaLoadConfig(device, &devContext->QuotaConfig, &devContext->QuotaTotalConfig);
+	CrosEcQuotaInitBucket(&devContext->QuotaTotalConfig, &devContext->QuotaTotal);
+
+	status = CrosEcEngineInit(device);
+	if (!NT_SUCCESS(status)) {
+		CrosEcBusPrint(DEBUG_LEVEL_ERROR, DBG_PNP,
+			"CrosEcEngineInit failed 0x%x\n", status);
+		return status;
+	}
 
 	DECLARE_CONST_UNICODE_STRING(dosDeviceName, SYMBOLIC_NAME_STRING);
 
@@ -726,7 +1184,108 @@ IN PWDFDEVICE_INIT DeviceInit
 		}
 	}
 
-	devContext->KernelAccessesWaiting = 0;
+	{ // V3
+		CROSEC_INTERFACE_STANDARD_V3 CrosEcInterface;
+		RtlZeroMemory(&CrosEcInterface, sizeof(CrosEcInterface));
+
+		CrosEcInterface.InterfaceHeader.Size = sizeof(CrosEcInterface);
+		CrosEcInterface.InterfaceHeader.Version = 3;
+		CrosEcInterface.InterfaceHeader.Context = (PVOID)devContext;
+
+		//
+		// Let the framework handle reference counting.
+		//
+		CrosEcInterface.InterfaceHeader.InterfaceReference = WdfDeviceInterfaceReferenceNoOp;
+		CrosEcInterface.InterfaceHeader.InterfaceDereference = WdfDeviceInterfaceDereferenceNoOp;
+
+		CrosEcInterface.CheckFeatures = CrosEcCheckFeatures;
+		CrosEcInterface.CmdXferStatus = CrosEcCmdXferStatus;
+		CrosEcInterface.ReadEcMem = CrosEcReadMem;
+		CrosEcInterface.CmdXferBatch = CrosEcCmdXferBatch;
+
+		WDF_QUERY_INTERFACE_CONFIG_INIT(&qiConfig,
+			(PINTERFACE)&CrosEcInterface,
+			&GUID_CROSEC_INTERFACE_STANDARD_V3,
+			NULL);
+
+		status = WdfDeviceAddQueryInterface(device, &qiConfig);
+		if (!NT_SUCCESS(status)) {
+			CrosEcBusPrint(DEBUG_LEVEL_ERROR, DBG_PNP,
+				"WdfDeviceAddQueryInterface failed 0x%x\n", status);
+
+			return status;
+		}
+	}
+
+	{ // V4
+		CROSEC_INTERFACE_STANDARD_V4 CrosEcInterface;
+		RtlZeroMemory(&CrosEcInterface, sizeof(CrosEcInterface));
+
+		CrosEcInterface.InterfaceHeader.Size = sizeof(CrosEcInterface);
+		CrosEcInterface.InterfaceHeader.Version = 4;
+		CrosEcInterface.InterfaceHeader.Context = (PVOID)devContext;
+
+		//
+		// Let the framework handle reference counting.
+		//
+		CrosEcInterface.InterfaceHeader.InterfaceReference = WdfDeviceInterfaceReferenceNoOp;
+		CrosEcInterface.InterfaceHeader.InterfaceDereference = WdfDeviceInterfaceDereferenceNoOp;
+
+		CrosEcInterface.CheckFeatures = CrosEcCheckFeatures;
+		CrosEcInterface.CmdXferStatus = CrosEcCmdXferStatus;
+		CrosEcInterface.ReadEcMem = CrosEcReadMem;
+		CrosEcInterface.CmdXferBatch = CrosEcCmdXferBatch;
+		CrosEcInterface.GetMaxSizes = CrosEcGetMaxSizes;
+
+		WDF_QUERY_INTERFACE_CONFIG_INIT(&qiConfig,
+			(PINTERFACE)&CrosEcInterface,
+			&GUID_CROSEC_INTERFACE_STANDARD_V4,
+			NULL);
+
+		status = WdfDeviceAddQueryInterface(device, &qiConfig);
+		if (!NT_SUCCESS(status)) {
+			CrosEcBusPrint(DEBUG_LEVEL_ERROR, DBG_PNP,
+				"WdfDeviceAddQueryInterface failed 0x%x\n", status);
+
+			return status;
+		}
+	}
+
+	{ // V5
+		CROSEC_INTERFACE_STANDARD_V5 CrosEcInterface;
+		RtlZeroMemory(&CrosEcInterface, sizeof(CrosEcInterface));
+
+		CrosEcInterface.InterfaceHeader.Size = sizeof(CrosEcInterface);
+		CrosEcInterface.InterfaceHeader.Version = 5;
+		CrosEcInterface.InterfaceHeader.Context = (PVOID)devContext;
+
+		//
+		// Let the framework handle reference counting.
+		//
+		CrosEcInterface.InterfaceHeader.InterfaceReference = WdfDeviceInterfaceReferenceNoOp;
+		CrosEcInterface.InterfaceHeader.InterfaceDereference = WdfDeviceInterfaceDereferenceNoOp;
+
+		CrosEcInterface.CheckFeatures = CrosEcCheckFeatures;
+		CrosEcInterface.CmdXferStatus = CrosEcCmdXferStatus;
+		CrosEcInterface.ReadEcMem = CrosEcReadMem;
+		CrosEcInterface.CmdXferBatch = CrosEcCmdXferBatch;
+		CrosEcInterface.GetMaxSizes = CrosEcGetMaxSizes;
+		CrosEcInterface.GetCmdVersions = CrosEcGetCmdVersions;
+
+		WDF_QUERY_INTERFACE_CONFIG_INIT(&qiConfig,
+			(PINTERFACE)&CrosEcInterface,
+			&GUID_CROSEC_INTERFACE_STANDARD_V5,
+			NULL);
+
+		status = WdfDeviceAddQueryInterface(device, &qiConfig);
+		if (!NT_SUCCESS(status)) {
+			CrosEcBusPrint(DEBUG_LEVEL_ERROR, DBG_PNP,
+				"WdfDeviceAddQueryInterface failed 0x%x\n", status);
+
+			return status;
+		}
+	}
+
 	devContext->FxDevice = device;
 
 	return status;
@@ -1,6 +1,9 @@
 #if !defined(_CROSECBUS_H_)
 #define _CROSECBUS_H_
 
+#ifdef CROSEC_HOST
+#include "crosec-wdk.h"
+#else
 #pragma warning(disable:4200)  // suppress nameless struct/union warning
 #pragma warning(disable:4201)  // suppress nameless struct/union warning
 #pragma warning(disable:4214)  // suppress bit field types other than int warning
@@ -18,6 +21,19 @@
 #include <hidport.h>
 
 #include <acpiioct.h>
+#endif
+
+#include "memmapCache.h"
+#include "ecLock.h"
+#include "ecQuota.h"
+#include "cmdVersions.h"
+#include "responseCache.h"
+#include "singleFlight.h"
+#include "passthru.h"
+#include "ecStats.h"
+#include "ecTrace.h"
+#include "cmdLog.h"
+#include "ecCapture.h"
 
 //
 // String definitions
@@ -45,6 +61,9 @@ typedef struct _CROSEC_COMMAND {
     UINT8 Data[];
 } CROSEC_COMMAND, *PCROSEC_COMMAND;
 
+#include "msgPool.h"
+
+#ifndef CROSEC_HOST
 typedef
 NTSTATUS
 (*PCROSEC_CMD_XFER_STATUS)(
@@ -68,12 +87,46 @@ INT
     OUT PVOID dest
     );
 
+typedef
+NTSTATUS
+(*PCROSEC_CMD_XFER_BATCH)(
+    IN      PVOID Context,
+    IN      ULONG Count,
+    IN OUT  PCROSEC_COMMAND *Msgs,
+    OUT     NTSTATUS *Results
+    );
+
+typedef
+NTSTATUS
+(*PCROSEC_GET_MAX_SIZES)(
+    IN      PVOID Context,
+    OUT     PULONG MaxOutSize,
+    OUT     PULONG MaxInSize
+    );
+
+typedef
+NTSTATUS
+(*PCROSEC_GET_CMD_VERSIONS)(
+    IN      PVOID Context,
+    IN      UINT16 Command,
+    OUT     PUINT32 VersionMask
+    );
+
 DEFINE_GUID(GUID_CROSEC_INTERFACE_STANDARD,
     0xd7062676, 0xe3a4, 0x11ec, 0xa6, 0xc4, 0x24, 0x4b, 0xfe, 0x99, 0x46, 0xd0);
 
 DEFINE_GUID(GUID_CROSEC_INTERFACE_STANDARD_V2,
     0xad8649fa, 0x7c71, 0x11ed, 0xb6, 0x3c, 0x00, 0x15, 0x5d, 0xa4, 0x49, 0xad);
 
+DEFINE_GUID(GUID_CROSEC_INTERFACE_STANDARD_V3,
+    0x8fb86917, 0x5a23, 0x4888, 0xb6, 0x38, 0x8a, 0x5d, 0x61, 0xfd, 0x0e, 0xc6);
+
+DEFINE_GUID(GUID_CROSEC_INTERFACE_STANDARD_V4,
+    0x73ba5cff, 0xc1a9, 0x48c2, 0xb4, 0xcc, 0x6e, 0x11, 0x78, 0x90, 0xb0, 0x98);
+
+DEFINE_GUID(GUID_CROSEC_INTERFACE_STANDARD_V5,
+    0x5a70e31a, 0x5534, 0x4966, 0xbf, 0x40, 0x71, 0xf1, 0xbb, 0x7c, 0x81, 0xb4);
+
 typedef enum {
     CSVivaldiRequestUpdateButton = 0x101
 } CSVivaldiRequest;
@@ -106,6 +159,50 @@ typedef struct _CROSEC_INTERFACE_STANDARD_V2 {
     PCROSEC_READ_MEM                 ReadEcMem;
 } CROSEC_INTERFACE_STANDARD_V2, * PCROSEC_INTERFACE_STANDARD_V2;
 
+//
+// V3 adds CmdXferBatch, which runs Count commands back to back under a
+// single acquisition of the EC. Results[i] receives the status of Msgs[i];
+// the return value is the first failure, or STATUS_SUCCESS. A command that
+// returns EC_RES_IN_PROGRESS is polled to completion with the EC still held,
+// so no other caller's command runs between batch members.
+//
+typedef struct _CROSEC_INTERFACE_STANDARD_V3 {
+    INTERFACE                        InterfaceHeader;
+    PCROSEC_CMD_XFER_STATUS          CmdXferStatus;
+    PCROSEC_CHECK_FEATURES           CheckFeatures;
+    PCROSEC_READ_MEM                 ReadEcMem;
+    PCROSEC_CMD_XFER_BATCH           CmdXferBatch;
+} CROSEC_INTERFACE_STANDARD_V3, * PCROSEC_INTERFACE_STANDARD_V3;
+
+//
+// V4 adds GetMaxSizes, the largest OutSize and InSize a CROSEC_COMMAND can
+// use, as negotiated with the EC. Larger InSize is clamped and larger
+// OutSize fails. Returns STATUS_DEVICE_NOT_READY until the EC is started.
+//
+typedef struct _CROSEC_INTERFACE_STANDARD_V4 {
+    INTERFACE                        InterfaceHeader;
+    PCROSEC_CMD_XFER_STATUS          CmdXferStatus;
+    PCROSEC_CHECK_FEATURES           CheckFeatures;
+    PCROSEC_READ_MEM                 ReadEcMem;
+    PCROSEC_CMD_XFER_BATCH           CmdXferBatch;
+    PCROSEC_GET_MAX_SIZES            GetMaxSizes;
+} CROSEC_INTERFACE_STANDARD_V4, * PCROSEC_INTERFACE_STANDARD_V4;
+
+//
+// V5 adds GetCmdVersions, the EC_VER_MASK() of versions the EC supports for
+// Command (0 if it doesn't know the command). Answers are cached until the
+// EC restarts, so children don't need to send EC_CMD_GET_CMD_VERSIONS.
+//
+typedef struct _CROSEC_INTERFACE_STANDARD_V5 {
+    INTERFACE                        InterfaceHeader;
+    PCROSEC_CMD_XFER_STATUS          CmdXferStatus;
+    PCROSEC_CHECK_FEATURES           CheckFeatures;
+    PCROSEC_READ_MEM                 ReadEcMem;
+    PCROSEC_CMD_XFER_BATCH           CmdXferBatch;
+    PCROSEC_GET_MAX_SIZES            GetMaxSizes;
+    PCROSEC_GET_CMD_VERSIONS         GetCmdVersions;
+} CROSEC_INTERFACE_STANDARD_V5, * PCROSEC_INTERFACE_STANDARD_V5;
+
 typedef struct _CROSECBUS_CONTEXT
 {
 
@@ -116,9 +213,56 @@ typedef struct _CROSECBUS_CONTEXT
 	WDFDEVICE FxDevice;
 
     UINT32 EcFeatures[2];
-
-    LONG64 KernelAccessesWaiting;
-    WDFWAITLOCK EcLock;
+    UINT32 EcProtocolFlags; //EC_PROTOCOL_INFO_*
+
+    CROSEC_LOCK EcLock;
+
+    //Async engine for userspace commands
+    CROSEC_LOCK_WAITER EngineWaiter;
+    WDFQUEUE EngineQueues[CROSEC_EC_TARGETS]; //Pending requests, by passthrough target
+    ULONG EngineNextTarget; //Passthrough target whose turn it is
+    WDFWORKITEM EngineWorkItem;
+    WDFTIMER EnginePollTimer;
+    volatile LONG EngineKicks;
+    volatile LONG EngineStopped; //Between D0Exit and D0Entry
+    WDFREQUEST EngineCurrent; //Request whose command is on the EC
+    ULONGLONG EngineSubmitTime;
+    ULONG EnginePollDelay;
+    ULONG EngineSpinUs;
+    ULONG EngineTimeoutUs;
+    LONG EngineCacheGeneration;
+    ULONG EngineParamsSize;
+    UINT8 EngineParams[CROSEC_RESPONSE_CACHE_MAX_PARAMS]; //Request params, kept for the response cache
+    PCROSEC_FLIGHT EngineFlight; //Led by EngineCurrent, if it is read-only
+
+    //XCMD requests waiting for their handle's quota, or all handles', to refill
+    CROSEC_QUOTA_CONFIG QuotaConfig;
+    CROSEC_QUOTA_CONFIG QuotaTotalConfig;
+    CROSEC_QUOTA_BUCKET QuotaTotal; //Charged for every XCMD command; only touched by the engine
+    WDFQUEUE EngineThrottledQueue;
+    WDFTIMER EngineThrottleTimer;
+    ULONGLONG EngineThrottleDue; //0 if the timer isn't armed
+    volatile LONG EngineThrottleFired;
+
+    //XCMD request whose command returned EC_RES_IN_PROGRESS, polled off the bus
+    KSPIN_LOCK EngineLock; //Guards EngineInProgress against its cancel routine
+    WDFREQUEST EngineInProgress;
+    PCROSEC_FLIGHT EngineInProgressFlight;
+    ULONGLONG EngineInProgressSince;
+    WDFTIMER EngineStatusTimer;
+    volatile LONG EngineStatusFired;
+    BOOLEAN EngineStatusDue;
+
+    CROSEC_MEMMAP_CACHE MemmapCache;
+    CROSEC_CMD_VERSIONS CmdVersions;
+    CROSEC_RESPONSE_CACHE ResponseCache;
+    CROSEC_FLIGHTS Flights;
+    CROSEC_TARGET_STATS TargetStats[CROSEC_EC_TARGETS];
+    CROSEC_STATS Stats;
+    CROSEC_CMD_LOG CmdLog;
+    CROSEC_CAPTURE Capture;
+
+    CROSEC_MSG_POOL MsgPool;
 
     WDFINTERRUPT Interrupt;
     BOOLEAN FoundSyncGPIO;
@@ -133,6 +277,21 @@ typedef struct _CROSECBUS_CONTEXT
 
 WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(CROSECBUS_CONTEXT, GetDeviceContext)
 
+typedef struct _CROSEC_FILE_CONTEXT
+{
+    CROSEC_QUOTA_BUCKET Quota; //Only touched by the engine after create
+} CROSEC_FILE_CONTEXT, *PCROSEC_FILE_CONTEXT;
+
+WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(CROSEC_FILE_CONTEXT, GetFileContext)
+
+typedef struct _CROSEC_REQUEST_CONTEXT
+{
+    ULONGLONG Arrived; //When an XCMD request came in, for ecStats.h
+    ULONGLONG Started; //When its command went to the EC, 0 if it never did
+} CROSEC_REQUEST_CONTEXT, *PCROSEC_REQUEST_CONTEXT;
+
+WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(CROSEC_REQUEST_CONTEXT, GetRequestContext)
+
 //
 // Function definitions
 //
@@ -143,6 +302,18 @@ EVT_WDF_DRIVER_UNLOAD CrosEcBusDriverUnload;
 
 EVT_WDF_DRIVER_DEVICE_ADD CrosEcBusEvtDeviceAdd;
 
+EVT_WDF_DEVICE_FILE_CREATE CrosEcBusEvtFileCreate;
+
+EVT_WDF_OBJECT_CONTEXT_CLEANUP CrosEcBusEvtDeviceCleanup;
+
+// Reads a DWORD from the device's Settings key
+NTSTATUS
+CrosEcBusReadSetting(
+    IN WDFDEVICE Device,
+    IN PCUNICODE_STRING Name,
+    OUT PULONG Value
+    );
+
 EVT_WDF_IO_QUEUE_IO_INTERNAL_DEVICE_CONTROL CrosEcBusEvtInternalDeviceControl;
 
 //
@@ -170,4 +341,5 @@ EVT_WDF_IO_QUEUE_IO_INTERNAL_DEVICE_CONTROL CrosEcBusEvtInternalDeviceControl;
 #define CrosEcBusPrint(dbglevel, fmt, ...) {                       \
 }
 #endif
-#endif
\ No newline at end of file
+#endif
+#endif
@@ -0,0 +1,153 @@
+#include "driver.h"
+
+NTSTATUS CrosEcCaptureControl(
+	_Inout_ PCROSEC_LOCK EcLock,
+	_Inout_ PCROSEC_CAPTURE Capture,
+	_In_ ULONG Bytes)
+{
+	PUINT8 buffer = NULL;
+	PUINT8 old;
+
+	if (Bytes > CROSEC_CAPTURE_MAX_BYTES) {
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	//Allocate before taking the EC so nobody waits on the pool
+	if (Bytes) {
+		buffer = (PUINT8)ExAllocatePoolWithTag(NonPagedPool, Bytes, CROSECBUS_POOL_TAG);
+		if (!buffer) {
+			return STATUS_INSUFFICIENT_RESOURCES;
+		}
+	}
+
+	CrosEcLockAcquire(EcLock, CrosEcLockClassKernel);
+	old = Capture->Buffer;
+	Capture->Buffer = buffer;
+	Capture->Size = Bytes;
+	Capture->Used = 0;
+	Capture->Records = 0;
+	Capture->Dropped = 0;
+	Capture->Open = CROSEC_CAPTURE_NONE;
+	Capture->StartTime = KeQueryInterruptTime();
+	Capture->LastStart = Capture->StartTime;
+	CrosEcLockRelease(EcLock);
+
+	if (old) {
+		ExFreePoolWithTag(old, CROSECBUS_POOL_TAG);
+	}
+	return STATUS_SUCCESS;
+}
+
+VOID CrosEcCaptureFree(_Inout_ PCROSEC_CAPTURE Capture) {
+	if (Capture->Buffer) {
+		ExFreePoolWithTag(Capture->Buffer, CROSECBUS_POOL_TAG);
+		Capture->Buffer = NULL;
+	}
+}
+
+VOID CrosEcCaptureBegin(
+	_Inout_ PCROSEC_CAPTURE Capture,
+	_In_ CROSEC_LOCK_CLASS Class,
+	_In_ UINT16 Command,
+	_In_ UINT8 Version,
+	_In_reads_bytes_(OutSize) const VOID* Params,
+	_In_ ULONG OutSize,
+	_In_ ULONG InSize,
+	_In_ ULONGLONG StartTime)
+{
+	if (!Capture->Buffer) {
+		return;
+	}
+
+	//Room for the largest response; End only keeps what came back
+	ULONG needed = CROSEC_CAPTURE_ALIGN(sizeof(CROSEC_CAPTURE_RECORD) + OutSize + InSize);
+	if (Capture->Size - Capture->Used < needed) {
+		Capture->Open = CROSEC_CAPTURE_NONE;
+		Capture->Dropped++;
+		return;
+	}
+
+	PCROSEC_CAPTURE_RECORD record = (PCROSEC_CAPTURE_RECORD)(Capture->Buffer + Capture->Used);
+	record->Command = Command;
+	record->Version = Version;
+	record->Class = (UINT8)Class;
+	record->OutSize = (UINT16)OutSize;
+	record->InSize = 0;
+	record->MaxInSize = (UINT16)InSize;
+	record->Reserved = 0;
+	RtlCopyMemory(record + 1, Params, OutSize);
+
+	Capture->Open = Capture->Used;
+	Capture->OpenStart = StartTime;
+}
+
+VOID CrosEcCaptureEnd(
+	_Inout_ PCROSEC_CAPTURE Capture,
+	_In_ int Result,
+	_In_reads_bytes_opt_(Result) const VOID* Response)
+{
+	if (!Capture->Buffer || Capture->Open == CROSEC_CAPTURE_NONE) {
+		return;
+	}
+
+	PCROSEC_CAPTURE_RECORD record = (PCROSEC_CAPTURE_RECORD)(Capture->Buffer + Capture->Open);
+	ULONGLONG now = KeQueryInterruptTime();
+
+	if (Result > 0 && Response) {
+		record->InSize = (UINT16)min((ULONG)Result, record->MaxInSize);
+		RtlCopyMemory((PUINT8)(record + 1) + record->OutSize, Response, record->InSize);
+	}
+	record->Result = Result;
+	record->GapUs = (UINT32)min((Capture->OpenStart - Capture->LastStart) / 10, MAXULONG);
+	record->DurationUs = (UINT32)min((now - Capture->OpenStart) / 10, MAXULONG);
+
+	Capture->Used += CROSEC_CAPTURE_ALIGN(sizeof(*record) + record->OutSize + record->InSize);
+	Capture->Records++;
+	Capture->LastStart = Capture->OpenStart;
+	Capture->Open = CROSEC_CAPTURE_NONE;
+}
+
+NTSTATUS CrosEcCaptureRead(
+	_Inout_ PCROSEC_LOCK EcLock,
+	_In_ PCROSEC_CAPTURE Capture,
+	_Out_writes_bytes_(Length) PVOID Buffer,
+	_In_ SIZE_T Length,
+	_Out_ PSIZE_T Written)
+{
+	PCROSEC_CAPTURE_HEADER header = (PCROSEC_CAPTURE_HEADER)Buffer;
+	NTSTATUS status = STATUS_SUCCESS;
+
+	*Written = 0;
+	if (Length < sizeof(*header)) {
+		return STATUS_BUFFER_TOO_SMALL;
+	}
+
+	//Hold the EC so no record is half written while we copy
+	CrosEcLockAcquire(EcLock, CrosEcLockClassKernel);
+	if (!Capture->Buffer) {
+		status = STATUS_DEVICE_NOT_READY;
+		goto out;
+	}
+
+	header->Magic = CROSEC_CAPTURE_MAGIC;
+	header->Version = CROSEC_CAPTURE_VERSION;
+	header->RecordSize = sizeof(CROSEC_CAPTURE_RECORD);
+	header->Records = Capture->Records;
+	header->Dropped = Capture->Dropped;
+	header->DataSize = Capture->Used;
+	header->Reserved = 0;
+	header->StartTime = Capture->StartTime;
+
+	if (Length < sizeof(*header) + Capture->Used) {
+		*Written = sizeof(*header);
+		status = STATUS_BUFFER_OVERFLOW;
+		goto out;
+	}
+
+	RtlCopyMemory(header + 1, Capture->Buffer, Capture->Used);
+	*Written = sizeof(*header) + Capture->Used;
+
+out:
+	CrosEcLockRelease(EcLock);
+	return status;
+}
@@ -0,0 +1,103 @@
+#pragma once
+
+//
+// Capture of host command traffic, params and responses included, for
+// replaying against the simulated EC (host/crosec-replay.c). Records are
+// appended to one buffer while the EC is held, so there's nothing to lock;
+// once the buffer is full further commands are only counted. Off unless
+// the CaptureBytes setting or IOCTL_CROSEC_CAPTURE gives it a buffer.
+//
+// Commands are recorded as ec_command_proto saw them: a command that
+// returned EC_RES_IN_PROGRESS is recorded with that result, and the status
+// polls that follow it aren't recorded.
+//
+// IOCTL_CROSEC_CAPTURE_READ returns a CROSEC_CAPTURE_HEADER followed by
+// DataSize bytes of records, which is also the capture file format. The
+// format part of this header is shared with host programs, which define
+// CROSEC_CAPTURE_FORMAT_ONLY and the UINT types themselves.
+//
+
+#define CROSEC_CAPTURE_MAGIC     0x50434543 // 'CECP'
+#define CROSEC_CAPTURE_VERSION   1
+#define CROSEC_CAPTURE_MAX_BYTES 0x1000000
+
+// Each record is followed by OutSize params and InSize response bytes,
+// then padding up to the next 4 byte boundary
+#define CROSEC_CAPTURE_ALIGN(Size) (((Size) + 3) & ~3U)
+
+typedef struct _CROSEC_CAPTURE_HEADER {
+	UINT32 Magic;
+	UINT16 Version;
+	UINT16 RecordSize;  // sizeof(CROSEC_CAPTURE_RECORD)
+	UINT32 Records;
+	UINT32 Dropped;     // Commands that didn't fit in the buffer
+	UINT32 DataSize;    // Bytes of records after the header
+	UINT32 Reserved;
+	UINT64 StartTime;   // Interrupt time (100ns) the capture started
+} CROSEC_CAPTURE_HEADER, *PCROSEC_CAPTURE_HEADER;
+
+typedef struct _CROSEC_CAPTURE_RECORD {
+	UINT32 GapUs;       // From the start of the previous record (or the capture)
+	UINT32 DurationUs;
+	UINT16 Command;
+	UINT8 Version;
+	UINT8 Class;        // CROSEC_LOCK_CLASS of the caller
+	UINT16 OutSize;
+	UINT16 InSize;      // Response bytes kept; 0 unless Result > 0
+	UINT16 MaxInSize;   // Response buffer the caller passed
+	UINT16 Reserved;
+	INT32 Result;       // ec_command_proto style
+} CROSEC_CAPTURE_RECORD, *PCROSEC_CAPTURE_RECORD;
+
+#ifndef CROSEC_CAPTURE_FORMAT_ONLY
+
+#define CROSEC_CAPTURE_NONE MAXULONG
+
+// All fields are protected by the EC lock
+typedef struct _CROSEC_CAPTURE {
+	PUINT8 Buffer;      // NULL while not capturing
+	ULONG Size;
+	ULONG Used;         // Bytes of finished records
+	ULONG Records;
+	ULONG Dropped;
+	ULONG Open;         // Offset of the record being filled in, or CROSEC_CAPTURE_NONE
+	ULONGLONG OpenStart;
+	ULONGLONG LastStart;
+	ULONGLONG StartTime;
+} CROSEC_CAPTURE, *PCROSEC_CAPTURE;
+
+// Starts a new capture into a Bytes buffer, dropping the old one; 0 just stops
+NTSTATUS CrosEcCaptureControl(
+	_Inout_ PCROSEC_LOCK EcLock,
+	_Inout_ PCROSEC_CAPTURE Capture,
+	_In_ ULONG Bytes);
+
+// Only once nothing can be sending commands (device cleanup)
+VOID CrosEcCaptureFree(_Inout_ PCROSEC_CAPTURE Capture);
+
+// Called with the EC held, before the command goes out
+VOID CrosEcCaptureBegin(
+	_Inout_ PCROSEC_CAPTURE Capture,
+	_In_ CROSEC_LOCK_CLASS Class,
+	_In_ UINT16 Command,
+	_In_ UINT8 Version,
+	_In_reads_bytes_(OutSize) const VOID* Params,
+	_In_ ULONG OutSize,
+	_In_ ULONG InSize,
+	_In_ ULONGLONG StartTime);
+
+// Called with the EC held, still, once ec_command_proto has returned
+VOID CrosEcCaptureEnd(
+	_Inout_ PCROSEC_CAPTURE Capture,
+	_In_ int Result,
+	_In_reads_bytes_opt_(Result) const VOID* Response);
+
+// STATUS_BUFFER_OVERFLOW with just the header if Buffer can't hold it all
+NTSTATUS CrosEcCaptureRead(
+	_Inout_ PCROSEC_LOCK EcLock,
+	_In_ PCROSEC_CAPTURE Capture,
+	_Out_writes_bytes_(Length) PVOID Buffer,
+	_In_ SIZE_T Length,
+	_Out_ PSIZE_T Written);
+
+#endif
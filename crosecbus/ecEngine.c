@@ -0,0 +1,666 @@
+#include "driver.h"
+#include "comm-host.h"
+#include "userspaceQueue.h"
+#include "ecEngine.h"
+
+static ULONG CrosEcBusDebugLevel = 100;
+static ULONG CrosEcBusDebugCatagories = DBG_INIT || DBG_PNP || DBG_IOCTL;
+
+EVT_WDF_WORKITEM CrosEcEngineEvtWorkItem;
+EVT_WDF_TIMER CrosEcEngineEvtTimer;
+EVT_WDF_TIMER CrosEcEngineEvtThrottleTimer;
+EVT_WDF_TIMER CrosEcEngineEvtStatusTimer;
+EVT_WDF_REQUEST_CANCEL CrosEcEngineEvtInProgressCancel;
+
+static VOID CrosEcEngineGranted(_In_ PVOID Context) {
+	CrosEcEngineKick((PCROSECBUS_CONTEXT)Context);
+}
+
+NTSTATUS CrosEcEngineInit(_In_ WDFDEVICE Device) {
+	PCROSECBUS_CONTEXT pDevice = GetDeviceContext(Device);
+	WDF_IO_QUEUE_CONFIG queueConfig;
+	WDF_WORKITEM_CONFIG workItemConfig;
+	WDF_TIMER_CONFIG timerConfig;
+	WDF_OBJECT_ATTRIBUTES attributes;
+	NTSTATUS status;
+
+	pDevice->EngineWaiter.Class = CrosEcLockClassUser;
+	pDevice->EngineWaiter.OnGrant = CrosEcEngineGranted;
+	pDevice->EngineWaiter.Context = pDevice;
+	KeInitializeSpinLock(&pDevice->EngineLock);
+	pDevice->EngineStopped = TRUE; //Until D0Entry
+
+	//Not power managed: the engine stops and starts itself with the device
+	for (ULONG i = 0; i < CROSEC_EC_TARGETS; i++) {
+		WDF_IO_QUEUE_CONFIG_INIT(&queueConfig, WdfIoQueueDispatchManual);
+		queueConfig.PowerManaged = WdfFalse;
+		queueConfig.EvtIoStop = CrosECEvtIoStop;
+		status = WdfIoQueueCreate(Device, &queueConfig, WDF_NO_OBJECT_ATTRIBUTES, &pDevice->EngineQueues[i]);
+		if (!NT_SUCCESS(status)) {
+			CrosEcBusPrint(DEBUG_LEVEL_ERROR, DBG_PNP, "WdfIoQueueCreate failed %!STATUS!", status);
+			return status;
+		}
+	}
+
+	WDF_IO_QUEUE_CONFIG_INIT(&queueConfig, WdfIoQueueDispatchManual);
+	queueConfig.PowerManaged = WdfFalse;
+	queueConfig.EvtIoStop = CrosECEvtIoStop;
+	status = WdfIoQueueCreate(Device, &queueConfig, WDF_NO_OBJECT_ATTRIBUTES, &pDevice->EngineThrottledQueue);
+	if (!NT_SUCCESS(status)) {
+		CrosEcBusPrint(DEBUG_LEVEL_ERROR, DBG_PNP, "WdfIoQueueCreate failed %!STATUS!", status);
+		return status;
+	}
+
+	WDF_WORKITEM_CONFIG_INIT(&workItemConfig, CrosEcEngineEvtWorkItem);
+	WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
+	attributes.ParentObject = Device;
+	status = WdfWorkItemCreate(&workItemConfig, &attributes, &pDevice->EngineWorkItem);
+	if (!NT_SUCCESS(status)) {
+		CrosEcBusPrint(DEBUG_LEVEL_ERROR, DBG_PNP, "WdfWorkItemCreate failed %!STATUS!", status);
+		return status;
+	}
+
+	WDF_TIMER_CONFIG_INIT(&timerConfig, CrosEcEngineEvtTimer);
+	timerConfig.UseHighResolutionTimer = WdfTrue;
+	WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
+	attributes.ParentObject = Device;
+	status = WdfTimerCreate(&timerConfig, &attributes, &pDevice->EnginePollTimer);
+	if (!NT_SUCCESS(status)) {
+		CrosEcBusPrint(DEBUG_LEVEL_ERROR, DBG_PNP, "WdfTimerCreate failed %!STATUS!", status);
+		return status;
+	}
+
+	WDF_TIMER_CONFIG_INIT(&timerConfig, CrosEcEngineEvtThrottleTimer);
+	WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
+	attributes.ParentObject = Device;
+	status = WdfTimerCreate(&timerConfig, &attributes, &pDevice->EngineThrottleTimer);
+	if (!NT_SUCCESS(status)) {
+		CrosEcBusPrint(DEBUG_LEVEL_ERROR, DBG_PNP, "WdfTimerCreate failed %!STATUS!", status);
+		return status;
+	}
+
+	WDF_TIMER_CONFIG_INIT(&timerConfig, CrosEcEngineEvtStatusTimer);
+	WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
+	attributes.ParentObject = Device;
+	status = WdfTimerCreate(&timerConfig, &attributes, &pDevice->EngineStatusTimer);
+	if (!NT_SUCCESS(status)) {
+		CrosEcBusPrint(DEBUG_LEVEL_ERROR, DBG_PNP, "WdfTimerCreate failed %!STATUS!", status);
+		return status;
+	}
+
+	return status;
+}
+
+//Pending queue for the target a request's command goes to
+static WDFQUEUE CrosEcEngineQueueFor(
+	_In_ PCROSECBUS_CONTEXT pDevice,
+	_In_ WDFREQUEST Request)
+{
+	PCROSEC_COMMAND cmd;
+
+	//Buffers were validated by CrosECIoctlXCmd
+	WdfRequestRetrieveInputBuffer(Request, sizeof(*cmd), (PVOID*)&cmd, NULL);
+	return pDevice->EngineQueues[CrosEcTargetOf(cmd->Command)];
+}
+
+NTSTATUS CrosEcEngineSubmit(
+	_In_ PCROSECBUS_CONTEXT pDevice,
+	_In_ WDFREQUEST Request)
+{
+	NTSTATUS status = WdfRequestForwardToIoQueue(Request, CrosEcEngineQueueFor(pDevice, Request));
+	if (!NT_SUCCESS(status)) {
+		return status;
+	}
+
+	CrosEcEngineKick(pDevice);
+	return STATUS_SUCCESS;
+}
+
+VOID CrosEcEngineKick(_In_ PCROSECBUS_CONTEXT pDevice) {
+	//Only the first kick queues the work item; it keeps running until it has seen them all
+	if (InterlockedIncrement(&pDevice->EngineKicks) == 1) {
+		WdfWorkItemEnqueue(pDevice->EngineWorkItem);
+	}
+}
+
+static PCROSEC_QUOTA_BUCKET CrosEcEngineQuota(_In_ WDFREQUEST Request) {
+	WDFFILEOBJECT fileObject = WdfRequestGetFileObject(Request);
+	return fileObject ? &GetFileContext(fileObject)->Quota : NULL;
+}
+
+//Both the handle and userspace as a whole need bus time left. Refills both
+//buckets either way.
+static BOOLEAN CrosEcEngineAdmit(
+	_In_ PCROSECBUS_CONTEXT pDevice,
+	_In_opt_ PCROSEC_QUOTA_BUCKET Quota)
+{
+	BOOLEAN handle = !Quota || CrosEcQuotaAdmit(&pDevice->QuotaConfig, Quota);
+	BOOLEAN total = CrosEcQuotaAdmit(&pDevice->QuotaTotalConfig, &pDevice->QuotaTotal);
+
+	return handle && total;
+}
+
+static VOID CrosEcEngineCharge(
+	_In_ PCROSECBUS_CONTEXT pDevice,
+	_In_opt_ PCROSEC_QUOTA_BUCKET Quota,
+	_In_ ULONG64 BusUs)
+{
+	if (Quota) {
+		CrosEcQuotaCharge(Quota, BusUs);
+	}
+	CrosEcQuotaCharge(&pDevice->QuotaTotal, BusUs);
+}
+
+//Park a request until its handle and userspace as a whole have bus time again
+static VOID CrosEcEngineThrottle(
+	_In_ PCROSECBUS_CONTEXT pDevice,
+	_In_ WDFREQUEST Request,
+	_In_opt_ PCROSEC_QUOTA_BUCKET Quota)
+{
+	if (!NT_SUCCESS(WdfRequestForwardToIoQueue(Request, pDevice->EngineThrottledQueue))) {
+		WdfRequestComplete(Request, STATUS_QUOTA_EXCEEDED);
+		return;
+	}
+
+	ULONG delayUs = CrosEcQuotaDelayUs(&pDevice->QuotaTotalConfig, &pDevice->QuotaTotal);
+	if (Quota) {
+		delayUs = max(delayUs, CrosEcQuotaDelayUs(&pDevice->QuotaConfig, Quota));
+	}
+	delayUs = max(delayUs, CROSEC_ENGINE_MIN_POLL_US);
+	ULONGLONG due = KeQueryInterruptTime() + delayUs * 10ULL;
+
+	//Only pull the timer in; anything due later is picked up when it fires
+	if (!pDevice->EngineThrottleDue || due < pDevice->EngineThrottleDue) {
+		pDevice->EngineThrottleDue = due;
+		WdfTimerStart(pDevice->EngineThrottleTimer, WDF_REL_TIMEOUT_IN_US(delayUs));
+	}
+}
+
+//Move requests whose handles have refilled back onto the pending queue
+static VOID CrosEcEngineUnthrottle(_In_ PCROSECBUS_CONTEXT pDevice) {
+	ULONG throttled = 0;
+	WDFREQUEST request;
+
+	pDevice->EngineThrottleDue = 0;
+
+	WdfIoQueueGetState(pDevice->EngineThrottledQueue, &throttled, NULL);
+	for (ULONG i = 0; i < throttled; i++) {
+		if (!NT_SUCCESS(WdfIoQueueRetrieveNextRequest(pDevice->EngineThrottledQueue, &request))) {
+			break; //Cancelled under us
+		}
+
+		PCROSEC_QUOTA_BUCKET quota = CrosEcEngineQuota(request);
+		if (!CrosEcEngineAdmit(pDevice, quota)) {
+			CrosEcEngineThrottle(pDevice, request, quota);
+		}
+		else if (!NT_SUCCESS(WdfRequestForwardToIoQueue(request, CrosEcEngineQueueFor(pDevice, request)))) {
+			WdfRequestComplete(request, STATUS_QUOTA_EXCEEDED);
+		}
+	}
+}
+
+//Hands the result to anyone who asked for the same thing meanwhile.
+//Only a response needs the leader's buffer.
+static VOID CrosEcEngineLand(
+	_In_ PCROSECBUS_CONTEXT pDevice,
+	_In_opt_ PCROSEC_FLIGHT Flight,
+	_In_opt_ WDFREQUEST Request,
+	_In_ int res)
+{
+	PCROSEC_COMMAND outCmd = NULL;
+
+	if (!Flight) {
+		return;
+	}
+
+	if (res > 0) {
+		WdfRequestRetrieveOutputBuffer(Request, sizeof(*outCmd), (PVOID*)&outCmd, NULL);
+	}
+	CrosEcFlightLand(&pDevice->Flights, Flight, res, outCmd ? outCmd->Data : NULL);
+}
+
+static PCROSECBUS_CONTEXT CrosEcEngineDeviceOf(_In_ WDFREQUEST Request) {
+	return GetDeviceContext(WdfIoQueueGetDevice(WdfRequestGetIoQueue(Request)));
+}
+
+//Takes the parked request back from its cancel routine; NULL if there's none
+//or the cancel routine got there first, in which case it completes it
+static WDFREQUEST CrosEcEngineTakeInProgress(
+	_In_ PCROSECBUS_CONTEXT pDevice,
+	_Out_ PCROSEC_FLIGHT* Flight)
+{
+	WDFREQUEST request;
+	KIRQL irql;
+
+	KeAcquireSpinLock(&pDevice->EngineLock, &irql);
+	request = pDevice->EngineInProgress;
+	*Flight = pDevice->EngineInProgressFlight;
+	pDevice->EngineInProgress = NULL;
+	pDevice->EngineInProgressFlight = NULL;
+	if (request && WdfRequestUnmarkCancelable(request) == STATUS_CANCELLED) {
+		request = NULL;
+	}
+	KeReleaseSpinLock(&pDevice->EngineLock, irql);
+
+	return request;
+}
+
+//The caller gave up on a command parked on EC_RES_IN_PROGRESS. The EC carries on
+//with it; anyone who joined is told it's still in progress.
+VOID CrosEcEngineEvtInProgressCancel(_In_ WDFREQUEST Request) {
+	PCROSECBUS_CONTEXT pDevice = CrosEcEngineDeviceOf(Request);
+	PCROSEC_FLIGHT flight = NULL;
+	KIRQL irql;
+
+	KeAcquireSpinLock(&pDevice->EngineLock, &irql);
+	if (pDevice->EngineInProgress == Request) {
+		flight = pDevice->EngineInProgressFlight;
+		pDevice->EngineInProgress = NULL;
+		pDevice->EngineInProgressFlight = NULL;
+	}
+	KeReleaseSpinLock(&pDevice->EngineLock, irql);
+
+	CrosEcEngineLand(pDevice, flight, NULL, -EECRESULT - EC_RES_IN_PROGRESS);
+	WdfRequestComplete(Request, STATUS_CANCELLED);
+}
+
+VOID CrosEcEngineEvtFlightCancel(_In_ WDFREQUEST Request) {
+	CrosEcFlightDetachRequest(&CrosEcEngineDeviceOf(Request)->Flights, Request, FALSE);
+	WdfRequestComplete(Request, STATUS_CANCELLED);
+}
+
+BOOLEAN CrosEcEngineCancel(
+	_In_ PCROSECBUS_CONTEXT pDevice,
+	_In_ WDFREQUEST Request)
+{
+	PCROSEC_FLIGHT flight = NULL;
+	BOOLEAN taken = FALSE;
+	KIRQL irql;
+
+	KeAcquireSpinLock(&pDevice->EngineLock, &irql);
+	if (pDevice->EngineInProgress == Request && WdfRequestUnmarkCancelable(Request) != STATUS_CANCELLED) {
+		flight = pDevice->EngineInProgressFlight;
+		pDevice->EngineInProgress = NULL;
+		pDevice->EngineInProgressFlight = NULL;
+		taken = TRUE;
+	}
+	KeReleaseSpinLock(&pDevice->EngineLock, irql);
+
+	if (taken) {
+		CrosEcEngineLand(pDevice, flight, NULL, -EECRESULT - EC_RES_IN_PROGRESS);
+	}
+	else {
+		taken = CrosEcFlightDetachRequest(&pDevice->Flights, Request, TRUE);
+	}
+
+	if (taken) {
+		WdfRequestComplete(Request, STATUS_CANCELLED);
+	}
+	return taken;
+}
+
+static VOID CrosEcEngineFinish(
+	_In_ PCROSECBUS_CONTEXT pDevice,
+	_In_ int res)
+{
+	WDFREQUEST request = pDevice->EngineCurrent;
+	PCROSEC_FLIGHT flight = pDevice->EngineFlight;
+	ULONG64 busUs = (KeQueryInterruptTime() - pDevice->EngineSubmitTime) / 10;
+	PCROSEC_COMMAND cmd;
+	pDevice->EngineCurrent = NULL;
+	pDevice->EngineFlight = NULL;
+
+	WdfRequestRetrieveInputBuffer(request, sizeof(*cmd), (PVOID*)&cmd, NULL);
+	CrosEcTrace(CrosEcTraceCmdComplete, cmd->Command, res, busUs);
+	CrosEcCmdLogRecord(&pDevice->CmdLog, CrosEcLockClassUser, (UINT16)cmd->Command, (UINT8)cmd->Version,
+		cmd->OutSize, cmd->InSize, res, pDevice->EngineSubmitTime);
+	CrosEcTargetRecord(pDevice->TargetStats, (UINT16)cmd->Command, busUs, res);
+	CrosEcCaptureEnd(&pDevice->Capture, res, cmd->Data);
+
+	CrosEcLockRelease(&pDevice->EcLock);
+
+	//Charge the handle for the time it actually held the bus
+	CrosEcEngineCharge(pDevice, CrosEcEngineQuota(request), busUs);
+
+	CrosEcEngineLand(pDevice, flight, request, res);
+	WdfRequestComplete(request, CrosECIoctlXCmdFinish(request, res));
+}
+
+//Called with the EC held when the current command returned EC_RES_IN_PROGRESS.
+//Parks the request and gives up the EC; returns FALSE to finish it as is.
+static BOOLEAN CrosEcEngineDefer(_In_ PCROSECBUS_CONTEXT pDevice) {
+	WDFREQUEST request = pDevice->EngineCurrent;
+	WDF_REQUEST_PARAMETERS params;
+	NTSTATUS status;
+	KIRQL irql;
+
+	if (!(pDevice->EcProtocolFlags & EC_PROTOCOL_INFO_IN_PROGRESS_SUPPORTED) || pDevice->EngineInProgress ||
+		pDevice->EngineStopped) {
+		return FALSE;
+	}
+
+	//Async callers get CROSEC_STATUS_IN_PROGRESS and poll for themselves
+	WDF_REQUEST_PARAMETERS_INIT(&params);
+	WdfRequestGetParameters(request, &params);
+	if (params.Parameters.DeviceIoControl.IoControlCode == IOCTL_CROSEC_XCMD_ASYNC) {
+		return FALSE;
+	}
+
+	//Parked for up to EC_IN_PROGRESS_TIMEOUT_USEC, so the caller may give up on it
+	//meanwhile. The cancel routine may complete it as soon as the lock is dropped.
+	KeAcquireSpinLock(&pDevice->EngineLock, &irql);
+	status = WdfRequestMarkCancelableEx(request, CrosEcEngineEvtInProgressCancel);
+	if (NT_SUCCESS(status)) {
+		pDevice->EngineInProgress = request;
+		pDevice->EngineInProgressFlight = pDevice->EngineFlight;
+		pDevice->EngineInProgressSince = KeQueryInterruptTime();
+		pDevice->EngineCurrent = NULL;
+		pDevice->EngineFlight = NULL;
+
+		CrosEcEngineCharge(pDevice, CrosEcEngineQuota(request),
+			(pDevice->EngineInProgressSince - pDevice->EngineSubmitTime) / 10);
+	}
+	KeReleaseSpinLock(&pDevice->EngineLock, irql);
+	if (!NT_SUCCESS(status)) {
+		return FALSE; //Already cancelled
+	}
+
+	CrosEcCaptureEnd(&pDevice->Capture, -EECRESULT - EC_RES_IN_PROGRESS, NULL);
+
+	CrosEcLockRelease(&pDevice->EcLock);
+
+	WdfTimerStart(pDevice->EngineStatusTimer, WDF_REL_TIMEOUT_IN_US(EC_IN_PROGRESS_POLL_USEC));
+	return TRUE;
+}
+
+//Called with the EC held; asks whether the parked command is done
+static VOID CrosEcEnginePollInProgress(_In_ PCROSECBUS_CONTEXT pDevice) {
+	int res = ec_command_in_progress();
+
+	if (res == 1) {
+		ULONGLONG elapsed = (KeQueryInterruptTime() - pDevice->EngineInProgressSince) / 10;
+		if (elapsed < EC_IN_PROGRESS_TIMEOUT_USEC) {
+			CrosEcLockRelease(&pDevice->EcLock);
+			WdfTimerStart(pDevice->EngineStatusTimer, WDF_REL_TIMEOUT_IN_US(EC_IN_PROGRESS_POLL_USEC));
+			return;
+		}
+
+		CrosEcBusPrint(DEBUG_LEVEL_INFO, DBG_IOCTL,
+			"Timeout waiting for EC command in progress\n");
+		res = -EC_RES_ERROR;
+	}
+
+	PCROSEC_FLIGHT flight;
+	WDFREQUEST request = CrosEcEngineTakeInProgress(pDevice, &flight);
+	CrosEcLockRelease(&pDevice->EcLock);
+
+	CrosEcEngineLand(pDevice, flight, request, res);
+	if (request) {
+		WdfRequestComplete(request, CrosECIoctlXCmdFinish(request, res));
+	}
+}
+
+//Local EC commands always go first so a slow sub-processor can't hold up
+//e.g. MKBP; passthrough targets take turns after that
+static NTSTATUS CrosEcEngineRetrieveNext(
+	_In_ PCROSECBUS_CONTEXT pDevice,
+	_Out_ WDFREQUEST* Request)
+{
+	NTSTATUS status = WdfIoQueueRetrieveNextRequest(pDevice->EngineQueues[0], Request);
+
+	for (ULONG i = 0; i < CROSEC_EC_TARGETS - 1 && !NT_SUCCESS(status); i++) {
+		ULONG target = pDevice->EngineNextTarget % (CROSEC_EC_TARGETS - 1) + 1;
+
+		pDevice->EngineNextTarget = target;
+		status = WdfIoQueueRetrieveNextRequest(pDevice->EngineQueues[target], Request);
+	}
+	return status;
+}
+
+static ULONG CrosEcEngineQueued(_In_ PCROSECBUS_CONTEXT pDevice) {
+	ULONG total = 0;
+
+	for (ULONG i = 0; i < CROSEC_EC_TARGETS; i++) {
+		ULONG queued = 0;
+		WdfIoQueueGetState(pDevice->EngineQueues[i], &queued, NULL);
+		total += queued;
+	}
+	return total;
+}
+
+//Called with the EC held; returns FALSE if nothing was started
+static BOOLEAN CrosEcEngineStart(
+	_In_ PCROSECBUS_CONTEXT pDevice)
+{
+	WDFREQUEST request;
+	PCROSEC_COMMAND cmd, outCmd;
+	CROSEC_FLIGHT_KEY key;
+	PCROSEC_FLIGHT flight = NULL;
+
+	while (TRUE) {
+		if (!NT_SUCCESS(CrosEcEngineRetrieveNext(pDevice, &request))) {
+			return FALSE;
+		}
+
+		PCROSEC_QUOTA_BUCKET quota = CrosEcEngineQuota(request);
+		if (!CrosEcEngineAdmit(pDevice, quota)) {
+			if (quota) {
+				quota->Throttled++;
+			}
+			pDevice->QuotaTotal.Throttled++;
+			CrosEcEngineThrottle(pDevice, request, quota);
+			continue;
+		}
+
+		//Buffers were validated by CrosECIoctlXCmd
+		WdfRequestRetrieveInputBuffer(request, sizeof(*cmd), (PVOID*)&cmd, NULL);
+		WdfRequestRetrieveOutputBuffer(request, sizeof(*outCmd), (PVOID*)&outCmd, NULL);
+
+		//Read-only commands lead a flight others can join, unless one is already up
+		if (!CrosEcFlightKeyInit(&key, (UINT16)cmd->Command, (UINT8)cmd->Version, cmd->Data, cmd->OutSize, cmd->InSize) ||
+			!CrosEcFlightJoinRequest(&pDevice->Flights, &key, request, CrosEcEngineEvtFlightCancel, &flight)) {
+			break;
+		}
+	}
+
+	RtlCopyMemory(outCmd, cmd, sizeof(*cmd)); //Copy header
+
+	//The response lands on top of the params
+	pDevice->EngineParamsSize = cmd->OutSize;
+	pDevice->EngineCacheGeneration = CrosEcResponseCacheGeneration(&pDevice->ResponseCache);
+	if (cmd->OutSize <= sizeof(pDevice->EngineParams)) {
+		RtlCopyMemory(pDevice->EngineParams, cmd->Data, cmd->OutSize);
+	}
+
+	pDevice->EngineCurrent = request;
+	pDevice->EngineFlight = flight;
+	pDevice->EngineSubmitTime = KeQueryInterruptTime();
+	GetRequestContext(request)->Started = pDevice->EngineSubmitTime;
+	pDevice->EngineTimeoutUs = ec_command_timeout((UINT16)cmd->Command);
+	if (CrosEcTargetOf(cmd->Command)) {
+		pDevice->EngineSpinUs = 0;
+		pDevice->EnginePollDelay = CROSEC_PASSTHRU_MIN_POLL_US;
+	}
+	else {
+		pDevice->EngineSpinUs = CROSEC_ENGINE_SPIN_US;
+		pDevice->EnginePollDelay = CROSEC_ENGINE_MIN_POLL_US;
+	}
+
+	CrosEcTrace(CrosEcTraceCmdSubmit, cmd->Command, cmd->Version, cmd->OutSize);
+	CrosEcCaptureBegin(&pDevice->Capture, CrosEcLockClassUser, (UINT16)cmd->Command, (UINT8)cmd->Version,
+		outCmd->Data, cmd->OutSize, cmd->InSize, pDevice->EngineSubmitTime);
+	int res = ec_command_submit((UINT16)cmd->Command, (UINT8)cmd->Version, outCmd->Data, cmd->OutSize);
+	if (res < 0) {
+		CrosEcEngineFinish(pDevice, res);
+	}
+	return TRUE;
+}
+
+//Called with the EC held once the current command is no longer busy
+static VOID CrosEcEngineComplete(_In_ PCROSECBUS_CONTEXT pDevice) {
+	PCROSEC_COMMAND cmd;
+
+	WdfRequestRetrieveInputBuffer(pDevice->EngineCurrent, sizeof(*cmd), (PVOID*)&cmd, NULL);
+	int res = ec_command_complete(cmd->Data, cmd->InSize);
+	if (res >= 0 && pDevice->EngineParamsSize <= sizeof(pDevice->EngineParams)) {
+		CrosEcResponseCacheInsert(&pDevice->ResponseCache, pDevice->EngineCacheGeneration,
+			(UINT16)cmd->Command, (UINT8)cmd->Version,
+			pDevice->EngineParams, pDevice->EngineParamsSize, cmd->Data, res);
+	}
+	if (res != -EECRESULT - EC_RES_IN_PROGRESS || !CrosEcEngineDefer(pDevice)) {
+		CrosEcEngineFinish(pDevice, res);
+	}
+}
+
+static VOID CrosEcEngineRun(_In_ PCROSECBUS_CONTEXT pDevice) {
+	if (pDevice->EngineStopped) {
+		//Give back a grant that came in meanwhile; CrosEcEngineDrain sees to the rest
+		if (!pDevice->EngineCurrent && pDevice->EngineWaiter.State == CrosEcLockWaiterGranted &&
+			CrosEcLockAcquireAsync(&pDevice->EcLock, &pDevice->EngineWaiter)) {
+			CrosEcLockRelease(&pDevice->EcLock);
+		}
+		return;
+	}
+
+	if (InterlockedExchange(&pDevice->EngineThrottleFired, 0)) {
+		CrosEcEngineUnthrottle(pDevice);
+	}
+
+	while (TRUE) {
+		if (pDevice->EngineCurrent) {
+			if (ec_command_busy()) {
+				ULONGLONG elapsed = (KeQueryInterruptTime() - pDevice->EngineSubmitTime) / 10;
+
+				if (elapsed < pDevice->EngineSpinUs) {
+					KeStallExecutionProcessor(1);
+					continue;
+				}
+
+				if (elapsed < pDevice->EngineTimeoutUs) {
+					//Give the thread back; the timer or the EC interrupt brings us back
+					WdfTimerStart(pDevice->EnginePollTimer, WDF_REL_TIMEOUT_IN_US(pDevice->EnginePollDelay));
+					pDevice->EnginePollDelay = min(pDevice->EnginePollDelay * 2, CROSEC_ENGINE_MAX_POLL_US);
+					return;
+				}
+
+				CrosEcBusPrint(DEBUG_LEVEL_INFO, DBG_IOCTL,
+					"Timeout waiting for EC response\n");
+				CrosEcEngineFinish(pDevice, -EC_RES_ERROR);
+				continue;
+			}
+
+			CrosEcEngineComplete(pDevice);
+			continue;
+		}
+
+		//Nothing new goes to the EC once the engine is stopping
+		if (pDevice->EngineStopped) {
+			return;
+		}
+
+		if (InterlockedExchange(&pDevice->EngineStatusFired, 0)) {
+			pDevice->EngineStatusDue = TRUE;
+		}
+		BOOLEAN pollDue = pDevice->EngineInProgress && pDevice->EngineStatusDue;
+
+		//Only queue for the EC when there's something to send, but always take a grant
+		ULONG queued = CrosEcEngineQueued(pDevice);
+		if (!queued && !pollDue && pDevice->EngineWaiter.State != CrosEcLockWaiterGranted) {
+			return;
+		}
+
+		//Kicked again once the arbiter hands us the EC
+		if (!CrosEcLockAcquireAsync(&pDevice->EcLock, &pDevice->EngineWaiter)) {
+			return;
+		}
+
+		if (pollDue) {
+			pDevice->EngineStatusDue = FALSE;
+			CrosEcEnginePollInProgress(pDevice);
+			continue;
+		}
+
+		if (!CrosEcEngineStart(pDevice)) {
+			CrosEcLockRelease(&pDevice->EcLock);
+			return;
+		}
+	}
+}
+
+VOID CrosEcEngineDrain(_In_ PCROSECBUS_CONTEXT pDevice) {
+	LARGE_INTEGER delay;
+
+	InterlockedExchange(&pDevice->EngineStopped, TRUE);
+
+	//A stopped engine doesn't arm the timers, and they only kick the work item
+	WdfWorkItemFlush(pDevice->EngineWorkItem);
+	WdfTimerStop(pDevice->EnginePollTimer, TRUE);
+	WdfTimerStop(pDevice->EngineThrottleTimer, TRUE);
+	WdfTimerStop(pDevice->EngineStatusTimer, TRUE);
+	WdfWorkItemFlush(pDevice->EngineWorkItem);
+	pDevice->EngineThrottleDue = 0;
+	pDevice->EngineStatusDue = FALSE;
+	InterlockedExchange(&pDevice->EngineStatusFired, 0);
+
+	//A command on the EC can't be called back; wait it out as the work item would
+	delay.QuadPart = -10LL * CROSEC_ENGINE_MIN_POLL_US;
+	while (pDevice->EngineCurrent) {
+		ULONGLONG elapsed = (KeQueryInterruptTime() - pDevice->EngineSubmitTime) / 10;
+
+		if (!ec_command_busy()) {
+			CrosEcEngineComplete(pDevice);
+		}
+		else if (elapsed < pDevice->EngineTimeoutUs) {
+			KeDelayExecutionThread(KernelMode, FALSE, &delay);
+		}
+		else {
+			CrosEcBusPrint(DEBUG_LEVEL_INFO, DBG_IOCTL,
+				"Timeout waiting for EC response\n");
+			CrosEcEngineFinish(pDevice, -EC_RES_ERROR);
+		}
+	}
+
+	//A parked command goes back to its caller to poll for, as an async one would
+	PCROSEC_FLIGHT flight;
+	WDFREQUEST request = CrosEcEngineTakeInProgress(pDevice, &flight);
+	CrosEcEngineLand(pDevice, flight, NULL, -EECRESULT - EC_RES_IN_PROGRESS);
+	if (request) {
+		WdfRequestComplete(request, CrosECIoctlXCmdFinish(request, -EECRESULT - EC_RES_IN_PROGRESS));
+	}
+}
+
+VOID CrosEcEngineResume(_In_ PCROSECBUS_CONTEXT pDevice) {
+	InterlockedExchange(&pDevice->EngineStopped, FALSE);
+
+	//Pick up whatever queued or was throttled while stopped
+	InterlockedExchange(&pDevice->EngineThrottleFired, 1);
+	CrosEcEngineKick(pDevice);
+}
+
+VOID CrosEcEngineEvtWorkItem(_In_ WDFWORKITEM WorkItem) {
+	PCROSECBUS_CONTEXT pDevice = GetDeviceContext(WdfWorkItemGetParentObject(WorkItem));
+	LONG kicks = pDevice->EngineKicks;
+
+	do {
+		CrosEcEngineRun(pDevice);
+		kicks = InterlockedAdd(&pDevice->EngineKicks, -kicks);
+	} while (kicks != 0);
+}
+
+VOID CrosEcEngineEvtTimer(_In_ WDFTIMER Timer) {
+	CrosEcEngineKick(GetDeviceContext(WdfTimerGetParentObject(Timer)));
+}
+
+VOID CrosEcEngineEvtThrottleTimer(_In_ WDFTIMER Timer) {
+	PCROSECBUS_CONTEXT pDevice = GetDeviceContext(WdfTimerGetParentObject(Timer));
+
+	InterlockedExchange(&pDevice->EngineThrottleFired, 1);
+	CrosEcEngineKick(pDevice);
+}
+
+VOID CrosEcEngineEvtStatusTimer(_In_ WDFTIMER Timer) {
+	PCROSECBUS_CONTEXT pDevice = GetDeviceContext(WdfTimerGetParentObject(Timer));
+
+	InterlockedExchange(&pDevice->EngineStatusFired, 1);
+	CrosEcEngineKick(pDevice);
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+//
+// Userspace host commands (IOCTL_CROSEC_XCMD) don't tie up a worker thread
+// each. Validated requests are parked on a manual queue and a single owner,
+// a work item re-armed by a timer while the EC is busy, submits each command,
+// polls for completion and completes the request.
+//
+// The engine waits for EcLock as a userspace-class waiter without blocking,
+// and holds it from submit to complete.
+//
+// Each command is charged to its handle's quota and to the device-wide one
+// (ecQuota.h). Requests that are over either quota move to a throttled queue
+// and are put back on the pending queue by a timer once both have bus time
+// again.
+//
+// A command that returns EC_RES_IN_PROGRESS is parked off the bus, and the
+// engine polls the EC for it every EC_IN_PROGRESS_POLL_USEC in between other
+// commands. IOCTL_CROSEC_XCMD_ASYNC requests complete straight away with
+// CROSEC_STATUS_IN_PROGRESS instead.
+//
+// Requests are queued per passthrough target (passthru.h). Local EC commands
+// are started before any passthrough, and each command is timed out after
+// ec_command_timeout, the same limit wait_for_ec uses.
+//
+// Read-only commands lead a flight (singleFlight.h) while they're on the EC;
+// identical XCMD requests that come in meanwhile are attached to it and
+// completed with its response rather than queued.
+//
+// Requests parked off the bus, on EC_RES_IN_PROGRESS or attached to a
+// flight, are cancelable. Queued and throttled ones sit in manual queues, so
+// the framework cancels those. The queues aren't power managed; instead
+// D0Exit drains the engine, and requests that queue meanwhile wait for
+// D0Entry to resume it.
+//
+
+#define CROSEC_ENGINE_SPIN_US        50      // Poll inline this long before arming the timer
+#define CROSEC_ENGINE_MIN_POLL_US    100
+#define CROSEC_ENGINE_MAX_POLL_US    10000
+
+NTSTATUS CrosEcEngineInit(_In_ WDFDEVICE Device);
+
+// Hands a validated XCMD request to the engine, which completes it
+NTSTATUS CrosEcEngineSubmit(
+	_In_ PCROSECBUS_CONTEXT pDevice,
+	_In_ WDFREQUEST Request);
+
+// Let the engine run, e.g. it was granted the EC or the EC raised an interrupt
+VOID CrosEcEngineKick(_In_ PCROSECBUS_CONTEXT pDevice);
+
+// Stops the engine for D0Exit and removal. Waits out the command on the EC
+// and hands one parked on EC_RES_IN_PROGRESS back to its caller, who polls
+// for it like an async one.
+VOID CrosEcEngineDrain(_In_ PCROSECBUS_CONTEXT pDevice);
+
+VOID CrosEcEngineResume(_In_ PCROSECBUS_CONTEXT pDevice);
+
+// For EvtIoStop: completes Request with STATUS_CANCELLED if it's parked on
+// EC_RES_IN_PROGRESS or attached to a flight; FALSE if it's neither
+BOOLEAN CrosEcEngineCancel(
+	_In_ PCROSECBUS_CONTEXT pDevice,
+	_In_ WDFREQUEST Request);
+
+// Cancel routine for requests attached to a flight
+EVT_WDF_REQUEST_CANCEL CrosEcEngineEvtFlightCancel;
@@ -0,0 +1,153 @@
+#include "driver.h"
+
+VOID CrosEcLockInit(_Out_ PCROSEC_LOCK Lock) {
+	RtlZeroMemory(Lock, sizeof(*Lock));
+	KeInitializeSpinLock(&Lock->SpinLock);
+
+	for (int i = 0; i < CrosEcLockClassCount; i++) {
+		InitializeListHead(&Lock->Waiters[i]);
+	}
+}
+
+static VOID CrosEcLockAccount(
+	_Inout_ PCROSEC_LOCK Lock,
+	_In_ CROSEC_LOCK_CLASS Class,
+	_In_ ULONGLONG QueuedAt)
+{
+	PCROSEC_LOCK_CLASS_STATS stats = &Lock->Stats[Class];
+	ULONG64 waitUs = 0;
+
+	Lock->Owner = Class;
+	stats->Acquisitions++;
+	if (QueuedAt) {
+		waitUs = (KeQueryInterruptTime() - QueuedAt) / 10;
+
+		stats->Contended++;
+		stats->TotalWaitUs += waitUs;
+		if (waitUs > stats->MaxWaitUs)
+			stats->MaxWaitUs = waitUs;
+	}
+
+	CrosEcTrace(CrosEcTraceLockAcquire, Class, waitUs, 0);
+}
+
+//Called with the spinlock held and the lock changing hands
+static PCROSEC_LOCK_WAITER CrosEcLockPickNext(_Inout_ PCROSEC_LOCK Lock) {
+	int pick = -1;
+
+	//Highest priority first, unless a lower class has been passed over too often
+	for (int i = 0; i < CrosEcLockClassCount; i++) {
+		if (IsListEmpty(&Lock->Waiters[i]))
+			continue;
+
+		if (pick < 0)
+			pick = i;
+
+		if (Lock->Bypassed[i] >= CROSEC_LOCK_MAX_BYPASS) {
+			pick = i;
+			break;
+		}
+	}
+
+	if (pick < 0)
+		return NULL;
+
+	for (int i = 0; i < CrosEcLockClassCount; i++) {
+		if (i != pick && !IsListEmpty(&Lock->Waiters[i]))
+			Lock->Bypassed[i]++;
+	}
+	Lock->Bypassed[pick] = 0;
+
+	PCROSEC_LOCK_WAITER waiter = CONTAINING_RECORD(RemoveHeadList(&Lock->Waiters[pick]), CROSEC_LOCK_WAITER, Entry);
+	waiter->State = CrosEcLockWaiterGranted;
+	CrosEcLockAccount(Lock, waiter->Class, waiter->QueuedAt);
+	return waiter;
+}
+
+VOID CrosEcLockAcquire(
+	_Inout_ PCROSEC_LOCK Lock,
+	_In_ CROSEC_LOCK_CLASS Class)
+{
+	CROSEC_LOCK_WAITER waiter;
+	KIRQL irql;
+
+	KeAcquireSpinLock(&Lock->SpinLock, &irql);
+	if (!Lock->Held) {
+		Lock->Held = TRUE;
+		CrosEcLockAccount(Lock, Class, 0);
+		KeReleaseSpinLock(&Lock->SpinLock, irql);
+		return;
+	}
+
+	waiter.Class = Class;
+	waiter.State = CrosEcLockWaiterQueued;
+	waiter.QueuedAt = KeQueryInterruptTime();
+	waiter.OnGrant = NULL;
+	KeInitializeEvent(&waiter.Event, NotificationEvent, FALSE);
+	InsertTailList(&Lock->Waiters[Class], &waiter.Entry);
+	KeReleaseSpinLock(&Lock->SpinLock, irql);
+
+	//Ownership is handed over by CrosEcLockRelease before the event is set
+	KeWaitForSingleObject(&waiter.Event, Executive, KernelMode, FALSE, NULL);
+}
+
+BOOLEAN CrosEcLockAcquireAsync(
+	_Inout_ PCROSEC_LOCK Lock,
+	_Inout_ PCROSEC_LOCK_WAITER Waiter)
+{
+	BOOLEAN held = FALSE;
+	KIRQL irql;
+
+	KeAcquireSpinLock(&Lock->SpinLock, &irql);
+	if (Waiter->State == CrosEcLockWaiterGranted) {
+		Waiter->State = CrosEcLockWaiterIdle;
+		held = TRUE;
+	}
+	else if (Waiter->State == CrosEcLockWaiterIdle) {
+		if (!Lock->Held) {
+			Lock->Held = TRUE;
+			CrosEcLockAccount(Lock, Waiter->Class, 0);
+			held = TRUE;
+		}
+		else {
+			Waiter->State = CrosEcLockWaiterQueued;
+			Waiter->QueuedAt = KeQueryInterruptTime();
+			InsertTailList(&Lock->Waiters[Waiter->Class], &Waiter->Entry);
+		}
+	}
+	KeReleaseSpinLock(&Lock->SpinLock, irql);
+
+	return held;
+}
+
+VOID CrosEcLockRelease(_Inout_ PCROSEC_LOCK Lock) {
+	PCROSEC_LOCK_WAITER next;
+	KIRQL irql;
+
+	KeAcquireSpinLock(&Lock->SpinLock, &irql);
+	CrosEcTrace(CrosEcTraceLockRelease, Lock->Owner, 0, 0);
+	next = CrosEcLockPickNext(Lock);
+	if (!next) {
+		Lock->Held = FALSE;
+	}
+	KeReleaseSpinLock(&Lock->SpinLock, irql);
+
+	if (next) {
+		//A blocking waiter's frame may be gone once its event is set, so don't touch it after
+		if (next->OnGrant)
+			next->OnGrant(next->Context);
+		else
+			KeSetEvent(&next->Event, IO_NO_INCREMENT, FALSE);
+	}
+}
+
+VOID CrosEcLockQueryStats(
+	_In_ PCROSEC_LOCK Lock,
+	_Out_writes_(CrosEcLockClassCount) PCROSEC_LOCK_CLASS_STATS Stats)
+{
+	KIRQL irql;
+
+	KeAcquireSpinLock(&Lock->SpinLock, &irql);
+	RtlCopyMemory(Stats, Lock->Stats, sizeof(Lock->Stats));
+	KeReleaseSpinLock(&Lock->SpinLock, irql);
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+//
+// Arbitration for the EC. Waiters are granted in priority order (ISR, then
+// kernel, then userspace), but a class that has been passed over
+// CROSEC_LOCK_MAX_BYPASS times in a row goes next, so nobody waits forever.
+// The lock is handed straight to the next waiter on release and may be
+// released from a different thread than acquired it.
+//
+
+typedef enum _CROSEC_LOCK_CLASS {
+	CrosEcLockClassIsr = 0,  // Host event handling in OnInterruptIsr
+	CrosEcLockClassKernel,   // Child drivers and power callbacks
+	CrosEcLockClassUser,     // IOCTL_CROSEC_XCMD through the engine
+	CrosEcLockClassCount
+} CROSEC_LOCK_CLASS;
+
+#define CROSEC_LOCK_MAX_BYPASS 4
+
+typedef VOID(*PCROSEC_LOCK_GRANTED)(PVOID Context);
+
+typedef enum _CROSEC_LOCK_WAITER_STATE {
+	CrosEcLockWaiterIdle = 0,
+	CrosEcLockWaiterQueued,
+	CrosEcLockWaiterGranted  // Handed the lock; the next CrosEcLockAcquireAsync takes it
+} CROSEC_LOCK_WAITER_STATE;
+
+typedef struct _CROSEC_LOCK_WAITER {
+	LIST_ENTRY Entry;
+	CROSEC_LOCK_CLASS Class;
+	volatile CROSEC_LOCK_WAITER_STATE State;
+	ULONGLONG QueuedAt;
+	KEVENT Event;                 // Blocking waiters
+	PCROSEC_LOCK_GRANTED OnGrant; // Waiters that can't block
+	PVOID Context;
+} CROSEC_LOCK_WAITER, *PCROSEC_LOCK_WAITER;
+
+typedef struct _CROSEC_LOCK_CLASS_STATS {
+	ULONG64 Acquisitions;
+	ULONG64 Contended;   // Acquisitions that had to wait
+	ULONG64 TotalWaitUs;
+	ULONG64 MaxWaitUs;
+} CROSEC_LOCK_CLASS_STATS, *PCROSEC_LOCK_CLASS_STATS;
+
+typedef struct _CROSEC_LOCK {
+	KSPIN_LOCK SpinLock;
+	BOOLEAN Held;
+	CROSEC_LOCK_CLASS Owner; // Class of the holder, while Held
+	LIST_ENTRY Waiters[CrosEcLockClassCount];
+	ULONG Bypassed[CrosEcLockClassCount];
+	CROSEC_LOCK_CLASS_STATS Stats[CrosEcLockClassCount];
+} CROSEC_LOCK, *PCROSEC_LOCK;
+
+VOID CrosEcLockInit(_Out_ PCROSEC_LOCK Lock);
+
+VOID CrosEcLockAcquire(
+	_Inout_ PCROSEC_LOCK Lock,
+	_In_ CROSEC_LOCK_CLASS Class);
+
+//
+// For callers that can't block. Returns TRUE if the lock is held. Otherwise
+// Waiter (Class, OnGrant and Context filled in) is queued, OnGrant runs once
+// the lock has been handed to it, and the next call returns TRUE.
+//
+BOOLEAN CrosEcLockAcquireAsync(
+	_Inout_ PCROSEC_LOCK Lock,
+	_Inout_ PCROSEC_LOCK_WAITER Waiter);
+
+VOID CrosEcLockRelease(_Inout_ PCROSEC_LOCK Lock);
+
+VOID CrosEcLockQueryStats(
+	_In_ PCROSEC_LOCK Lock,
+	_Out_writes_(CrosEcLockClassCount) PCROSEC_LOCK_CLASS_STATS Stats);
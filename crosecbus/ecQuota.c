@@ -0,0 +1,93 @@
+#include "driver.h"
+
+static ULONG CrosEcBusDebugLevel = 100;
+static ULONG CrosEcBusDebugCatagories = DBG_INIT || DBG_PNP || DBG_IOCTL;
+
+#define CROSEC_QUOTA_MAX_REFILL (100ULL * 10000000) // 100s, more than any bucket needs to fill
+
+static VOID CrosEcQuotaReadConfig(
+	_In_ WDFDEVICE Device,
+	_In_ PCUNICODE_STRING RateName,
+	_In_ PCUNICODE_STRING BurstName,
+	_Out_ PCROSEC_QUOTA_CONFIG Config)
+{
+	ULONG value;
+
+	if (NT_SUCCESS(CrosEcBusReadSetting(Device, RateName, &value))) {
+		Config->RateUs = min(value, 1000000);
+	}
+	if (NT_SUCCESS(CrosEcBusReadSetting(Device, BurstName, &value))) {
+		Config->BurstUs = max(value, CROSEC_QUOTA_MIN_BURST_US);
+	}
+}
+
+VOID CrosEcQuotaLoadConfig(
+	_In_ WDFDEVICE Device,
+	_Out_ PCROSEC_QUOTA_CONFIG Config,
+	_Out_ PCROSEC_QUOTA_CONFIG Total)
+{
+	DECLARE_CONST_UNICODE_STRING(rateName, L"XcmdQuotaRateUs");
+	DECLARE_CONST_UNICODE_STRING(burstName, L"XcmdQuotaBurstUs");
+	DECLARE_CONST_UNICODE_STRING(totalRateName, L"XcmdQuotaTotalRateUs");
+	DECLARE_CONST_UNICODE_STRING(totalBurstName, L"XcmdQuotaTotalBurstUs");
+
+	Config->RateUs = CROSEC_QUOTA_DEFAULT_RATE_US;
+	Config->BurstUs = CROSEC_QUOTA_DEFAULT_BURST_US;
+	CrosEcQuotaReadConfig(Device, &rateName, &burstName, Config);
+
+	Total->RateUs = CROSEC_QUOTA_DEFAULT_TOTAL_RATE_US;
+	Total->BurstUs = CROSEC_QUOTA_DEFAULT_TOTAL_BURST_US;
+	CrosEcQuotaReadConfig(Device, &totalRateName, &totalBurstName, Total);
+
+	CrosEcBusPrint(DEBUG_LEVEL_INFO, DBG_PNP, "XCMD quota: %u us/s, burst %u us per handle; %u us/s, burst %u us in all\n",
+		Config->RateUs, Config->BurstUs, Total->RateUs, Total->BurstUs);
+}
+
+VOID CrosEcQuotaInitBucket(
+	_In_ PCROSEC_QUOTA_CONFIG Config,
+	_Out_ PCROSEC_QUOTA_BUCKET Bucket)
+{
+	Bucket->TokensUs = Config->BurstUs;
+	Bucket->LastRefill = KeQueryInterruptTime();
+	Bucket->Throttled = 0;
+}
+
+BOOLEAN CrosEcQuotaAdmit(
+	_In_ PCROSEC_QUOTA_CONFIG Config,
+	_Inout_ PCROSEC_QUOTA_BUCKET Bucket)
+{
+	if (!Config->RateUs) {
+		return TRUE;
+	}
+
+	ULONGLONG now = KeQueryInterruptTime();
+	ULONGLONG elapsed = min(now - Bucket->LastRefill, CROSEC_QUOTA_MAX_REFILL);
+	LONGLONG earned = (LONGLONG)((elapsed * Config->RateUs) / 10000000);
+
+	//Leave LastRefill alone until a whole token is earned so short gaps add up
+	if (earned) {
+		Bucket->TokensUs = min(Bucket->TokensUs + earned, (LONGLONG)Config->BurstUs);
+		Bucket->LastRefill = now;
+	}
+
+	return Bucket->TokensUs > 0;
+}
+
+VOID CrosEcQuotaCharge(
+	_Inout_ PCROSEC_QUOTA_BUCKET Bucket,
+	_In_ ULONG64 BusUs)
+{
+	Bucket->TokensUs -= (LONGLONG)BusUs;
+}
+
+ULONG CrosEcQuotaDelayUs(
+	_In_ PCROSEC_QUOTA_CONFIG Config,
+	_In_ PCROSEC_QUOTA_BUCKET Bucket)
+{
+	if (!Config->RateUs || Bucket->TokensUs > 0) {
+		return 0;
+	}
+
+	ULONG64 owed = (ULONG64)(1 - Bucket->TokensUs);
+	return (ULONG)min(owed * 1000000 / Config->RateUs, 1000000);
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+//
+// Per-handle quotas on EC bus time for IOCTL_CROSEC_XCMD. Each file object
+// has a token bucket of bus microseconds that refills at RateUs per second
+// up to BurstUs. Commands are charged for the time they actually held the
+// bus, so a handle may go into debt; while its balance isn't positive the
+// engine parks its requests until the bucket refills.
+//
+// Per-handle buckets alone don't bound userspace as a whole, since every new
+// handle starts with a full bucket. A second bucket on the device is charged
+// for every XCMD command as well, and a request waits until both its handle's
+// bucket and the device's are positive.
+//
+// Defaults come from the Settings key (XcmdQuotaRateUs, XcmdQuotaBurstUs, and
+// XcmdQuotaTotalRateUs, XcmdQuotaTotalBurstUs for the device). A rate of 0
+// turns that quota off. Bursts are at least CROSEC_QUOTA_MIN_BURST_US, since a
+// bucket that can't hold a token never admits anything.
+//
+
+#define CROSEC_QUOTA_DEFAULT_RATE_US  250000 // A quarter of the bus per handle
+#define CROSEC_QUOTA_DEFAULT_BURST_US 100000
+#define CROSEC_QUOTA_MIN_BURST_US     1000   // About one command's worth of bus time
+
+#define CROSEC_QUOTA_DEFAULT_TOTAL_RATE_US  500000 // Half the bus for all handles together
+#define CROSEC_QUOTA_DEFAULT_TOTAL_BURST_US 100000
+
+typedef struct _CROSEC_QUOTA_CONFIG {
+	ULONG RateUs;  // Bus time earned per second
+	ULONG BurstUs; // Most a handle can save up
+} CROSEC_QUOTA_CONFIG, *PCROSEC_QUOTA_CONFIG;
+
+typedef struct _CROSEC_QUOTA_BUCKET {
+	LONGLONG TokensUs;
+	ULONGLONG LastRefill; // Interrupt time of the last whole token added
+	ULONG64 Throttled;    // Requests that had to wait for tokens
+} CROSEC_QUOTA_BUCKET, *PCROSEC_QUOTA_BUCKET;
+
+// Config is for each handle, Total for the device-wide bucket
+VOID CrosEcQuotaLoadConfig(
+	_In_ WDFDEVICE Device,
+	_Out_ PCROSEC_QUOTA_CONFIG Config,
+	_Out_ PCROSEC_QUOTA_CONFIG Total);
+
+VOID CrosEcQuotaInitBucket(
+	_In_ PCROSEC_QUOTA_CONFIG Config,
+	_Out_ PCROSEC_QUOTA_BUCKET Bucket);
+
+// Refills the bucket; returns TRUE if the handle may use the bus now
+BOOLEAN CrosEcQuotaAdmit(
+	_In_ PCROSEC_QUOTA_CONFIG Config,
+	_Inout_ PCROSEC_QUOTA_BUCKET Bucket);
+
+VOID CrosEcQuotaCharge(
+	_Inout_ PCROSEC_QUOTA_BUCKET Bucket,
+	_In_ ULONG64 BusUs);
+
+// Microseconds until a bucket that failed CrosEcQuotaAdmit is positive again
+ULONG CrosEcQuotaDelayUs(
+	_In_ PCROSEC_QUOTA_CONFIG Config,
+	_In_ PCROSEC_QUOTA_BUCKET Bucket);
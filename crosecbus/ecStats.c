@@ -0,0 +1,147 @@
+#include "driver.h"
+#include "comm-host.h"
+
+#define CROSEC_STATS_ENTRIES (CROSEC_STATS_SLOTS + 1) // Plus the overflow slot
+
+NTSTATUS CrosEcStatsInit(_Out_ PCROSEC_STATS Stats) {
+	RtlZeroMemory(Stats, sizeof(*Stats));
+
+	Stats->ShardCount = KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS);
+	//Keep neighbouring CPUs off each other's cache lines
+	Stats->ShardStride = ALIGN_UP_BY(CROSEC_STATS_ENTRIES * sizeof(CROSEC_COMMAND_STATS), SYSTEM_CACHE_ALIGNMENT_SIZE);
+
+	PUCHAR shards = (PUCHAR)ExAllocatePoolWithTag(NonPagedPool, Stats->ShardCount * Stats->ShardStride, CROSECBUS_POOL_TAG);
+	if (!shards) {
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+	RtlZeroMemory(shards, Stats->ShardCount * Stats->ShardStride);
+
+	Stats->Shards = shards;
+	return STATUS_SUCCESS;
+}
+
+VOID CrosEcStatsFree(_Inout_ PCROSEC_STATS Stats) {
+	PUCHAR shards = Stats->Shards;
+
+	Stats->Shards = NULL;
+	if (shards) {
+		ExFreePoolWithTag(shards, CROSECBUS_POOL_TAG);
+	}
+}
+
+static ULONG CrosEcStatsSlot(
+	_Inout_ PCROSEC_STATS Stats,
+	_In_ UINT16 Command)
+{
+	LONG tag = (LONG)Command + 1;
+	ULONG hash = (Command * 0x9E37u) >> 3;
+
+	for (ULONG i = 0; i < CROSEC_STATS_SLOTS; i++) {
+		ULONG index = (hash + i) & (CROSEC_STATS_SLOTS - 1);
+		LONG current = ReadNoFence(&Stats->SlotCommands[index]);
+
+		if (current == 0) {
+			current = InterlockedCompareExchange(&Stats->SlotCommands[index], tag, 0);
+			if (current == 0) {
+				return index;
+			}
+		}
+		if (current == tag) {
+			return index;
+		}
+	}
+
+	return CROSEC_STATS_SLOTS;
+}
+
+static ULONG CrosEcStatsBucket(_In_ ULONG64 Us) {
+	ULONG bit;
+
+	if (!_BitScanReverse64(&bit, Us)) {
+		return 0;
+	}
+	return min(bit + 1, CROSEC_STATS_LATENCY_BUCKETS - 1);
+}
+
+VOID CrosEcStatsRecord(
+	_Inout_ PCROSEC_STATS Stats,
+	_In_ UINT16 Command,
+	_In_ ULONG BytesOut,
+	_In_ int Result,
+	_In_ ULONG64 LockWaitUs,
+	_In_ ULONG64 TotalUs)
+{
+	PUCHAR shards = Stats->Shards;
+	if (!shards) {
+		return;
+	}
+
+	//We may move to another CPU partway through; the adds are interlocked so that's harmless
+	ULONG cpu = KeGetCurrentProcessorNumberEx(NULL) % Stats->ShardCount;
+	PCROSEC_COMMAND_STATS c = (PCROSEC_COMMAND_STATS)(shards + cpu * Stats->ShardStride) +
+		CrosEcStatsSlot(Stats, Command);
+
+	InterlockedIncrement64((LONG64*)&c->Calls);
+	InterlockedAdd64((LONG64*)&c->BytesOut, BytesOut);
+	InterlockedAdd64((LONG64*)&c->LockWaitUs, LockWaitUs);
+	InterlockedAdd64((LONG64*)&c->TotalUs, TotalUs);
+	InterlockedIncrement64((LONG64*)&c->Latency[CrosEcStatsBucket(TotalUs)]);
+
+	if (Result >= 0) {
+		InterlockedAdd64((LONG64*)&c->BytesIn, Result);
+	}
+	else if (Result <= -EECRESULT) {
+		ULONG code = min((ULONG)(-EECRESULT - Result), CROSEC_STATS_EC_RESULTS - 1);
+		InterlockedIncrement64((LONG64*)&c->EcResults[code]);
+	}
+	else {
+		InterlockedIncrement64((LONG64*)&c->HostErrors);
+	}
+}
+
+VOID CrosEcStatsReset(_Inout_ PCROSEC_STATS Stats) {
+	PUCHAR shards = Stats->Shards;
+	if (!shards) {
+		return;
+	}
+
+	//Each counter is cleared with a single store, so a concurrent add is either kept or lost whole
+	for (ULONG i = 0; i < Stats->ShardCount * Stats->ShardStride / sizeof(LONG64); i++) {
+		InterlockedExchange64((LONG64*)shards + i, 0);
+	}
+}
+
+BOOLEAN CrosEcStatsQuery(
+	_In_ PCROSEC_STATS Stats,
+	_In_ ULONG Index,
+	_Out_ PUINT32 Command,
+	_Out_ PCROSEC_COMMAND_STATS Counters)
+{
+	PUCHAR shards = Stats->Shards;
+
+	RtlZeroMemory(Counters, sizeof(*Counters));
+	if (Index < CROSEC_STATS_SLOTS) {
+		LONG tag = ReadNoFence(&Stats->SlotCommands[Index]);
+		if (!tag) {
+			return FALSE;
+		}
+		*Command = tag - 1;
+	}
+	else {
+		*Command = CROSEC_STATS_OTHER;
+	}
+
+	if (!shards) {
+		return TRUE;
+	}
+
+	for (ULONG cpu = 0; cpu < Stats->ShardCount; cpu++) {
+		const ULONG64* src = (const ULONG64*)((PCROSEC_COMMAND_STATS)(shards + cpu * Stats->ShardStride) + Index);
+		ULONG64* dst = (ULONG64*)Counters;
+
+		for (ULONG i = 0; i < sizeof(*Counters) / sizeof(ULONG64); i++) {
+			dst[i] += ReadNoFence64((const volatile LONG64*)&src[i]);
+		}
+	}
+	return TRUE;
+}
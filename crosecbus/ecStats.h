@@ -0,0 +1,61 @@
+#pragma once
+
+//
+// Per-command counters for everything sent to the EC: calls, failures by
+// EC_RES_* code, bytes each way, time spent waiting for the EC and a log2
+// histogram of end-to-end latency.
+//
+// Counters are sharded per CPU, and each caller adds to its current CPU's
+// shard with interlocked adds, so recording never takes a lock and rarely
+// shares a cache line. Readers sum the shards. Commands claim one of
+// CROSEC_STATS_SLOTS slots the first time they are seen; once those run out
+// the rest are counted together under CROSEC_STATS_OTHER.
+//
+
+#define CROSEC_STATS_SLOTS           32 // Power of 2
+#define CROSEC_STATS_EC_RESULTS      24 // EC_RES_* codes counted apiece; higher ones share the last
+#define CROSEC_STATS_LATENCY_BUCKETS 20 // Bucket n holds [2^(n-1), 2^n) us, the last is open-ended
+
+#define CROSEC_STATS_OTHER 0xFFFFFFFF
+
+typedef struct _CROSEC_COMMAND_STATS {
+	ULONG64 Calls;
+	ULONG64 HostErrors;  // Failed without an EC result (timeouts, bad responses)
+	ULONG64 BytesOut;
+	ULONG64 BytesIn;
+	ULONG64 LockWaitUs;  // Waiting for the EC before the command went out
+	ULONG64 TotalUs;
+	ULONG64 EcResults[CROSEC_STATS_EC_RESULTS]; // Failures by EC_RES_* code
+	ULONG64 Latency[CROSEC_STATS_LATENCY_BUCKETS];
+} CROSEC_COMMAND_STATS, *PCROSEC_COMMAND_STATS;
+
+typedef struct _CROSEC_STATS {
+	PUCHAR Shards;      // NULL until allocated; recording is skipped
+	ULONG ShardCount;
+	SIZE_T ShardStride;
+	volatile LONG SlotCommands[CROSEC_STATS_SLOTS]; // Command + 1, 0 if free
+} CROSEC_STATS, *PCROSEC_STATS;
+
+NTSTATUS CrosEcStatsInit(_Out_ PCROSEC_STATS Stats);
+
+VOID CrosEcStatsFree(_Inout_ PCROSEC_STATS Stats);
+
+// Result is what ec_command_proto returned
+VOID CrosEcStatsRecord(
+	_Inout_ PCROSEC_STATS Stats,
+	_In_ UINT16 Command,
+	_In_ ULONG BytesOut,
+	_In_ int Result,
+	_In_ ULONG64 LockWaitUs,
+	_In_ ULONG64 TotalUs);
+
+// Zeroes the counters; commands keep their slots
+VOID CrosEcStatsReset(_Inout_ PCROSEC_STATS Stats);
+
+// Sums the shards for slot Index (CROSEC_STATS_SLOTS is the overflow slot)
+// and sets *Command to its command or CROSEC_STATS_OTHER. FALSE if unused.
+BOOLEAN CrosEcStatsQuery(
+	_In_ PCROSEC_STATS Stats,
+	_In_ ULONG Index,
+	_Out_ PUINT32 Command,
+	_Out_ PCROSEC_COMMAND_STATS Counters);
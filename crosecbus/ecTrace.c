@@ -0,0 +1,119 @@
+#include "driver.h"
+
+PCROSEC_TRACE_RING CrosEcTraceRings;
+
+static ULONG CrosEcTraceCpuCount;
+static UINT64 CrosEcTraceTscStart;
+static UINT64 CrosEcTraceQpcStart;
+
+NTSTATUS CrosEcTraceStart(VOID) {
+	ULONG cpuCount = KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS);
+	SIZE_T size = cpuCount * sizeof(CROSEC_TRACE_RING);
+
+	PCROSEC_TRACE_RING rings = (PCROSEC_TRACE_RING)ExAllocatePoolWithTag(NonPagedPool, size, CROSECBUS_POOL_TAG);
+	if (!rings) {
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+	RtlZeroMemory(rings, size);
+
+	CrosEcTraceCpuCount = cpuCount;
+	CrosEcTraceQpcStart = KeQueryPerformanceCounter(NULL).QuadPart;
+	CrosEcTraceTscStart = ReadTimeStampCounter();
+
+	//Publish last; writers only look at the pointer
+	InterlockedExchangePointer((PVOID*)&CrosEcTraceRings, rings);
+	return STATUS_SUCCESS;
+}
+
+VOID CrosEcTraceStop(VOID) {
+	PCROSEC_TRACE_RING rings = (PCROSEC_TRACE_RING)InterlockedExchangePointer((PVOID*)&CrosEcTraceRings, NULL);
+
+	if (rings) {
+		ExFreePoolWithTag(rings, CROSECBUS_POOL_TAG);
+	}
+}
+
+VOID CrosEcTraceWrite(
+	_In_ CROSEC_TRACE_EVENT Event,
+	_In_ UINT16 Arg0,
+	_In_ UINT32 Arg1,
+	_In_ UINT32 Arg2)
+{
+	PCROSEC_TRACE_RING rings = CrosEcTraceRings;
+	if (!rings) {
+		return;
+	}
+
+	//Interlocked since we can be preempted by another writer on this CPU
+	PCROSEC_TRACE_RING ring = &rings[KeGetCurrentProcessorNumberEx(NULL) % CrosEcTraceCpuCount];
+	LONG64 position = InterlockedIncrement64(&ring->Head) - 1;
+	PCROSEC_TRACE_ENTRY entry = &ring->Entries[position & (CROSEC_TRACE_ENTRIES - 1)];
+
+	//Mark the slot busy first so a dump can't take a half-written entry for the old one
+	InterlockedExchange((volatile LONG*)&entry->Sequence, CROSEC_TRACE_BUSY);
+	entry->Tsc = ReadTimeStampCounter();
+	entry->Event = (UINT16)Event;
+	entry->Arg0 = Arg0;
+	entry->Arg1 = Arg1;
+	entry->Arg2 = Arg2;
+	WriteRelease((volatile LONG*)&entry->Sequence, (LONG)position);
+}
+
+NTSTATUS CrosEcTraceDump(
+	_Out_writes_bytes_(Length) PVOID Buffer,
+	_In_ SIZE_T Length,
+	_Out_ PSIZE_T Written)
+{
+	PCROSEC_TRACE_RING rings = CrosEcTraceRings;
+	PCROSEC_TRACE_HEADER header = (PCROSEC_TRACE_HEADER)Buffer;
+	LARGE_INTEGER frequency;
+
+	*Written = 0;
+	if (!rings) {
+		return STATUS_DEVICE_NOT_READY;
+	}
+	if (Length < sizeof(*header)) {
+		return STATUS_BUFFER_TOO_SMALL;
+	}
+
+	header->Magic = CROSEC_TRACE_MAGIC;
+	header->Version = CROSEC_TRACE_VERSION;
+	header->EntrySize = sizeof(CROSEC_TRACE_ENTRY);
+	header->CpuCount = CrosEcTraceCpuCount;
+	header->EntriesPerCpu = CROSEC_TRACE_ENTRIES;
+	header->TscStart = CrosEcTraceTscStart;
+	header->QpcStart = CrosEcTraceQpcStart;
+	header->QpcDump = KeQueryPerformanceCounter(&frequency).QuadPart;
+	header->TscDump = ReadTimeStampCounter();
+	header->QpcFrequency = frequency.QuadPart;
+
+	SIZE_T ringsSize = CrosEcTraceCpuCount * (sizeof(UINT64) + sizeof(rings->Entries));
+	if (Length < sizeof(*header) + ringsSize) {
+		*Written = sizeof(*header);
+		return STATUS_BUFFER_OVERFLOW;
+	}
+
+	//Heads first. A slot that was being written, or was rewritten while we
+	//copied it, goes out marked busy and the decoder counts it as torn.
+	PUINT64 heads = (PUINT64)(header + 1);
+	PCROSEC_TRACE_ENTRY entries = (PCROSEC_TRACE_ENTRY)(heads + CrosEcTraceCpuCount);
+	for (ULONG cpu = 0; cpu < CrosEcTraceCpuCount; cpu++) {
+		heads[cpu] = ReadAcquire64(&rings[cpu].Head);
+	}
+	for (ULONG cpu = 0; cpu < CrosEcTraceCpuCount; cpu++) {
+		for (ULONG i = 0; i < CROSEC_TRACE_ENTRIES; i++) {
+			PCROSEC_TRACE_ENTRY entry = &rings[cpu].Entries[i];
+			PCROSEC_TRACE_ENTRY copy = &entries[cpu * CROSEC_TRACE_ENTRIES + i];
+			LONG sequence = ReadAcquire((volatile LONG*)&entry->Sequence);
+
+			*copy = *entry;
+			MemoryBarrier();
+			if (ReadNoFence((volatile LONG*)&entry->Sequence) != sequence) {
+				copy->Sequence = CROSEC_TRACE_BUSY;
+			}
+		}
+	}
+
+	*Written = sizeof(*header) + ringsSize;
+	return STATUS_SUCCESS;
+}
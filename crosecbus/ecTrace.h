@@ -0,0 +1,94 @@
+#pragma once
+
+//
+// Binary event trace. Each CPU has a ring of fixed-size records stamped
+// with the TSC; writers claim a slot with an interlocked increment of their
+// CPU's head and fill it in, so tracing never takes a lock. When tracing is
+// off (the Trace setting is 0, the default) the rings aren't allocated and
+// CrosEcTrace costs a load and a branch.
+//
+// IOCTL_CROSEC_TRACE_DUMP copies out a CROSEC_TRACE_HEADER, the ring heads
+// and the rings. tools/crosec-trace.c turns that into a timeline.
+//
+// The format part of this header is shared with the tool, which defines
+// CROSEC_TRACE_FORMAT_ONLY and the UINT types itself.
+//
+
+#define CROSEC_TRACE_MAGIC   0x52544543 // 'CETR'
+#define CROSEC_TRACE_VERSION 1
+#define CROSEC_TRACE_ENTRIES 2048       // Per CPU, power of 2
+#define CROSEC_TRACE_BUSY    0xFFFFFFFF // Sequence of a slot that's being written
+
+// Event IDs are part of the dump format; only ever add to the end
+typedef enum _CROSEC_TRACE_EVENT {
+	CrosEcTraceCmdSubmit = 1,  // Arg0 command, Arg1 version, Arg2 bytes out
+	CrosEcTraceCmdComplete,    // Arg0 command, Arg1 result (ec_command_proto style), Arg2 bus us
+	CrosEcTraceLockAcquire,    // Arg0 CROSEC_LOCK_CLASS, Arg1 wait us
+	CrosEcTraceLockRelease,    // Arg0 CROSEC_LOCK_CLASS
+	CrosEcTraceInterrupt,      // EC interrupt taken
+	CrosEcTraceHostEvents,     // Arg1 host event mask
+	CrosEcTraceMkbpEvent,      // Arg0 event type, Arg1 first 4 bytes of its data
+	CrosEcTraceS0ixEnter,      // Arg1 NTSTATUS of the sleep event
+	CrosEcTraceS0ixExit,       // Arg1 NTSTATUS of the resume event
+	CrosEcTraceEventCount
+} CROSEC_TRACE_EVENT;
+
+typedef struct _CROSEC_TRACE_ENTRY {
+	UINT64 Tsc;
+	UINT32 Sequence; // Low 32 bits of the slot's position, written last; CROSEC_TRACE_BUSY before that
+	UINT16 Event;
+	UINT16 Arg0;
+	UINT32 Arg1;
+	UINT32 Arg2;
+} CROSEC_TRACE_ENTRY, *PCROSEC_TRACE_ENTRY;
+
+//
+// A dump is this header, then UINT64 Heads[CpuCount] (how many records each
+// CPU has written), then CpuCount rings of EntriesPerCpu records. The TSC
+// and QPC pairs let a decoder turn TSC values into time.
+//
+typedef struct _CROSEC_TRACE_HEADER {
+	UINT32 Magic;
+	UINT16 Version;
+	UINT16 EntrySize;
+	UINT32 CpuCount;
+	UINT32 EntriesPerCpu;
+	UINT64 QpcFrequency;
+	UINT64 TscStart;
+	UINT64 QpcStart;
+	UINT64 TscDump;
+	UINT64 QpcDump;
+} CROSEC_TRACE_HEADER, *PCROSEC_TRACE_HEADER;
+
+#ifndef CROSEC_TRACE_FORMAT_ONLY
+
+typedef struct _CROSEC_TRACE_RING {
+	volatile LONG64 Head;
+	CROSEC_TRACE_ENTRY Entries[CROSEC_TRACE_ENTRIES];
+} CROSEC_TRACE_RING, *PCROSEC_TRACE_RING;
+
+extern PCROSEC_TRACE_RING CrosEcTraceRings; // NULL while tracing is off
+
+NTSTATUS CrosEcTraceStart(VOID);
+
+// Only once nothing can be tracing (device cleanup)
+VOID CrosEcTraceStop(VOID);
+
+VOID CrosEcTraceWrite(
+	_In_ CROSEC_TRACE_EVENT Event,
+	_In_ UINT16 Arg0,
+	_In_ UINT32 Arg1,
+	_In_ UINT32 Arg2);
+
+#define CrosEcTrace(Event, Arg0, Arg1, Arg2) do {                      \
+	if (CrosEcTraceRings)                                              \
+		CrosEcTraceWrite((Event), (UINT16)(Arg0), (UINT32)(Arg1), (UINT32)(Arg2)); \
+} while (0)
+
+// STATUS_BUFFER_OVERFLOW with just the header if Buffer can't hold it all
+NTSTATUS CrosEcTraceDump(
+	_Out_writes_bytes_(Length) PVOID Buffer,
+	_In_ SIZE_T Length,
+	_Out_ PSIZE_T Written);
+
+#endif
@@ -580,6 +580,28 @@ struct ec_response_get_cmd_versions {
 };
 #include <poppack.h>
 
+/*
+ * Check EC communications status (busy). Used to poll for the end of a
+ * command that returned EC_RES_IN_PROGRESS.
+ */
+#define EC_CMD_GET_COMMS_STATUS		0x0009
+
+/* Avoid using ec_status which is for return values */
+enum ec_comms_status {
+	EC_COMMS_STATUS_PROCESSING	= (1 << 0),	/* Processing cmd */
+};
+
+#include <pshpack4.h>
+/**
+ * struct ec_response_get_comms_status - Response for the get comms
+ *         status command.
+ * @flags: Mask of enum ec_comms_status.
+ */
+struct ec_response_get_comms_status {
+	UINT32 flags;		/* Mask of enum ec_comms_status */
+};
+#include <poppack.h>
+
 /* Get protocol information */
 #define EC_CMD_GET_PROTOCOL_INFO	0x0b
 
@@ -0,0 +1,149 @@
+#include "driver.h"
+#include "comm-host.h"
+
+// Lines that only change when the EC reboots
+static const UINT8 sCrosEcStaticLines[] = {
+	EC_MEMMAP_ID / CROSEC_MEMMAP_LINE_SIZE,          // ID, versions, host command flags
+	EC_MEMMAP_BATT_MFGR / CROSEC_MEMMAP_LINE_SIZE,   // Battery manufacturer, model
+	EC_MEMMAP_BATT_SERIAL / CROSEC_MEMMAP_LINE_SIZE, // Battery serial, type
+};
+
+// Static lines that describe the battery, which can come and go
+static const UINT8 sCrosEcBatteryLines[] = {
+	EC_MEMMAP_BATT_MFGR / CROSEC_MEMMAP_LINE_SIZE,
+	EC_MEMMAP_BATT_SERIAL / CROSEC_MEMMAP_LINE_SIZE,
+};
+
+VOID CrosEcMemmapCacheInit(_Out_ PCROSEC_MEMMAP_CACHE Cache) {
+	RtlZeroMemory(Cache, sizeof(*Cache));
+	ExInitializeFastMutex(&Cache->RefillLock);
+
+	Cache->Ttl = CROSEC_MEMMAP_TTL_MS * 10000ULL;
+	Cache->Generation = 1; // Lines start at generation 0, i.e. never filled
+
+	for (int i = 0; i < ARRAYSIZE(sCrosEcStaticLines); i++) {
+		Cache->Lines[sCrosEcStaticLines[i]].Static = TRUE;
+	}
+	for (int i = 0; i < ARRAYSIZE(sCrosEcBatteryLines); i++) {
+		Cache->Lines[sCrosEcBatteryLines[i]].Battery = TRUE;
+	}
+}
+
+VOID CrosEcMemmapCacheInvalidate(_Inout_ PCROSEC_MEMMAP_CACHE Cache) {
+	InterlockedIncrement(&Cache->Generation);
+}
+
+VOID CrosEcMemmapCacheInvalidateVolatile(_Inout_ PCROSEC_MEMMAP_CACHE Cache) {
+	InterlockedIncrement(&Cache->VolatileGeneration);
+}
+
+VOID CrosEcMemmapCacheInvalidateBattery(_Inout_ PCROSEC_MEMMAP_CACHE Cache) {
+	InterlockedIncrement(&Cache->BatteryGeneration);
+}
+
+static BOOLEAN CrosEcMemmapLineValid(
+	_In_ PCROSEC_MEMMAP_CACHE Cache,
+	_In_ PCROSEC_MEMMAP_LINE Line,
+	_In_ ULONGLONG Now)
+{
+	if (Line->Generation != Cache->Generation)
+		return FALSE;
+
+	if (Line->Static)
+		return !Line->Battery || Line->BatteryGeneration == Cache->BatteryGeneration;
+
+	return Line->VolatileGeneration == Cache->VolatileGeneration &&
+		(Now - Line->FilledAt) < Cache->Ttl;
+}
+
+static BOOLEAN CrosEcMemmapCacheRefill(
+	_Inout_ PCROSEC_MEMMAP_CACHE Cache,
+	_In_ ULONG Index)
+{
+	PCROSEC_MEMMAP_LINE line = &Cache->Lines[Index];
+	BOOLEAN ok = TRUE;
+
+	ExAcquireFastMutex(&Cache->RefillLock);
+
+	// Sample the generations first so an invalidate during the read leaves the line stale
+	LONG generation = Cache->Generation;
+	LONG volatileGeneration = Cache->VolatileGeneration;
+	LONG batteryGeneration = Cache->BatteryGeneration;
+
+	if (!CrosEcMemmapLineValid(Cache, line, KeQueryInterruptTime())) {
+		INT start = Index * CROSEC_MEMMAP_LINE_SIZE;
+		INT len = min(CROSEC_MEMMAP_LINE_SIZE, EC_MEMMAP_SIZE - start);
+
+		InterlockedIncrement(&line->Sequence); // Odd: readers retry
+		if (ec_readmem(start, len, line->Data) == len) {
+			line->FilledAt = KeQueryInterruptTime();
+			line->Generation = generation;
+			line->VolatileGeneration = volatileGeneration;
+			line->BatteryGeneration = batteryGeneration;
+		}
+		else {
+			line->Generation = 0;
+			ok = FALSE;
+		}
+		InterlockedIncrement(&line->Sequence);
+	}
+
+	ExReleaseFastMutex(&Cache->RefillLock);
+	return ok;
+}
+
+INT CrosEcMemmapCacheRead(
+	_Inout_ PCROSEC_MEMMAP_CACHE Cache,
+	_In_ INT offset,
+	_In_ INT bytes,
+	_Out_ PVOID dest)
+{
+	PUINT8 out = (PUINT8)dest;
+	BOOLEAN isString = (bytes == 0);
+	INT end = isString ? EC_MEMMAP_SIZE : offset + bytes;
+	INT pos = offset;
+
+	if (offset < 0 || bytes < 0 || offset >= EC_MEMMAP_SIZE || end > EC_MEMMAP_SIZE)
+		return -1;
+
+	while (pos < end) {
+		ULONG index = pos / CROSEC_MEMMAP_LINE_SIZE;
+		PCROSEC_MEMMAP_LINE line = &Cache->Lines[index];
+		INT chunk = min(end, (INT)(index + 1) * CROSEC_MEMMAP_LINE_SIZE) - pos;
+		INT copied;
+
+		while (TRUE) {
+			LONG sequence = line->Sequence;
+			KeMemoryBarrier();
+
+			if ((sequence & 1) || !CrosEcMemmapLineValid(Cache, line, KeQueryInterruptTime())) {
+				if (!CrosEcMemmapCacheRefill(Cache, index))
+					return -1;
+				continue;
+			}
+
+			PUINT8 src = &line->Data[pos % CROSEC_MEMMAP_LINE_SIZE];
+			if (isString) {
+				for (copied = 0; copied < chunk; ) {
+					out[pos - offset + copied] = src[copied];
+					if (src[copied++] == '\0')
+						break;
+				}
+			}
+			else {
+				RtlCopyMemory(&out[pos - offset], src, chunk);
+				copied = chunk;
+			}
+
+			KeMemoryBarrier();
+			if (line->Sequence == sequence)
+				break;
+		}
+
+		pos += copied;
+		if (isString && out[pos - offset - 1] == '\0')
+			break;
+	}
+
+	return pos - offset;
+}
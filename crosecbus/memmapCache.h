@@ -0,0 +1,56 @@
+#pragma once
+
+//
+// Shadow copy of the EC memory map (EC_LPC_ADDR_MEMMAP) so frequent readers
+// don't go out to the bus. The map is split into lines; static lines are
+// kept until the EC restarts, the rest expire after a TTL or when a host
+// event or resume says they may have changed. The battery strings are static
+// too, but also go on a battery event, since the battery may have been
+// swapped or only just appeared.
+//
+// Readers are lock-free: each line carries a sequence count that is odd
+// while the line is being refilled, and a copy is retried if it changed.
+//
+
+#define CROSEC_MEMMAP_LINE_SIZE 16
+#define CROSEC_MEMMAP_LINES     16 // Covers EC_MEMMAP_SIZE (255) bytes
+
+#define CROSEC_MEMMAP_TTL_MS    100
+
+typedef struct _CROSEC_MEMMAP_LINE {
+	volatile LONG Sequence;
+	LONG Generation;
+	LONG VolatileGeneration;
+	LONG BatteryGeneration;
+	BOOLEAN Static;
+	BOOLEAN Battery; // Static, but dropped on battery events
+	ULONGLONG FilledAt;
+	UINT8 Data[CROSEC_MEMMAP_LINE_SIZE];
+} CROSEC_MEMMAP_LINE, *PCROSEC_MEMMAP_LINE;
+
+typedef struct _CROSEC_MEMMAP_CACHE {
+	FAST_MUTEX RefillLock;
+	ULONGLONG Ttl; // 100ns units
+	volatile LONG Generation;         // Bumped when the EC restarts
+	volatile LONG VolatileGeneration; // Bumped when the non-static lines may have changed
+	volatile LONG BatteryGeneration;  // Bumped when the battery strings may have changed
+	CROSEC_MEMMAP_LINE Lines[CROSEC_MEMMAP_LINES];
+} CROSEC_MEMMAP_CACHE, *PCROSEC_MEMMAP_CACHE;
+
+VOID CrosEcMemmapCacheInit(_Out_ PCROSEC_MEMMAP_CACHE Cache);
+
+// Drop everything, including static lines (EC reset or jump to another image)
+VOID CrosEcMemmapCacheInvalidate(_Inout_ PCROSEC_MEMMAP_CACHE Cache);
+
+// Drop all but the static lines (host events, resume)
+VOID CrosEcMemmapCacheInvalidateVolatile(_Inout_ PCROSEC_MEMMAP_CACHE Cache);
+
+// Drop the battery strings (EC_HOST_EVENT_BATTERY, BATTERY_STATUS)
+VOID CrosEcMemmapCacheInvalidateBattery(_Inout_ PCROSEC_MEMMAP_CACHE Cache);
+
+// Same contract as ec_readmem
+INT CrosEcMemmapCacheRead(
+	_Inout_ PCROSEC_MEMMAP_CACHE Cache,
+	_In_ INT offset,
+	_In_ INT bytes,
+	_Out_ PVOID dest);
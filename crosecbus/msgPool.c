@@ -0,0 +1,61 @@
+#include "driver.h"
+
+NTSTATUS CrosEcMsgPoolInit(
+	_Inout_ PCROSEC_MSG_POOL Pool,
+	_In_ SIZE_T DataSize)
+{
+	CrosEcMsgPoolFree(Pool);
+
+	Pool->DataSize = DataSize;
+	Pool->Stride = ALIGN_UP_BY(sizeof(CROSEC_COMMAND) + DataSize, MEMORY_ALLOCATION_ALIGNMENT);
+
+	Pool->Buffers = (PUINT8)ExAllocatePoolWithTag(NonPagedPool, CROSEC_MSG_POOL_DEPTH * Pool->Stride, CROSECBUS_POOL_TAG);
+	if (!Pool->Buffers) {
+		return STATUS_NO_MEMORY;
+	}
+	Pool->Free = (1L << CROSEC_MSG_POOL_DEPTH) - 1;
+
+	return STATUS_SUCCESS;
+}
+
+VOID CrosEcMsgPoolFree(_Inout_ PCROSEC_MSG_POOL Pool) {
+	if (Pool->Buffers) {
+		ExFreePoolWithTag(Pool->Buffers, CROSECBUS_POOL_TAG);
+		Pool->Buffers = NULL;
+	}
+	Pool->Free = 0;
+}
+
+PCROSEC_COMMAND CrosEcMsgAlloc(
+	_Inout_ PCROSEC_MSG_POOL Pool,
+	_In_ SIZE_T DataSize)
+{
+	if (Pool->Buffers && DataSize <= Pool->DataSize) {
+		LONG freeMask;
+		while ((freeMask = Pool->Free) != 0) {
+			ULONG index;
+			_BitScanForward(&index, (ULONG)freeMask);
+			if (InterlockedCompareExchange(&Pool->Free, freeMask & ~(1L << index), freeMask) == freeMask) {
+				return (PCROSEC_COMMAND)(Pool->Buffers + index * Pool->Stride);
+			}
+		}
+	}
+
+	//Pool exhausted or command too big, fall back to the heap
+	return (PCROSEC_COMMAND)ExAllocatePoolWithTag(NonPagedPool, sizeof(CROSEC_COMMAND) + DataSize, CROSECBUS_POOL_TAG);
+}
+
+VOID CrosEcMsgFree(
+	_Inout_ PCROSEC_MSG_POOL Pool,
+	_In_ PCROSEC_COMMAND Msg)
+{
+	PUINT8 p = (PUINT8)Msg;
+	if (Pool->Buffers && p >= Pool->Buffers &&
+		p < Pool->Buffers + CROSEC_MSG_POOL_DEPTH * Pool->Stride) {
+		ULONG index = (ULONG)((p - Pool->Buffers) / Pool->Stride);
+		InterlockedOr(&Pool->Free, 1L << index);
+		return;
+	}
+
+	ExFreePoolWithTag(Msg, CROSECBUS_POOL_TAG);
+}
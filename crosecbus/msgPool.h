@@ -0,0 +1,34 @@
+#pragma once
+
+//
+// Buffers for send_ec_command. Commands whose data fits in
+// CROSEC_MSG_STACK_SIZE bytes use one on the caller's stack, which covers
+// everything OnInterruptIsr sends. Larger ones take one of
+// CROSEC_MSG_POOL_DEPTH buffers sized for the negotiated packet limits when
+// the EC starts, and only go to the heap while all of those are in use.
+//
+
+#define CROSEC_MSG_STACK_SIZE 64
+#define CROSEC_MSG_POOL_DEPTH 4
+
+typedef struct _CROSEC_MSG_POOL {
+	PUINT8 Buffers;
+	SIZE_T Stride;
+	SIZE_T DataSize;
+	volatile LONG Free; // One bit per free buffer
+} CROSEC_MSG_POOL, *PCROSEC_MSG_POOL;
+
+// Drops any earlier buffers; DataSize is the largest command data to serve
+NTSTATUS CrosEcMsgPoolInit(
+	_Inout_ PCROSEC_MSG_POOL Pool,
+	_In_ SIZE_T DataSize);
+
+VOID CrosEcMsgPoolFree(_Inout_ PCROSEC_MSG_POOL Pool);
+
+PCROSEC_COMMAND CrosEcMsgAlloc(
+	_Inout_ PCROSEC_MSG_POOL Pool,
+	_In_ SIZE_T DataSize);
+
+VOID CrosEcMsgFree(
+	_Inout_ PCROSEC_MSG_POOL Pool,
+	_In_ PCROSEC_COMMAND Msg);
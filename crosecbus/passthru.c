@@ -0,0 +1,24 @@
+#include "driver.h"
+#include "comm-host.h"
+
+VOID CrosEcTargetRecord(
+	_Inout_updates_(CROSEC_EC_TARGETS) PCROSEC_TARGET_STATS Stats,
+	_In_ UINT16 Command,
+	_In_ ULONG64 BusUs,
+	_In_ int Result)
+{
+	PCROSEC_TARGET_STATS target = &Stats[CrosEcTargetOf(Command)];
+
+	target->Commands++;
+	target->TotalUs += BusUs;
+	if (BusUs > target->MaxUs) {
+		target->MaxUs = BusUs;
+	}
+
+	if (Result < 0) {
+		target->Errors++;
+		if (BusUs >= (ULONG64)ec_command_timeout(Command)) {
+			target->Timeouts++;
+		}
+	}
+}
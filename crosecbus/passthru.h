@@ -0,0 +1,35 @@
+#pragma once
+
+//
+// Commands at EC_CMD_PASSTHRU_OFFSET(n) are forwarded by the EC to a
+// sub-processor (1 is the PD MCU) and hold the bus for the whole round trip.
+// Traffic is split by target: the XCMD engine keeps a queue per target and
+// always runs local EC commands first, passthrough targets take turns, and
+// each target gets its own timeout (ec_command_timeout) and polling.
+//
+// Per-target latency is recorded for every command. Callers hold the EC
+// while recording, so the counters need no lock of their own.
+//
+
+#define CROSEC_EC_TARGETS 4 // The EC itself, then EC_CMD_PASSTHRU_OFFSET(1..3)
+
+#define CROSEC_PASSTHRU_MIN_POLL_US 1000 // Passthrough never answers within a few us
+
+typedef struct _CROSEC_TARGET_STATS {
+	ULONG64 Commands;
+	ULONG64 Errors;
+	ULONG64 Timeouts;
+	ULONG64 TotalUs;  // Time on the bus, submit to response
+	ULONG64 MaxUs;
+} CROSEC_TARGET_STATS, *PCROSEC_TARGET_STATS;
+
+// EC_CMD_PASSTHRU_OFFSET(n) is n << 14, so the target is the top two bits
+static __inline ULONG CrosEcTargetOf(_In_ UINT32 Command) {
+	return ((UINT16)Command >> 14) & (CROSEC_EC_TARGETS - 1);
+}
+
+VOID CrosEcTargetRecord(
+	_Inout_updates_(CROSEC_EC_TARGETS) PCROSEC_TARGET_STATS Stats,
+	_In_ UINT16 Command,
+	_In_ ULONG64 BusUs,
+	_In_ int Result);
@@ -0,0 +1,202 @@
+#include "driver.h"
+#include "ec_commands.h"
+
+#define CROSEC_CACHE_ANY_PARAMS 0xFF
+
+typedef struct _CROSEC_CACHEABLE_COMMAND {
+	UINT16 Command;
+	UINT8 MatchOffset; // Params byte that selects a subcommand, or CROSEC_CACHE_ANY_PARAMS
+	UINT8 MatchValue;
+} CROSEC_CACHEABLE_COMMAND;
+
+// Everything here must answer the same way until the EC restarts
+static const CROSEC_CACHEABLE_COMMAND sCrosEcCacheable[] = {
+	{ EC_CMD_GET_VERSION, CROSEC_CACHE_ANY_PARAMS, 0 },
+	{ EC_CMD_GET_CMD_VERSIONS, CROSEC_CACHE_ANY_PARAMS, 0 },
+	{ EC_CMD_GET_PROTOCOL_INFO, CROSEC_CACHE_ANY_PARAMS, 0 },
+	{ EC_CMD_GET_FEATURES, CROSEC_CACHE_ANY_PARAMS, 0 },
+	{ EC_CMD_GET_KEYBOARD_ID, CROSEC_CACHE_ANY_PARAMS, 0 },
+	{ EC_CMD_MKBP_INFO, FIELD_OFFSET(struct ec_params_mkbp_info, info_type), EC_MKBP_INFO_KBD },
+	{ EC_CMD_MKBP_INFO, FIELD_OFFSET(struct ec_params_mkbp_info, info_type), EC_MKBP_INFO_SUPPORTED },
+	{ EC_CMD_MOTION_SENSE_CMD, FIELD_OFFSET(struct ec_params_motion_sense, cmd), MOTIONSENSE_CMD_INFO },
+};
+
+static BOOLEAN CrosEcResponseCacheable(
+	_In_ UINT16 Command,
+	_In_reads_bytes_(ParamsSize) const UINT8* Params,
+	_In_ ULONG ParamsSize)
+{
+	if (ParamsSize > CROSEC_RESPONSE_CACHE_MAX_PARAMS) {
+		return FALSE;
+	}
+
+	for (int i = 0; i < ARRAYSIZE(sCrosEcCacheable); i++) {
+		const CROSEC_CACHEABLE_COMMAND* c = &sCrosEcCacheable[i];
+
+		if (c->Command != Command) {
+			continue;
+		}
+		if (c->MatchOffset == CROSEC_CACHE_ANY_PARAMS ||
+			(c->MatchOffset < ParamsSize && Params[c->MatchOffset] == c->MatchValue)) {
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+//FNV-1a over the key
+static UINT32 CrosEcResponseCacheHash(
+	_In_ UINT16 Command,
+	_In_ UINT8 Version,
+	_In_reads_bytes_(ParamsSize) const UINT8* Params,
+	_In_ ULONG ParamsSize)
+{
+	UINT32 hash = 2166136261u;
+
+	hash = (hash ^ (Command & 0xFF)) * 16777619u;
+	hash = (hash ^ (Command >> 8)) * 16777619u;
+	hash = (hash ^ Version) * 16777619u;
+	for (ULONG i = 0; i < ParamsSize; i++) {
+		hash = (hash ^ Params[i]) * 16777619u;
+	}
+	return hash;
+}
+
+//Called with the lock held
+static PCROSEC_RESPONSE_CACHE_ENTRY CrosEcResponseCacheFind(
+	_In_ PCROSEC_RESPONSE_CACHE Cache,
+	_In_ UINT32 Hash,
+	_In_ UINT16 Command,
+	_In_ UINT8 Version,
+	_In_reads_bytes_(ParamsSize) const UINT8* Params,
+	_In_ ULONG ParamsSize)
+{
+	for (int i = 0; i < CROSEC_RESPONSE_CACHE_ENTRIES; i++) {
+		PCROSEC_RESPONSE_CACHE_ENTRY entry = &Cache->Entries[i];
+
+		if (entry->Generation == Cache->Generation && entry->Hash == Hash &&
+			entry->Command == Command && entry->Version == Version &&
+			entry->ParamsSize == ParamsSize && RtlEqualMemory(entry->Params, Params, ParamsSize)) {
+			return entry;
+		}
+	}
+	return NULL;
+}
+
+VOID CrosEcResponseCacheInit(
+	_Out_ PCROSEC_RESPONSE_CACHE Cache,
+	_In_ BOOLEAN Enabled)
+{
+	RtlZeroMemory(Cache, sizeof(*Cache));
+	KeInitializeSpinLock(&Cache->Lock);
+	Cache->Enabled = Enabled;
+	Cache->Generation = 1; // Entries start at generation 0, i.e. unused
+}
+
+VOID CrosEcResponseCacheInvalidate(_Inout_ PCROSEC_RESPONSE_CACHE Cache) {
+	KIRQL irql;
+
+	KeAcquireSpinLock(&Cache->Lock, &irql);
+	if (++Cache->Generation == 0) {
+		Cache->Generation = 1;
+	}
+	KeReleaseSpinLock(&Cache->Lock, irql);
+
+	InterlockedIncrement64(&Cache->Invalidations);
+}
+
+LONG CrosEcResponseCacheGeneration(_In_ PCROSEC_RESPONSE_CACHE Cache) {
+	return Cache->Generation;
+}
+
+BOOLEAN CrosEcResponseCacheLookup(
+	_Inout_ PCROSEC_RESPONSE_CACHE Cache,
+	_In_ UINT16 Command,
+	_In_ UINT8 Version,
+	_In_reads_bytes_(ParamsSize) const VOID* Params,
+	_In_ ULONG ParamsSize,
+	_Out_writes_bytes_(MaxResponse) PVOID Response,
+	_In_ ULONG MaxResponse,
+	_Out_ PULONG ResponseSize)
+{
+	BOOLEAN hit = FALSE;
+	KIRQL irql;
+
+	if (!Cache->Enabled || !CrosEcResponseCacheable(Command, (const UINT8*)Params, ParamsSize)) {
+		return FALSE;
+	}
+
+	UINT32 hash = CrosEcResponseCacheHash(Command, Version, (const UINT8*)Params, ParamsSize);
+
+	KeAcquireSpinLock(&Cache->Lock, &irql);
+	PCROSEC_RESPONSE_CACHE_ENTRY entry = CrosEcResponseCacheFind(Cache, hash, Command, Version, (const UINT8*)Params, ParamsSize);
+	//Too small a buffer fails on the EC, so let it
+	if (entry && entry->ResponseSize <= MaxResponse) {
+		RtlCopyMemory(Response, entry->Response, entry->ResponseSize);
+		*ResponseSize = entry->ResponseSize;
+		hit = TRUE;
+	}
+	KeReleaseSpinLock(&Cache->Lock, irql);
+
+	InterlockedIncrement64(hit ? &Cache->Hits : &Cache->Misses);
+	return hit;
+}
+
+VOID CrosEcResponseCacheInsert(
+	_Inout_ PCROSEC_RESPONSE_CACHE Cache,
+	_In_ LONG Generation,
+	_In_ UINT16 Command,
+	_In_ UINT8 Version,
+	_In_reads_bytes_(ParamsSize) const VOID* Params,
+	_In_ ULONG ParamsSize,
+	_In_reads_bytes_(ResponseSize) const VOID* Response,
+	_In_ ULONG ResponseSize)
+{
+	KIRQL irql;
+
+	if (!Cache->Enabled || ResponseSize > CROSEC_RESPONSE_CACHE_MAX_RESPONSE ||
+		!CrosEcResponseCacheable(Command, (const UINT8*)Params, ParamsSize)) {
+		return;
+	}
+
+	UINT32 hash = CrosEcResponseCacheHash(Command, Version, (const UINT8*)Params, ParamsSize);
+
+	KeAcquireSpinLock(&Cache->Lock, &irql);
+
+	//Don't keep an answer from before a reset, or the same answer twice
+	if (Generation == Cache->Generation &&
+		!CrosEcResponseCacheFind(Cache, hash, Command, Version, (const UINT8*)Params, ParamsSize)) {
+		PCROSEC_RESPONSE_CACHE_ENTRY entry = NULL;
+
+		for (int i = 0; i < CROSEC_RESPONSE_CACHE_ENTRIES; i++) {
+			if (Cache->Entries[i].Generation != Cache->Generation) {
+				entry = &Cache->Entries[i];
+				break;
+			}
+		}
+		if (!entry) {
+			entry = &Cache->Entries[Cache->NextVictim];
+			Cache->NextVictim = (Cache->NextVictim + 1) % CROSEC_RESPONSE_CACHE_ENTRIES;
+		}
+
+		entry->Generation = Generation;
+		entry->Hash = hash;
+		entry->Command = Command;
+		entry->Version = Version;
+		entry->ParamsSize = (UINT8)ParamsSize;
+		entry->ResponseSize = (UINT16)ResponseSize;
+		RtlCopyMemory(entry->Params, Params, ParamsSize);
+		RtlCopyMemory(entry->Response, Response, ResponseSize);
+	}
+
+	KeReleaseSpinLock(&Cache->Lock, irql);
+}
+
+VOID CrosEcResponseCacheQueryStats(
+	_In_ PCROSEC_RESPONSE_CACHE Cache,
+	_Out_ PCROSEC_RESPONSE_CACHE_STATS Stats)
+{
+	Stats->Hits = Cache->Hits;
+	Stats->Misses = Cache->Misses;
+	Stats->Invalidations = Cache->Invalidations;
+}
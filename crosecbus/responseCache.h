@@ -0,0 +1,78 @@
+#pragma once
+
+//
+// Replies to host commands whose answer can't change until the EC restarts
+// (versions, features, keyboard and sensor info). Only commands on the
+// allowlist in responseCache.c are kept, keyed on command, version and
+// parameters. Entries are dropped when the EC resets or jumps images.
+//
+// Off unless the ResponseCache value in the Settings key is non-zero.
+//
+
+#define CROSEC_RESPONSE_CACHE_ENTRIES       32
+#define CROSEC_RESPONSE_CACHE_MAX_PARAMS    16
+#define CROSEC_RESPONSE_CACHE_MAX_RESPONSE  128
+
+typedef struct _CROSEC_RESPONSE_CACHE_ENTRY {
+	LONG Generation; // 0 if unused
+	UINT32 Hash;
+	UINT16 Command;
+	UINT8 Version;
+	UINT8 ParamsSize;
+	UINT16 ResponseSize;
+	UINT8 Params[CROSEC_RESPONSE_CACHE_MAX_PARAMS];
+	UINT8 Response[CROSEC_RESPONSE_CACHE_MAX_RESPONSE];
+} CROSEC_RESPONSE_CACHE_ENTRY, *PCROSEC_RESPONSE_CACHE_ENTRY;
+
+typedef struct _CROSEC_RESPONSE_CACHE_STATS {
+	ULONG64 Hits;
+	ULONG64 Misses;        // Cacheable commands that went to the EC
+	ULONG64 Invalidations;
+} CROSEC_RESPONSE_CACHE_STATS, *PCROSEC_RESPONSE_CACHE_STATS;
+
+typedef struct _CROSEC_RESPONSE_CACHE {
+	KSPIN_LOCK Lock;
+	BOOLEAN Enabled;
+	volatile LONG Generation;
+	ULONG NextVictim;
+	CROSEC_RESPONSE_CACHE_ENTRY Entries[CROSEC_RESPONSE_CACHE_ENTRIES];
+	volatile LONG64 Hits;
+	volatile LONG64 Misses;
+	volatile LONG64 Invalidations;
+} CROSEC_RESPONSE_CACHE, *PCROSEC_RESPONSE_CACHE;
+
+VOID CrosEcResponseCacheInit(
+	_Out_ PCROSEC_RESPONSE_CACHE Cache,
+	_In_ BOOLEAN Enabled);
+
+// The EC reset or jumped to another image
+VOID CrosEcResponseCacheInvalidate(_Inout_ PCROSEC_RESPONSE_CACHE Cache);
+
+// Sample before sending a command and pass to CrosEcResponseCacheInsert
+LONG CrosEcResponseCacheGeneration(_In_ PCROSEC_RESPONSE_CACHE Cache);
+
+// Returns TRUE and the response size in *ResponseSize on a hit
+BOOLEAN CrosEcResponseCacheLookup(
+	_Inout_ PCROSEC_RESPONSE_CACHE Cache,
+	_In_ UINT16 Command,
+	_In_ UINT8 Version,
+	_In_reads_bytes_(ParamsSize) const VOID* Params,
+	_In_ ULONG ParamsSize,
+	_Out_writes_bytes_(MaxResponse) PVOID Response,
+	_In_ ULONG MaxResponse,
+	_Out_ PULONG ResponseSize);
+
+// Keeps a successful response if the command is cacheable
+VOID CrosEcResponseCacheInsert(
+	_Inout_ PCROSEC_RESPONSE_CACHE Cache,
+	_In_ LONG Generation,
+	_In_ UINT16 Command,
+	_In_ UINT8 Version,
+	_In_reads_bytes_(ParamsSize) const VOID* Params,
+	_In_ ULONG ParamsSize,
+	_In_reads_bytes_(ResponseSize) const VOID* Response,
+	_In_ ULONG ResponseSize);
+
+VOID CrosEcResponseCacheQueryStats(
+	_In_ PCROSEC_RESPONSE_CACHE Cache,
+	_Out_ PCROSEC_RESPONSE_CACHE_STATS Stats);
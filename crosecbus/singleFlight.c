@@ -0,0 +1,340 @@
+#include "driver.h"
+#include "comm-host.h"
+#include "userspaceQueue.h"
+
+#define CROSEC_FLIGHT_ANY_PARAMS 0xFF
+
+typedef struct _CROSEC_READ_ONLY_COMMAND {
+	UINT16 Command;
+	UINT8 MatchOffset; // Params byte that selects a subcommand, or CROSEC_FLIGHT_ANY_PARAMS
+	UINT8 MatchValue;
+} CROSEC_READ_ONLY_COMMAND;
+
+// Commands that only read state, so one answer serves everyone asking at once
+static const CROSEC_READ_ONLY_COMMAND sCrosEcReadOnly[] = {
+	{ EC_CMD_GET_VERSION, CROSEC_FLIGHT_ANY_PARAMS, 0 },
+	{ EC_CMD_READ_MEMMAP, CROSEC_FLIGHT_ANY_PARAMS, 0 },
+	{ EC_CMD_GET_CMD_VERSIONS, CROSEC_FLIGHT_ANY_PARAMS, 0 },
+	{ EC_CMD_GET_PROTOCOL_INFO, CROSEC_FLIGHT_ANY_PARAMS, 0 },
+	{ EC_CMD_GET_FEATURES, CROSEC_FLIGHT_ANY_PARAMS, 0 },
+	{ EC_CMD_PWM_GET_FAN_TARGET_RPM, CROSEC_FLIGHT_ANY_PARAMS, 0 },
+	{ EC_CMD_PWM_GET_KEYBOARD_BACKLIGHT, CROSEC_FLIGHT_ANY_PARAMS, 0 },
+	{ EC_CMD_MKBP_INFO, CROSEC_FLIGHT_ANY_PARAMS, 0 },
+	{ EC_CMD_MKBP_GET_CONFIG, CROSEC_FLIGHT_ANY_PARAMS, 0 },
+	{ EC_CMD_GET_KEYBOARD_ID, CROSEC_FLIGHT_ANY_PARAMS, 0 },
+	{ EC_CMD_MOTION_SENSE_CMD, FIELD_OFFSET(struct ec_params_motion_sense, cmd), MOTIONSENSE_CMD_DUMP },
+	{ EC_CMD_MOTION_SENSE_CMD, FIELD_OFFSET(struct ec_params_motion_sense, cmd), MOTIONSENSE_CMD_INFO },
+	{ EC_CMD_MOTION_SENSE_CMD, FIELD_OFFSET(struct ec_params_motion_sense, cmd), MOTIONSENSE_CMD_DATA },
+};
+
+VOID CrosEcFlightsInit(_Out_ PCROSEC_FLIGHTS Flights) {
+	RtlZeroMemory(Flights, sizeof(*Flights));
+	KeInitializeSpinLock(&Flights->Lock);
+	InitializeListHead(&Flights->Active);
+}
+
+BOOLEAN CrosEcFlightKeyInit(
+	_Out_ PCROSEC_FLIGHT_KEY Key,
+	_In_ UINT16 Command,
+	_In_ UINT8 Version,
+	_In_reads_bytes_(ParamsSize) const VOID* Params,
+	_In_ ULONG ParamsSize,
+	_In_ ULONG InSize)
+{
+	const UINT8* params = (const UINT8*)Params;
+	BOOLEAN readOnly = FALSE;
+
+	if (ParamsSize > CROSEC_FLIGHT_MAX_PARAMS || ParamsSize > ec_max_outsize) {
+		return FALSE;
+	}
+
+	for (int i = 0; i < ARRAYSIZE(sCrosEcReadOnly) && !readOnly; i++) {
+		const CROSEC_READ_ONLY_COMMAND* c = &sCrosEcReadOnly[i];
+
+		readOnly = c->Command == Command &&
+			(c->MatchOffset == CROSEC_FLIGHT_ANY_PARAMS ||
+			(c->MatchOffset < ParamsSize && params[c->MatchOffset] == c->MatchValue));
+	}
+	if (!readOnly) {
+		return FALSE;
+	}
+
+	RtlZeroMemory(Key, sizeof(*Key));
+	Key->Command = Command;
+	Key->Version = Version;
+	Key->ParamsSize = (UINT8)ParamsSize;
+	Key->InSize = min(InSize, ec_max_insize); //Clamped the same way for every caller
+	RtlCopyMemory(Key->Params, params, ParamsSize);
+
+	//FNV-1a, just to skip most compares
+	Key->Hash = 2166136261u;
+	for (ULONG i = 0; i < FIELD_OFFSET(CROSEC_FLIGHT_KEY, Params) + ParamsSize; i++) {
+		if (i >= sizeof(Key->Hash)) {
+			Key->Hash = (Key->Hash ^ ((const UINT8*)Key)[i]) * 16777619u;
+		}
+	}
+	return TRUE;
+}
+
+static BOOLEAN CrosEcFlightKeyEqual(
+	_In_ PCROSEC_FLIGHT_KEY A,
+	_In_ PCROSEC_FLIGHT_KEY B)
+{
+	return A->Hash == B->Hash &&
+		RtlEqualMemory(A, B, FIELD_OFFSET(CROSEC_FLIGHT_KEY, Params) + A->ParamsSize);
+}
+
+//Called with the lock held
+static PCROSEC_FLIGHT CrosEcFlightFind(
+	_In_ PCROSEC_FLIGHTS Flights,
+	_In_ PCROSEC_FLIGHT_KEY Key)
+{
+	for (PLIST_ENTRY entry = Flights->Active.Flink; entry != &Flights->Active; entry = entry->Flink) {
+		PCROSEC_FLIGHT flight = CONTAINING_RECORD(entry, CROSEC_FLIGHT, Entry);
+
+		if (CrosEcFlightKeyEqual(&flight->Key, Key)) {
+			return flight;
+		}
+	}
+	return NULL;
+}
+
+//Allocated up front so the lock is only held to link it in
+static PCROSEC_FLIGHT CrosEcFlightAlloc(_In_ PCROSEC_FLIGHT_KEY Key) {
+	PCROSEC_FLIGHT flight = (PCROSEC_FLIGHT)ExAllocatePoolWithTag(NonPagedPool,
+		FIELD_OFFSET(CROSEC_FLIGHT, Response) + Key->InSize, CROSECBUS_POOL_TAG);
+	if (!flight) {
+		return NULL;
+	}
+
+	RtlZeroMemory(flight, FIELD_OFFSET(CROSEC_FLIGHT, Response));
+	flight->Key = *Key;
+	flight->Refs = 1;
+	KeInitializeEvent(&flight->Landed, NotificationEvent, FALSE);
+	return flight;
+}
+
+static VOID CrosEcFlightRelease(_In_ PCROSEC_FLIGHT Flight) {
+	if (InterlockedDecrement(&Flight->Refs) == 0) {
+		ExFreePoolWithTag(Flight, CROSECBUS_POOL_TAG);
+	}
+}
+
+PCROSEC_FLIGHT CrosEcFlightJoin(
+	_Inout_ PCROSEC_FLIGHTS Flights,
+	_In_ PCROSEC_FLIGHT_KEY Key,
+	_Out_ PBOOLEAN Leader)
+{
+	PCROSEC_FLIGHT newFlight = CrosEcFlightAlloc(Key);
+	PCROSEC_FLIGHT flight;
+	KIRQL irql;
+
+	KeAcquireSpinLock(&Flights->Lock, &irql);
+	flight = CrosEcFlightFind(Flights, Key);
+	if (flight) {
+		InterlockedIncrement(&flight->Refs);
+	}
+	else if (newFlight) {
+		InsertTailList(&Flights->Active, &newFlight->Entry);
+	}
+	KeReleaseSpinLock(&Flights->Lock, irql);
+
+	if (flight) {
+		if (newFlight) {
+			ExFreePoolWithTag(newFlight, CROSECBUS_POOL_TAG);
+		}
+		*Leader = FALSE;
+		return flight;
+	}
+
+	if (newFlight) {
+		InterlockedIncrement64(&Flights->Led);
+	}
+	*Leader = TRUE;
+	return newFlight;
+}
+
+//Called with the lock held. Requests that don't fit, or were already
+//cancelled, run on their own.
+static BOOLEAN CrosEcFlightAttach(
+	_Inout_ PCROSEC_FLIGHT Flight,
+	_In_ WDFREQUEST Request,
+	_In_ PFN_WDF_REQUEST_CANCEL EvtRequestCancel)
+{
+	if (Flight->RequestCount == CROSEC_FLIGHT_MAX_REQUESTS ||
+		!NT_SUCCESS(WdfRequestMarkCancelableEx(Request, EvtRequestCancel))) {
+		return FALSE;
+	}
+
+	Flight->Requests[Flight->RequestCount++] = Request;
+	return TRUE;
+}
+
+BOOLEAN CrosEcFlightJoinRequest(
+	_Inout_ PCROSEC_FLIGHTS Flights,
+	_In_ PCROSEC_FLIGHT_KEY Key,
+	_In_ WDFREQUEST Request,
+	_In_ PFN_WDF_REQUEST_CANCEL EvtRequestCancel,
+	_Out_ PCROSEC_FLIGHT* Flight)
+{
+	PCROSEC_FLIGHT newFlight = CrosEcFlightAlloc(Key);
+	PCROSEC_FLIGHT flight;
+	BOOLEAN attached = FALSE;
+	KIRQL irql;
+
+	KeAcquireSpinLock(&Flights->Lock, &irql);
+	flight = CrosEcFlightFind(Flights, Key);
+	if (flight) {
+		attached = CrosEcFlightAttach(flight, Request, EvtRequestCancel);
+	}
+	else if (newFlight) {
+		InsertTailList(&Flights->Active, &newFlight->Entry);
+	}
+	KeReleaseSpinLock(&Flights->Lock, irql);
+
+	//Either attached, or this one runs on its own beside the flight
+	if (flight) {
+		if (newFlight) {
+			ExFreePoolWithTag(newFlight, CROSECBUS_POOL_TAG);
+		}
+		newFlight = NULL;
+	}
+
+	if (attached) {
+		InterlockedIncrement64(&Flights->Shared);
+		*Flight = NULL;
+		return TRUE;
+	}
+
+	if (newFlight) {
+		InterlockedIncrement64(&Flights->Led);
+	}
+	*Flight = newFlight;
+	return FALSE;
+}
+
+BOOLEAN CrosEcFlightAttachRequest(
+	_Inout_ PCROSEC_FLIGHTS Flights,
+	_In_ PCROSEC_FLIGHT_KEY Key,
+	_In_ WDFREQUEST Request,
+	_In_ PFN_WDF_REQUEST_CANCEL EvtRequestCancel)
+{
+	PCROSEC_FLIGHT flight;
+	BOOLEAN attached = FALSE;
+	KIRQL irql;
+
+	KeAcquireSpinLock(&Flights->Lock, &irql);
+	flight = CrosEcFlightFind(Flights, Key);
+	if (flight) {
+		attached = CrosEcFlightAttach(flight, Request, EvtRequestCancel);
+	}
+	KeReleaseSpinLock(&Flights->Lock, irql);
+
+	if (attached) {
+		InterlockedIncrement64(&Flights->Shared);
+	}
+	return attached;
+}
+
+BOOLEAN CrosEcFlightDetachRequest(
+	_Inout_ PCROSEC_FLIGHTS Flights,
+	_In_ WDFREQUEST Request,
+	_In_ BOOLEAN Unmark)
+{
+	BOOLEAN detached = FALSE;
+	KIRQL irql;
+
+	KeAcquireSpinLock(&Flights->Lock, &irql);
+	for (PLIST_ENTRY entry = Flights->Active.Flink; entry != &Flights->Active && !detached; entry = entry->Flink) {
+		PCROSEC_FLIGHT flight = CONTAINING_RECORD(entry, CROSEC_FLIGHT, Entry);
+
+		for (ULONG i = 0; i < flight->RequestCount; i++) {
+			if (flight->Requests[i] != Request) {
+				continue;
+			}
+
+			//Leave it to a cancel routine that's already on its way
+			if (!Unmark || WdfRequestUnmarkCancelable(Request) != STATUS_CANCELLED) {
+				flight->Requests[i] = flight->Requests[--flight->RequestCount];
+				detached = TRUE;
+			}
+			break;
+		}
+	}
+	KeReleaseSpinLock(&Flights->Lock, irql);
+
+	return detached;
+}
+
+int CrosEcFlightWait(
+	_Inout_ PCROSEC_FLIGHTS Flights,
+	_In_ PCROSEC_FLIGHT Flight,
+	_Out_writes_bytes_(Flight->Key.InSize) PVOID Response)
+{
+	KeWaitForSingleObject(&Flight->Landed, Executive, KernelMode, FALSE, NULL);
+
+	int result = Flight->Result;
+	if (result > 0) {
+		RtlCopyMemory(Response, Flight->Response, result);
+	}
+
+	InterlockedIncrement64(&Flights->Shared);
+	CrosEcFlightRelease(Flight);
+	return result;
+}
+
+VOID CrosEcFlightLand(
+	_Inout_ PCROSEC_FLIGHTS Flights,
+	_In_ PCROSEC_FLIGHT Flight,
+	_In_ int Result,
+	_In_reads_bytes_opt_(Result) const VOID* Response)
+{
+	KIRQL irql;
+
+	//Unlink first: anyone asking from now on needs a fresh answer. Requests
+	//being cancelled are left to their cancel routine, which won't find them.
+	KeAcquireSpinLock(&Flights->Lock, &irql);
+	RemoveEntryList(&Flight->Entry);
+	ULONG requests = 0;
+	for (ULONG i = 0; i < Flight->RequestCount; i++) {
+		if (WdfRequestUnmarkCancelable(Flight->Requests[i]) != STATUS_CANCELLED) {
+			Flight->Requests[requests++] = Flight->Requests[i];
+		}
+	}
+	Flight->RequestCount = requests;
+	KeReleaseSpinLock(&Flights->Lock, irql);
+
+	if (Result > (int)Flight->Key.InSize) {
+		Result = -EC_RES_RESPONSE_TOO_BIG;
+	}
+	Flight->Result = Result;
+	if (Result > 0) {
+		RtlCopyMemory(Flight->Response, Response, Result);
+	}
+	KeSetEvent(&Flight->Landed, IO_NO_INCREMENT, FALSE);
+
+	for (ULONG i = 0; i < Flight->RequestCount; i++) {
+		WDFREQUEST request = Flight->Requests[i];
+		PCROSEC_COMMAND cmd, outCmd;
+
+		//Buffers were validated by CrosECIoctlXCmd
+		WdfRequestRetrieveInputBuffer(request, sizeof(*cmd), (PVOID*)&cmd, NULL);
+		WdfRequestRetrieveOutputBuffer(request, sizeof(*outCmd), (PVOID*)&outCmd, NULL);
+
+		RtlMoveMemory(outCmd, cmd, sizeof(*cmd)); //Copy header
+		if (Result > 0) {
+			RtlCopyMemory(outCmd->Data, Flight->Response, Result);
+		}
+		WdfRequestComplete(request, CrosECIoctlXCmdFinish(request, Result));
+	}
+
+	CrosEcFlightRelease(Flight);
+}
+
+VOID CrosEcFlightsQueryStats(
+	_In_ PCROSEC_FLIGHTS Flights,
+	_Out_ PCROSEC_FLIGHT_STATS Stats)
+{
+	Stats->Led = Flights->Led;
+	Stats->Shared = Flights->Shared;
+}
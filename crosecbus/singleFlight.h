@@ -0,0 +1,112 @@
+#pragma once
+
+//
+// Coalescing of identical read-only commands. The first caller to send one
+// leads a flight; anyone who asks for the same thing (command, version,
+// params and response size) before it lands shares its response instead of
+// queueing for the EC again. Kernel callers wait for the flight; XCMD
+// requests are attached to it and completed when it lands. Attached
+// requests are cancelable until then.
+//
+
+#define CROSEC_FLIGHT_MAX_PARAMS   16
+#define CROSEC_FLIGHT_MAX_REQUESTS 8
+
+typedef struct _CROSEC_FLIGHT_KEY {
+	UINT32 Hash;
+	UINT16 Command;
+	UINT8 Version;
+	UINT8 ParamsSize;
+	UINT32 InSize;
+	UINT8 Params[CROSEC_FLIGHT_MAX_PARAMS];
+} CROSEC_FLIGHT_KEY, *PCROSEC_FLIGHT_KEY;
+
+typedef struct _CROSEC_FLIGHT {
+	LIST_ENTRY Entry;
+	CROSEC_FLIGHT_KEY Key;
+	volatile LONG Refs;
+	KEVENT Landed;
+	int Result;                                      // ec_command_proto style
+	ULONG RequestCount;
+	WDFREQUEST Requests[CROSEC_FLIGHT_MAX_REQUESTS]; // Attached XCMD requests
+	UINT8 Response[ANYSIZE_ARRAY];
+} CROSEC_FLIGHT, *PCROSEC_FLIGHT;
+
+typedef struct _CROSEC_FLIGHT_STATS {
+	ULONG64 Led;     // Commands that went to the EC
+	ULONG64 Shared;  // Requests answered by someone else's flight
+} CROSEC_FLIGHT_STATS, *PCROSEC_FLIGHT_STATS;
+
+typedef struct _CROSEC_FLIGHTS {
+	KSPIN_LOCK Lock;
+	LIST_ENTRY Active;
+	volatile LONG64 Led;
+	volatile LONG64 Shared;
+} CROSEC_FLIGHTS, *PCROSEC_FLIGHTS;
+
+VOID CrosEcFlightsInit(_Out_ PCROSEC_FLIGHTS Flights);
+
+// Returns FALSE if the command may have side effects, so it can't be shared
+BOOLEAN CrosEcFlightKeyInit(
+	_Out_ PCROSEC_FLIGHT_KEY Key,
+	_In_ UINT16 Command,
+	_In_ UINT8 Version,
+	_In_reads_bytes_(ParamsSize) const VOID* Params,
+	_In_ ULONG ParamsSize,
+	_In_ ULONG InSize);
+
+//
+// Joins the flight for Key, or starts one with *Leader set. Returns NULL if
+// a flight couldn't be started; send the command uncoalesced.
+//
+PCROSEC_FLIGHT CrosEcFlightJoin(
+	_Inout_ PCROSEC_FLIGHTS Flights,
+	_In_ PCROSEC_FLIGHT_KEY Key,
+	_Out_ PBOOLEAN Leader);
+
+//
+// Non-blocking form for the XCMD engine. Attaches Request to the flight for
+// Key and returns TRUE, in which case the request is completed when it
+// lands, or by EvtRequestCancel. Otherwise starts a flight for the caller
+// to lead in *Flight (NULL if one couldn't be started).
+//
+BOOLEAN CrosEcFlightJoinRequest(
+	_Inout_ PCROSEC_FLIGHTS Flights,
+	_In_ PCROSEC_FLIGHT_KEY Key,
+	_In_ WDFREQUEST Request,
+	_In_ PFN_WDF_REQUEST_CANCEL EvtRequestCancel,
+	_Out_ PCROSEC_FLIGHT* Flight);
+
+// Attaches Request to a flight already in the air; FALSE if there isn't one
+BOOLEAN CrosEcFlightAttachRequest(
+	_Inout_ PCROSEC_FLIGHTS Flights,
+	_In_ PCROSEC_FLIGHT_KEY Key,
+	_In_ WDFREQUEST Request,
+	_In_ PFN_WDF_REQUEST_CANCEL EvtRequestCancel);
+
+//
+// Takes Request back off its flight so the caller can complete it; FALSE if
+// it isn't attached to one. Cancel routines pass Unmark FALSE; anyone else
+// gets FALSE too if the cancel routine is already on its way.
+//
+BOOLEAN CrosEcFlightDetachRequest(
+	_Inout_ PCROSEC_FLIGHTS Flights,
+	_In_ WDFREQUEST Request,
+	_In_ BOOLEAN Unmark);
+
+// Followers: waits for the leader and copies out its response
+int CrosEcFlightWait(
+	_Inout_ PCROSEC_FLIGHTS Flights,
+	_In_ PCROSEC_FLIGHT Flight,
+	_Out_writes_bytes_(Flight->Key.InSize) PVOID Response);
+
+// Leaders: publishes the result and completes attached requests
+VOID CrosEcFlightLand(
+	_Inout_ PCROSEC_FLIGHTS Flights,
+	_In_ PCROSEC_FLIGHT Flight,
+	_In_ int Result,
+	_In_reads_bytes_opt_(Result) const VOID* Response);
+
+VOID CrosEcFlightsQueryStats(
+	_In_ PCROSEC_FLIGHTS Flights,
+	_Out_ PCROSEC_FLIGHT_STATS Stats);
@@ -9,15 +9,17 @@ extern "C"
 	// Tracing Definitions:
 	//
 	// Control GUID: 
-	// {73e3b785-f5fb-423e-94a9-56627fea9053}
+	// {941fe00d-3c96-4eb0-bfa1-b9db44a8acc6}
+	//
+	// Text tracing only; EC timing goes through the binary trace in ecTrace.h.
 	//
 
 #define WPP_CONTROL_GUIDS                           \
     WPP_DEFINE_CONTROL_GUID(                        \
-        SpbTestToolTraceGuid,                       \
-        (73e3b785,f5fb,423e,94a9,56627fea9053),     \
+        CrosEcBusTraceGuid,                         \
+        (941fe00d,3c96,4eb0,bfa1,b9db44a8acc6),     \
         WPP_DEFINE_BIT(TRACE_FLAG_WDFLOADING)       \
-        WPP_DEFINE_BIT(TRACE_FLAG_SPBAPI)           \
+        WPP_DEFINE_BIT(TRACE_FLAG_IOCTL)            \
         WPP_DEFINE_BIT(TRACE_FLAG_OTHER)            \
         )
 }
@@ -25,12 +27,12 @@ extern "C"
 #define WPP_LEVEL_FLAGS_LOGGER(level,flags) WPP_LEVEL_LOGGER(flags)
 #define WPP_LEVEL_FLAGS_ENABLED(level, flags) (WPP_LEVEL_ENABLED(flags) && WPP_CONTROL(WPP_BIT_ ## flags).Level >= level)
 
-#define Trace CyapaPrint
+#define Trace CrosEcBusPrint
 #define FuncEntry 
 #define FuncExit 
 #define WPP_INIT_TRACING
 #define WPP_CLEANUP 
-#define TRACE_FLAG_SPBAPI 0
+#define TRACE_FLAG_IOCTL 0
 #define TRACE_FLAG_WDFLOADING 0
 
 // begin_wpp config
@@ -2,6 +2,7 @@
 #include "userspaceQueue.h"
 #include "ec_commands.h"
 #include "comm-host.h"
+#include "ecEngine.h"
 
 static ULONG CrosEcBusDebugLevel = 100;
 static ULONG CrosEcBusDebugCatagories = DBG_INIT || DBG_PNP || DBG_IOCTL;
@@ -81,21 +82,25 @@ NTSTATUS CrosECQueueInitialize(_In_ WDFDEVICE Device) {
 }
 
 NTSTATUS CrosECIoctlXCmd(_In_ PCROSECBUS_CONTEXT pDevice, _In_ WDFREQUEST Request) {
+	GetRequestContext(Request)->Arrived = KeQueryInterruptTime();
+	GetRequestContext(Request)->Started = 0;
+
 	PCROSEC_COMMAND cmd;
 	size_t cmdLen;
-	NT_RETURN_IF_NTSTATUS_FAILED(WdfRequestRetrieveInputBuffer(Request, sizeof(cmd), (PVOID*)&cmd, &cmdLen));
+	NT_RETURN_IF_NTSTATUS_FAILED(WdfRequestRetrieveInputBuffer(Request, sizeof(*cmd), (PVOID*)&cmd, &cmdLen));
 
 	PCROSEC_COMMAND outCmd;
 	size_t outLen;
 	NT_RETURN_IF_NTSTATUS_FAILED(WdfRequestRetrieveOutputBuffer(Request, sizeof(*cmd), &outCmd, &outLen));
 	NT_ANALYSIS_ASSUME(outLen >= sizeof(*cmd));
 
-	// User tried to send/receive too much data
-	NT_RETURN_IF(STATUS_BUFFER_OVERFLOW, cmdLen > (sizeof(CROSEC_COMMAND) + ec_max_insize));
-	NT_RETURN_IF(STATUS_BUFFER_OVERFLOW, outLen > (sizeof(CROSEC_COMMAND) + ec_max_outsize));
+	// User tried to send more than the EC takes. Buffers may be bigger than the sizes they declare.
+	NT_RETURN_IF(STATUS_BUFFER_OVERFLOW, cmd->OutSize > ec_max_outsize);
 	// User tried to send/receive more bytes than they offered in storage
 	NT_RETURN_IF(STATUS_BUFFER_TOO_SMALL, cmdLen < (sizeof(CROSEC_COMMAND) + cmd->OutSize));
 	NT_RETURN_IF(STATUS_BUFFER_TOO_SMALL, outLen < (sizeof(CROSEC_COMMAND) + cmd->InSize));
+	// Ask for no more than the EC can send, as CrosEcCmdXferLocked does
+	cmd->InSize = min(cmd->InSize, ec_max_insize);
 
 	// I know this seems overprotective, and that I am wielding too much power over you,
 	// but I don't think that the Windows driver should let you erase your EC flash.
@@ -108,38 +113,54 @@ NTSTATUS CrosECIoctlXCmd(_In_ PCROSECBUS_CONTEXT pDevice, _In_ WDFREQUEST Reques
 		cmd->Command == EC_CMD_FLASH_WRITE ||
 		cmd->Command == EC_CMD_USB_PD_FW_UPDATE);
 
-	int tries = 5; //Wait our turn if kernel driver wants to access first
-	while (tries > 0) {
-		LONG64 accesses = InterlockedCompareExchange64(&pDevice->KernelAccessesWaiting, 0, 0);
-		if (accesses == 0) //No kernel driver access. We're good to go.
-			break;
-
-		LARGE_INTEGER Interval;
-		Interval.QuadPart = -10 * 500; //Wait 500 microseconds before checking again to hopefully let kernel complete
-		KeDelayExecutionThread(KernelMode, TRUE, &Interval);
-		tries--;
-	}
-	if (tries <= 0) {
-		return STATUS_RETRY; //Userland should retry later.
+	ULONG responseSize;
+	if (CrosEcResponseCacheLookup(&pDevice->ResponseCache, (UINT16)cmd->Command, (UINT8)cmd->Version,
+		cmd->Data, cmd->OutSize, outCmd->Data, cmd->InSize, &responseSize)) {
+		RtlMoveMemory(outCmd, cmd, sizeof(*cmd)); //Copy header
+		return CrosECIoctlXCmdFinish(Request, responseSize);
 	}
 
-	WdfWaitLockAcquire(pDevice->EcLock, NULL);
-
-	RtlCopyMemory(outCmd, cmd, sizeof(*cmd)); //Copy header
+	//Ride along with an identical read-only command already on the EC
+	CROSEC_FLIGHT_KEY key;
+	if (CrosEcFlightKeyInit(&key, (UINT16)cmd->Command, (UINT8)cmd->Version, cmd->Data, cmd->OutSize, cmd->InSize) &&
+		CrosEcFlightAttachRequest(&pDevice->Flights, &key, Request, CrosEcEngineEvtFlightCancel)) {
+		return STATUS_PENDING; //Completed when the flight lands
+	}
 
-	int res = ec_command_proto((UINT16)cmd->Command, (UINT8)cmd->Version, outCmd->Data, cmd->OutSize,
-		cmd->Data, cmd->InSize);
+	//The engine runs the command when the arbiter grants it the EC, and completes the request
+	NT_RETURN_IF_NTSTATUS_FAILED(CrosEcEngineSubmit(pDevice, Request));
+	return STATUS_PENDING;
+}
 
-	WdfWaitLockRelease(pDevice->EcLock);
+NTSTATUS CrosECIoctlXCmdFinish(_In_ WDFREQUEST Request, _In_ int res) {
+	PCROSEC_COMMAND cmd;
+	size_t outLen;
+	NT_RETURN_IF_NTSTATUS_FAILED(WdfRequestRetrieveOutputBuffer(Request, sizeof(*cmd), (PVOID*)&cmd, &outLen));
 
 	CrosEcBusPrint(DEBUG_LEVEL_ERROR, DBG_IOCTL,
 		"%!FUNC! Request 0x%p Command %u Version %u OutSize %u Result %d", Request, cmd->Command,
 		cmd->Version, cmd->OutSize, res);
 
+	//Every XCMD that got past validation ends up here, however it was answered
+	PCROSEC_REQUEST_CONTEXT times = GetRequestContext(Request);
+	ULONGLONG now = KeQueryInterruptTime();
+	CrosEcStatsRecord(&GetDeviceContext(WdfIoQueueGetDevice(WdfRequestGetIoQueue(Request)))->Stats,
+		(UINT16)cmd->Command, cmd->OutSize, res,
+		times->Started ? (times->Started - times->Arrived) / 10 : 0, (now - times->Arrived) / 10);
+
 	if (res < -EECRESULT) {
 		// Propagate a response code from the EC as res (EC result codes are positive)
 		cmd->Result = (-res) - EECRESULT;
 		res = 0;  // tell the client we received nothing
+
+		// Async callers asked to hear about it; they poll EC_CMD_GET_COMMS_STATUS themselves
+		if (cmd->Result == EC_RES_IN_PROGRESS) {
+			WDF_REQUEST_PARAMETERS params;
+			WDF_REQUEST_PARAMETERS_INIT(&params);
+			WdfRequestGetParameters(Request, &params);
+			NT_RETURN_IF(CROSEC_STATUS_IN_PROGRESS,
+				params.Parameters.DeviceIoControl.IoControlCode == IOCTL_CROSEC_XCMD_ASYNC);
+		}
 	}
 	else if (res < 0) {
 		// Transform the protocol failure into an NTSTATUS and return early.
@@ -159,14 +180,14 @@ NTSTATUS CrosECIoctlXCmd(_In_ PCROSECBUS_CONTEXT pDevice, _In_ WDFREQUEST Reques
 	return STATUS_SUCCESS;
 }
 
-NTSTATUS CrosECIoctlReadMem(_In_ WDFREQUEST Request) {
+NTSTATUS CrosECIoctlReadMem(_In_ PCROSECBUS_CONTEXT pDevice, _In_ WDFREQUEST Request) {
 	PCROSEC_READMEM rq, rs;
 	NT_RETURN_IF_NTSTATUS_FAILED(WdfRequestRetrieveInputBuffer(Request, sizeof(*rq), (PVOID*)&rq, NULL));
 	NT_RETURN_IF_NTSTATUS_FAILED(WdfRequestRetrieveOutputBuffer(Request, sizeof(*rs), (PVOID*)&rs, NULL));
 
 	NT_RETURN_IF(STATUS_INVALID_ADDRESS, (rq->offset + rq->bytes) > CROSEC_MEMMAP_SIZE);
 
-	int res = ec_readmem(rq->offset, rq->bytes, rs->buffer);
+	int res = CrosEcMemmapCacheRead(&pDevice->MemmapCache, rq->offset, rq->bytes, rs->buffer);
 
 	CrosEcBusPrint(DEBUG_LEVEL_INFO, DBG_IOCTL, "%!FUNC! Request 0x%p Offset 0x%x Buffer %d Result %d",
 		Request, rq->offset, rq->bytes, res);
@@ -180,6 +201,103 @@ NTSTATUS CrosECIoctlReadMem(_In_ WDFREQUEST Request) {
 	return STATUS_SUCCESS;
 }
 
+NTSTATUS CrosECIoctlLockStats(_In_ PCROSECBUS_CONTEXT pDevice, _In_ WDFREQUEST Request) {
+	PCROSEC_LOCK_STATS rs;
+	NT_RETURN_IF_NTSTATUS_FAILED(WdfRequestRetrieveOutputBuffer(Request, sizeof(*rs), (PVOID*)&rs, NULL));
+
+	CrosEcLockQueryStats(&pDevice->EcLock, rs->Classes);
+
+	WdfRequestSetInformation(Request, sizeof(*rs));
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS CrosECIoctlCacheStats(_In_ PCROSECBUS_CONTEXT pDevice, _In_ WDFREQUEST Request) {
+	PCROSEC_RESPONSE_CACHE_STATS rs;
+	NT_RETURN_IF_NTSTATUS_FAILED(WdfRequestRetrieveOutputBuffer(Request, sizeof(*rs), (PVOID*)&rs, NULL));
+
+	CrosEcResponseCacheQueryStats(&pDevice->ResponseCache, rs);
+
+	WdfRequestSetInformation(Request, sizeof(*rs));
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS CrosECIoctlTargetStats(_In_ PCROSECBUS_CONTEXT pDevice, _In_ WDFREQUEST Request) {
+	PCROSEC_TARGETS_STATS rs;
+	NT_RETURN_IF_NTSTATUS_FAILED(WdfRequestRetrieveOutputBuffer(Request, sizeof(*rs), (PVOID*)&rs, NULL));
+
+	for (ULONG i = 0; i < CROSEC_EC_TARGETS; i++) {
+		rs->Targets[i] = pDevice->TargetStats[i];
+		rs->Queued[i] = 0;
+		WdfIoQueueGetState(pDevice->EngineQueues[i], &rs->Queued[i], NULL);
+	}
+
+	WdfRequestSetInformation(Request, sizeof(*rs));
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS CrosECIoctlStats(_In_ PCROSECBUS_CONTEXT pDevice, _In_ WDFREQUEST Request) {
+	PCROSEC_STATS_SNAPSHOT rs;
+	NT_RETURN_IF_NTSTATUS_FAILED(WdfRequestRetrieveOutputBuffer(Request, sizeof(*rs), (PVOID*)&rs, NULL));
+
+	rs->Count = 0;
+	rs->Reserved = 0;
+	for (ULONG i = 0; i <= CROSEC_STATS_SLOTS; i++) {
+		PCROSEC_STATS_ENTRY entry = &rs->Entries[rs->Count];
+
+		if (CrosEcStatsQuery(&pDevice->Stats, i, &entry->Command, &entry->Stats) && entry->Stats.Calls) {
+			entry->Reserved = 0;
+			rs->Count++;
+		}
+	}
+
+	WdfRequestSetInformation(Request, FIELD_OFFSET(CROSEC_STATS_SNAPSHOT, Entries[rs->Count]));
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS CrosECIoctlTraceDump(_In_ WDFREQUEST Request) {
+	PVOID buffer;
+	size_t length;
+	SIZE_T written;
+	NT_RETURN_IF_NTSTATUS_FAILED(WdfRequestRetrieveOutputBuffer(Request, sizeof(CROSEC_TRACE_HEADER), &buffer, &length));
+
+	//A short buffer still gets the header, which says how much to ask for
+	NTSTATUS status = CrosEcTraceDump(buffer, length, &written);
+	WdfRequestSetInformation(Request, written);
+	return status;
+}
+
+NTSTATUS CrosECIoctlCmdLog(_In_ PCROSECBUS_CONTEXT pDevice, _In_ WDFREQUEST Request) {
+	PCROSEC_CMD_LOG_DUMP rs;
+	size_t outLen;
+	NT_RETURN_IF_NTSTATUS_FAILED(WdfRequestRetrieveOutputBuffer(Request, sizeof(*rs), (PVOID*)&rs, &outLen));
+
+	ULONG maxRecords = (ULONG)min((outLen - FIELD_OFFSET(CROSEC_CMD_LOG_DUMP, Records)) / sizeof(CROSEC_CMD_RECORD),
+		CROSEC_CMD_LOG_ENTRIES);
+	rs->Count = CrosEcCmdLogRead(&pDevice->CmdLog, rs->Records, maxRecords, &rs->Head);
+	rs->Reserved = 0;
+
+	WdfRequestSetInformation(Request, FIELD_OFFSET(CROSEC_CMD_LOG_DUMP, Records[rs->Count]));
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS CrosECIoctlCapture(_In_ PCROSECBUS_CONTEXT pDevice, _In_ WDFREQUEST Request) {
+	PCROSEC_CAPTURE_CONTROL rq;
+	NT_RETURN_IF_NTSTATUS_FAILED(WdfRequestRetrieveInputBuffer(Request, sizeof(*rq), (PVOID*)&rq, NULL));
+
+	return CrosEcCaptureControl(&pDevice->EcLock, &pDevice->Capture, rq->Bytes);
+}
+
+NTSTATUS CrosECIoctlCaptureRead(_In_ PCROSECBUS_CONTEXT pDevice, _In_ WDFREQUEST Request) {
+	PVOID buffer;
+	size_t length;
+	SIZE_T written;
+	NT_RETURN_IF_NTSTATUS_FAILED(WdfRequestRetrieveOutputBuffer(Request, sizeof(CROSEC_CAPTURE_HEADER), &buffer, &length));
+
+	NTSTATUS status = CrosEcCaptureRead(&pDevice->EcLock, &pDevice->Capture, buffer, length, &written);
+	WdfRequestSetInformation(Request, written);
+	return status;
+}
+
 VOID CrosECEvtIoDeviceControl(_In_ WDFQUEUE Queue,
 	_In_ WDFREQUEST Request,
 	_In_ size_t OutputBufferLength,
@@ -196,14 +314,56 @@ VOID CrosECEvtIoDeviceControl(_In_ WDFQUEUE Queue,
 	NTSTATUS Status = STATUS_INVALID_PARAMETER;
 
 	switch (IoControlCode) {
-	case IOCTL_CROSEC_XCMD: {
+	case IOCTL_CROSEC_XCMD:
+	case IOCTL_CROSEC_XCMD_ASYNC: {
 		Status = CrosECIoctlXCmd(deviceContext, Request);
 		break;
 	}
 	case IOCTL_CROSEC_RDMEM: {
-		Status = CrosECIoctlReadMem(Request);
+		Status = CrosECIoctlReadMem(deviceContext, Request);
 		break;
 	}
+	case IOCTL_CROSEC_LOCK_STATS: {
+		Status = CrosECIoctlLockStats(deviceContext, Request);
+		break;
+	}
+	case IOCTL_CROSEC_CACHE_STATS: {
+		Status = CrosECIoctlCacheStats(deviceContext, Request);
+		break;
+	}
+	case IOCTL_CROSEC_TARGET_STATS: {
+		Status = CrosECIoctlTargetStats(deviceContext, Request);
+		break;
+	}
+	case IOCTL_CROSEC_STATS: {
+		Status = CrosECIoctlStats(deviceContext, Request);
+		break;
+	}
+	case IOCTL_CROSEC_CMD_LOG: {
+		Status = CrosECIoctlCmdLog(deviceContext, Request);
+		break;
+	}
+	case IOCTL_CROSEC_TRACE_DUMP: {
+		Status = CrosECIoctlTraceDump(Request);
+		break;
+	}
+	case IOCTL_CROSEC_CAPTURE: {
+		Status = CrosECIoctlCapture(deviceContext, Request);
+		break;
+	}
+	case IOCTL_CROSEC_CAPTURE_READ: {
+		Status = CrosECIoctlCaptureRead(deviceContext, Request);
+		break;
+	}
+	case IOCTL_CROSEC_STATS_RESET: {
+		CrosEcStatsReset(&deviceContext->Stats);
+		Status = STATUS_SUCCESS;
+		break;
+	}
+	}
+
+	if (Status == STATUS_PENDING) {
+		return; //Owned by the engine now
 	}
 
 	WdfRequestComplete(Request, Status);
@@ -215,47 +375,15 @@ VOID CrosECEvtIoStop(_In_ WDFQUEUE Queue, _In_ WDFREQUEST Request, _In_ ULONG Ac
 	CrosEcBusPrint(DEBUG_LEVEL_INFO, DBG_IOCTL, "%!FUNC! Queue 0x%p, Request 0x%p ActionFlags %d", Queue,
 		Request, ActionFlags);
 
-	UNREFERENCED_PARAMETER(Queue);
-	UNREFERENCED_PARAMETER(Request);
-	UNREFERENCED_PARAMETER(ActionFlags);
+	PCROSECBUS_CONTEXT pDevice = GetDeviceContext(WdfIoQueueGetDevice(Queue));
 
-	//
-	// In most cases, the EvtIoStop callback function completes, cancels, or postpones
-	// further processing of the I/O request.
-	//
-	// Typically, the driver uses the following rules:
-	//
-	// - If the driver owns the I/O request, it calls WdfRequestUnmarkCancelable
-	//   (if the request is cancelable) and either calls WdfRequestStopAcknowledge
-	//   with a Requeue value of TRUE, or it calls WdfRequestComplete with a
-	//   completion status value of STATUS_SUCCESS or STATUS_CANCELLED.
-	//
-	//   Before it can call these methods safely, the driver must make sure that
-	//   its implementation of EvtIoStop has exclusive access to the request.
-	//
-	//   In order to do that, the driver must synchronize access to the request
-	//   to prevent other threads from manipulating the request concurrently.
-	//   The synchronization method you choose will depend on your driver's design.
-	//
-	//   For example, if the request is held in a shared context, the EvtIoStop callback
-	//   might acquire an internal driver lock, take the request from the shared context,
-	//   and then release the lock. At this point, the EvtIoStop callback owns the request
-	//   and can safely complete or requeue the request.
-	//
-	// - If the driver has forwarded the I/O request to an I/O target, it either calls
-	//   WdfRequestCancelSentRequest to attempt to cancel the request, or it postpones
-	//   further processing of the request and calls WdfRequestStopAcknowledge with
-	//   a Requeue value of FALSE.
-	//
-	// A driver might choose to take no action in EvtIoStop for requests that are
-	// guaranteed to complete in a small amount of time.
-	//
-	// In this case, the framework waits until the specified request is complete
-	// before moving the device (or system) to a lower power state or removing the device.
-	// Potentially, this inaction can prevent a system from entering its hibernation state
-	// or another low system power state. In extreme cases, it can cause the system
-	// to crash with bugcheck code 9F.
-	//
+	//Only the engine holds on to requests. Parked ones can go straight away on removal.
+	if ((ActionFlags & WdfRequestStopActionPurge) && (ActionFlags & WdfRequestStopRequestCancelable) &&
+		CrosEcEngineCancel(pDevice, Request)) {
+		return;
+	}
 
-	return;
-}
\ No newline at end of file
+	//Anything else is on the EC or waiting on a command that is, and D0Exit
+	//drains the engine before the EC goes away
+	WdfRequestStopAcknowledge(Request, FALSE);
+}
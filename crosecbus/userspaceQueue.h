@@ -2,6 +2,9 @@
 
 NTSTATUS CrosECQueueInitialize(_In_ WDFDEVICE Device);
 
+// Fills in an XCMD reply from an ec_command_proto style result
+NTSTATUS CrosECIoctlXCmdFinish(_In_ WDFREQUEST Request, _In_ int res);
+
 DEFINE_GUID(GUID_DEVINTERFACE_CrosEC, 0xd66bb4f8, 0x0a7a, 0x4f89, 0x90, 0x33, 0x79, 0x8a, 0xff, 0xa4, 0xf5, 0x38);
 // {d66bb4f8-0a7a-4f89-9033-798affa4f538}
 
@@ -10,6 +13,27 @@ DEFINE_GUID(GUID_DEVINTERFACE_CrosEC, 0xd66bb4f8, 0x0a7a, 0x4f89, 0x90, 0x33, 0x
 #define IOCTL_CROSEC_XCMD \
 	CTL_CODE(FILE_DEVICE_CROS_EMBEDDED_CONTROLLER, 0x801, METHOD_BUFFERED, FILE_READ_DATA | FILE_WRITE_DATA)
 #define IOCTL_CROSEC_RDMEM CTL_CODE(FILE_DEVICE_CROS_EMBEDDED_CONTROLLER, 0x802, METHOD_BUFFERED, FILE_READ_DATA)
+#define IOCTL_CROSEC_LOCK_STATS CTL_CODE(FILE_DEVICE_CROS_EMBEDDED_CONTROLLER, 0x803, METHOD_BUFFERED, FILE_READ_DATA)
+// Same as IOCTL_CROSEC_XCMD, but fails with CROSEC_STATUS_IN_PROGRESS if the EC
+// returns EC_RES_IN_PROGRESS rather than waiting for the command to finish
+#define IOCTL_CROSEC_XCMD_ASYNC \
+	CTL_CODE(FILE_DEVICE_CROS_EMBEDDED_CONTROLLER, 0x804, METHOD_BUFFERED, FILE_READ_DATA | FILE_WRITE_DATA)
+// Returns CROSEC_RESPONSE_CACHE_STATS
+#define IOCTL_CROSEC_CACHE_STATS CTL_CODE(FILE_DEVICE_CROS_EMBEDDED_CONTROLLER, 0x805, METHOD_BUFFERED, FILE_READ_DATA)
+// Returns CROSEC_TARGETS_STATS
+#define IOCTL_CROSEC_TARGET_STATS CTL_CODE(FILE_DEVICE_CROS_EMBEDDED_CONTROLLER, 0x806, METHOD_BUFFERED, FILE_READ_DATA)
+// Returns CROSEC_STATS_SNAPSHOT, per-command counters for kernel and XCMD traffic
+#define IOCTL_CROSEC_STATS CTL_CODE(FILE_DEVICE_CROS_EMBEDDED_CONTROLLER, 0x807, METHOD_BUFFERED, FILE_READ_DATA)
+// Zeroes the IOCTL_CROSEC_STATS counters
+#define IOCTL_CROSEC_STATS_RESET CTL_CODE(FILE_DEVICE_CROS_EMBEDDED_CONTROLLER, 0x808, METHOD_BUFFERED, FILE_WRITE_DATA)
+// Returns the event trace (ecTrace.h); fails with STATUS_DEVICE_NOT_READY unless the Trace setting is on
+#define IOCTL_CROSEC_TRACE_DUMP CTL_CODE(FILE_DEVICE_CROS_EMBEDDED_CONTROLLER, 0x809, METHOD_OUT_DIRECT, FILE_READ_DATA)
+// Returns CROSEC_CMD_LOG_DUMP with as many of the latest commands as fit
+#define IOCTL_CROSEC_CMD_LOG CTL_CODE(FILE_DEVICE_CROS_EMBEDDED_CONTROLLER, 0x80A, METHOD_OUT_DIRECT, FILE_READ_DATA)
+// Takes CROSEC_CAPTURE_CONTROL; starts a new command capture (ecCapture.h), or stops it if Bytes is 0
+#define IOCTL_CROSEC_CAPTURE CTL_CODE(FILE_DEVICE_CROS_EMBEDDED_CONTROLLER, 0x80B, METHOD_BUFFERED, FILE_WRITE_DATA)
+// Returns the capture file; fails with STATUS_DEVICE_NOT_READY unless a capture is running
+#define IOCTL_CROSEC_CAPTURE_READ CTL_CODE(FILE_DEVICE_CROS_EMBEDDED_CONTROLLER, 0x80C, METHOD_OUT_DIRECT, FILE_READ_DATA)
 
 #define CROSEC_CMD_MAX_REQUEST  0x100
 #define CROSEC_CMD_MAX_RESPONSE 0x100
@@ -26,4 +50,38 @@ typedef struct _CROSEC_READMEM {
 	ULONG offset;
 	ULONG bytes;
 	UCHAR buffer[CROSEC_MEMMAP_SIZE];
-} *PCROSEC_READMEM, CROSEC_READMEM;
\ No newline at end of file
+} *PCROSEC_READMEM, CROSEC_READMEM;
+
+// EC arbitration counters, indexed by CROSEC_LOCK_CLASS (ISR, kernel, userspace)
+typedef struct _CROSEC_LOCK_STATS {
+	CROSEC_LOCK_CLASS_STATS Classes[CrosEcLockClassCount];
+} *PCROSEC_LOCK_STATS, CROSEC_LOCK_STATS;
+
+// Latency per passthrough target, indexed by CrosEcTargetOf (0 is the EC itself)
+typedef struct _CROSEC_TARGETS_STATS {
+	CROSEC_TARGET_STATS Targets[CROSEC_EC_TARGETS];
+	ULONG Queued[CROSEC_EC_TARGETS]; // XCMD requests waiting for the EC
+} *PCROSEC_TARGETS_STATS, CROSEC_TARGETS_STATS;
+
+typedef struct _CROSEC_STATS_ENTRY {
+	UINT32 Command; // CROSEC_STATS_OTHER for commands that didn't get a slot
+	UINT32 Reserved;
+	CROSEC_COMMAND_STATS Stats;
+} *PCROSEC_STATS_ENTRY, CROSEC_STATS_ENTRY;
+
+typedef struct _CROSEC_STATS_SNAPSHOT {
+	ULONG Count; // Entries filled in
+	ULONG Reserved;
+	CROSEC_STATS_ENTRY Entries[CROSEC_STATS_SLOTS + 1];
+} *PCROSEC_STATS_SNAPSHOT, CROSEC_STATS_SNAPSHOT;
+
+typedef struct _CROSEC_CMD_LOG_DUMP {
+	ULONG64 Head;  // Commands logged since the driver loaded
+	ULONG Count;   // Records filled in, oldest first
+	ULONG Reserved;
+	CROSEC_CMD_RECORD Records[ANYSIZE_ARRAY];
+} *PCROSEC_CMD_LOG_DUMP, CROSEC_CMD_LOG_DUMP;
+
+typedef struct _CROSEC_CAPTURE_CONTROL {
+	ULONG Bytes; // Capture buffer size, at most CROSEC_CAPTURE_MAX_BYTES
+} *PCROSEC_CAPTURE_CONTROL, CROSEC_CAPTURE_CONTROL;
@@ -0,0 +1,463 @@
+#include "comm-sim.h"
+
+/*
+ * Host packet and memory map share one backing store, laid out the way the
+ * MEC EMI sees it: EC address 0x000 is port 0x800, 0x100 is port 0x900.
+ */
+#define SIM_RAM_SIZE    0x200
+#define SIM_RAM_MEMMAP  0x100
+
+/* MEC EMI window, see comm-mec_lpc.c */
+#define SIM_EMI_BASE            EC_HOST_CMD_REGION0
+#define SIM_EMI_ADDRESS_B0      (SIM_EMI_BASE + 2)
+#define SIM_EMI_ADDRESS_B1      (SIM_EMI_BASE + 3)
+#define SIM_EMI_DATA_B0         (SIM_EMI_BASE + 4)
+#define SIM_EMI_DATA_B3         (SIM_EMI_BASE + 7)
+#define SIM_EMI_AUTOINCREMENT   0x3
+
+static struct {
+	ec_sim_mode mode;
+	ec_sim_handler handler;
+
+	UINT64 now_ns;
+	UINT64 busy_until_ns;
+	UINT64 latency_ns;
+	UINT64 port_cost_ns;
+
+	/* Completion interrupt; irq_at_ns is 0 when none is pending */
+	UINT64 irq_latency_ns;
+	UINT64 irq_at_ns;
+	int irq_enabled;
+
+	UINT8 result;
+	UINT16 emi_address;
+	UINT8 ram[SIM_RAM_SIZE];
+} sim;
+
+struct ec_sim_stats ec_sim_stats;
+
+static int sim_sum(const UINT8* data, int length) {
+	int sum = 0;
+	int i;
+	for (i = 0; i < length; i++)
+		sum += data[i];
+	return sum;
+}
+
+static int sim_reply(const void* data, int size,
+	UINT8* response, int max_response, int* response_size)
+{
+	if (size > max_response)
+		return EC_RES_RESPONSE_TOO_BIG;
+
+	memcpy(response, data, size);
+	*response_size = size;
+	return EC_RES_SUCCESS;
+}
+
+int ec_sim_default_handler(UINT16 command, UINT8 version,
+	const UINT8* params, int params_size,
+	UINT8* response, int max_response, int* response_size)
+{
+	UNREFERENCED_PARAMETER(version);
+
+	switch (command) {
+	case EC_CMD_PROTO_VERSION: {
+		struct ec_response_proto_version r = { EC_PROTO_VERSION };
+		return sim_reply(&r, sizeof(r), response, max_response, response_size);
+	}
+	case EC_CMD_HELLO: {
+		struct ec_params_hello p;
+		struct ec_response_hello r;
+		if (params_size < (int)sizeof(p))
+			return EC_RES_INVALID_PARAM;
+		memcpy(&p, params, sizeof(p));
+		r.out_data = p.in_data + 0x01020304;
+		return sim_reply(&r, sizeof(r), response, max_response, response_size);
+	}
+	case EC_CMD_GET_VERSION: {
+		struct ec_response_get_version r = { 0 };
+		strcpy(r.version_string_ro, "sim_ro");
+		strcpy(r.version_string_rw, "sim_rw");
+		r.current_image = EC_IMAGE_RW;
+		return sim_reply(&r, sizeof(r), response, max_response, response_size);
+	}
+	case EC_CMD_READ_MEMMAP: {
+		struct ec_params_read_memmap p;
+		if (params_size < (int)sizeof(p))
+			return EC_RES_INVALID_PARAM;
+		memcpy(&p, params, sizeof(p));
+		if (p.offset + p.size > EC_MEMMAP_SIZE)
+			return EC_RES_INVALID_PARAM;
+		return sim_reply(&sim.ram[SIM_RAM_MEMMAP + p.offset], p.size,
+			response, max_response, response_size);
+	}
+	case EC_CMD_GET_CMD_VERSIONS: {
+		struct ec_response_get_cmd_versions r;
+		r.version_mask = EC_VER_MASK(0) | EC_VER_MASK(1);
+		return sim_reply(&r, sizeof(r), response, max_response, response_size);
+	}
+	case EC_CMD_GET_PROTOCOL_INFO: {
+		struct ec_response_get_protocol_info r = { 0 };
+		r.protocol_versions = (1 << 3);
+		r.max_request_packet_size = EC_LPC_HOST_PACKET_SIZE;
+		r.max_response_packet_size = EC_LPC_HOST_PACKET_SIZE;
+		return sim_reply(&r, sizeof(r), response, max_response, response_size);
+	}
+	case EC_CMD_GET_FEATURES: {
+		struct ec_response_get_features r = { 0 };
+		return sim_reply(&r, sizeof(r), response, max_response, response_size);
+	}
+	case EC_CMD_HOST_EVENT_GET_B: {
+		struct ec_response_host_event_mask r = { 0 };
+		return sim_reply(&r, sizeof(r), response, max_response, response_size);
+	}
+	case EC_CMD_HOST_EVENT_CLEAR_B:
+		*response_size = 0;
+		return EC_RES_SUCCESS;
+	case EC_CMD_GET_NEXT_EVENT:
+		return EC_RES_UNAVAILABLE;
+	default:
+		return EC_RES_INVALID_COMMAND;
+	}
+}
+
+static void sim_command_v2(UINT8 command) {
+	struct ec_lpc_host_args args;
+	UINT8* params = &sim.ram[sizeof(args)];
+	UINT8 response[EC_PROTO2_MAX_PARAM_SIZE];
+	int response_size = 0;
+	int res;
+
+	memcpy(&args, sim.ram, sizeof(args));
+
+	if (!(args.flags & EC_HOST_ARGS_FLAG_FROM_HOST)) {
+		/* Old-style commands are not modelled */
+		sim.result = EC_RES_INVALID_COMMAND;
+		return;
+	}
+
+	if (args.data_size > EC_PROTO2_MAX_PARAM_SIZE) {
+		sim.result = EC_RES_INVALID_PARAM;
+		return;
+	}
+
+	if ((UINT8)(command + args.flags + args.command_version + args.data_size +
+		sim_sum(params, args.data_size)) != args.checksum) {
+		sim.result = EC_RES_INVALID_CHECKSUM;
+		return;
+	}
+
+	res = sim.handler(command, args.command_version, params, args.data_size,
+		response, sizeof(response), &response_size);
+	sim.result = (UINT8)res;
+	if (res != EC_RES_SUCCESS)
+		return;
+
+	args.flags = EC_HOST_ARGS_FLAG_TO_HOST;
+	args.data_size = (UINT8)response_size;
+	args.checksum = (UINT8)(command + args.flags + args.command_version +
+		args.data_size + sim_sum(response, response_size));
+
+	memcpy(params, response, response_size);
+	memcpy(sim.ram, &args, sizeof(args));
+}
+
+static void sim_command_v3(void) {
+	struct ec_host_request rq;
+	struct ec_host_response rs;
+	UINT8 response[EC_LPC_HOST_PACKET_SIZE - sizeof(rs)];
+	int response_size = 0;
+	int res;
+
+	memcpy(&rq, sim.ram, sizeof(rq));
+
+	if (rq.struct_version != EC_HOST_REQUEST_VERSION)
+		res = EC_RES_INVALID_HEADER;
+	else if (rq.data_len > EC_LPC_HOST_PACKET_SIZE - sizeof(rq))
+		res = EC_RES_REQUEST_TRUNCATED;
+	else if ((UINT8)sim_sum(sim.ram, sizeof(rq) + rq.data_len))
+		res = EC_RES_INVALID_CHECKSUM;
+	else
+		res = sim.handler(rq.command, rq.command_version,
+			&sim.ram[sizeof(rq)], rq.data_len,
+			response, sizeof(response), &response_size);
+
+	if (res != EC_RES_SUCCESS)
+		response_size = 0;
+
+	rs.struct_version = EC_HOST_RESPONSE_VERSION;
+	rs.checksum = 0;
+	rs.result = (UINT16)res;
+	rs.data_len = (UINT16)response_size;
+	rs.reserved = 0;
+
+	memcpy(sim.ram, &rs, sizeof(rs));
+	memcpy(&sim.ram[sizeof(rs)], response, response_size);
+	sim.ram[1] = (UINT8)(-sim_sum(sim.ram, sizeof(rs) + response_size));
+
+	sim.result = (UINT8)res;
+}
+
+static void sim_command(UINT8 command) {
+	ec_sim_stats.commands++;
+
+	if (sim.mode != EC_SIM_LPC_V2 && command == EC_COMMAND_PROTOCOL_3)
+		sim_command_v3();
+	else
+		sim_command_v2(command);
+
+	sim.busy_until_ns = sim.now_ns + sim.latency_ns;
+	if (sim.irq_enabled)
+		sim.irq_at_ns = sim.busy_until_ns + sim.irq_latency_ns;
+}
+
+/* Map a port in the 0x800-0x9ff window to the backing store, or -1 */
+static int sim_ram_index(unsigned int port) {
+	if (sim.mode == EC_SIM_MEC) {
+		if (port >= SIM_EMI_DATA_B0 && port <= SIM_EMI_DATA_B3)
+			return ((sim.emi_address & 0xFFFC) + (port - SIM_EMI_DATA_B0)) % SIM_RAM_SIZE;
+		return -1;
+	}
+
+	if (port >= EC_LPC_ADDR_HOST_PACKET &&
+		port < EC_LPC_ADDR_HOST_PACKET + EC_LPC_HOST_PACKET_SIZE)
+		return port - EC_LPC_ADDR_HOST_PACKET;
+	if (port >= EC_LPC_ADDR_MEMMAP && port < EC_LPC_ADDR_MEMMAP + EC_MEMMAP_SIZE)
+		return SIM_RAM_MEMMAP + (port - EC_LPC_ADDR_MEMMAP);
+	return -1;
+}
+
+static UINT8 sim_read_byte(unsigned int port) {
+	int index;
+
+	if (port == EC_LPC_ADDR_HOST_DATA)
+		return sim.result;
+
+	if (port == EC_LPC_ADDR_HOST_CMD) {
+		if (sim.now_ns < sim.busy_until_ns) {
+			ec_sim_stats.busy_polls++;
+			return EC_LPC_STATUS_PROCESSING;
+		}
+		return 0;
+	}
+
+	if (sim.mode == EC_SIM_MEC) {
+		if (port == SIM_EMI_ADDRESS_B0)
+			return (UINT8)sim.emi_address;
+		if (port == SIM_EMI_ADDRESS_B1)
+			return (UINT8)(sim.emi_address >> 8);
+	}
+
+	index = sim_ram_index(port);
+	if (index < 0)
+		return 0xff;
+	return sim.ram[index];
+}
+
+static void sim_write_byte(UINT8 val, unsigned int port) {
+	int index;
+
+	if (port == EC_LPC_ADDR_HOST_CMD) {
+		sim_command(val);
+		return;
+	}
+
+	if (sim.mode == EC_SIM_MEC) {
+		if (port == SIM_EMI_ADDRESS_B0) {
+			sim.emi_address = (sim.emi_address & 0xFF00) | val;
+			return;
+		}
+		if (port == SIM_EMI_ADDRESS_B1) {
+			sim.emi_address = (sim.emi_address & 0x00FF) | (val << 8);
+			return;
+		}
+	}
+
+	index = sim_ram_index(port);
+	if (index >= 0)
+		sim.ram[index] = val;
+}
+
+static int sim_touches(unsigned int port, int width, unsigned int reg) {
+	return port <= reg && port + width > reg;
+}
+
+static void sim_access_done(unsigned int port, int width, int write) {
+	if (sim.mode != EC_SIM_MEC)
+		return;
+
+	if (write && (sim_touches(port, width, SIM_EMI_ADDRESS_B0) ||
+		sim_touches(port, width, SIM_EMI_ADDRESS_B1)))
+		ec_sim_stats.emi_address_writes++;
+
+	/* Any access covering DATA_B3 advances the EC address */
+	if ((sim.emi_address & 0x3) == SIM_EMI_AUTOINCREMENT &&
+		sim_touches(port, width, SIM_EMI_DATA_B3))
+		sim.emi_address = ((sim.emi_address & 0xFFFC) + 4) | SIM_EMI_AUTOINCREMENT;
+}
+
+static UINT32 sim_read(unsigned int port, int width) {
+	UINT32 val = 0;
+	int i;
+	for (i = 0; i < width; i++)
+		val |= (UINT32)sim_read_byte(port + i) << (8 * i);
+	sim_access_done(port, width, false);
+	sim.now_ns += sim.port_cost_ns;
+	return val;
+}
+
+static void sim_write(UINT32 val, unsigned int port, int width) {
+	int i;
+	for (i = 0; i < width; i++)
+		sim_write_byte((UINT8)(val >> (8 * i)), port + i);
+	sim_access_done(port, width, true);
+	sim.now_ns += sim.port_cost_ns;
+}
+
+static UINT8 sim_inb(unsigned int port) {
+	ec_sim_stats.inb++;
+	return (UINT8)sim_read(port, 1);
+}
+
+static UINT16 sim_inw(unsigned int port) {
+	ec_sim_stats.inw++;
+	return (UINT16)sim_read(port, 2);
+}
+
+static UINT32 sim_inl(unsigned int port) {
+	ec_sim_stats.inl++;
+	return sim_read(port, 4);
+}
+
+static void sim_outb(UINT8 val, unsigned int port) {
+	ec_sim_stats.outb++;
+	sim_write(val, port, 1);
+}
+
+static void sim_outw(UINT16 val, unsigned int port) {
+	ec_sim_stats.outw++;
+	sim_write(val, port, 2);
+}
+
+static void sim_outl(UINT32 val, unsigned int port) {
+	ec_sim_stats.outl++;
+	sim_write(val, port, 4);
+}
+
+static void sim_udelay(unsigned int usec) {
+	sim.now_ns += (UINT64)usec * 1000;
+}
+
+static void sim_stall(unsigned int usec) {
+	sim.now_ns += (UINT64)usec * 1000;
+}
+
+static UINT64 sim_time_us(void) {
+	return sim.now_ns / 1000;
+}
+
+static void sim_lock(void) {
+}
+
+static void sim_unlock(void) {
+}
+
+static void sim_irq_arm(void) {
+	/* Forget an interrupt that has already fired */
+	if (sim.irq_at_ns && sim.irq_at_ns <= sim.now_ns)
+		sim.irq_at_ns = 0;
+}
+
+static int sim_irq_wait(unsigned int usec) {
+	UINT64 deadline = sim.now_ns + (UINT64)usec * 1000;
+
+	if (sim.irq_at_ns && sim.irq_at_ns <= deadline) {
+		if (sim.irq_at_ns > sim.now_ns)
+			sim.now_ns = sim.irq_at_ns;
+		ec_sim_stats.irq_wakeups++;
+		return 1;
+	}
+
+	sim.now_ns = deadline;
+	return 0;
+}
+
+void ec_sim_init(ec_sim_mode mode)
+{
+	UINT8* memmap;
+
+	memset(&sim, 0, sizeof(sim));
+	memset(&ec_sim_stats, 0, sizeof(ec_sim_stats));
+
+	sim.mode = mode;
+	sim.handler = ec_sim_default_handler;
+
+	memmap = &sim.ram[SIM_RAM_MEMMAP];
+	memmap[EC_MEMMAP_ID] = 'E';
+	memmap[EC_MEMMAP_ID + 1] = 'C';
+	memmap[EC_MEMMAP_ID_VERSION] = 1;
+	memmap[EC_MEMMAP_BATTERY_VERSION] = 1;
+	memmap[EC_MEMMAP_HOST_CMD_FLAGS] = EC_HOST_CMD_FLAG_LPC_ARGS_SUPPORTED;
+	if (mode != EC_SIM_LPC_V2)
+		memmap[EC_MEMMAP_HOST_CMD_FLAGS] |= EC_HOST_CMD_FLAG_VERSION_3;
+	memmap[EC_MEMMAP_BATT_FLAG] = EC_BATT_FLAG_AC_PRESENT | EC_BATT_FLAG_BATT_PRESENT;
+	memcpy(&memmap[EC_MEMMAP_BATT_MFGR], "SIMBAT", 7);
+	memcpy(&memmap[EC_MEMMAP_BATT_MODEL], "MODEL01", 8);
+	memcpy(&memmap[EC_MEMMAP_BATT_SERIAL], "12345", 6);
+	memcpy(&memmap[EC_MEMMAP_BATT_TYPE], "LION", 5);
+
+	ec_port.inb = sim_inb;
+	ec_port.inw = sim_inw;
+	ec_port.inl = sim_inl;
+	ec_port.outb = sim_outb;
+	ec_port.outw = sim_outw;
+	ec_port.outl = sim_outl;
+	ec_port.udelay = sim_udelay;
+	ec_port.stall = sim_stall;
+	ec_port.time_us = sim_time_us;
+	ec_port.lock = sim_lock;
+	ec_port.unlock = sim_unlock;
+	ec_port.irq_arm = NULL;
+	ec_port.irq_wait = NULL;
+}
+
+void ec_sim_set_handler(ec_sim_handler handler)
+{
+	sim.handler = handler ? handler : ec_sim_default_handler;
+}
+
+void ec_sim_set_latency(UINT64 latency_ns)
+{
+	sim.latency_ns = latency_ns;
+}
+
+void ec_sim_set_port_cost(UINT64 cost_ns)
+{
+	sim.port_cost_ns = cost_ns;
+}
+
+void ec_sim_set_irq(int enable, UINT64 latency_ns)
+{
+	sim.irq_enabled = enable;
+	sim.irq_latency_ns = latency_ns;
+	sim.irq_at_ns = 0;
+
+	ec_port.irq_arm = enable ? sim_irq_arm : NULL;
+	ec_port.irq_wait = enable ? sim_irq_wait : NULL;
+}
+
+UINT8* ec_sim_memmap(void)
+{
+	return &sim.ram[SIM_RAM_MEMMAP];
+}
+
+UINT8* ec_sim_ram(void)
+{
+	return sim.ram;
+}
+
+UINT64 ec_sim_now(void)
+{
+	return sim.now_ns;
+}
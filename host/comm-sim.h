@@ -0,0 +1,80 @@
+#ifndef __COMM_SIM_H__
+#define __COMM_SIM_H__
+
+#include "comm-host.h"
+
+/*
+ * In-memory model of a Chromium EC behind the LPC host command registers
+ * (0x200 data, 0x204 command/status, 0x800 packet, 0x900 memmap), or behind
+ * a MEC EMI window at 0x800. Plugs into the transport through ec_port so
+ * comm-lpc.c and comm-mec_lpc.c can run unmodified in a user-mode program.
+ *
+ * Time is virtual: udelay() and EC processing advance a simulated clock,
+ * so runs are deterministic and as fast as the host CPU allows.
+ */
+
+typedef enum _ec_sim_mode {
+	EC_SIM_LPC_V2,
+	EC_SIM_LPC_V3,
+	EC_SIM_MEC
+} ec_sim_mode;
+
+/*
+ * Host command handler. Returns an EC_RES_* code and sets *response_size
+ * to the number of response bytes written (at most max_response).
+ */
+typedef int(*ec_sim_handler)(UINT16 command, UINT8 version,
+	const UINT8* params, int params_size,
+	UINT8* response, int max_response, int* response_size);
+
+struct ec_sim_stats {
+	UINT64 inb, inw, inl;
+	UINT64 outb, outw, outl;
+	/* Writes to MEC_EMI_EC_ADDRESS_B0/B1 */
+	UINT64 emi_address_writes;
+	/* Status register reads that saw the EC busy */
+	UINT64 busy_polls;
+	/* irq_wait calls ended by the virtual completion interrupt */
+	UINT64 irq_wakeups;
+	UINT64 commands;
+};
+
+extern struct ec_sim_stats ec_sim_stats;
+
+/* Reset the model, install it as ec_port and use the default handler */
+void ec_sim_init(ec_sim_mode mode);
+
+/* Replace the host command handler; NULL restores the default */
+void ec_sim_set_handler(ec_sim_handler handler);
+
+/* Time the EC stays busy after each command, in nanoseconds */
+void ec_sim_set_latency(UINT64 latency_ns);
+
+/* Time each port access takes, whatever its width, in nanoseconds */
+void ec_sim_set_port_cost(UINT64 cost_ns);
+
+/*
+ * Raise a virtual interrupt latency_ns after each command completes and
+ * install the ec_port irq hooks; disabled (polling) after ec_sim_init.
+ */
+void ec_sim_set_irq(int enable, UINT64 latency_ns);
+
+/* Direct access to the simulated memory map (EC_MEMMAP_SIZE bytes) */
+UINT8* ec_sim_memmap(void);
+
+/*
+ * The whole EC RAM behind the window, EC_SIM_RAM_SIZE bytes: port 0x800
+ * (the host packet) is at 0, port 0x900 (the memory map) at 0x100
+ */
+#define EC_SIM_RAM_SIZE 0x200
+UINT8* ec_sim_ram(void);
+
+/* Current virtual time in nanoseconds */
+UINT64 ec_sim_now(void);
+
+/* Built-in handler: HELLO, GET_VERSION, GET_FEATURES, READ_MEMMAP, ... */
+int ec_sim_default_handler(UINT16 command, UINT8 version,
+	const UINT8* params, int params_size,
+	UINT8* response, int max_response, int* response_size);
+
+#endif
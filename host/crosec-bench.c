@@ -0,0 +1,788 @@
+/*
+ * crosec-bench: throughput and latency of the LPC v2, LPC v3 and MEC
+ * transports against the simulated EC, across payload sizes from 0 to
+ * EC_LPC_HOST_PACKET_SIZE (clamped to what each protocol can carry).
+ *
+ *   crosec-bench [transport|wait|fifo|quota|fanin|log] [options]
+ *     transport         every interface and payload size (the default)
+ *     wait              the old fixed 200us/100us sleeps in wait_for_ec
+ *                       against the adaptive wait, over a range of EC
+ *                       latencies (-l and -a are ignored)
+ *     fifo              MOTIONSENSE_CMD_FIFO_READ with a full FIFO, so
+ *                       every response is as large as the interface allows
+ *     quota             kernel commands every 1ms while userspace handles
+ *                       flood the EC with full-size XCMDs: no quotas,
+ *                       per-handle quotas only, and per-handle quotas plus
+ *                       the device-wide one (crosecbus/ecQuota.c); -n
+ *                       counts kernel commands
+ *     fanin             1 to 16 threads asking for EC_CMD_GET_VERSION at
+ *                       once, each command sent on its own or coalesced by
+ *                       crosecbus/singleFlight.c; -n counts requests per
+ *                       thread, and -l is spent in real time so the
+ *                       threads overlap
+ *     log               host time per command with and without
+ *                       CrosEcCmdLogRecord (crosecbus/cmdLog.c), best of
+ *                       five passes
+ *
+ *     -m lpc2|lpc3|mec  only run one EC interface (default all three)
+ *     -a <ns>           time per port access (default 1000)
+ *     -l <ns>           EC processing time per command (default 20000)
+ *     -j <ns>           add up to <ns> of random EC processing time
+ *     -i <ns>           raise a completion interrupt <ns> after each command
+ *     -n <count>        commands per payload size (default 10000)
+ *
+ * Each command sends and asks for the same number of payload bytes. Bus
+ * time is virtual, so commands/s, port accesses and the percentiles only
+ * change when the transport (or the model) does; host commands/s is the
+ * CPU cost of the transport and the model on this machine.
+ *
+ * Build with:
+ *   gcc -O2 -DCROSEC_HOST -Ihost/include -Icrosecbus -Ihost crosecbus/comm-lpc.c
+ *       crosecbus/comm-mec_lpc.c crosecbus/cmdLog.c crosecbus/ecQuota.c
+ *       crosecbus/singleFlight.c host/comm-sim.c host/crosec-wdk.c
+ *       host/crosec-bench.c -lpthread
+ */
+
+#include <stdlib.h>
+#include <time.h>
+
+#include "comm-sim.h"
+#include "driver.h"
+
+static const struct {
+	const char* name;
+	ec_sim_mode mode;
+} modes[] = {
+	{ "lpc2", EC_SIM_LPC_V2 },
+	{ "lpc3", EC_SIM_LPC_V3 },
+	{ "mec", EC_SIM_MEC },
+};
+
+static const int sizes[] = { 0, 8, 16, 32, 64, 128, 192, EC_LPC_HOST_PACKET_SIZE };
+
+static UINT64 bench_latency_ns, bench_jitter_ns;
+static UINT32 bench_random = 1;
+static int bench_response;
+
+/* xorshift32, so every run sees the same jitter whatever the libc */
+static UINT32 bench_next_random(void)
+{
+	bench_random ^= bench_random << 13;
+	bench_random ^= bench_random >> 17;
+	bench_random ^= bench_random << 5;
+	return bench_random;
+}
+
+/* Answers any command with bench_response bytes */
+static int bench_handler(UINT16 command, UINT8 version,
+	const UINT8* params, int params_size,
+	UINT8* response, int max_response, int* response_size)
+{
+	UNREFERENCED_PARAMETER(command);
+	UNREFERENCED_PARAMETER(version);
+	UNREFERENCED_PARAMETER(params);
+	UNREFERENCED_PARAMETER(params_size);
+
+	if (bench_jitter_ns)
+		ec_sim_set_latency(bench_latency_ns + bench_next_random() % bench_jitter_ns);
+
+	if (bench_response > max_response)
+		return EC_RES_RESPONSE_TOO_BIG;
+	memset(response, 0xa5, bench_response);
+	*response_size = bench_response;
+	return EC_RES_SUCCESS;
+}
+
+static UINT64 host_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (UINT64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int by_value(const void* a, const void* b)
+{
+	UINT64 x = *(const UINT64*)a;
+	UINT64 y = *(const UINT64*)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static double percentile_us(const UINT64* sorted, long count, double p)
+{
+	long i = (long)(p * count);
+
+	return sorted[i < count ? i : count - 1] / 1e3;
+}
+
+static void print_percentiles(UINT64* latencies, long count)
+{
+	qsort(latencies, count, sizeof(*latencies), by_value);
+	printf(" %9.2f %9.2f %9.2f\n",
+		percentile_us(latencies, count, 0.5),
+		percentile_us(latencies, count, 0.99),
+		percentile_us(latencies, count, 0.999));
+}
+
+static int start_sim(ec_sim_mode mode, const char* name, UINT64 port_ns, int irq, UINT64 irq_ns)
+{
+	ec_sim_init(mode);
+	if (irq)
+		ec_sim_set_irq(1, irq_ns);
+	/* Also starts wait_for_ec over with no latency estimates */
+	if (!NT_SUCCESS(comm_init_lpc())) {
+		fprintf(stderr, "%s: transport didn't come up against the simulated EC\n", name);
+		return 1;
+	}
+
+	ec_sim_set_handler(bench_handler);
+	ec_sim_set_latency(bench_latency_ns);
+	ec_sim_set_port_cost(port_ns);
+	return 0;
+}
+
+static int run_transport(ec_sim_mode mode, const char* name, UINT64 port_ns,
+	int irq, UINT64 irq_ns, long count, UINT64* latencies)
+{
+	static UINT8 out[EC_LPC_HOST_PACKET_SIZE], in[EC_LPC_HOST_PACKET_SIZE];
+	int last = -1;
+
+	if (start_sim(mode, name, port_ns, irq, irq_ns))
+		return 1;
+	memset(out, 0x5a, sizeof(out));
+
+	for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+		int size = sizes[s];
+		if (size > (int)ec_max_outsize)
+			size = ec_max_outsize;
+		if (size > (int)ec_max_insize)
+			size = ec_max_insize;
+		if (size == last)
+			continue;
+		last = size;
+
+		bench_response = size;
+		memset(&ec_sim_stats, 0, sizeof(ec_sim_stats));
+		UINT64 virtual_start = ec_sim_now();
+		UINT64 host_start = host_ns();
+
+		for (long i = 0; i < count; i++) {
+			UINT64 start = ec_sim_now();
+			int res = ec_command_proto(EC_CMD_HELLO, 0, out, size, in, size);
+
+			if (res != size) {
+				fprintf(stderr, "%s: %d byte command failed: %d\n", name, size, res);
+				return 1;
+			}
+			latencies[i] = ec_sim_now() - start;
+		}
+
+		UINT64 host_elapsed = host_ns() - host_start;
+		UINT64 virtual_elapsed = ec_sim_now() - virtual_start;
+		UINT64 ports = ec_sim_stats.inb + ec_sim_stats.inw + ec_sim_stats.inl +
+			ec_sim_stats.outb + ec_sim_stats.outw + ec_sim_stats.outl;
+
+		printf("%-5s %5d %12.0f %12.0f %10.2f", name, size,
+			virtual_elapsed ? count * 1e9 / virtual_elapsed : 0,
+			host_elapsed ? count * 1e9 / host_elapsed : 0,
+			(double)ports / count);
+		print_percentiles(latencies, count);
+	}
+	return 0;
+}
+
+/* A sensor FIFO that always has more samples than fit in a response */
+static int fifo_handler(UINT16 command, UINT8 version,
+	const UINT8* params, int params_size,
+	UINT8* response, int max_response, int* response_size)
+{
+	const struct ec_params_motion_sense* p = (const struct ec_params_motion_sense*)params;
+	struct ec_response_motion_sense_fifo_data* r = (struct ec_response_motion_sense_fifo_data*)response;
+
+	UNREFERENCED_PARAMETER(version);
+
+	if (command != EC_CMD_MOTION_SENSE_CMD || params_size < 1 + (int)sizeof(p->fifo_read) ||
+		p->cmd != MOTIONSENSE_CMD_FIFO_READ)
+		return EC_RES_INVALID_COMMAND;
+
+	UINT32 n = (max_response - sizeof(*r)) / sizeof(r->data[0]);
+	if (n > p->fifo_read.max_data_vector)
+		n = p->fifo_read.max_data_vector;
+
+	r->number_data = n;
+	for (UINT32 i = 0; i < n; i++) {
+		r->data[i].flags = 0;
+		r->data[i].sensor_num = i & 1;
+		r->data[i].data[0] = (INT16)(i * 3);
+		r->data[i].data[1] = (INT16)(i * 3 + 1);
+		r->data[i].data[2] = (INT16)(i * 3 + 2);
+	}
+	*response_size = sizeof(*r) + n * sizeof(r->data[0]);
+	return EC_RES_SUCCESS;
+}
+
+static int run_fifo(ec_sim_mode mode, const char* name, UINT64 port_ns,
+	int irq, UINT64 irq_ns, long count, UINT64* latencies)
+{
+	static UINT8 in[EC_LPC_HOST_PACKET_SIZE];
+	struct ec_response_motion_sense_fifo_data* r = (struct ec_response_motion_sense_fifo_data*)in;
+	struct ec_params_motion_sense p = { 0 };
+
+	if (start_sim(mode, name, port_ns, irq, irq_ns))
+		return 1;
+	ec_sim_set_handler(fifo_handler);
+
+	int insize = ec_max_insize < sizeof(in) ? ec_max_insize : sizeof(in);
+	UINT32 vectors = (insize - sizeof(*r)) / sizeof(r->data[0]);
+	p.cmd = MOTIONSENSE_CMD_FIFO_READ;
+	p.fifo_read.max_data_vector = vectors;
+
+	memset(&ec_sim_stats, 0, sizeof(ec_sim_stats));
+	UINT64 virtual_start = ec_sim_now();
+	UINT64 host_start = host_ns();
+	int res = 0;
+
+	for (long i = 0; i < count; i++) {
+		UINT64 start = ec_sim_now();
+		res = ec_command_proto(EC_CMD_MOTION_SENSE_CMD, 0, &p, 1 + sizeof(p.fifo_read), in, insize);
+
+		if (res != (int)(sizeof(*r) + vectors * sizeof(r->data[0])) || r->number_data != vectors ||
+			r->data[vectors - 1].data[2] != (INT16)(vectors * 3 - 1)) {
+			fprintf(stderr, "%s: FIFO read failed: %d\n", name, res);
+			return 1;
+		}
+		latencies[i] = ec_sim_now() - start;
+	}
+
+	UINT64 host_elapsed = host_ns() - host_start;
+	UINT64 virtual_elapsed = ec_sim_now() - virtual_start;
+	UINT64 ports = ec_sim_stats.inb + ec_sim_stats.inw + ec_sim_stats.inl +
+		ec_sim_stats.outb + ec_sim_stats.outw + ec_sim_stats.outl;
+
+	printf("%-5s %5d %7u %12.0f %10.1f %10.2f", name, res, vectors,
+		virtual_elapsed ? count * vectors * 1e9 / virtual_elapsed : 0,
+		(double)host_elapsed / count, (double)ports / count);
+	print_percentiles(latencies, count);
+	return 0;
+}
+
+/* wait_for_ec as it was: sleep 200us, then poll every 100us */
+static int fixed_sleep_command(void)
+{
+	int res = ec_command_submit(EC_CMD_HELLO, 0, NULL, 0);
+	if (res < 0)
+		return res;
+
+	ec_port.udelay(200);
+	while (ec_command_busy())
+		ec_port.udelay(100);
+	return ec_command_complete(NULL, 0);
+}
+
+static int run_wait(ec_sim_mode mode, const char* name, UINT64 port_ns,
+	int irq, UINT64 irq_ns, long count, UINT64* latencies)
+{
+	static const UINT64 ec_latencies_ns[] = { 3000, 10000, 50000, 200000, 1000000 };
+
+	for (size_t l = 0; l < sizeof(ec_latencies_ns) / sizeof(ec_latencies_ns[0]); l++) {
+		for (int adaptive = 0; adaptive < 2; adaptive++) {
+			bench_latency_ns = ec_latencies_ns[l];
+			if (start_sim(mode, name, port_ns, irq, irq_ns))
+				return 1;
+			bench_response = 0;
+			memset(&ec_sim_stats, 0, sizeof(ec_sim_stats));
+
+			for (long i = 0; i < count; i++) {
+				UINT64 start = ec_sim_now();
+				int res = adaptive ? ec_command_proto(EC_CMD_HELLO, 0, NULL, 0, NULL, 0) :
+					fixed_sleep_command();
+
+				if (res != 0) {
+					fprintf(stderr, "%s: command failed: %d\n", name, res);
+					return 1;
+				}
+				latencies[i] = ec_sim_now() - start;
+			}
+
+			printf("%-5s %8.0f %-8s %11.2f", name, ec_latencies_ns[l] / 1e3,
+				adaptive ? "adaptive" : "fixed", (double)ec_sim_stats.busy_polls / count);
+			print_percentiles(latencies, count);
+		}
+	}
+	return 0;
+}
+
+#define QUOTA_KERNEL_PERIOD_NS 1000000
+#define QUOTA_MAX_USERS        16
+
+static const int quota_users[] = { 0, 1, 4, QUOTA_MAX_USERS };
+
+/* Same order as the quota column */
+static const char* quota_names[] = { "off", "handle", "total" };
+
+/* Quotas run on virtual time */
+static ULONGLONG bench_clock(void)
+{
+	return ec_sim_now() / 100;
+}
+
+/*
+ * The arbiter grants kernel callers the EC ahead of the XCMD engine, but
+ * can't take it back from a command already on the bus. Kernel latency is
+ * counted from when each command was due, so it includes any wait for the
+ * userspace command in the way.
+ */
+static int run_quota(ec_sim_mode mode, const char* name, UINT64 port_ns,
+	int irq, UINT64 irq_ns, long count, UINT64* latencies)
+{
+	static UINT8 out[EC_LPC_HOST_PACKET_SIZE], in[EC_LPC_HOST_PACKET_SIZE];
+	CROSEC_QUOTA_BUCKET buckets[QUOTA_MAX_USERS], total_bucket;
+
+	for (size_t n = 0; n < sizeof(quota_users) / sizeof(quota_users[0]); n++) {
+		for (int quota = 0; quota < 3; quota++) {
+			int users = quota_users[n];
+			CROSEC_QUOTA_CONFIG config = { quota ? CROSEC_QUOTA_DEFAULT_RATE_US : 0, CROSEC_QUOTA_DEFAULT_BURST_US };
+			CROSEC_QUOTA_CONFIG total = { quota > 1 ? CROSEC_QUOTA_DEFAULT_TOTAL_RATE_US : 0,
+				CROSEC_QUOTA_DEFAULT_TOTAL_BURST_US };
+
+			if (!users && quota)
+				continue;
+			if (start_sim(mode, name, port_ns, irq, irq_ns))
+				return 1;
+			crosec_wdk_clock = bench_clock;
+			for (int u = 0; u < users; u++)
+				CrosEcQuotaInitBucket(&config, &buckets[u]);
+			CrosEcQuotaInitBucket(&total, &total_bucket);
+
+			int size = ec_max_outsize < ec_max_insize ? ec_max_outsize : ec_max_insize;
+			if (size > (int)sizeof(out))
+				size = sizeof(out);
+
+			UINT64 virtual_start = ec_sim_now();
+			UINT64 next_kernel = virtual_start;
+			UINT64 user_cmds = 0, user_ns = 0, user_max_ns = 0;
+			int turn = 0;
+
+			for (long done = 0; done < count;) {
+				UINT64 now = ec_sim_now();
+				int res;
+
+				if (now >= next_kernel) {
+					bench_response = 0;
+					res = ec_command_proto(EC_CMD_HELLO, 0, NULL, 0, NULL, 0);
+					if (res != 0) {
+						fprintf(stderr, "%s: kernel command failed: %d\n", name, res);
+						return 1;
+					}
+					latencies[done++] = ec_sim_now() - next_kernel;
+					next_kernel += QUOTA_KERNEL_PERIOD_NS;
+					continue;
+				}
+
+				/*
+				 * Otherwise the engine starts the next handle in turn that has
+				 * bus time, if userspace as a whole has some left
+				 */
+				int admitted = -1;
+				if (CrosEcQuotaAdmit(&total, &total_bucket)) {
+					for (int i = 0; i < users && admitted < 0; i++) {
+						if (CrosEcQuotaAdmit(&config, &buckets[(turn + i) % users]))
+							admitted = (turn + i) % users;
+					}
+				}
+
+				if (admitted < 0) {
+					/* Idle until the next kernel command or the first bucket to refill */
+					UINT64 wake = next_kernel;
+					UINT64 total_due = now + (UINT64)CrosEcQuotaDelayUs(&total, &total_bucket) * 1000;
+					for (int u = 0; u < users; u++) {
+						UINT64 due = now + (UINT64)CrosEcQuotaDelayUs(&config, &buckets[u]) * 1000;
+						if (due < total_due)
+							due = total_due;
+						if (due < wake)
+							wake = due;
+					}
+					ec_port.udelay((UINT32)((wake - now + 999) / 1000));
+					continue;
+				}
+
+				turn = admitted + 1;
+				bench_response = size;
+				res = ec_command_proto(EC_CMD_HELLO, 0, out, size, in, size);
+				if (res != size) {
+					fprintf(stderr, "%s: %d byte command failed: %d\n", name, size, res);
+					return 1;
+				}
+
+				UINT64 ns = ec_sim_now() - now;
+				CrosEcQuotaCharge(&buckets[admitted], ns / 1000);
+				CrosEcQuotaCharge(&total_bucket, ns / 1000);
+				user_cmds++;
+				user_ns += ns;
+				if (ns > user_max_ns)
+					user_max_ns = ns;
+			}
+
+			UINT64 virtual_elapsed = ec_sim_now() - virtual_start;
+			crosec_wdk_clock = NULL;
+
+			printf("%-5s %5d %-6s %12.0f %9.1f %11.2f", name, users, quota_names[quota],
+				user_cmds * 1e9 / virtual_elapsed, user_ns * 100.0 / virtual_elapsed, user_max_ns / 1e3);
+			print_percentiles(latencies, count);
+		}
+	}
+	return 0;
+}
+
+#define FANIN_MAX_THREADS 16
+
+static const int fanin_threads[] = { 1, 2, 4, 8, FANIN_MAX_THREADS };
+
+static pthread_mutex_t fanin_ec = PTHREAD_MUTEX_INITIALIZER;
+static CROSEC_FLIGHTS fanin_flights;
+static int fanin_coalesce, fanin_failed;
+static long fanin_count;
+static UINT64* fanin_latencies;
+
+/* Answers EC_CMD_GET_VERSION after bench_latency_ns of wall-clock time */
+static int fanin_handler(UINT16 command, UINT8 version,
+	const UINT8* params, int params_size,
+	UINT8* response, int max_response, int* response_size)
+{
+	struct ec_response_get_version* r = (struct ec_response_get_version*)response;
+	struct timespec delay = { 0, (long)bench_latency_ns };
+
+	UNREFERENCED_PARAMETER(version);
+	UNREFERENCED_PARAMETER(params);
+	UNREFERENCED_PARAMETER(params_size);
+
+	if (command != EC_CMD_GET_VERSION)
+		return EC_RES_INVALID_COMMAND;
+	if (max_response < (int)sizeof(*r))
+		return EC_RES_RESPONSE_TOO_BIG;
+
+	nanosleep(&delay, NULL);
+	memset(r, 0, sizeof(*r));
+	strcpy(r->version_string_ro, "bench_v1.0.0");
+	strcpy(r->version_string_rw, "bench_v1.0.1");
+	r->current_image = EC_IMAGE_RW;
+	*response_size = sizeof(*r);
+	return EC_RES_SUCCESS;
+}
+
+/* The mutex stands in for EcLock */
+static int fanin_send(struct ec_response_get_version* r)
+{
+	pthread_mutex_lock(&fanin_ec);
+	int res = ec_command_proto(EC_CMD_GET_VERSION, 0, NULL, 0, r, sizeof(*r));
+	pthread_mutex_unlock(&fanin_ec);
+	return res;
+}
+
+/* What CrosEcCmdXferClass does with a read-only kernel command */
+static void* fanin_client(void* arg)
+{
+	long index = (long)(intptr_t)arg;
+	struct ec_response_get_version r;
+	CROSEC_FLIGHT_KEY key;
+	UINT8 noParams = 0;
+
+	CrosEcFlightKeyInit(&key, EC_CMD_GET_VERSION, 0, &noParams, 0, sizeof(r));
+
+	for (long i = 0; i < fanin_count; i++) {
+		UINT64 start = host_ns();
+		PCROSEC_FLIGHT flight = NULL;
+		BOOLEAN leader = TRUE;
+		int res;
+
+		if (fanin_coalesce)
+			flight = CrosEcFlightJoin(&fanin_flights, &key, &leader);
+
+		if (!leader) {
+			res = CrosEcFlightWait(&fanin_flights, flight, &r);
+		}
+		else {
+			res = fanin_send(&r);
+			if (flight)
+				CrosEcFlightLand(&fanin_flights, flight, res, &r);
+		}
+
+		if (res != (int)sizeof(r) || strcmp(r.version_string_rw, "bench_v1.0.1"))
+			__atomic_store_n(&fanin_failed, 1, __ATOMIC_RELAXED);
+		fanin_latencies[index * fanin_count + i] = host_ns() - start;
+	}
+	return NULL;
+}
+
+static int run_fanin(ec_sim_mode mode, const char* name, UINT64 port_ns,
+	int irq, UINT64 irq_ns, long count, UINT64* latencies)
+{
+	pthread_t threads[FANIN_MAX_THREADS];
+
+	UNREFERENCED_PARAMETER(latencies);
+
+	fanin_latencies = calloc((size_t)count * FANIN_MAX_THREADS, sizeof(*fanin_latencies));
+	if (!fanin_latencies) {
+		fprintf(stderr, "Out of memory\n");
+		return 1;
+	}
+	fanin_count = count;
+
+	for (size_t t = 0; t < sizeof(fanin_threads) / sizeof(fanin_threads[0]); t++) {
+		for (fanin_coalesce = 0; fanin_coalesce < 2; fanin_coalesce++) {
+			long nthreads = fanin_threads[t];
+			long requests = nthreads * count;
+			CROSEC_FLIGHT_STATS stats;
+
+			/* The EC's time is spent in the handler instead */
+			UINT64 latency_ns = bench_latency_ns;
+			bench_latency_ns = 0;
+			int rc = start_sim(mode, name, port_ns, irq, irq_ns);
+			bench_latency_ns = latency_ns;
+			if (rc) {
+				free(fanin_latencies);
+				return 1;
+			}
+			ec_sim_set_handler(fanin_handler);
+			CrosEcFlightsInit(&fanin_flights);
+			fanin_failed = 0;
+			memset(&ec_sim_stats, 0, sizeof(ec_sim_stats));
+
+			UINT64 host_start = host_ns();
+			for (long i = 0; i < nthreads; i++)
+				pthread_create(&threads[i], NULL, fanin_client, (void*)(intptr_t)i);
+			for (long i = 0; i < nthreads; i++)
+				pthread_join(threads[i], NULL);
+			UINT64 host_elapsed = host_ns() - host_start;
+
+			if (fanin_failed || crosec_wdk_stats.outstanding) {
+				fprintf(stderr, "%s: GET_VERSION failed, or %lld flights weren't freed\n", name,
+					(long long)crosec_wdk_stats.outstanding);
+				free(fanin_latencies);
+				return 1;
+			}
+
+			CrosEcFlightsQueryStats(&fanin_flights, &stats);
+			printf("%-5s %7ld %-8s %9ld %11.3f %9.2f %12.0f", name, nthreads,
+				fanin_coalesce ? "flights" : "off", requests,
+				(double)ec_sim_stats.commands / requests,
+				fanin_coalesce ? (double)stats.Shared / requests * 100 : 0.0,
+				requests * 1e9 / host_elapsed);
+			print_percentiles(fanin_latencies, requests);
+		}
+	}
+
+	free(fanin_latencies);
+	return 0;
+}
+
+#define LOG_PASSES 5
+
+static CROSEC_CMD_LOG bench_log;
+
+/* Host ns per command the way CrosEcCmdXferLocked sends it, one pass */
+static double log_pass_ns(int size, long count, int logging)
+{
+	static UINT8 out[EC_LPC_HOST_PACKET_SIZE], in[EC_LPC_HOST_PACKET_SIZE];
+	UINT64 host_start = host_ns();
+
+	for (long i = 0; i < count; i++) {
+		ULONGLONG start = KeQueryInterruptTime();
+		int res = ec_command_proto(EC_CMD_HELLO, 0, out, size, in, size);
+
+		if (res != size)
+			return -1;
+		if (logging)
+			CrosEcCmdLogRecord(&bench_log, CrosEcLockClassKernel, EC_CMD_HELLO, 0, size, size, res, start);
+	}
+	return (double)(host_ns() - host_start) / count;
+}
+
+/* CrosEcCmdLogRecord on its own, no EC */
+static double log_record_ns(long count)
+{
+	double best = 0;
+
+	for (int pass = 0; pass < LOG_PASSES; pass++) {
+		UINT64 host_start = host_ns();
+
+		for (long i = 0; i < count; i++)
+			CrosEcCmdLogRecord(&bench_log, CrosEcLockClassKernel, EC_CMD_HELLO, 0, 0, 0, 0, KeQueryInterruptTime());
+
+		double ns = (double)(host_ns() - host_start) / count;
+		if (!pass || ns < best)
+			best = ns;
+	}
+	return best;
+}
+
+static int run_log(ec_sim_mode mode, const char* name, UINT64 port_ns,
+	int irq, UINT64 irq_ns, long count, UINT64* latencies)
+{
+	int last = -1;
+
+	UNREFERENCED_PARAMETER(latencies);
+
+	if (start_sim(mode, name, port_ns, irq, irq_ns))
+		return 1;
+
+	for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+		int size = sizes[s];
+		if (size > (int)ec_max_outsize)
+			size = ec_max_outsize;
+		if (size > (int)ec_max_insize)
+			size = ec_max_insize;
+		if (size == last)
+			continue;
+		last = size;
+
+		/* Alternate the passes so drift in host speed hits both sides alike */
+		bench_response = size;
+		double off = 0, on = 0;
+		for (int pass = 0; pass < LOG_PASSES; pass++) {
+			double plain = log_pass_ns(size, count, 0);
+			double logged = log_pass_ns(size, count, 1);
+			if (plain < 0 || logged < 0) {
+				fprintf(stderr, "%s: %d byte command failed\n", name, size);
+				return 1;
+			}
+			if (!pass || plain < off)
+				off = plain;
+			if (!pass || logged < on)
+				on = logged;
+		}
+
+		printf("%-5s %5d %12.1f %12.1f %10.1f %8.2f\n", name, size, off, on, on - off,
+			(on - off) * 100 / off);
+	}
+	return 0;
+}
+
+int main(int argc, char** argv)
+{
+	const char* only = NULL;
+	UINT64 port_ns = 1000, irq_ns = 0;
+	int irq = 0;
+	long count = 10000;
+	int (*run)(ec_sim_mode, const char*, UINT64, int, UINT64, long, UINT64*) = run_transport;
+	int opt = 1;
+
+	if (argc > 1 && !strcmp(argv[1], "transport"))
+		opt++;
+	else if (argc > 1 && !strcmp(argv[1], "wait")) {
+		run = run_wait;
+		port_ns = 0;
+		opt++;
+	}
+	else if (argc > 1 && !strcmp(argv[1], "fifo")) {
+		run = run_fifo;
+		opt++;
+	}
+	else if (argc > 1 && !strcmp(argv[1], "quota")) {
+		run = run_quota;
+		count = 2000;
+		opt++;
+	}
+	else if (argc > 1 && !strcmp(argv[1], "fanin")) {
+		run = run_fanin;
+		count = 500;
+		opt++;
+	}
+	else if (argc > 1 && !strcmp(argv[1], "log")) {
+		run = run_log;
+		opt++;
+	}
+
+	bench_latency_ns = 20000;
+	for (; opt < argc; opt++) {
+		const char* arg = opt + 1 < argc ? argv[opt + 1] : NULL;
+
+		if (!arg)
+			break;
+		if (!strcmp(argv[opt], "-m"))
+			only = arg;
+		else if (!strcmp(argv[opt], "-a"))
+			port_ns = strtoull(arg, NULL, 0);
+		else if (!strcmp(argv[opt], "-l"))
+			bench_latency_ns = strtoull(arg, NULL, 0);
+		else if (!strcmp(argv[opt], "-j"))
+			bench_jitter_ns = strtoull(arg, NULL, 0);
+		else if (!strcmp(argv[opt], "-i")) {
+			irq = 1;
+			irq_ns = strtoull(arg, NULL, 0);
+		}
+		else if (!strcmp(argv[opt], "-n"))
+			count = strtol(arg, NULL, 0);
+		else
+			break;
+		opt++;
+	}
+	if (opt != argc || count < 1) {
+		fprintf(stderr, "usage: %s [transport|wait|fifo|quota|fanin|log] [-m lpc2|lpc3|mec] [-a ns] [-l ns] [-j ns] [-i ns] [-n count]\n",
+			argv[0]);
+		return 2;
+	}
+
+	UINT64* latencies = calloc(count, sizeof(*latencies));
+	if (!latencies) {
+		fprintf(stderr, "Out of memory\n");
+		return 1;
+	}
+
+	if (run == run_wait) {
+		printf("# EC latency + up to %llu ns, interrupt %s, %ld commands each\n",
+			(unsigned long long)bench_jitter_ns, irq ? "on" : "off", count);
+		printf("%-5s %8s %-8s %11s %9s %9s %9s\n",
+			"mode", "EC us", "wait", "polls/cmd", "p50 us", "p99 us", "p999 us");
+	}
+	else if (run == run_fifo) {
+		printf("# port access %llu ns, EC latency %llu ns + up to %llu ns, interrupt %s, %ld reads\n",
+			(unsigned long long)port_ns, (unsigned long long)bench_latency_ns,
+			(unsigned long long)bench_jitter_ns, irq ? "on" : "off", count);
+		printf("%-5s %5s %7s %12s %10s %10s %9s %9s %9s\n",
+			"mode", "bytes", "samples", "samples/s", "host ns", "ports/cmd", "p50 us", "p99 us", "p999 us");
+	}
+	else if (run == run_quota) {
+		printf("# port access %llu ns, EC latency %llu ns + up to %llu ns, interrupt %s, %ld kernel commands\n",
+			(unsigned long long)port_ns, (unsigned long long)bench_latency_ns,
+			(unsigned long long)bench_jitter_ns, irq ? "on" : "off", count);
+		printf("%-5s %5s %-6s %12s %9s %11s %9s %9s %9s\n",
+			"mode", "users", "quota", "user cmds/s", "user bus%", "user max us", "p50 us", "p99 us", "p999 us");
+	}
+	else if (run == run_log) {
+		printf("# port access %llu ns, %ld commands per size, CrosEcCmdLogRecord alone %.1f ns\n",
+			(unsigned long long)port_ns, count, log_record_ns(count));
+		printf("%-5s %5s %12s %12s %10s %8s\n",
+			"mode", "size", "host ns", "logged ns", "delta ns", "delta %");
+	}
+	else if (run == run_fanin) {
+		printf("# port access %llu ns, EC latency %llu ns (wall clock), interrupt %s, %ld requests per thread\n",
+			(unsigned long long)port_ns, (unsigned long long)bench_latency_ns, irq ? "on" : "off", count);
+		printf("%-5s %7s %-8s %9s %11s %9s %12s %9s %9s %9s\n",
+			"mode", "threads", "coalesce", "requests", "EC cmds/req", "shared %", "requests/s",
+			"p50 us", "p99 us", "p999 us");
+	}
+	else {
+		printf("# port access %llu ns, EC latency %llu ns + up to %llu ns, interrupt %s, %ld commands per size\n",
+			(unsigned long long)port_ns, (unsigned long long)bench_latency_ns,
+			(unsigned long long)bench_jitter_ns, irq ? "on" : "off", count);
+		printf("%-5s %5s %12s %12s %10s %9s %9s %9s\n",
+			"mode", "size", "cmds/s", "host cmds/s", "ports/cmd", "p50 us", "p99 us", "p999 us");
+	}
+
+	int rc = 0, ran = 0;
+	for (size_t m = 0; m < sizeof(modes) / sizeof(modes[0]); m++) {
+		if (only && strcmp(only, modes[m].name))
+			continue;
+		rc |= run(modes[m].mode, modes[m].name, port_ns, irq, irq_ns, count, latencies);
+		ran++;
+	}
+	if (!ran) {
+		fprintf(stderr, "Unknown mode %s\n", only);
+		rc = 2;
+	}
+
+	free(latencies);
+	return rc;
+}
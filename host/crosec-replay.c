@@ -0,0 +1,299 @@
+/*
+ * crosec-replay: run a crosecbus command capture (crosecbus/ecCapture.h)
+ * through the real transport code against the simulated EC, which answers
+ * each command with the response that was recorded for it. Time is
+ * virtual, so two runs of the same capture count the same port accesses
+ * and the same bus time, and a transport change shows up as a difference.
+ *
+ *   crosec-replay [options] <file>
+ *     -m lpc2|lpc3|mec  EC interface to simulate (default lpc3)
+ *     -l <ns>           EC processing time per command (default 0)
+ *     -r                use each command's recorded duration instead
+ *     -i <ns>           raise a completion interrupt <ns> after each command
+ *     -g                keep the recorded idle time between commands
+ *     -n <count>        replay the capture <count> times (default 1)
+ *     -p                print the capture instead of replaying it
+ *     -v                report every command that came back differently
+ *
+ * Commands that failed on the host side when captured (timeouts and the
+ * like) are skipped, since the simulated EC always answers. Exits non-zero
+ * if any replayed command came back differently.
+ *
+ * Build with:
+ *   gcc -DCROSEC_HOST -Ihost/include -Icrosecbus -Ihost crosecbus/comm-lpc.c
+ *       crosecbus/comm-mec_lpc.c host/comm-sim.c host/crosec-replay.c
+ */
+
+#include <stdlib.h>
+#include <time.h>
+
+#include "comm-sim.h"
+
+#define CROSEC_CAPTURE_FORMAT_ONLY
+#include "ecCapture.h"
+
+static const CROSEC_CAPTURE_RECORD* replay_record;
+static int replay_verbose;
+static UINT64 replay_unexpected;
+
+static const UINT8* record_params(const CROSEC_CAPTURE_RECORD* r)
+{
+	return (const UINT8*)(r + 1);
+}
+
+static const UINT8* record_response(const CROSEC_CAPTURE_RECORD* r)
+{
+	return record_params(r) + r->OutSize;
+}
+
+/* Host errors came from the transport or a timeout, not from the EC */
+static int record_replayable(const CROSEC_CAPTURE_RECORD* r)
+{
+	return r->Result >= 0 || r->Result <= -EECRESULT;
+}
+
+static int replay_handler(UINT16 command, UINT8 version,
+	const UINT8* params, int params_size,
+	UINT8* response, int max_response, int* response_size)
+{
+	const CROSEC_CAPTURE_RECORD* r = replay_record;
+
+	/* Exactly one EC command per record; anything else is the transport's doing */
+	replay_record = NULL;
+	if (!r || command != r->Command || version != r->Version ||
+		params_size != r->OutSize || memcmp(params, record_params(r), params_size)) {
+		if (replay_verbose)
+			fprintf(stderr, "unexpected command 0x%04x v%u, %d bytes\n", command, version, params_size);
+		replay_unexpected++;
+		return EC_RES_INVALID_COMMAND;
+	}
+
+	if (r->Result <= -EECRESULT)
+		return -r->Result - EECRESULT;
+
+	if (r->InSize > max_response)
+		return EC_RES_RESPONSE_TOO_BIG;
+	memcpy(response, record_response(r), r->InSize);
+	*response_size = r->InSize;
+	return EC_RES_SUCCESS;
+}
+
+static UINT64 host_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (UINT64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Reads a capture and indexes its records; returns the record count or -1 */
+static long load(const char* path, CROSEC_CAPTURE_HEADER* h, UINT8** data,
+	const CROSEC_CAPTURE_RECORD*** records)
+{
+	FILE* f = fopen(path, "rb");
+	if (!f) {
+		perror(path);
+		return -1;
+	}
+
+	if (fread(h, sizeof(*h), 1, f) != 1 || h->Magic != CROSEC_CAPTURE_MAGIC) {
+		fprintf(stderr, "%s: not a crosecbus capture\n", path);
+		fclose(f);
+		return -1;
+	}
+	if (h->Version != CROSEC_CAPTURE_VERSION || h->RecordSize != sizeof(CROSEC_CAPTURE_RECORD)) {
+		fprintf(stderr, "%s: unsupported capture version %u\n", path, h->Version);
+		fclose(f);
+		return -1;
+	}
+
+	*data = malloc(h->DataSize ? h->DataSize : 1);
+	*records = calloc(h->Records ? h->Records : 1, sizeof(**records));
+	if (!*data || !*records || fread(*data, 1, h->DataSize, f) != h->DataSize) {
+		fprintf(stderr, "%s: truncated\n", path);
+		fclose(f);
+		return -1;
+	}
+	fclose(f);
+
+	UINT32 offset = 0;
+	for (UINT32 i = 0; i < h->Records; i++) {
+		const CROSEC_CAPTURE_RECORD* r = (const CROSEC_CAPTURE_RECORD*)(*data + offset);
+
+		if (h->DataSize - offset < sizeof(*r) ||
+			h->DataSize - offset - sizeof(*r) < (UINT32)r->OutSize + r->InSize) {
+			fprintf(stderr, "%s: record %u is truncated\n", path, i);
+			return -1;
+		}
+		(*records)[i] = r;
+		offset += CROSEC_CAPTURE_ALIGN(sizeof(*r) + r->OutSize + r->InSize);
+	}
+	return h->Records;
+}
+
+static void print(const CROSEC_CAPTURE_RECORD** records, long count)
+{
+	/* Same order as CROSEC_LOCK_CLASS */
+	static const char* classes[] = { "isr", "kernel", "user" };
+	UINT64 t = 0;
+
+	printf("#%13s %10s %10s  %-6s %-6s %5s %5s %6s  %s\n",
+		"us", "gap", "duration", "class", "cmd", "out", "in", "max", "result");
+	for (long i = 0; i < count; i++) {
+		const CROSEC_CAPTURE_RECORD* r = records[i];
+
+		t += r->GapUs;
+		printf("%14llu %10u %10u  %-6s 0x%04x %5u %5u %6u  ", (unsigned long long)t, r->GapUs,
+			r->DurationUs, r->Class < 3 ? classes[r->Class] : "?", r->Command, r->OutSize, r->InSize,
+			r->MaxInSize);
+		if (r->Result >= 0)
+			printf("%d bytes\n", r->Result);
+		else if (r->Result <= -EECRESULT)
+			printf("EC_RES %d\n", -r->Result - EECRESULT);
+		else
+			printf("failed %d\n", r->Result);
+	}
+}
+
+int main(int argc, char** argv)
+{
+	ec_sim_mode mode = EC_SIM_LPC_V3;
+	UINT64 latency_ns = 0, irq_ns = 0;
+	int recorded_latency = 0, irq = 0, gaps = 0, only_print = 0;
+	long repeat = 1;
+	int opt = 1;
+
+	for (; opt < argc && argv[opt][0] == '-'; opt++) {
+		const char* arg = opt + 1 < argc ? argv[opt + 1] : NULL;
+
+		if (!strcmp(argv[opt], "-m") && arg) {
+			if (!strcmp(arg, "lpc2"))
+				mode = EC_SIM_LPC_V2;
+			else if (!strcmp(arg, "lpc3"))
+				mode = EC_SIM_LPC_V3;
+			else if (!strcmp(arg, "mec"))
+				mode = EC_SIM_MEC;
+			else
+				break;
+			opt++;
+		}
+		else if (!strcmp(argv[opt], "-l") && arg) {
+			latency_ns = strtoull(arg, NULL, 0);
+			opt++;
+		}
+		else if (!strcmp(argv[opt], "-i") && arg) {
+			irq = 1;
+			irq_ns = strtoull(arg, NULL, 0);
+			opt++;
+		}
+		else if (!strcmp(argv[opt], "-n") && arg) {
+			repeat = strtol(arg, NULL, 0);
+			opt++;
+		}
+		else if (!strcmp(argv[opt], "-r"))
+			recorded_latency = 1;
+		else if (!strcmp(argv[opt], "-g"))
+			gaps = 1;
+		else if (!strcmp(argv[opt], "-p"))
+			only_print = 1;
+		else if (!strcmp(argv[opt], "-v"))
+			replay_verbose = 1;
+		else
+			break;
+	}
+	if (opt != argc - 1 || repeat < 1) {
+		fprintf(stderr, "usage: %s [-m lpc2|lpc3|mec] [-l ns | -r] [-i ns] [-g] [-n count] [-p] [-v] <file>\n",
+			argv[0]);
+		return 2;
+	}
+
+	CROSEC_CAPTURE_HEADER h;
+	UINT8* data;
+	const CROSEC_CAPTURE_RECORD** records;
+	long count = load(argv[opt], &h, &data, &records);
+	if (count < 0)
+		return 1;
+
+	if (only_print) {
+		print(records, count);
+		return 0;
+	}
+
+	ec_sim_init(mode);
+	if (irq)
+		ec_sim_set_irq(1, irq_ns);
+	if (!NT_SUCCESS(comm_init_lpc())) {
+		fprintf(stderr, "Transport didn't come up against the simulated EC\n");
+		return 1;
+	}
+
+	/* Only count what the capture causes */
+	ec_sim_set_handler(replay_handler);
+	ec_sim_set_latency(latency_ns);
+	memset(&ec_sim_stats, 0, sizeof(ec_sim_stats));
+
+	static UINT8 in[0x10000];
+	UINT64 replayed = 0, skipped = 0, diverged = 0;
+	UINT64 bus_ns = 0, max_ns = 0;
+	UINT64 virtual_start = ec_sim_now();
+	UINT64 host_start = host_ns();
+
+	for (long pass = 0; pass < repeat; pass++) {
+		for (long i = 0; i < count; i++) {
+			const CROSEC_CAPTURE_RECORD* r = records[i];
+
+			if (!record_replayable(r)) {
+				skipped++;
+				continue;
+			}
+
+			if (gaps && i && r->GapUs > records[i - 1]->DurationUs)
+				ec_port.udelay(r->GapUs - records[i - 1]->DurationUs);
+			if (recorded_latency)
+				ec_sim_set_latency((UINT64)r->DurationUs * 1000);
+
+			UINT64 start = ec_sim_now();
+			replay_record = r;
+			int res = ec_command_proto(r->Command, r->Version, record_params(r), r->OutSize,
+				in, r->MaxInSize);
+			replay_record = NULL;
+
+			UINT64 ns = ec_sim_now() - start;
+			bus_ns += ns;
+			if (ns > max_ns)
+				max_ns = ns;
+			replayed++;
+
+			if (res != r->Result || (res > 0 && memcmp(in, record_response(r), res))) {
+				if (replay_verbose)
+					fprintf(stderr, "record %ld: cmd 0x%04x returned %d, captured %d\n",
+						i, r->Command, res, r->Result);
+				diverged++;
+			}
+		}
+	}
+
+	UINT64 host_elapsed = host_ns() - host_start;
+	UINT64 virtual_elapsed = ec_sim_now() - virtual_start;
+	UINT64 ports = ec_sim_stats.inb + ec_sim_stats.inw + ec_sim_stats.inl +
+		ec_sim_stats.outb + ec_sim_stats.outw + ec_sim_stats.outl;
+	double n = replayed ? (double)replayed : 1;
+
+	printf("%ld records (%u dropped while capturing), %ld passes\n", count, h.Dropped, repeat);
+	printf("replayed %llu, skipped %llu, diverged %llu, unexpected %llu\n",
+		(unsigned long long)replayed, (unsigned long long)skipped,
+		(unsigned long long)diverged, (unsigned long long)replay_unexpected);
+	printf("virtual time %.3f ms, %.3f us/cmd on the bus, max %.3f us\n",
+		virtual_elapsed / 1e6, bus_ns / n / 1e3, max_ns / 1e3);
+	printf("port accesses %.2f/cmd (%.2f in, %.2f out), EMI address writes %.2f/cmd\n",
+		ports / n, (ec_sim_stats.inb + ec_sim_stats.inw + ec_sim_stats.inl) / n,
+		(ec_sim_stats.outb + ec_sim_stats.outw + ec_sim_stats.outl) / n,
+		ec_sim_stats.emi_address_writes / n);
+	printf("busy polls %.2f/cmd, interrupt wakeups %.2f/cmd\n",
+		ec_sim_stats.busy_polls / n, ec_sim_stats.irq_wakeups / n);
+	printf("host time %.1f ns/cmd\n", host_elapsed / n);
+
+	free(records);
+	free(data);
+	return diverged || replay_unexpected ? 1 : 0;
+}
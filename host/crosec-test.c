@@ -0,0 +1,756 @@
+/*
+ * crosec-test: checks of the driver modules and the transport against the
+ * simulated EC that come down to counting, so they can run anywhere:
+ * allocations, port accesses, EMI address writes, wakeups.
+ *
+ *   crosec-test [check...]   run the named checks (default all of them)
+ *
+ * Prints one line per check and exits non-zero if any failed.
+ *
+ * Build with:
+ *   gcc -DCROSEC_HOST -Ihost/include -Icrosecbus -Ihost crosecbus/comm-lpc.c
+ *       crosecbus/comm-mec_lpc.c crosecbus/ecLock.c crosecbus/ecQuota.c
+ *       crosecbus/memmapCache.c crosecbus/msgPool.c host/comm-sim.c
+ *       host/crosec-wdk.c host/crosec-test.c -lpthread
+ */
+
+#include <stdlib.h>
+
+#include "comm-sim.h"
+#include "driver.h"
+
+static int test_failed;
+
+#define CHECK(cond, ...) do {                                          \
+	if (!(cond)) {                                                     \
+		printf("    %s:%d: ", __FILE__, __LINE__);                     \
+		printf(__VA_ARGS__);                                           \
+		printf("\n");                                                  \
+		test_failed = 1;                                               \
+	}                                                                  \
+} while (0)
+
+/*
+ * send_ec_command: nothing is allocated per command once the pool is set
+ * up, unless more than CROSEC_MSG_POOL_DEPTH large commands are in flight,
+ * and everything the ISR sends fits in the stack buffer.
+ */
+static void test_alloc(void)
+{
+	CROSEC_MSG_POOL pool;
+	PCROSEC_COMMAND msgs[CROSEC_MSG_POOL_DEPTH + 1];
+	SIZE_T dataSize = EC_LPC_HOST_PACKET_SIZE - sizeof(struct ec_host_request);
+
+	CHECK(sizeof(struct ec_response_host_event_mask) <= CROSEC_MSG_STACK_SIZE,
+		"host event mask doesn't fit on the stack");
+	CHECK(sizeof(struct ec_response_get_next_event_v1) <= CROSEC_MSG_STACK_SIZE,
+		"MKBP event doesn't fit on the stack");
+
+	RtlZeroMemory(&pool, sizeof(pool));
+	CHECK(NT_SUCCESS(CrosEcMsgPoolInit(&pool, dataSize)), "pool init failed");
+
+	UINT64 before = crosec_wdk_stats.allocations;
+	for (int pass = 0; pass < 1000; pass++) {
+		for (int i = 0; i < CROSEC_MSG_POOL_DEPTH; i++) {
+			msgs[i] = CrosEcMsgAlloc(&pool, dataSize);
+			CHECK(msgs[i] != NULL, "allocation %d failed", i);
+			memset(msgs[i]->Data, i, dataSize);
+		}
+		for (int i = 0; i < CROSEC_MSG_POOL_DEPTH; i++)
+			CrosEcMsgFree(&pool, msgs[i]);
+	}
+	CHECK(crosec_wdk_stats.allocations == before,
+		"%llu pool allocations with %d commands in flight",
+		(unsigned long long)(crosec_wdk_stats.allocations - before), CROSEC_MSG_POOL_DEPTH);
+
+	/* One more than the pool holds, or bigger than it was sized for, goes to the heap */
+	for (int i = 0; i <= CROSEC_MSG_POOL_DEPTH; i++)
+		msgs[i] = CrosEcMsgAlloc(&pool, dataSize);
+	CHECK(crosec_wdk_stats.allocations == before + 1, "pool overflow didn't fall back to the heap");
+	for (int i = 0; i <= CROSEC_MSG_POOL_DEPTH; i++)
+		CrosEcMsgFree(&pool, msgs[i]);
+
+	PCROSEC_COMMAND big = CrosEcMsgAlloc(&pool, dataSize + 1);
+	CHECK(big && crosec_wdk_stats.allocations == before + 2, "oversized command didn't go to the heap");
+	CrosEcMsgFree(&pool, big);
+
+	CHECK(pool.Free == (1L << CROSEC_MSG_POOL_DEPTH) - 1, "pool slots leaked: free mask 0x%x", pool.Free);
+	CrosEcMsgPoolFree(&pool);
+	CHECK(crosec_wdk_stats.outstanding == 0, "%lld allocations not freed",
+		(long long)crosec_wdk_stats.outstanding);
+}
+
+static int test_echo_handler(UINT16 command, UINT8 version,
+	const UINT8* params, int params_size,
+	UINT8* response, int max_response, int* response_size)
+{
+	UNREFERENCED_PARAMETER(command);
+	UNREFERENCED_PARAMETER(version);
+
+	if (params_size > max_response)
+		return EC_RES_RESPONSE_TOO_BIG;
+	memcpy(response, params, params_size);
+	*response_size = params_size;
+	return EC_RES_SUCCESS;
+}
+
+static UINT64 test_port_accesses(void)
+{
+	return ec_sim_stats.inb + ec_sim_stats.inw + ec_sim_stats.inl +
+		ec_sim_stats.outb + ec_sim_stats.outw + ec_sim_stats.outl;
+}
+
+/*
+ * LPC v3 and MEC packets move in 32-bit accesses, with at most a word and
+ * a byte for the tail, so an n byte echo costs about (8 + n) / 2 port
+ * accesses rather than 2 * (8 + n).
+ */
+static void test_ports(void)
+{
+	static const ec_sim_mode modes[] = { EC_SIM_LPC_V3, EC_SIM_MEC };
+	static const int sizes[] = { 0, 1, 2, 3, 4, 5, 7, 13, 64, 127, 200, 248 };
+	UINT8 out[EC_LPC_HOST_PACKET_SIZE], in[EC_LPC_HOST_PACKET_SIZE];
+
+	for (int i = 0; i < (int)sizeof(out); i++)
+		out[i] = (UINT8)(i * 7 + 1);
+
+	for (size_t m = 0; m < sizeof(modes) / sizeof(modes[0]); m++) {
+		ec_sim_init(modes[m]);
+		CHECK(NT_SUCCESS(comm_init_lpc()), "transport didn't come up");
+		ec_sim_set_handler(test_echo_handler);
+		ec_sim_set_latency(0);
+
+		for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+			int n = sizes[s];
+			if (n > (int)ec_max_outsize || n > (int)ec_max_insize)
+				continue;
+
+			/* Request and response each: header and payload in dwords, tail in a word and a byte */
+			UINT64 packet = 2 * ((sizeof(struct ec_host_request) + n) / 4 + 2);
+			/* Command and status registers, plus EMI address writes on MEC */
+			UINT64 limit = packet + 8;
+
+			memset(in, 0, sizeof(in));
+			memset(&ec_sim_stats, 0, sizeof(ec_sim_stats));
+			int res = ec_command_proto(EC_CMD_HELLO, 0, out, n, in, n);
+
+			CHECK(res == n && !memcmp(in, out, n), "mode %d: %d byte echo returned %d", modes[m], n, res);
+			CHECK(test_port_accesses() <= limit, "mode %d: %d byte echo took %llu port accesses, expected at most %llu",
+				modes[m], n, (unsigned long long)test_port_accesses(), (unsigned long long)limit);
+			CHECK(ec_sim_stats.inb + ec_sim_stats.outb <= 8, "mode %d: %d byte echo took %llu byte accesses",
+				modes[m], n, (unsigned long long)(ec_sim_stats.inb + ec_sim_stats.outb));
+		}
+	}
+}
+
+static ULONGLONG test_sim_clock(void)
+{
+	return ec_sim_now() / 100;
+}
+
+/* Reads one memmap byte through the cache; returns the port accesses it took */
+static UINT64 test_memmap_read(PCROSEC_MEMMAP_CACHE cache, int offset, UINT8 expect)
+{
+	UINT8 value = (UINT8)~expect;
+
+	memset(&ec_sim_stats, 0, sizeof(ec_sim_stats));
+	CHECK(CrosEcMemmapCacheRead(cache, offset, 1, &value) == 1, "memmap read at 0x%02x failed", offset);
+	CHECK(value == expect, "memmap 0x%02x read 0x%02x, expected 0x%02x", offset, value, expect);
+	return test_port_accesses();
+}
+
+/*
+ * The memmap cache keeps static lines (ID, battery strings) until the EC
+ * restarts, and refetches the rest after a volatile invalidate or the TTL.
+ * Battery events drop the battery strings as well.
+ */
+static void test_memmap(void)
+{
+	CROSEC_MEMMAP_CACHE cache;
+	UINT8* memmap;
+
+	ec_sim_init(EC_SIM_LPC_V3);
+	CHECK(NT_SUCCESS(comm_init_lpc()), "transport didn't come up");
+	crosec_wdk_clock = test_sim_clock;
+	memmap = ec_sim_memmap();
+	memmap[EC_MEMMAP_TEMP_SENSOR] = 0x40;
+	memmap[EC_MEMMAP_BATT_MFGR] = 'A';
+
+	CrosEcMemmapCacheInit(&cache);
+	CHECK(test_memmap_read(&cache, EC_MEMMAP_ID, 'E') > 0, "first ID read didn't go to the bus");
+	CHECK(test_memmap_read(&cache, EC_MEMMAP_BATT_MFGR, 'A') > 0, "first battery read didn't go to the bus");
+	CHECK(test_memmap_read(&cache, EC_MEMMAP_TEMP_SENSOR, 0x40) > 0, "first temp read didn't go to the bus");
+	CHECK(test_memmap_read(&cache, EC_MEMMAP_TEMP_SENSOR, 0x40) == 0, "cached temp read went to the bus");
+
+	/* Host event or resume: volatile lines are refetched, static ones aren't */
+	memmap[EC_MEMMAP_TEMP_SENSOR] = 0x41;
+	CrosEcMemmapCacheInvalidateVolatile(&cache);
+	CHECK(test_memmap_read(&cache, EC_MEMMAP_ID, 'E') == 0, "ID went to the bus after a volatile invalidate");
+	CHECK(test_memmap_read(&cache, EC_MEMMAP_BATT_MFGR, 'A') == 0,
+		"battery string went to the bus after a volatile invalidate");
+	CHECK(test_memmap_read(&cache, EC_MEMMAP_TEMP_SENSOR, 0x41) > 0, "temp wasn't refetched after a volatile invalidate");
+
+	/* TTL */
+	memmap[EC_MEMMAP_TEMP_SENSOR] = 0x42;
+	ec_port.udelay(CROSEC_MEMMAP_TTL_MS * 1000 + 1);
+	CHECK(test_memmap_read(&cache, EC_MEMMAP_ID, 'E') == 0, "ID expired");
+	CHECK(test_memmap_read(&cache, EC_MEMMAP_TEMP_SENSOR, 0x42) > 0, "temp didn't expire");
+
+	/* Battery event: the battery strings are refetched, the ID isn't */
+	memmap[EC_MEMMAP_BATT_MFGR] = 'B';
+	CrosEcMemmapCacheInvalidateBattery(&cache);
+	CHECK(test_memmap_read(&cache, EC_MEMMAP_ID, 'E') == 0, "ID went to the bus after a battery event");
+	CHECK(test_memmap_read(&cache, EC_MEMMAP_BATT_MFGR, 'B') > 0, "battery string wasn't refetched after a battery event");
+	CHECK(test_memmap_read(&cache, EC_MEMMAP_BATT_MFGR, 'B') == 0, "cached battery string went to the bus");
+
+	/* EC restart: everything is refetched */
+	memmap[EC_MEMMAP_BATT_MFGR] = 'C';
+	CrosEcMemmapCacheInvalidate(&cache);
+	CHECK(test_memmap_read(&cache, EC_MEMMAP_BATT_MFGR, 'C') > 0, "battery string wasn't refetched after a restart");
+	CHECK(test_memmap_read(&cache, EC_MEMMAP_TEMP_SENSOR, 0x42) > 0, "temp wasn't refetched after a restart");
+
+	crosec_wdk_clock = NULL;
+}
+
+/* ec_readmem string read; returns the EMI address writes it took */
+static UINT64 test_read_string(int offset, const char* expect)
+{
+	char value[EC_MEMMAP_SIZE];
+	int len = (int)strlen(expect) + 1;
+
+	memset(value, 0x7f, sizeof(value));
+	memset(&ec_sim_stats, 0, sizeof(ec_sim_stats));
+	int res = ec_readmem(offset, 0, value);
+
+	CHECK(res == len && !memcmp(value, expect, len), "string at 0x%02x returned %d \"%.*s\", expected \"%s\"",
+		offset, res, res > 0 ? res : 0, value, expect);
+	CHECK(value[len] == 0x7f, "string at 0x%02x wrote past its terminator", offset);
+	return ec_sim_stats.emi_address_writes;
+}
+
+/* The same string read a byte at a time, the way ec_readmem_lpc used to */
+static UINT64 test_read_string_bytewise(int offset)
+{
+	UINT8 c;
+
+	memset(&ec_sim_stats, 0, sizeof(ec_sim_stats));
+	do {
+		if (ec_readmem(offset++, 1, &c) != 1)
+			break;
+	} while (c);
+	return ec_sim_stats.emi_address_writes;
+}
+
+/*
+ * Memmap strings are read in EC_MEMMAP_TEXT_MAX chunks, so a battery
+ * model or serial costs one EMI transfer on MEC instead of one per byte.
+ */
+static void test_strings(void)
+{
+	static const struct {
+		int offset;
+		const char* value;
+	} strings[] = {
+		{ EC_MEMMAP_BATT_MFGR, "SMP" },
+		{ EC_MEMMAP_BATT_MODEL, "L17M3PB" },
+		{ EC_MEMMAP_BATT_SERIAL, "" },
+		{ EC_MEMMAP_BATT_TYPE, "LION" },
+	};
+
+	ec_sim_init(EC_SIM_MEC);
+	CHECK(NT_SUCCESS(comm_init_lpc()), "transport didn't come up");
+
+	UINT8* memmap = ec_sim_memmap();
+	for (size_t i = 0; i < sizeof(strings) / sizeof(strings[0]); i++) {
+		memset(&memmap[strings[i].offset], 0, EC_MEMMAP_TEXT_MAX);
+		memcpy(&memmap[strings[i].offset], strings[i].value, strlen(strings[i].value));
+	}
+
+	for (size_t i = 0; i < sizeof(strings) / sizeof(strings[0]); i++) {
+		UINT8 id[2];
+
+		/* Start from a different EMI address each time */
+		ec_readmem(EC_MEMMAP_ID, sizeof(id), id);
+		UINT64 chunked = test_read_string(strings[i].offset, strings[i].value);
+		ec_readmem(EC_MEMMAP_ID, sizeof(id), id);
+		UINT64 bytewise = test_read_string_bytewise(strings[i].offset);
+
+		CHECK(chunked <= 1, "\"%s\" took %llu EMI address writes", strings[i].value,
+			(unsigned long long)chunked);
+		CHECK(strlen(strings[i].value) < 2 || chunked < bytewise,
+			"\"%s\" took %llu EMI address writes, %llu a byte at a time", strings[i].value,
+			(unsigned long long)chunked, (unsigned long long)bytewise);
+	}
+
+	/* No terminator: the read runs on to the next field, and stops at the end of the map */
+	memcpy(&memmap[EC_MEMMAP_BATT_MFGR], "ABCDEFGH", EC_MEMMAP_TEXT_MAX);
+	test_read_string(EC_MEMMAP_BATT_MFGR, "ABCDEFGHL17M3PB");
+	memset(&memmap[EC_MEMMAP_SIZE - 3], 'Z', 3);
+	{
+		char value[4];
+		CHECK(ec_readmem(EC_MEMMAP_SIZE - 3, 0, value) == 3 && !memcmp(value, "ZZZ", 3),
+			"unterminated string at the end of the map");
+	}
+}
+
+/*
+ * MEC: the EMI address register is only written when the next access
+ * isn't where the last one left it. A response header and its payload
+ * stream through one auto-increment seek; a request takes one seek for
+ * the payload, one for the header and one more for an unaligned tail.
+ */
+static void test_emi(void)
+{
+	UINT8 out[EC_LPC_HOST_PACKET_SIZE], in[EC_LPC_HOST_PACKET_SIZE];
+
+	for (int i = 0; i < (int)sizeof(out); i++)
+		out[i] = (UINT8)(i ^ 0x5a);
+
+	ec_sim_init(EC_SIM_MEC);
+	CHECK(NT_SUCCESS(comm_init_lpc()), "transport didn't come up");
+	ec_sim_set_handler(test_echo_handler);
+	ec_sim_set_latency(0);
+
+	for (int n = 0; n <= (int)ec_max_outsize && n <= (int)ec_max_insize; n++) {
+		memset(&ec_sim_stats, 0, sizeof(ec_sim_stats));
+		int res = ec_command_submit(EC_CMD_HELLO, 0, out, n);
+		UINT64 submit = ec_sim_stats.emi_address_writes;
+
+		while (res == 0 && ec_command_busy())
+			;
+		memset(in, 0, sizeof(in));
+		memset(&ec_sim_stats, 0, sizeof(ec_sim_stats));
+		if (res == 0)
+			res = ec_command_complete(in, n);
+		UINT64 complete = ec_sim_stats.emi_address_writes;
+
+		CHECK(res == n && !memcmp(in, out, n), "%d byte echo returned %d", n, res);
+		CHECK(submit <= 2 + (n % 4 != 0), "%d byte request took %llu EMI address writes",
+			n, (unsigned long long)submit);
+		CHECK(complete <= 1, "%d byte response took %llu EMI address writes",
+			n, (unsigned long long)complete);
+	}
+}
+
+static UINT32 test_random = 1;
+
+/* xorshift32, so every run checks the same patterns */
+static UINT32 test_next_random(void)
+{
+	test_random ^= test_random << 13;
+	test_random ^= test_random >> 17;
+	test_random ^= test_random << 5;
+	return test_random;
+}
+
+static void test_fill_random(UINT8* data, int length)
+{
+	for (int i = 0; i < length; i++)
+		data[i] = (UINT8)test_next_random();
+}
+
+static int test_sum(const UINT8* data, int length)
+{
+	int sum = 0;
+
+	for (int i = 0; i < length; i++)
+		sum += data[i];
+	return sum;
+}
+
+/*
+ * ec_mec_xfer against a plain byte copy, for every offset and length in
+ * the EMI window (0x800 up to the end of the memory map), both ways. Reads
+ * must return exactly the EC's bytes and their sum and leave EC RAM alone;
+ * writes must change exactly the bytes written, whatever the alignment,
+ * including the neighbours of a read-modify-write. Each offset's lengths
+ * run under one hold of the window so the cached EMI address carries over
+ * from transfer to transfer.
+ */
+static void test_mecxfer(void)
+{
+	enum { WINDOW = EC_LPC_ADDR_MEMMAP + EC_MEMMAP_SIZE - EC_LPC_ADDR_HOST_PACKET };
+	UINT8 before[EC_SIM_RAM_SIZE], data[WINDOW + 4];
+	UINT8* ram;
+	long failures = 0;
+
+	ec_sim_init(EC_SIM_MEC);
+	CHECK(NT_SUCCESS(comm_init_lpc()), "transport didn't come up");
+	ram = ec_sim_ram();
+
+	for (int offset = 0; offset < WINDOW && failures < 10; offset++) {
+		if (ec_lpc_ops.lock)
+			ec_lpc_ops.lock();
+
+		for (int length = 1; offset + length <= WINDOW && failures < 10; length++) {
+			unsigned int port = EC_LPC_ADDR_HOST_PACKET + offset;
+			int sum;
+
+			/* Read */
+			test_fill_random(ram, EC_SIM_RAM_SIZE);
+			memcpy(before, ram, sizeof(before));
+			test_fill_random(data, sizeof(data));
+			UINT8 guard = (UINT8)~ram[offset + length - 1];
+			data[length] = guard;
+
+			sum = ec_lpc_ops.read(port, length, data);
+			if (memcmp(data, &ram[offset], length) || data[length] != guard ||
+				sum != test_sum(&ram[offset], length) || memcmp(ram, before, sizeof(before))) {
+				CHECK(0, "read of %d bytes at 0x%03x is wrong", length, port);
+				failures++;
+			}
+
+			/* Write */
+			test_fill_random(ram, EC_SIM_RAM_SIZE);
+			memcpy(before, ram, sizeof(before));
+			test_fill_random(data, length);
+			memcpy(&before[offset], data, length);
+
+			sum = ec_lpc_ops.write(port, length, data);
+			if (memcmp(ram, before, sizeof(before)) || sum != test_sum(data, length)) {
+				for (int i = 0; i < EC_SIM_RAM_SIZE; i++) {
+					if (ram[i] != before[i]) {
+						CHECK(0, "write of %d bytes at 0x%03x: EC byte 0x%03x is 0x%02x, expected 0x%02x%s",
+							length, port, i, ram[i], before[i],
+							i >= offset && i < offset + length ? "" : " (outside the write)");
+						break;
+					}
+				}
+				CHECK(sum == test_sum(data, length), "write of %d bytes at 0x%03x: wrong sum", length, port);
+				failures++;
+			}
+		}
+
+		if (ec_lpc_ops.unlock)
+			ec_lpc_ops.unlock();
+	}
+}
+
+/* Runs count commands; returns the slowest in virtual us, or -1 if one failed */
+static long test_slowest_command(UINT16 command, int count)
+{
+	UINT64 slowest = 0;
+
+	for (int i = 0; i < count; i++) {
+		UINT64 start = ec_sim_now();
+		if (ec_command_proto(command, 0, NULL, 0, NULL, 0) != 0)
+			return -1;
+		if (ec_sim_now() - start > slowest)
+			slowest = ec_sim_now() - start;
+	}
+	return (long)(slowest / 1000);
+}
+
+static long test_slowest_hello(int count)
+{
+	return test_slowest_command(EC_CMD_HELLO, count);
+}
+
+/*
+ * wait_for_ec's latency estimates: a fast command isn't slowed down by a
+ * slow one that hashes to the same slot, by one slow outlier of its own or
+ * by what an earlier transport probe learned, and a slow command that has
+ * settled finishes within a poll step of the EC.
+ */
+static void test_estimate(void)
+{
+	ec_sim_init(EC_SIM_LPC_V3);
+	CHECK(NT_SUCCESS(comm_init_lpc()), "transport didn't come up");
+	ec_sim_set_handler(test_echo_handler);
+
+	/* GET_NEXT_EVENT and HOST_EVENT share a slot */
+	ec_sim_set_latency(1000 * 1000);
+	test_slowest_command(EC_CMD_GET_NEXT_EVENT, 100);
+	long slowest = test_slowest_command(EC_CMD_GET_NEXT_EVENT, 20);
+	CHECK(slowest >= 0 && slowest <= 1000 + 1000 / 16 + 5, "settled 1000 us command took up to %ld us", slowest);
+
+	ec_sim_set_latency(3 * 1000);
+	slowest = test_slowest_command(EC_CMD_HOST_EVENT, 1);
+	CHECK(slowest >= 0 && slowest <= 10, "3 us command took %ld us after a slow one in its slot", slowest);
+
+	test_slowest_hello(50);
+	ec_sim_set_latency(10000 * 1000);
+	test_slowest_hello(1);
+	ec_sim_set_latency(3 * 1000);
+	slowest = test_slowest_hello(1);
+	CHECK(slowest >= 0 && slowest <= 10, "3 us command took %ld us after one 10 ms outlier", slowest);
+
+	ec_sim_set_latency(1000 * 1000);
+	test_slowest_hello(100);
+	CHECK(NT_SUCCESS(comm_init_lpc()), "transport didn't come up again");
+	ec_sim_set_latency(3 * 1000);
+	slowest = test_slowest_hello(1);
+	CHECK(slowest >= 0 && slowest <= 10, "3 us command took %ld us after the transport was probed again", slowest);
+}
+
+/*
+ * With a completion interrupt, wait_for_ec wakes within the interrupt
+ * latency of the EC finishing instead of at the next backoff step, and
+ * polls the status register a handful of times at most. An interrupt that
+ * never comes only costs the polling the driver would have done anyway.
+ */
+static void test_irq(void)
+{
+	static const UINT64 ec_latencies_us[] = { 30, 300, 3000, 20000 };
+	const UINT64 irq_us = 10;
+
+	for (size_t l = 0; l < sizeof(ec_latencies_us) / sizeof(ec_latencies_us[0]); l++) {
+		UINT64 ec_us = ec_latencies_us[l];
+
+		ec_sim_init(EC_SIM_LPC_V3);
+		ec_sim_set_irq(1, irq_us * 1000);
+		CHECK(NT_SUCCESS(comm_init_lpc()), "transport didn't come up");
+		ec_sim_set_handler(test_echo_handler);
+		ec_sim_set_latency(ec_us * 1000);
+
+		/* Let the latency estimate settle on this command */
+		test_slowest_hello(50);
+		memset(&ec_sim_stats, 0, sizeof(ec_sim_stats));
+		long slowest = test_slowest_hello(100);
+
+		CHECK(slowest >= 0, "%llu us command failed with the interrupt on", (unsigned long long)ec_us);
+		CHECK(slowest <= (long)(ec_us + irq_us + 5), "%llu us command took up to %ld us with a %llu us interrupt",
+			(unsigned long long)ec_us, slowest, (unsigned long long)irq_us);
+		/*
+		 * Fast commands are spun on for up to MAXIMUM_SPIN_UDELAY (50us), a
+		 * poll per us; slow ones see a poll per backoff step, which doubles
+		 */
+		CHECK(ec_sim_stats.busy_polls <= 100 * (ec_us < 50 ? ec_us + 5 : 16), "%llu us command: %.1f busy polls per command",
+			(unsigned long long)ec_us, ec_sim_stats.busy_polls / 100.0);
+		/* Slow ones sleep through most of it and are woken by the interrupt */
+		if (ec_us >= 1000)
+			CHECK(ec_sim_stats.irq_wakeups >= 100, "%llu us command: only %llu interrupt wakeups in 100 commands",
+				(unsigned long long)ec_us, (unsigned long long)ec_sim_stats.irq_wakeups);
+
+		/* The interrupt never arrives in time: polling still finishes the command */
+		ec_sim_set_irq(1, 1000000000ULL);
+		slowest = test_slowest_hello(20);
+		CHECK(slowest >= 0 && slowest <= (long)(2 * ec_us + 10000), "%llu us command took up to %ld us without its interrupt",
+			(unsigned long long)ec_us, slowest);
+
+		ec_sim_set_irq(0, 0);
+		CHECK(test_slowest_hello(20) >= 0, "%llu us command failed with the interrupt off", (unsigned long long)ec_us);
+	}
+}
+
+static ULONGLONG test_quota_now;
+
+static ULONGLONG test_quota_clock(void)
+{
+	return test_quota_now;
+}
+
+/*
+ * ecQuota: every burst setting admits a handle with tokens, and a handle in
+ * debt is let back in once CrosEcQuotaDelayUs has passed, not before.
+ */
+static void test_quota(void)
+{
+	static const ULONG bursts[] = { 0, 1, CROSEC_QUOTA_DEFAULT_BURST_US };
+	CROSEC_QUOTA_CONFIG config, total;
+	CROSEC_QUOTA_BUCKET bucket;
+
+	crosec_wdk_clock = test_quota_clock;
+	for (size_t b = 0; b < sizeof(bursts) / sizeof(bursts[0]); b++) {
+		crosec_wdk_set_setting(L"XcmdQuotaRateUs", 500000);
+		crosec_wdk_set_setting(L"XcmdQuotaBurstUs", bursts[b]);
+		crosec_wdk_set_setting(L"XcmdQuotaTotalBurstUs", bursts[b]);
+		CrosEcQuotaLoadConfig(NULL, &config, &total);
+		CHECK(config.BurstUs >= CROSEC_QUOTA_MIN_BURST_US, "burst %lu loaded as %lu",
+			(unsigned long)bursts[b], (unsigned long)config.BurstUs);
+		CHECK(total.BurstUs >= CROSEC_QUOTA_MIN_BURST_US, "total burst %lu loaded as %lu",
+			(unsigned long)bursts[b], (unsigned long)total.BurstUs);
+		CHECK(total.RateUs == CROSEC_QUOTA_DEFAULT_TOTAL_RATE_US, "total rate loaded as %lu",
+			(unsigned long)total.RateUs);
+
+		test_quota_now = 0;
+		CrosEcQuotaInitBucket(&config, &bucket);
+		CHECK(CrosEcQuotaAdmit(&config, &bucket), "burst %lu: a fresh handle wasn't admitted",
+			(unsigned long)bursts[b]);
+
+		CrosEcQuotaCharge(&bucket, config.BurstUs + 5000);
+		CHECK(!CrosEcQuotaAdmit(&config, &bucket), "burst %lu: admitted in debt", (unsigned long)bursts[b]);
+
+		ULONG delayUs = CrosEcQuotaDelayUs(&config, &bucket);
+		test_quota_now += (delayUs - 1000) * 10ULL;
+		CHECK(!CrosEcQuotaAdmit(&config, &bucket), "burst %lu: admitted before the %lu us delay",
+			(unsigned long)bursts[b], (unsigned long)delayUs);
+		test_quota_now += 1000 * 10ULL;
+		CHECK(CrosEcQuotaAdmit(&config, &bucket), "burst %lu: not admitted after the %lu us delay",
+			(unsigned long)bursts[b], (unsigned long)delayUs);
+	}
+	crosec_wdk_clock = NULL;
+	crosec_wdk_clear_settings();
+}
+
+static ULONGLONG test_lock_now;
+static int test_lock_order[16], test_lock_grants;
+
+static ULONGLONG test_lock_clock(void)
+{
+	return test_lock_now;
+}
+
+/* OnGrant for the async waiters; Context is the waiter's number */
+static VOID test_lock_granted(PVOID Context)
+{
+	if (test_lock_grants < (int)(sizeof(test_lock_order) / sizeof(test_lock_order[0])))
+		test_lock_order[test_lock_grants] = (int)(intptr_t)Context;
+	test_lock_grants++;
+}
+
+static void test_lock_waiter(PCROSEC_LOCK_WAITER waiter, CROSEC_LOCK_CLASS lockClass, int id)
+{
+	RtlZeroMemory(waiter, sizeof(*waiter));
+	waiter->Class = lockClass;
+	waiter->OnGrant = test_lock_granted;
+	waiter->Context = (PVOID)(intptr_t)id;
+}
+
+/* Hands the lock on 100us later and takes it with whoever it went to */
+static void test_lock_pass(PCROSEC_LOCK lock, PCROSEC_LOCK_WAITER* waiters)
+{
+	int grants = test_lock_grants;
+
+	test_lock_now += 100 * 10;
+	CrosEcLockRelease(lock);
+	CHECK(test_lock_grants == grants + 1, "release granted %d waiters", test_lock_grants - grants);
+	if (test_lock_grants == grants + 1 && grants < (int)(sizeof(test_lock_order) / sizeof(test_lock_order[0])))
+		CHECK(CrosEcLockAcquireAsync(lock, waiters[test_lock_order[grants]]), "granted waiter didn't get the lock");
+}
+
+/*
+ * ecLock: waiters are granted ISR first, then kernel, then userspace, in
+ * order within a class; a class passed over CROSEC_LOCK_MAX_BYPASS times
+ * goes next; and each class's wait stats add up.
+ */
+static void test_lock(void)
+{
+	CROSEC_LOCK lock;
+	CROSEC_LOCK_WAITER w[5];
+	PCROSEC_LOCK_WAITER waiters[5] = { &w[0], &w[1], &w[2], &w[3], &w[4] };
+	CROSEC_LOCK_CLASS_STATS stats[CrosEcLockClassCount];
+
+	/* A QueuedAt of 0 means "didn't wait", and interrupt time is never 0 */
+	crosec_wdk_clock = test_lock_clock;
+	test_lock_now = 10000000;
+	test_lock_grants = 0;
+	CrosEcLockInit(&lock);
+
+	/* Priority: queued user, user, kernel, ISR while a kernel caller holds it */
+	CrosEcLockAcquire(&lock, CrosEcLockClassKernel);
+	test_lock_waiter(&w[0], CrosEcLockClassUser, 0);
+	test_lock_waiter(&w[1], CrosEcLockClassUser, 1);
+	test_lock_waiter(&w[2], CrosEcLockClassKernel, 2);
+	test_lock_waiter(&w[3], CrosEcLockClassIsr, 3);
+	for (int i = 0; i < 4; i++)
+		CHECK(!CrosEcLockAcquireAsync(&lock, &w[i]), "waiter %d got a held lock", i);
+
+	for (int i = 0; i < 4; i++)
+		test_lock_pass(&lock, waiters);
+	CrosEcLockRelease(&lock);
+
+	static const int expected[] = { 3, 2, 0, 1 };
+	for (int i = 0; i < 4; i++)
+		CHECK(test_lock_order[i] == expected[i], "grant %d went to waiter %d, expected %d",
+			i, test_lock_order[i], expected[i]);
+
+	/* Waited 100, 200, 300 and 400us; the kernel's first acquisition didn't wait */
+	CrosEcLockQueryStats(&lock, stats);
+	CHECK(stats[CrosEcLockClassIsr].Acquisitions == 1 && stats[CrosEcLockClassIsr].Contended == 1 &&
+		stats[CrosEcLockClassIsr].TotalWaitUs == 100 && stats[CrosEcLockClassIsr].MaxWaitUs == 100,
+		"ISR stats: %llu acquisitions, %llu contended, %llu us total, %llu us max",
+		(unsigned long long)stats[CrosEcLockClassIsr].Acquisitions, (unsigned long long)stats[CrosEcLockClassIsr].Contended,
+		(unsigned long long)stats[CrosEcLockClassIsr].TotalWaitUs, (unsigned long long)stats[CrosEcLockClassIsr].MaxWaitUs);
+	CHECK(stats[CrosEcLockClassKernel].Acquisitions == 2 && stats[CrosEcLockClassKernel].Contended == 1 &&
+		stats[CrosEcLockClassKernel].TotalWaitUs == 200 && stats[CrosEcLockClassKernel].MaxWaitUs == 200,
+		"kernel stats: %llu acquisitions, %llu contended, %llu us total, %llu us max",
+		(unsigned long long)stats[CrosEcLockClassKernel].Acquisitions, (unsigned long long)stats[CrosEcLockClassKernel].Contended,
+		(unsigned long long)stats[CrosEcLockClassKernel].TotalWaitUs, (unsigned long long)stats[CrosEcLockClassKernel].MaxWaitUs);
+	CHECK(stats[CrosEcLockClassUser].Acquisitions == 2 && stats[CrosEcLockClassUser].Contended == 2 &&
+		stats[CrosEcLockClassUser].TotalWaitUs == 700 && stats[CrosEcLockClassUser].MaxWaitUs == 400,
+		"user stats: %llu acquisitions, %llu contended, %llu us total, %llu us max",
+		(unsigned long long)stats[CrosEcLockClassUser].Acquisitions, (unsigned long long)stats[CrosEcLockClassUser].Contended,
+		(unsigned long long)stats[CrosEcLockClassUser].TotalWaitUs, (unsigned long long)stats[CrosEcLockClassUser].MaxWaitUs);
+
+	/*
+	 * Bypass: ISR waiters keep coming, each re-queueing as soon as it has
+	 * the lock, yet the user waiter goes after CROSEC_LOCK_MAX_BYPASS of them
+	 */
+	test_lock_grants = 0;
+	CrosEcLockAcquire(&lock, CrosEcLockClassKernel);
+	test_lock_waiter(&w[0], CrosEcLockClassUser, 0);
+	test_lock_waiter(&w[1], CrosEcLockClassIsr, 1);
+	test_lock_waiter(&w[2], CrosEcLockClassIsr, 2);
+	for (int i = 0; i < 3; i++)
+		CHECK(!CrosEcLockAcquireAsync(&lock, &w[i]), "waiter %d got a held lock", i);
+
+	int isrGrants = 0;
+	while (test_lock_grants < 2 * CROSEC_LOCK_MAX_BYPASS) {
+		int grants = test_lock_grants;
+
+		test_lock_pass(&lock, waiters);
+		if (test_lock_grants != grants + 1 || test_lock_order[grants] == 0)
+			break;
+		isrGrants++;
+		CHECK(!CrosEcLockAcquireAsync(&lock, waiters[test_lock_order[grants]]), "ISR waiter got a held lock");
+	}
+	CHECK(isrGrants == CROSEC_LOCK_MAX_BYPASS, "user waiter went after %d ISR grants, expected %d",
+		isrGrants, CROSEC_LOCK_MAX_BYPASS);
+
+	/* Let the ISR waiters still queued through and leave the lock free */
+	while (test_lock_grants < 2 * CROSEC_LOCK_MAX_BYPASS && lock.Held) {
+		int grants = test_lock_grants;
+
+		test_lock_now += 100 * 10;
+		CrosEcLockRelease(&lock);
+		if (test_lock_grants == grants)
+			break;
+		CrosEcLockAcquireAsync(&lock, waiters[test_lock_order[grants]]);
+	}
+	CHECK(!lock.Held, "lock still held after every waiter released it");
+
+	crosec_wdk_clock = NULL;
+}
+
+static const struct {
+	const char* name;
+	void (*run)(void);
+} tests[] = {
+	{ "alloc", test_alloc },
+	{ "ports", test_ports },
+	{ "memmap", test_memmap },
+	{ "strings", test_strings },
+	{ "emi", test_emi },
+	{ "mecxfer", test_mecxfer },
+	{ "irq", test_irq },
+	{ "estimate", test_estimate },
+	{ "quota", test_quota },
+	{ "lock", test_lock },
+};
+
+int main(int argc, char** argv)
+{
+	int failures = 0, ran = 0;
+
+	for (size_t t = 0; t < sizeof(tests) / sizeof(tests[0]); t++) {
+		int wanted = argc < 2;
+
+		for (int i = 1; i < argc; i++)
+			wanted |= !strcmp(argv[i], tests[t].name);
+		if (!wanted)
+			continue;
+
+		test_failed = 0;
+		tests[t].run();
+		printf("%-12s %s\n", tests[t].name, test_failed ? "FAIL" : "ok");
+		failures += test_failed;
+		ran++;
+	}
+
+	if (!ran) {
+		fprintf(stderr, "usage: %s [check...]\n", argv[0]);
+		return 2;
+	}
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,170 @@
+/*
+ * Kernel and WDF stand-ins for host builds of the driver modules; see
+ * host/include/crosec-wdk.h.
+ */
+
+#include <stdlib.h>
+#include <time.h>
+
+#include "crosec-wdk.h"
+#include "ecTrace.h"
+
+#define WDK_MAX_SETTINGS 16
+
+struct crosec_wdk_stats crosec_wdk_stats;
+ULONGLONG(*crosec_wdk_clock)(void);
+
+static struct {
+	const WCHAR* name;
+	ULONG value;
+} wdk_settings[WDK_MAX_SETTINGS];
+static int wdk_setting_count;
+
+PVOID ExAllocatePoolWithTag(POOL_TYPE PoolType, SIZE_T NumberOfBytes, ULONG Tag)
+{
+	UNREFERENCED_PARAMETER(PoolType);
+	UNREFERENCED_PARAMETER(Tag);
+
+	PVOID p = malloc(NumberOfBytes ? NumberOfBytes : 1);
+	if (p) {
+		__atomic_add_fetch(&crosec_wdk_stats.allocations, 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&crosec_wdk_stats.outstanding, 1, __ATOMIC_RELAXED);
+	}
+	return p;
+}
+
+void ExFreePoolWithTag(PVOID P, ULONG Tag)
+{
+	UNREFERENCED_PARAMETER(Tag);
+
+	__atomic_sub_fetch(&crosec_wdk_stats.outstanding, 1, __ATOMIC_RELAXED);
+	free(P);
+}
+
+void KeInitializeEvent(PKEVENT Event, EVENT_TYPE Type, BOOLEAN State)
+{
+	pthread_mutex_init(&Event->Mutex, NULL);
+	pthread_cond_init(&Event->Cond, NULL);
+	Event->Type = Type;
+	Event->Signaled = State;
+}
+
+LONG KeSetEvent(PKEVENT Event, LONG Increment, BOOLEAN Wait)
+{
+	UNREFERENCED_PARAMETER(Increment);
+	UNREFERENCED_PARAMETER(Wait);
+
+	pthread_mutex_lock(&Event->Mutex);
+	LONG previous = Event->Signaled;
+	Event->Signaled = 1;
+	if (Event->Type == NotificationEvent)
+		pthread_cond_broadcast(&Event->Cond);
+	else
+		pthread_cond_signal(&Event->Cond);
+	pthread_mutex_unlock(&Event->Mutex);
+	return previous;
+}
+
+void KeClearEvent(PKEVENT Event)
+{
+	pthread_mutex_lock(&Event->Mutex);
+	Event->Signaled = 0;
+	pthread_mutex_unlock(&Event->Mutex);
+}
+
+NTSTATUS KeWaitForSingleObject(PVOID Object, int WaitReason, int WaitMode,
+	BOOLEAN Alertable, const LONGLONG* Timeout)
+{
+	PKEVENT event = (PKEVENT)Object;
+
+	UNREFERENCED_PARAMETER(WaitReason);
+	UNREFERENCED_PARAMETER(WaitMode);
+	UNREFERENCED_PARAMETER(Alertable);
+
+	/* Timeouts aren't modelled beyond polling with a zero timeout */
+	pthread_mutex_lock(&event->Mutex);
+	if (Timeout && *Timeout == 0 && !event->Signaled) {
+		pthread_mutex_unlock(&event->Mutex);
+		return 0x102; /* STATUS_TIMEOUT */
+	}
+	while (!event->Signaled)
+		pthread_cond_wait(&event->Cond, &event->Mutex);
+	if (event->Type == SynchronizationEvent)
+		event->Signaled = 0;
+	pthread_mutex_unlock(&event->Mutex);
+	return STATUS_SUCCESS;
+}
+
+ULONGLONG KeQueryInterruptTime(void)
+{
+	struct timespec ts;
+
+	if (crosec_wdk_clock)
+		return crosec_wdk_clock();
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ULONGLONG)ts.tv_sec * 10000000 + ts.tv_nsec / 100;
+}
+
+void crosec_wdk_unsupported(const char* what)
+{
+	fprintf(stderr, "%s isn't available in host builds\n", what);
+	abort();
+}
+
+/* Tracing stays off in host builds, so nothing ever writes a record */
+PCROSEC_TRACE_RING CrosEcTraceRings;
+
+VOID CrosEcTraceWrite(CROSEC_TRACE_EVENT Event, UINT16 Arg0, UINT32 Arg1, UINT32 Arg2)
+{
+	UNREFERENCED_PARAMETER(Event);
+	UNREFERENCED_PARAMETER(Arg0);
+	UNREFERENCED_PARAMETER(Arg1);
+	UNREFERENCED_PARAMETER(Arg2);
+
+	crosec_wdk_unsupported("CrosEcTraceWrite");
+}
+
+/* XCMD requests aren't modelled, so none is ever attached to a flight */
+NTSTATUS CrosECIoctlXCmdFinish(WDFREQUEST Request, int res)
+{
+	UNREFERENCED_PARAMETER(Request);
+	UNREFERENCED_PARAMETER(res);
+
+	crosec_wdk_unsupported("CrosECIoctlXCmdFinish");
+}
+
+NTSTATUS CrosEcBusReadSetting(WDFDEVICE Device, PCUNICODE_STRING Name, PULONG Value)
+{
+	UNREFERENCED_PARAMETER(Device);
+
+	for (int i = 0; i < wdk_setting_count; i++) {
+		if (!wcscmp(wdk_settings[i].name, Name->Buffer)) {
+			*Value = wdk_settings[i].value;
+			return STATUS_SUCCESS;
+		}
+	}
+	return STATUS_NOT_FOUND;
+}
+
+void crosec_wdk_set_setting(const WCHAR* name, ULONG value)
+{
+	for (int i = 0; i < wdk_setting_count; i++) {
+		if (!wcscmp(wdk_settings[i].name, name)) {
+			wdk_settings[i].value = value;
+			return;
+		}
+	}
+	if (wdk_setting_count == WDK_MAX_SETTINGS) {
+		fprintf(stderr, "Too many settings\n");
+		abort();
+	}
+	wdk_settings[wdk_setting_count].name = name;
+	wdk_settings[wdk_setting_count].value = value;
+	wdk_setting_count++;
+}
+
+void crosec_wdk_clear_settings(void)
+{
+	wdk_setting_count = 0;
+}
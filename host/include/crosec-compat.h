@@ -0,0 +1,56 @@
+#ifndef __CROSEC_COMPAT_H__
+#define __CROSEC_COMPAT_H__
+
+/*
+ * Just enough of the WDK for the transport code to build as a user-mode
+ * program. Only used when CROSEC_HOST is defined.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+typedef uint8_t UINT8;
+typedef uint16_t UINT16;
+typedef uint32_t UINT32;
+typedef uint64_t UINT64;
+typedef int8_t INT8;
+typedef int16_t INT16;
+typedef int32_t INT32;
+typedef int64_t INT64;
+typedef int INT;
+typedef unsigned long ULONG;
+typedef unsigned char BOOLEAN;
+typedef int32_t NTSTATUS;
+
+#define true 1
+#define false 0
+
+#define NT_SUCCESS(Status) (((NTSTATUS)(Status)) >= 0)
+
+#define STATUS_SUCCESS              ((NTSTATUS)0x00000000L)
+#define STATUS_NO_MEMORY            ((NTSTATUS)0xC0000017L)
+#define STATUS_DEVICE_NOT_READY     ((NTSTATUS)0xC00000A3L)
+#define STATUS_INVALID_DEVICE_STATE ((NTSTATUS)0xC0000184L)
+#define STATUS_CONNECTION_INVALID   ((NTSTATUS)0xC000023AL)
+
+#define UNREFERENCED_PARAMETER(P) ((void)(P))
+
+#define DEBUG_LEVEL_ERROR   1
+#define DEBUG_LEVEL_INFO    2
+#define DEBUG_LEVEL_VERBOSE 3
+
+#define DBG_INIT  1
+#define DBG_PNP   2
+#define DBG_IOCTL 4
+
+#ifdef CROSEC_HOST_VERBOSE
+#define DbgPrint(fmt, ...) fprintf(stderr, fmt, ##__VA_ARGS__)
+#else
+#define DbgPrint(fmt, ...) do { } while (0)
+#endif
+
+#define CrosEcBusPrint(dbglevel, fmt, ...) {                       \
+}
+
+#endif
@@ -0,0 +1,293 @@
+#ifndef __CROSEC_WDK_H__
+#define __CROSEC_WDK_H__
+
+/*
+ * Kernel and WDF stand-ins for building the driver's self-contained modules
+ * (msgPool.c, ecQuota.c, singleFlight.c, cmdLog.c, memmapCache.c, ...) into
+ * host programs. driver.h includes this instead of the WDK when CROSEC_HOST
+ * is defined; host/crosec-wdk.c implements the functions.
+ *
+ * Locks and events are pthreads, pool allocations are counted, and
+ * KeQueryInterruptTime can be pointed at a virtual clock. WDF request
+ * handling isn't modelled: a module that gets as far as a WdfRequest* call
+ * aborts the program.
+ */
+
+#include <pthread.h>
+#include <stddef.h>
+#include <wchar.h>
+
+#include "crosec-compat.h"
+
+typedef void VOID;
+typedef void* PVOID;
+typedef int32_t LONG;
+typedef int64_t LONG64;
+typedef int64_t LONGLONG;
+typedef uint64_t ULONGLONG;
+typedef uint64_t ULONG64;
+typedef unsigned char UCHAR;
+typedef unsigned short USHORT;
+typedef wchar_t WCHAR;
+typedef size_t SIZE_T;
+typedef UCHAR KIRQL;
+typedef ULONG* PULONG;
+typedef ULONG64* PULONG64;
+typedef SIZE_T* PSIZE_T;
+typedef UINT8* PUINT8;
+typedef UINT32* PUINT32;
+typedef UCHAR* PUCHAR;
+typedef BOOLEAN* PBOOLEAN;
+typedef KIRQL* PKIRQL;
+
+#define TRUE 1
+#define FALSE 0
+
+#define IN
+#define OUT
+#define _In_
+#define _Out_
+#define _Inout_
+#define _In_reads_bytes_(Size)
+#define _In_reads_bytes_opt_(Size)
+#define _Out_writes_(Size)
+#define _Out_writes_bytes_(Size)
+#define _Inout_updates_(Size)
+
+#ifndef min
+#define min(a, b) ((a) < (b) ? (a) : (b))
+#define max(a, b) ((a) > (b) ? (a) : (b))
+#endif
+
+#define MAXULONG 0xFFFFFFFFUL
+#define ANYSIZE_ARRAY 1
+#define ARRAYSIZE(A) ((int)(sizeof(A) / sizeof((A)[0])))
+#define FIELD_OFFSET(Type, Field) ((LONG)offsetof(Type, Field))
+#define CONTAINING_RECORD(Address, Type, Field) \
+	((Type*)((char*)(Address) - offsetof(Type, Field)))
+
+#define MEMORY_ALLOCATION_ALIGNMENT 16
+#define DECLSPEC_ALIGN(x) __attribute__((aligned(x)))
+#define ALIGN_UP_BY(Length, Alignment) \
+	(((SIZE_T)(Length) + (Alignment) - 1) & ~((SIZE_T)(Alignment) - 1))
+
+#define STATUS_PENDING               ((NTSTATUS)0x00000103L)
+#define STATUS_BUFFER_OVERFLOW       ((NTSTATUS)0x80000005L)
+#define STATUS_UNSUCCESSFUL          ((NTSTATUS)0xC0000001L)
+#define STATUS_INVALID_PARAMETER     ((NTSTATUS)0xC000000DL)
+#define STATUS_BUFFER_TOO_SMALL      ((NTSTATUS)0xC0000023L)
+#define STATUS_INSUFFICIENT_RESOURCES ((NTSTATUS)0xC000009AL)
+#define STATUS_NOT_SUPPORTED         ((NTSTATUS)0xC00000BBL)
+#define STATUS_CANCELLED             ((NTSTATUS)0xC0000120L)
+#define STATUS_NOT_FOUND             ((NTSTATUS)0xC0000225L)
+
+/* Lists */
+
+typedef struct _LIST_ENTRY {
+	struct _LIST_ENTRY* Flink;
+	struct _LIST_ENTRY* Blink;
+} LIST_ENTRY, *PLIST_ENTRY;
+
+static __inline void InitializeListHead(PLIST_ENTRY Head)
+{
+	Head->Flink = Head->Blink = Head;
+}
+
+static __inline BOOLEAN IsListEmpty(const LIST_ENTRY* Head)
+{
+	return Head->Flink == Head;
+}
+
+static __inline void InsertTailList(PLIST_ENTRY Head, PLIST_ENTRY Entry)
+{
+	Entry->Flink = Head;
+	Entry->Blink = Head->Blink;
+	Head->Blink->Flink = Entry;
+	Head->Blink = Entry;
+}
+
+static __inline void InsertHeadList(PLIST_ENTRY Head, PLIST_ENTRY Entry)
+{
+	Entry->Flink = Head->Flink;
+	Entry->Blink = Head;
+	Head->Flink->Blink = Entry;
+	Head->Flink = Entry;
+}
+
+static __inline BOOLEAN RemoveEntryList(PLIST_ENTRY Entry)
+{
+	Entry->Blink->Flink = Entry->Flink;
+	Entry->Flink->Blink = Entry->Blink;
+	return Entry->Flink == Entry->Blink;
+}
+
+static __inline PLIST_ENTRY RemoveHeadList(PLIST_ENTRY Head)
+{
+	PLIST_ENTRY entry = Head->Flink;
+
+	RemoveEntryList(entry);
+	return entry;
+}
+
+/* Interlocked operations and barriers, all sequentially consistent */
+
+#define InterlockedIncrement(p)                __atomic_add_fetch((p), 1, __ATOMIC_SEQ_CST)
+#define InterlockedDecrement(p)                __atomic_sub_fetch((p), 1, __ATOMIC_SEQ_CST)
+#define InterlockedIncrement64(p)              __atomic_add_fetch((p), 1, __ATOMIC_SEQ_CST)
+#define InterlockedDecrement64(p)              __atomic_sub_fetch((p), 1, __ATOMIC_SEQ_CST)
+#define InterlockedExchangeAdd(p, v)           __atomic_fetch_add((p), (v), __ATOMIC_SEQ_CST)
+#define InterlockedExchangeAdd64(p, v)         __atomic_fetch_add((p), (v), __ATOMIC_SEQ_CST)
+#define InterlockedAdd64(p, v)                 __atomic_add_fetch((p), (v), __ATOMIC_SEQ_CST)
+#define InterlockedOr(p, v)                    __atomic_fetch_or((p), (v), __ATOMIC_SEQ_CST)
+#define InterlockedAnd(p, v)                   __atomic_fetch_and((p), (v), __ATOMIC_SEQ_CST)
+#define InterlockedExchange(p, v)              __atomic_exchange_n((p), (v), __ATOMIC_SEQ_CST)
+#define InterlockedExchange64(p, v)            __atomic_exchange_n((p), (v), __ATOMIC_SEQ_CST)
+#define InterlockedCompareExchange(p, v, c)    __sync_val_compare_and_swap((p), (c), (v))
+#define InterlockedCompareExchange64(p, v, c)  __sync_val_compare_and_swap((p), (c), (v))
+#define InterlockedCompareExchangePointer(p, v, c) __sync_val_compare_and_swap((p), (c), (v))
+
+#define ReadAcquire(p)        __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define ReadAcquire64(p)      __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define ReadNoFence(p)        __atomic_load_n((p), __ATOMIC_RELAXED)
+#define ReadNoFence64(p)      __atomic_load_n((p), __ATOMIC_RELAXED)
+#define WriteRelease(p, v)    __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define WriteRelease64(p, v)  __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define WriteNoFence(p, v)    __atomic_store_n((p), (v), __ATOMIC_RELAXED)
+#define MemoryBarrier()       __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#define KeMemoryBarrier()     __atomic_thread_fence(__ATOMIC_SEQ_CST)
+
+static __inline BOOLEAN _BitScanForward(ULONG* Index, ULONG Mask)
+{
+	if (!Mask)
+		return FALSE;
+	*Index = __builtin_ctzl(Mask);
+	return TRUE;
+}
+
+/* Memory */
+
+#define RtlZeroMemory(d, n)     memset((d), 0, (n))
+#define RtlFillMemory(d, n, v)  memset((d), (v), (n))
+#define RtlCopyMemory(d, s, n)  memcpy((d), (s), (n))
+#define RtlMoveMemory(d, s, n)  memmove((d), (s), (n))
+#define RtlEqualMemory(a, b, n) (memcmp((a), (b), (n)) == 0)
+
+typedef enum _POOL_TYPE {
+	NonPagedPool,
+	NonPagedPoolNx,
+	PagedPool
+} POOL_TYPE;
+
+/* Counted in crosec_wdk_stats */
+PVOID ExAllocatePoolWithTag(POOL_TYPE PoolType, SIZE_T NumberOfBytes, ULONG Tag);
+void ExFreePoolWithTag(PVOID P, ULONG Tag);
+
+/* Spin locks and fast mutexes */
+
+typedef pthread_mutex_t KSPIN_LOCK, *PKSPIN_LOCK;
+typedef pthread_mutex_t FAST_MUTEX, *PFAST_MUTEX;
+
+#define KeInitializeSpinLock(l)              pthread_mutex_init((l), NULL)
+#define KeAcquireSpinLock(l, irql)           (*(irql) = 0, pthread_mutex_lock(l))
+#define KeReleaseSpinLock(l, irql)           ((void)(irql), pthread_mutex_unlock(l))
+#define KeAcquireSpinLockAtDpcLevel(l)       pthread_mutex_lock(l)
+#define KeReleaseSpinLockFromDpcLevel(l)     pthread_mutex_unlock(l)
+#define ExInitializeFastMutex(m)             pthread_mutex_init((m), NULL)
+#define ExAcquireFastMutex(m)                pthread_mutex_lock(m)
+#define ExReleaseFastMutex(m)                pthread_mutex_unlock(m)
+
+/* Events */
+
+typedef enum _EVENT_TYPE {
+	NotificationEvent,
+	SynchronizationEvent
+} EVENT_TYPE;
+
+typedef struct _KEVENT {
+	pthread_mutex_t Mutex;
+	pthread_cond_t Cond;
+	EVENT_TYPE Type;
+	LONG Signaled;
+} KEVENT, *PKEVENT;
+
+#define Executive 0
+#define KernelMode 0
+#define IO_NO_INCREMENT 0
+
+void KeInitializeEvent(PKEVENT Event, EVENT_TYPE Type, BOOLEAN State);
+LONG KeSetEvent(PKEVENT Event, LONG Increment, BOOLEAN Wait);
+void KeClearEvent(PKEVENT Event);
+NTSTATUS KeWaitForSingleObject(PVOID Object, int WaitReason, int WaitMode,
+	BOOLEAN Alertable, const LONGLONG* Timeout);
+
+/* Time */
+
+/* 100ns units, from crosec_wdk_clock if it is set, else CLOCK_MONOTONIC */
+ULONGLONG KeQueryInterruptTime(void);
+
+/* WDF objects are only passed around, never looked into */
+
+typedef struct _WDFDEVICE_STUB* WDFDEVICE;
+typedef struct _WDFQUEUE_STUB* WDFQUEUE;
+typedef struct _WDFREQUEST_STUB* WDFREQUEST;
+typedef struct _WDFINTERRUPT_STUB* WDFINTERRUPT;
+
+void crosec_wdk_unsupported(const char* what) __attribute__((noreturn));
+
+#define WdfRequestRetrieveInputBuffer(...)  (crosec_wdk_unsupported("WdfRequestRetrieveInputBuffer"), STATUS_NOT_SUPPORTED)
+#define WdfRequestRetrieveOutputBuffer(...) (crosec_wdk_unsupported("WdfRequestRetrieveOutputBuffer"), STATUS_NOT_SUPPORTED)
+#define WdfRequestComplete(...)             crosec_wdk_unsupported("WdfRequestComplete")
+#define WdfRequestCompleteWithInformation(...) crosec_wdk_unsupported("WdfRequestCompleteWithInformation")
+#define WdfRequestMarkCancelableEx(...)     (crosec_wdk_unsupported("WdfRequestMarkCancelableEx"), STATUS_NOT_SUPPORTED)
+#define WdfRequestUnmarkCancelable(...)     (crosec_wdk_unsupported("WdfRequestUnmarkCancelable"), STATUS_NOT_SUPPORTED)
+
+typedef void EVT_WDF_IO_QUEUE_IO_DEVICE_CONTROL(WDFQUEUE Queue, WDFREQUEST Request,
+	size_t OutputBufferLength, size_t InputBufferLength, ULONG IoControlCode);
+typedef void EVT_WDF_IO_QUEUE_IO_STOP(WDFQUEUE Queue, WDFREQUEST Request, ULONG ActionFlags);
+typedef void EVT_WDF_REQUEST_CANCEL(WDFREQUEST Request);
+typedef EVT_WDF_REQUEST_CANCEL* PFN_WDF_REQUEST_CANCEL;
+
+/* Just enough for the IOCTL definitions in userspaceQueue.h */
+
+#define DEFINE_GUID(Name, ...)
+#define METHOD_BUFFERED   0
+#define METHOD_IN_DIRECT  1
+#define METHOD_OUT_DIRECT 2
+#define METHOD_NEITHER    3
+#define FILE_ANY_ACCESS   0
+#define FILE_READ_DATA    1
+#define FILE_WRITE_DATA   2
+#define CTL_CODE(DeviceType, Function, Method, Access) \
+	(((DeviceType) << 16) | ((Access) << 14) | ((Function) << 2) | (Method))
+
+/* Settings, answered from crosec_wdk_set_setting */
+
+typedef struct _UNICODE_STRING {
+	const WCHAR* Buffer;
+} UNICODE_STRING;
+typedef const UNICODE_STRING* PCUNICODE_STRING;
+
+#define DECLARE_CONST_UNICODE_STRING(Name, Value) const UNICODE_STRING Name = { Value }
+
+NTSTATUS CrosEcBusReadSetting(WDFDEVICE Device, PCUNICODE_STRING Name, PULONG Value);
+
+/* Host side controls */
+
+struct crosec_wdk_stats {
+	/* ExAllocatePoolWithTag calls, and those not yet freed */
+	UINT64 allocations;
+	INT64 outstanding;
+};
+
+extern struct crosec_wdk_stats crosec_wdk_stats;
+
+/* Time source for KeQueryInterruptTime in 100ns units; NULL for the host clock */
+extern ULONGLONG(*crosec_wdk_clock)(void);
+
+/* Answer CrosEcBusReadSetting(Name) with Value; at most 16 settings */
+void crosec_wdk_set_setting(const WCHAR* name, ULONG value);
+
+/* Forget every setting, so reads fail and modules use their defaults */
+void crosec_wdk_clear_settings(void);
+
+#endif
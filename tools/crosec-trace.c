@@ -0,0 +1,323 @@
+/*
+ * crosec-trace: fetch and decode the crosecbus binary event trace.
+ *
+ *   crosec-trace dump <file>     (Windows) save IOCTL_CROSEC_TRACE_DUMP to file
+ *   crosec-trace decode <file>   print a dump as a timeline, on any host
+ *   crosec-trace capture <bytes> (Windows) start a command capture, 0 stops it
+ *   crosec-trace save <file>     (Windows) save the command capture to file
+ *
+ * Build with any C compiler, e.g. "cc -o crosec-trace crosec-trace.c" or
+ * "cl crosec-trace.c". The driver only records while the Trace setting
+ * under its Settings key is non-zero. Captures are replayed with
+ * host/crosec-replay.c.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <winioctl.h>
+#else
+#include <stdint.h>
+typedef uint8_t UINT8;
+typedef uint16_t UINT16;
+typedef uint32_t UINT32;
+typedef uint64_t UINT64;
+typedef int32_t INT32;
+#endif
+
+#define CROSEC_TRACE_FORMAT_ONLY
+#include "../crosecbus/ecTrace.h"
+#define CROSEC_CAPTURE_FORMAT_ONLY
+#include "../crosecbus/ecCapture.h"
+
+static const char* event_names[CrosEcTraceEventCount] = {
+	[CrosEcTraceCmdSubmit] = "cmd-submit",
+	[CrosEcTraceCmdComplete] = "cmd-complete",
+	[CrosEcTraceLockAcquire] = "lock-acquire",
+	[CrosEcTraceLockRelease] = "lock-release",
+	[CrosEcTraceInterrupt] = "interrupt",
+	[CrosEcTraceHostEvents] = "host-events",
+	[CrosEcTraceMkbpEvent] = "mkbp-event",
+	[CrosEcTraceS0ixEnter] = "s0ix-enter",
+	[CrosEcTraceS0ixExit] = "s0ix-exit",
+};
+
+/* Same order as CROSEC_LOCK_CLASS */
+static const char* lock_classes[] = { "isr", "kernel", "user" };
+
+struct event {
+	UINT64 tsc;
+	UINT32 cpu;
+	CROSEC_TRACE_ENTRY e;
+};
+
+static int by_tsc(const void* a, const void* b)
+{
+	const struct event* x = a;
+	const struct event* y = b;
+
+	return x->tsc < y->tsc ? -1 : x->tsc > y->tsc;
+}
+
+static const char* lock_class(unsigned int c)
+{
+	return c < sizeof(lock_classes) / sizeof(lock_classes[0]) ? lock_classes[c] : "?";
+}
+
+static void print_args(const CROSEC_TRACE_ENTRY* e)
+{
+	switch (e->Event) {
+	case CrosEcTraceCmdSubmit:
+		printf("cmd 0x%04x v%u out %u", e->Arg0, e->Arg1, e->Arg2);
+		break;
+	case CrosEcTraceCmdComplete:
+		if ((int)e->Arg1 >= 0)
+			printf("cmd 0x%04x in %d, %u us on the bus", e->Arg0, (int)e->Arg1, e->Arg2);
+		else if ((int)e->Arg1 <= -1000) /* -EECRESULT - EC_RES_* */
+			printf("cmd 0x%04x EC_RES %d, %u us on the bus", e->Arg0, -(int)e->Arg1 - 1000, e->Arg2);
+		else
+			printf("cmd 0x%04x failed %d, %u us on the bus", e->Arg0, (int)e->Arg1, e->Arg2);
+		break;
+	case CrosEcTraceLockAcquire:
+		printf("%s, waited %u us", lock_class(e->Arg0), e->Arg1);
+		break;
+	case CrosEcTraceLockRelease:
+		printf("%s", lock_class(e->Arg0));
+		break;
+	case CrosEcTraceHostEvents:
+		printf("mask 0x%08x", e->Arg1);
+		break;
+	case CrosEcTraceMkbpEvent:
+		printf("type %u data 0x%08x", e->Arg0, e->Arg1);
+		break;
+	case CrosEcTraceS0ixEnter:
+	case CrosEcTraceS0ixExit:
+		printf("status 0x%08x", e->Arg1);
+		break;
+	}
+}
+
+static int decode(const char* path)
+{
+	FILE* f = fopen(path, "rb");
+	if (!f) {
+		perror(path);
+		return 1;
+	}
+
+	CROSEC_TRACE_HEADER h;
+	if (fread(&h, sizeof(h), 1, f) != 1 || h.Magic != CROSEC_TRACE_MAGIC) {
+		fprintf(stderr, "%s: not a crosecbus trace\n", path);
+		fclose(f);
+		return 1;
+	}
+	if (h.Version != CROSEC_TRACE_VERSION || h.EntrySize != sizeof(CROSEC_TRACE_ENTRY) ||
+		!h.EntriesPerCpu || (h.EntriesPerCpu & (h.EntriesPerCpu - 1))) {
+		fprintf(stderr, "%s: unsupported trace version %u\n", path, h.Version);
+		fclose(f);
+		return 1;
+	}
+
+	UINT64* heads = calloc(h.CpuCount, sizeof(*heads));
+	CROSEC_TRACE_ENTRY* ring = calloc(h.EntriesPerCpu, sizeof(*ring));
+	struct event* events = calloc((size_t)h.CpuCount * h.EntriesPerCpu, sizeof(*events));
+	size_t count = 0, torn = 0, lost = 0;
+
+	if (!heads || !ring || !events || fread(heads, sizeof(*heads), h.CpuCount, f) != h.CpuCount) {
+		fprintf(stderr, "%s: truncated\n", path);
+		fclose(f);
+		return 1;
+	}
+
+	for (UINT32 cpu = 0; cpu < h.CpuCount; cpu++) {
+		if (fread(ring, sizeof(*ring), h.EntriesPerCpu, f) != h.EntriesPerCpu) {
+			fprintf(stderr, "%s: truncated\n", path);
+			fclose(f);
+			return 1;
+		}
+
+		/* Only the last EntriesPerCpu records of each CPU survive */
+		UINT64 first = heads[cpu] > h.EntriesPerCpu ? heads[cpu] - h.EntriesPerCpu : 0;
+		lost += (size_t)first;
+		for (UINT64 pos = first; pos < heads[cpu]; pos++) {
+			const CROSEC_TRACE_ENTRY* e = &ring[pos & (h.EntriesPerCpu - 1)];
+
+			/* Busy, or already rewritten for a later position */
+			if (e->Sequence == CROSEC_TRACE_BUSY || e->Sequence != (UINT32)pos) {
+				torn++;
+				continue;
+			}
+			events[count].tsc = e->Tsc;
+			events[count].cpu = cpu;
+			events[count].e = *e;
+			count++;
+		}
+	}
+	fclose(f);
+
+	qsort(events, count, sizeof(*events), by_tsc);
+
+	/* TSC ticks per microsecond, from the QPC pairs taken at start and dump */
+	double tsc_per_us = 0;
+	if (h.QpcDump > h.QpcStart && h.QpcFrequency)
+		tsc_per_us = (double)(h.TscDump - h.TscStart) /
+			((double)(h.QpcDump - h.QpcStart) * 1e6 / h.QpcFrequency);
+
+	printf("# %zu events on %u CPUs, %zu overwritten, %zu torn%s\n", count, h.CpuCount, lost, torn,
+		tsc_per_us ? "" : "; times in TSC ticks");
+	printf("#%13s %12s %4s  %-13s\n", tsc_per_us ? "us" : "tsc", "delta", "cpu", "event");
+
+	for (size_t i = 0; i < count; i++) {
+		const CROSEC_TRACE_ENTRY* e = &events[i].e;
+		double t = (double)(events[i].tsc - events[0].tsc);
+		double dt = i ? (double)(events[i].tsc - events[i - 1].tsc) : 0;
+		if (tsc_per_us) {
+			t /= tsc_per_us;
+			dt /= tsc_per_us;
+		}
+
+		const char* name = e->Event < CrosEcTraceEventCount && event_names[e->Event] ?
+			event_names[e->Event] : "unknown";
+		printf("%14.3f %12.3f %4u  %-13s ", t, dt, events[i].cpu, name);
+		print_args(e);
+		printf("\n");
+	}
+
+	free(events);
+	free(ring);
+	free(heads);
+	return 0;
+}
+
+#ifdef _WIN32
+#define IOCTL_CROSEC_TRACE_DUMP CTL_CODE(0x80EC, 0x809, METHOD_OUT_DIRECT, FILE_READ_DATA)
+#define IOCTL_CROSEC_CAPTURE CTL_CODE(0x80EC, 0x80B, METHOD_BUFFERED, FILE_WRITE_DATA)
+#define IOCTL_CROSEC_CAPTURE_READ CTL_CODE(0x80EC, 0x80C, METHOD_OUT_DIRECT, FILE_READ_DATA)
+
+static HANDLE open_ec(DWORD access)
+{
+	HANDLE dev = CreateFileW(L"\\\\.\\GOOG0004", access, FILE_SHARE_READ | FILE_SHARE_WRITE,
+		NULL, OPEN_EXISTING, 0, NULL);
+	if (dev == INVALID_HANDLE_VALUE)
+		fprintf(stderr, "Can't open the EC: %lu\n", GetLastError());
+	return dev;
+}
+
+static int write_file(const char* path, const void* buf, DWORD size)
+{
+	FILE* f = fopen(path, "wb");
+	if (!f || fwrite(buf, 1, size, f) != size) {
+		perror(path);
+		return 1;
+	}
+	fclose(f);
+
+	printf("Wrote %lu bytes to %s\n", size, path);
+	return 0;
+}
+
+static int dump(const char* path)
+{
+	HANDLE dev = open_ec(GENERIC_READ);
+	if (dev == INVALID_HANDLE_VALUE)
+		return 1;
+
+	/* The header alone says how big the whole dump is */
+	CROSEC_TRACE_HEADER h;
+	DWORD got = 0;
+	if (!DeviceIoControl(dev, IOCTL_CROSEC_TRACE_DUMP, NULL, 0, &h, sizeof(h), &got, NULL) &&
+		GetLastError() != ERROR_MORE_DATA) {
+		fprintf(stderr, "Trace dump failed: %lu (is the Trace setting on?)\n", GetLastError());
+		CloseHandle(dev);
+		return 1;
+	}
+
+	DWORD size = sizeof(h) + h.CpuCount * (sizeof(UINT64) + h.EntriesPerCpu * sizeof(CROSEC_TRACE_ENTRY));
+	void* buf = malloc(size);
+	if (!buf || !DeviceIoControl(dev, IOCTL_CROSEC_TRACE_DUMP, NULL, 0, buf, size, &got, NULL)) {
+		fprintf(stderr, "Trace dump failed: %lu\n", GetLastError());
+		CloseHandle(dev);
+		return 1;
+	}
+	CloseHandle(dev);
+
+	int rc = write_file(path, buf, got);
+	free(buf);
+	return rc;
+}
+
+static int capture(const char* bytes)
+{
+	HANDLE dev = open_ec(GENERIC_WRITE);
+	if (dev == INVALID_HANDLE_VALUE)
+		return 1;
+
+	ULONG size = strtoul(bytes, NULL, 0);
+	DWORD got = 0;
+	if (!DeviceIoControl(dev, IOCTL_CROSEC_CAPTURE, &size, sizeof(size), NULL, 0, &got, NULL)) {
+		fprintf(stderr, "Capture control failed: %lu\n", GetLastError());
+		CloseHandle(dev);
+		return 1;
+	}
+	CloseHandle(dev);
+
+	if (size)
+		printf("Capturing into a %lu byte buffer\n", size);
+	else
+		printf("Capture stopped\n");
+	return 0;
+}
+
+static int save(const char* path)
+{
+	HANDLE dev = open_ec(GENERIC_READ);
+	if (dev == INVALID_HANDLE_VALUE)
+		return 1;
+
+	/* Ask for the header first, so a missing capture gets a clear error */
+	CROSEC_CAPTURE_HEADER h;
+	DWORD got = 0;
+	if (!DeviceIoControl(dev, IOCTL_CROSEC_CAPTURE_READ, NULL, 0, &h, sizeof(h), &got, NULL) &&
+		GetLastError() != ERROR_MORE_DATA) {
+		fprintf(stderr, "Capture read failed: %lu (is a capture running?)\n", GetLastError());
+		CloseHandle(dev);
+		return 1;
+	}
+
+	/* It may have grown since, so leave room for a full buffer */
+	DWORD size = sizeof(h) + CROSEC_CAPTURE_MAX_BYTES;
+	void* buf = malloc(size);
+	if (!buf || !DeviceIoControl(dev, IOCTL_CROSEC_CAPTURE_READ, NULL, 0, buf, size, &got, NULL)) {
+		fprintf(stderr, "Capture read failed: %lu\n", GetLastError());
+		CloseHandle(dev);
+		return 1;
+	}
+	CloseHandle(dev);
+
+	printf("%u commands, %u dropped\n", ((CROSEC_CAPTURE_HEADER*)buf)->Records,
+		((CROSEC_CAPTURE_HEADER*)buf)->Dropped);
+	int rc = write_file(path, buf, got);
+	free(buf);
+	return rc;
+}
+#endif
+
+int main(int argc, char** argv)
+{
+	if (argc == 3 && !strcmp(argv[1], "decode"))
+		return decode(argv[2]);
+#ifdef _WIN32
+	if (argc == 3 && !strcmp(argv[1], "dump"))
+		return dump(argv[2]);
+	if (argc == 3 && !strcmp(argv[1], "capture"))
+		return capture(argv[2]);
+	if (argc == 3 && !strcmp(argv[1], "save"))
+		return save(argv[2]);
+#endif
+
+	fprintf(stderr, "usage: %s dump <file> | decode <file> | capture <bytes> | save <file>\n", argv[0]);
+	return 2;
+}